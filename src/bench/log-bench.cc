@@ -0,0 +1,57 @@
+/**
+ * @file log-bench.cc
+ * @brief Measures the per-operation cost of logging a typical operation
+ * message with the logger enabled, disabled, and with the old synchronous
+ * line-buffered fprintf.
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "debug_logger.h"
+
+/**
+ * Time a logging loop
+ * @param name label printed with the result
+ * @param count number of messages
+ * @param log logs message i
+ */
+template <typename F> static void run(const char *name, int count, F log) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    log(i);
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  printf("%-10s: %d messages, %.1f ns/op\n", name, count,
+         elapsed.count() * 1e9 / count);
+}
+
+int main(int argc, char **argv) {
+  std::string log_path = argc > 1 ? argv[1] : "/tmp/log-bench.log";
+  int count = argc > 2 ? atoi(argv[2]) : 1000000;
+  std::string path = "/dir/some_file_name";
+
+  {
+    DebugLogger logger(log_path, LOG_LEVEL_INFO);
+    run("disabled", count, [&](int i) {
+      logger.debug("truncate_file: ", path, ", size: ", i);
+    });
+    run("enabled", count, [&](int i) {
+      logger.info("truncate_file: ", path, ", size: ", i);
+    });
+  }
+
+  FILE *file = fopen(log_path.c_str(), "w");
+  setvbuf(file, NULL, _IOLBF, 0);
+  run("sync", count, [&](int i) {
+    std::string msg = "[CloudFS Info] truncate_file: " + path +
+                      ", size: " + std::to_string(i);
+    fprintf(file, "%s\n", msg.c_str());
+  });
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,532 @@
+/**
+ * @file micro-bench.cc
+ * @brief Microbenchmarks of the in-process components: content defined
+ * chunking, the chunk table, the LRU cache replacer, the chunk lookup of a
+ * file and the compression of snapshot objects. Links cloudfs-core directly,
+ * no mount or cloud is needed.
+ *
+ * Every benchmark is repeated until it runs for at least --min-time seconds,
+ * inputs are generated from fixed seeds so results are comparable across
+ * commits. With --json one JSON line per benchmark is printed.
+ *
+ * Usage: micro-bench [--filter substr] [--json] [--min-time sec]
+ *                    [--max-keys N] [--dir path]
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ftw.h>
+#include <getopt.h>
+#include <memory>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "cache_replacer.h"
+#include "chunk_splitter.h"
+#include "chunk_table.h"
+#include "cloudfs.h"
+#include "cloudfs_controller.h"
+#include "snapshot_stream.h"
+
+static std::string filter_;     // only run benchmarks containing this
+static bool json_ = false;      // print JSON lines
+static double min_time_ = 0.5;  // minimum seconds per benchmark
+static uint64_t max_keys_ = 1000000; // largest chunk table to build
+static std::string dir_ = "/tmp"; // directory of temporary SSD state
+
+/**
+ * splitmix64, deterministic input generator
+ * @param state generator state
+ * @return next value
+ */
+static uint64_t next_random(uint64_t &state) {
+  uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Get the chunk key of a number, 32 hex digits like an MD5 key
+ * @param i number
+ * @return key
+ */
+static std::string make_key(uint64_t i) {
+  uint64_t state = i;
+  char key[33];
+  snprintf(key, sizeof(key), "%016llx%016llx",
+           (unsigned long long)next_random(state),
+           (unsigned long long)next_random(state));
+  return std::string(key, 32);
+}
+
+/**
+ * Check whether a benchmark is selected by --filter
+ * @param name benchmark name
+ * @return true if it should run
+ */
+static bool selected(const std::string &name) {
+  return filter_.empty() || name.find(filter_) != std::string::npos;
+}
+
+/**
+ * Print the result of a benchmark
+ * @param name benchmark name
+ * @param iterations number of operations
+ * @param seconds elapsed time
+ * @param bytes_per_op bytes processed per operation, 0 if not meaningful
+ */
+static void report(const std::string &name, uint64_t iterations,
+                   double seconds, double bytes_per_op) {
+  double ns_per_op = seconds * 1e9 / iterations;
+  double ops_per_s = iterations / seconds;
+  double bytes_per_s = bytes_per_op * ops_per_s;
+  if (json_) {
+    printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,"
+           "\"ops_per_second\":%.0f,\"bytes_per_second\":%.0f}\n",
+           name.c_str(), (unsigned long long)iterations, ns_per_op, ops_per_s,
+           bytes_per_s);
+  } else if (bytes_per_op > 0) {
+    printf("%-36s %12llu %12.1f ns/op %12.0f ops/s %8.3f GB/s\n",
+           name.c_str(), (unsigned long long)iterations, ns_per_op, ops_per_s,
+           bytes_per_s / 1e9);
+  } else {
+    printf("%-36s %12llu %12.1f ns/op %12.0f ops/s\n", name.c_str(),
+           (unsigned long long)iterations, ns_per_op, ops_per_s);
+  }
+  fflush(stdout);
+}
+
+/**
+ * Run a benchmark, the iteration count grows until it runs for --min-time
+ * @param name benchmark name
+ * @param bytes_per_op bytes processed per operation, 0 if not meaningful
+ * @param body runs the given number of operations, must be repeatable
+ */
+template <typename F>
+static void run(const std::string &name, double bytes_per_op, F body) {
+  if (!selected(name)) {
+    return;
+  }
+  uint64_t iterations = 1;
+  double seconds = 0;
+  while (true) {
+    auto start = std::chrono::steady_clock::now();
+    body(iterations);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    seconds = elapsed.count();
+    if (seconds >= min_time_) {
+      break;
+    }
+    // aim slightly past the minimum time, grow at most 100x per round
+    double scale = seconds > 0 ? min_time_ * 1.4 / seconds : 100;
+    scale = std::min(std::max(scale, 2.0), 100.0);
+    iterations = (uint64_t)(iterations * scale);
+  }
+  report(name, iterations, seconds, bytes_per_op);
+}
+
+/**
+ * Time a benchmark that runs exactly once, e.g. building a table
+ * @param name benchmark name
+ * @param iterations number of operations done by body
+ * @param body runs the operations
+ */
+template <typename F>
+static void run_once(const std::string &name, uint64_t iterations, F body) {
+  if (!selected(name)) {
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  body();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  report(name, iterations, elapsed.count(), 0);
+}
+
+/**
+ * Remove a temporary directory tree
+ * @param path directory path
+ */
+static void remove_tree(const std::string &path) {
+  nftw(path.c_str(),
+       [](const char *fpath, const struct stat *, int, struct FTW *) {
+         return remove(fpath);
+       },
+       16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * Create a temporary directory under --dir
+ * @param name prefix of the directory name
+ * @return directory path
+ */
+static std::string make_temp_dir(const std::string &name) {
+  std::string path = dir_ + "/micro-bench-" + name + "-XXXXXX";
+  std::vector<char> buf(path.begin(), path.end());
+  buf.push_back('\0');
+  if (mkdtemp(buf.data()) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+  return buf.data();
+}
+
+/**
+ * Chunking throughput of the Rabin fingerprint splitter, MD5 keys included
+ */
+static void bench_chunk_splitter() {
+  const size_t data_size = 64 * 1024 * 1024;
+  const size_t block_size = 1024 * 1024; // bytes per operation
+  std::vector<char> data(data_size);
+  uint64_t state = 1;
+  for (size_t i = 0; i < data_size; i += sizeof(uint64_t)) {
+    uint64_t v = next_random(state);
+    memcpy(&data[i], &v, sizeof(v));
+  }
+
+  // the defaults of cloudfs, then segments four times larger
+  for (int avg : {4096, 16384}) {
+    ChunkSplitter splitter(48, avg, avg * 3 / 4, avg * 3 / 2);
+    splitter.init(0);
+    size_t pos = 0;
+    size_t chunks = 0;
+    run("chunk_splitter/avg:" + std::to_string(avg), block_size,
+        [&](uint64_t iterations) {
+          for (uint64_t i = 0; i < iterations; i++) {
+            chunks += splitter.get_chunks_next(&data[pos], block_size).size();
+            pos = (pos + block_size) % data_size;
+          }
+        });
+    if (chunks == 0) {
+      fprintf(stderr, "chunk_splitter: no chunks generated\n");
+    }
+  }
+}
+
+/**
+ * Chunk table operations at growing table sizes
+ * @param logger logger
+ */
+static void bench_chunk_table(std::shared_ptr<DebugLogger> logger) {
+  const uint64_t batch = 256; // operations per committed batch
+
+  for (uint64_t keys = 1000000; keys <= max_keys_; keys *= 10) {
+    auto suffix = "/" + std::to_string(keys / 1000000) + "M";
+    if (!selected("chunk_table/insert" + suffix) &&
+        !selected("chunk_table/use_release" + suffix) &&
+        !selected("chunk_table/reopen" + suffix)) {
+      continue;
+    }
+    auto path = make_temp_dir("chunk-table");
+    std::unique_ptr<ChunkTable> table(new ChunkTable(path, logger, nullptr));
+
+    // new chunks, every use() misses the bloom filter
+    run_once("chunk_table/insert" + suffix, keys, [&]() {
+      for (uint64_t i = 0; i < keys; i++) {
+        table->use(make_key(i));
+        if (i % batch == batch - 1) {
+          table->commit();
+        }
+      }
+      table->commit();
+    });
+
+    // duplicate chunks written and released again, keys hit the SSD index
+    uint64_t state = keys;
+    run("chunk_table/use_release" + suffix, 0, [&](uint64_t iterations) {
+      for (uint64_t i = 0; i < iterations; i++) {
+        auto key = make_key(next_random(state) % keys);
+        table->use(key);
+        table->release(key);
+        if (i % batch == batch - 1) {
+          table->commit();
+        }
+      }
+      table->commit();
+    });
+
+    // recovery cost on mount
+    run_once("chunk_table/reopen" + suffix, keys, [&]() {
+      table.reset();
+      table.reset(new ChunkTable(path, logger, nullptr));
+    });
+
+    table.reset();
+    remove_tree(path);
+  }
+}
+
+/**
+ * Accesses and evictions of the LRU cache replacer
+ * @param logger logger
+ */
+static void bench_cache_replacer(std::shared_ptr<DebugLogger> logger) {
+  const uint64_t entries = 64 * 1024; // chunks in the cache
+  if (!selected("lru_replacer/access_hit") &&
+      !selected("lru_replacer/access_evict")) {
+    return;
+  }
+
+  auto path = make_temp_dir("replacer");
+  struct cloudfs_state state;
+  memset(&state, 0, sizeof(state));
+  snprintf(state.ssd_path, sizeof(state.ssd_path), "%s/", path.c_str());
+
+  std::vector<std::string> keys;
+  for (uint64_t i = 0; i < entries; i++) {
+    keys.push_back(make_key(i));
+  }
+
+  LRUCacheReplacer replacer(&state, logger);
+  for (auto &key : keys) {
+    replacer.access(key);
+  }
+
+  uint64_t seed = entries;
+  run("lru_replacer/access_hit", 0, [&](uint64_t iterations) {
+    for (uint64_t i = 0; i < iterations; i++) {
+      replacer.access(keys[next_random(seed) % entries]);
+    }
+  });
+
+  // a cache miss: the new chunk enters, the least recently used one leaves
+  uint64_t next = entries;
+  run("lru_replacer/access_evict", 0, [&](uint64_t iterations) {
+    std::string victim;
+    for (uint64_t i = 0; i < iterations; i++) {
+      replacer.access(make_key(next++));
+      replacer.evict(victim);
+    }
+  });
+
+  remove_tree(path);
+}
+
+/**
+ * Cost of finding the chunk of an offset versus the file size
+ */
+static void bench_get_chunk_idx() {
+  const size_t lookups = 4096; // distinct offsets per file
+
+  for (off_t size_mb : {1, 16, 256, 4096}) {
+    auto name = "get_chunk_idx/" + std::to_string(size_mb) + "MiB";
+    if (!selected(name)) {
+      continue;
+    }
+    // chunk lengths between the default min and max segment size
+    off_t size = size_mb * 1024 * 1024;
+    uint64_t state = size_mb;
+    std::vector<Chunk> chunks;
+    for (off_t start = 0; start < size;) {
+      Chunk chunk;
+      chunk.start_ = start;
+      chunk.len_ = std::min<off_t>(3072 + next_random(state) % 3073,
+                                   size - start);
+      start += chunk.len_;
+      chunks.push_back(chunk);
+    }
+    std::vector<off_t> offsets;
+    for (size_t i = 0; i < lookups; i++) {
+      offsets.push_back(next_random(state) % size);
+    }
+
+    long sum = 0;
+    run(name, 0, [&](uint64_t iterations) {
+      for (uint64_t i = 0; i < iterations; i++) {
+        sum += CloudfsController::get_chunk_idx(chunks, offsets[i % lookups]);
+      }
+    });
+    if (sum < 0) {
+      fprintf(stderr, "get_chunk_idx: offset not found\n");
+    }
+  }
+}
+
+/**
+ * Archive and restore of a snapshot object with each compression of
+ * SnapshotStream, on the simulated cloud without latency. The gzip setting is
+ * the compression of older versions. The compressed size of a setting is
+ * printed after its timings.
+ * @param logger logger
+ */
+static void bench_snapshot_stream(std::shared_ptr<DebugLogger> logger) {
+  const size_t data_size = 64 * 1024 * 1024;
+  struct Setting {
+    const char *filter_;
+    int level_;
+    int threads_; // 0 for one per core
+  };
+  const Setting settings[] = {{"gzip", 6, 1}, {"zstd", 3, 1}, {"zstd", 3, 4},
+                              {"zstd", 3, 0}, {"zstd", 9, 0}};
+  std::vector<std::string> names;
+  bool any = false;
+  for (auto &setting : settings) {
+    names.push_back(std::string(setting.filter_) + ":" +
+                    std::to_string(setting.level_) + "/threads:" +
+                    (setting.threads_ > 0 ? std::to_string(setting.threads_)
+                                          : std::string("all")));
+    any = any || selected("snapshot_stream/archive/" + names.back()) ||
+          selected("snapshot_stream/restore/" + names.back());
+  }
+  if (!any) {
+    return;
+  }
+
+  // entries like the ones of a snapshot: a path, the attributes and the
+  // chunk keys of a file, keys repeat across files like deduplicated chunks
+  std::string data;
+  uint64_t seed = 1;
+  for (uint64_t i = 0; data.size() < data_size; i++) {
+    data += "/dir" + std::to_string(i / 100) + "/file" + std::to_string(i);
+    uint64_t attrs[4] = {0100644, 1000, next_random(seed) % (1 << 20),
+                         1700000000 + i};
+    data.append(reinterpret_cast<const char *>(attrs), sizeof(attrs));
+    for (uint64_t n = next_random(seed) % 8 + 1; n > 0; n--) {
+      data += make_key(next_random(seed) % 100000);
+    }
+  }
+  data.resize(data_size);
+
+  auto path = make_temp_dir("snapshot");
+  struct cloudfs_state state;
+  memset(&state, 0, sizeof(state));
+  snprintf(state.ssd_path, sizeof(state.ssd_path), "%s/",
+           path.c_str());
+  snprintf(state.hostname, sizeof(state.hostname),
+           "sim:%s/cloud", path.c_str());
+  auto controller = std::make_shared<BufferFileController>(
+      &state, "bench", logger);
+
+  for (size_t i = 0; i < names.size(); i++) {
+    SnapshotStream::Compression compression;
+    compression.filter_ = settings[i].filter_;
+    compression.level_ = settings[i].level_;
+    compression.threads_ = settings[i].threads_;
+    auto key = "snapshot_" + std::to_string(i);
+    uint64_t generation = 0;
+    uint64_t size = 0;
+
+    // every iteration writes a new generation of the object, the old ones
+    // are removed with the directory
+    auto archive = [&](uint64_t iterations) {
+      for (uint64_t j = 0; j < iterations; j++) {
+        SnapshotStream stream(controller, key, ++generation, compression,
+                              logger);
+        if (stream.file() == NULL ||
+            fwrite(data.data(), 1, data.size(), stream.file()) !=
+                data.size() ||
+            stream.finish() != 0) {
+          fprintf(stderr, "snapshot_stream: archive failed\n");
+          exit(1);
+        }
+        size = stream.compressed_size();
+      }
+    };
+    auto name = "snapshot_stream/archive/" + names[i];
+    if (selected(name)) {
+      run(name, data_size, archive);
+    } else {
+      archive(1); // the object to restore
+    }
+
+    auto restored = path + "/restored";
+    SnapshotStream::Parts parts;
+    name = "snapshot_stream/restore/" + names[i];
+    run(name, data_size, [&](uint64_t iterations) {
+      for (uint64_t j = 0; j < iterations; j++) {
+        if (SnapshotStream::download(controller, key, restored, parts,
+                                     logger) != 0) {
+          fprintf(stderr, "snapshot_stream: restore failed\n");
+          exit(1);
+        }
+      }
+    });
+    if (selected(name)) {
+      std::string contents;
+      FILE *file = fopen(restored.c_str(), "r");
+      char buf[64 * 1024];
+      size_t n;
+      while (file != NULL && (n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        contents.append(buf, n);
+      }
+      if (file != NULL) {
+        fclose(file);
+      }
+      if (contents != data) {
+        fprintf(stderr, "snapshot_stream: restored object differs\n");
+      }
+    }
+
+    if (json_) {
+      printf("{\"name\":\"snapshot_stream/size/%s\",\"bytes\":%llu,"
+             "\"ratio\":%.3f}\n",
+             names[i].c_str(), (unsigned long long)size,
+             (double)data_size / size);
+    } else {
+      printf("%-36s %12llu bytes %8.3f ratio\n",
+             ("snapshot_stream/size/" + names[i]).c_str(),
+             (unsigned long long)size, (double)data_size / size);
+    }
+    fflush(stdout);
+  }
+
+  controller.reset();
+  remove_tree(path);
+}
+
+static void usage_exit(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [--filter substr] [--json] [--min-time sec] "
+          "[--max-keys N] [--dir path]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  static struct option long_options[] = {
+      {"filter", required_argument, NULL, 'f'},
+      {"json", no_argument, NULL, 'j'},
+      {"min-time", required_argument, NULL, 't'},
+      {"max-keys", required_argument, NULL, 'k'},
+      {"dir", required_argument, NULL, 'd'},
+      {0, 0, 0, 0}};
+  int c;
+  while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'f':
+      filter_ = optarg;
+      break;
+    case 'j':
+      json_ = true;
+      break;
+    case 't':
+      min_time_ = atof(optarg);
+      break;
+    case 'k':
+      max_keys_ = strtoull(optarg, NULL, 10);
+      break;
+    case 'd':
+      dir_ = optarg;
+      break;
+    default:
+      usage_exit(argv[0]);
+    }
+  }
+
+  auto logger = std::make_shared<DebugLogger>("/dev/null", LOG_LEVEL_OFF);
+
+  bench_chunk_splitter();
+  bench_chunk_table(logger);
+  bench_cache_replacer(logger);
+  bench_get_chunk_idx();
+  bench_snapshot_stream(logger);
+  return 0;
+}
@@ -0,0 +1,87 @@
+#!/bin/bash
+#
+# End-to-end benchmark suite. Mounts cloudfs against the local s3server,
+# runs fio-style and metadata workloads plus snapshot create/restore, and
+# appends one JSON line per workload (throughput, p50/p99 latency and the
+# S3 request/byte counters it moved) to $RESULTS.
+#
+# Extra arguments are passed to cloudfs, e.g.
+#   ./bench/run-bench.sh --container-size 4096
+# Sizes can be set with SIZE_MB, BLOCK_KB, COUNT and FILES.
+#
+BENCH_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+source $BENCH_DIR/../scripts/paths.sh
+source $SCRIPTS_DIR/functions.sh
+
+WORKLOAD_BIN="$SCRIPTS_DIR/../build/bench/workload-bench"
+SNAPSHOT_BIN="$SCRIPTS_DIR/snapshot"
+RESULTS=${RESULTS:-"/tmp/bench-`date +"%Y-%m-%d-%H%M%S"`.jsonl"}
+SIZE_MB=${SIZE_MB:-64}   # size of the large file
+BLOCK_KB=${BLOCK_KB:-128} # request size
+COUNT=${COUNT:-1000}      # random requests
+FILES=${FILES:-1000}      # small files
+
+process_args cloudfs --ssd-path $SSD_MNT_ --fuse-path $FUSE_MNT_ "$@"
+
+if [ ! -x $WORKLOAD_BIN ]; then
+  echo "$WORKLOAD_BIN not found, build the bench targets first"
+  exit 1
+fi
+
+reinit_env
+mkdir -p $FUSE_MNT/bench
+
+#
+# Runs a workload and records its result line
+#
+function run_workload()
+{
+  local workload=$1
+  shift
+  $WORKLOAD_BIN $workload $FUSE_MNT/bench --stats $FUSE_MNT/.stats.json "$@" | tee -a $RESULTS
+}
+
+#
+# Remounts cloudfs to drop the kernel and cloudfs caches
+#
+function drop_caches()
+{
+  $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS
+}
+
+#
+# Times a snapshot command and records it as a workload
+#
+function run_snapshot()
+{
+  local workload=$1
+  shift
+  local start=`date +%s%N`
+  SNAPSHOT_OUT=`$SNAPSHOT_BIN $FUSE_MNT/.snapshot "$@"`
+  local status=$?
+  local end=`date +%s%N`
+  printf '{"workload":"%s","status":%d,"seconds":%.3f}\n' $workload $status \
+    `echo "($end - $start) / 1000000000" | bc -l` | tee -a $RESULTS
+}
+
+echo "Writing results to $RESULTS"
+
+run_workload seqwrite --size $SIZE_MB --block $BLOCK_KB
+drop_caches
+run_workload seqread --block $BLOCK_KB
+run_workload randread --block 4 --count $COUNT
+run_workload randwrite --block 4 --count $COUNT
+run_workload smallfiles --block 4 --count $FILES
+run_workload dedup --size $(( (SIZE_MB + 7) / 8 )) --block $BLOCK_KB --count 8
+
+run_snapshot snapshot_create s
+snapshot_num=$SNAPSHOT_OUT
+rm -rf $FUSE_MNT/bench
+run_snapshot snapshot_restore r $snapshot_num
+run_snapshot snapshot_delete d $snapshot_num
+
+# cleanup
+$SCRIPTS_DIR/cloudfs_controller.sh u
+$SCRIPTS_DIR/kill_server.sh
+exit 0
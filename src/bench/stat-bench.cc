@@ -0,0 +1,69 @@
+/**
+ * @file stat-bench.cc
+ * @brief Measures the latency of lstat over many files in a mounted
+ * directory, run once cold and once warm to show the getattr caches.
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/**
+ * Run lstat over all files once
+ * @param dir directory holding the files
+ * @param count number of files
+ * @return seconds taken, negative on failure
+ */
+static double stat_all(const std::string &dir, int count) {
+  struct stat stbuf;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < count; i++) {
+    auto path = dir + "/f" + std::to_string(i);
+    if (lstat(path.c_str(), &stbuf) < 0) {
+      perror(path.c_str());
+      return -1;
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <dir in mount> [num_files]\n", argv[0]);
+    return 1;
+  }
+  std::string dir = argv[1];
+  int count = argc > 2 ? atoi(argv[2]) : 100000;
+
+  if (mkdir(dir.c_str(), 0755) < 0) {
+    perror(dir.c_str());
+    return 1;
+  }
+  for (int i = 0; i < count; i++) {
+    auto path = dir + "/f" + std::to_string(i);
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+      perror(path.c_str());
+      return 1;
+    }
+    close(fd);
+  }
+
+  for (int pass = 0; pass < 2; pass++) {
+    double seconds = stat_all(dir, count);
+    if (seconds < 0) {
+      return 1;
+    }
+    printf("%s: %d files, %.3f s, %.2f us/stat\n", pass == 0 ? "cold" : "warm",
+           count, seconds, seconds * 1e6 / count);
+  }
+  return 0;
+}
@@ -0,0 +1,281 @@
+/**
+ * @file workload-bench.cc
+ * @brief Runs one fio-style workload in a directory of a mounted cloudfs and
+ * prints its throughput, latency percentiles and the cloudfs counters it
+ * moved as one JSON line. Driven by run-bench.sh.
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Workload parameters
+ */
+struct Options {
+  std::string workload; // workload name
+  std::string dir;      // directory in the mount
+  std::string stats;    // path of /.stats.json, empty to skip counters
+  size_t size;          // file size in bytes
+  size_t block;         // request size in bytes
+  size_t count;         // random requests, small files or dedup copies
+  unsigned seed;        // random seed
+};
+
+/**
+ * Workload results
+ */
+struct Result {
+  std::vector<double> latencies_; // per request latency in us
+  size_t bytes_;                  // bytes transferred
+
+  Result() : bytes_(0) {}
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_us(Clock::time_point start) {
+  return std::chrono::duration<double, std::micro>(Clock::now() - start)
+      .count();
+}
+
+/**
+ * Read the counters section of /.stats.json
+ * @param path path of the stats file
+ * @return counter values by name, empty if unavailable
+ */
+static std::map<std::string, long long> read_counters(const std::string &path) {
+  std::map<std::string, long long> counters;
+  std::ifstream in(path);
+  std::stringstream ss;
+  ss << in.rdbuf();
+  auto json = ss.str();
+  auto begin = json.find("\"counters\":{");
+  if (begin == std::string::npos) {
+    return counters;
+  }
+  auto end = json.find('}', begin);
+  auto pos = begin + strlen("\"counters\":{");
+  while (pos < end) {
+    auto name_end = json.find('"', pos + 1);
+    auto name = json.substr(pos + 1, name_end - pos - 1);
+    auto value_end = std::min(json.find(',', name_end), end);
+    counters[name] = atoll(json.c_str() + name_end + 2);
+    pos = value_end + 1;
+  }
+  return counters;
+}
+
+static void fill_random(std::vector<char> &buf, std::mt19937 &rng) {
+  for (auto &c : buf) {
+    c = (char)rng();
+  }
+}
+
+static int open_or_die(const std::string &path, int flags) {
+  int fd = open(path.c_str(), flags, 0644);
+  if (fd < 0) {
+    perror(path.c_str());
+    exit(1);
+  }
+  return fd;
+}
+
+/**
+ * Write a file sequentially, one timed request per block
+ */
+static void write_file(const std::string &path, const std::vector<char> &data,
+                       size_t block, Result &result) {
+  int fd = open_or_die(path, O_CREAT | O_WRONLY | O_TRUNC);
+  for (size_t off = 0; off < data.size(); off += block) {
+    auto len = std::min(block, data.size() - off);
+    auto start = Clock::now();
+    if (pwrite(fd, data.data() + off, len, off) != (ssize_t)len) {
+      perror("pwrite");
+      exit(1);
+    }
+    result.latencies_.push_back(elapsed_us(start));
+    result.bytes_ += len;
+  }
+  close(fd);
+}
+
+static void seq_write(const Options &opts, Result &result) {
+  std::mt19937 rng(opts.seed);
+  std::vector<char> data(opts.size);
+  fill_random(data, rng);
+  write_file(opts.dir + "/seq.dat", data, opts.block, result);
+}
+
+static void seq_read(const Options &opts, Result &result) {
+  int fd = open_or_die(opts.dir + "/seq.dat", O_RDONLY);
+  std::vector<char> buf(opts.block);
+  for (off_t off = 0;; off += opts.block) {
+    auto start = Clock::now();
+    auto ret = pread(fd, buf.data(), opts.block, off);
+    if (ret <= 0) {
+      break;
+    }
+    result.latencies_.push_back(elapsed_us(start));
+    result.bytes_ += ret;
+  }
+  close(fd);
+}
+
+static void random_io(const Options &opts, Result &result, bool write) {
+  std::mt19937 rng(opts.seed);
+  int fd = open_or_die(opts.dir + "/seq.dat", write ? O_RDWR : O_RDONLY);
+  struct stat stbuf;
+  fstat(fd, &stbuf);
+  size_t blocks = std::max((size_t)1, (size_t)stbuf.st_size / opts.block);
+  std::vector<char> buf(opts.block);
+  fill_random(buf, rng);
+  for (size_t i = 0; i < opts.count; i++) {
+    off_t off = (off_t)(rng() % blocks) * opts.block;
+    auto start = Clock::now();
+    auto ret = write ? pwrite(fd, buf.data(), opts.block, off)
+                     : pread(fd, buf.data(), opts.block, off);
+    if (ret < 0) {
+      perror(write ? "pwrite" : "pread");
+      exit(1);
+    }
+    result.latencies_.push_back(elapsed_us(start));
+    result.bytes_ += ret;
+  }
+  close(fd);
+}
+
+static void small_files(const Options &opts, Result &result) {
+  std::mt19937 rng(opts.seed);
+  auto dir = opts.dir + "/small";
+  mkdir(dir.c_str(), 0755);
+  std::vector<char> buf(opts.block);
+  for (size_t i = 0; i < opts.count; i++) {
+    fill_random(buf, rng);
+    auto start = Clock::now();
+    int fd = open_or_die(dir + "/f" + std::to_string(i),
+                         O_CREAT | O_WRONLY | O_TRUNC);
+    if (write(fd, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+      perror("write");
+      exit(1);
+    }
+    close(fd);
+    result.latencies_.push_back(elapsed_us(start));
+    result.bytes_ += buf.size();
+  }
+}
+
+static void dedup(const Options &opts, Result &result) {
+  // copies of one base file, each with one block overwritten
+  std::mt19937 rng(opts.seed);
+  std::vector<char> base(opts.size);
+  fill_random(base, rng);
+  auto dir = opts.dir + "/dedup";
+  mkdir(dir.c_str(), 0755);
+  for (size_t i = 0; i < opts.count; i++) {
+    auto data = base;
+    size_t off = rng() % std::max((size_t)1, data.size() - opts.block);
+    for (size_t j = 0; j < opts.block && off + j < data.size(); j++) {
+      data[off + j] = (char)rng();
+    }
+    write_file(dir + "/copy" + std::to_string(i), data, opts.block, result);
+  }
+}
+
+static double percentile(std::vector<double> &sorted, double quantile) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[(size_t)(quantile * (sorted.size() - 1))];
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s <seqwrite|seqread|randwrite|randread|smallfiles|dedup> "
+          "<dir in mount> [--size MB] [--block KB] [--count N] [--seed N] "
+          "[--stats <mount>/.stats.json]\n",
+          prog);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    usage(argv[0]);
+  }
+  Options opts;
+  opts.workload = argv[1];
+  opts.dir = argv[2];
+  opts.size = 64 << 20;
+  opts.block = 128 << 10;
+  opts.count = 1000;
+  opts.seed = 1;
+  for (int i = 3; i + 1 < argc; i += 2) {
+    std::string arg = argv[i];
+    if (arg == "--size") {
+      opts.size = (size_t)atol(argv[i + 1]) << 20;
+    } else if (arg == "--block") {
+      opts.block = (size_t)atol(argv[i + 1]) << 10;
+    } else if (arg == "--count") {
+      opts.count = atol(argv[i + 1]);
+    } else if (arg == "--seed") {
+      opts.seed = atoi(argv[i + 1]);
+    } else if (arg == "--stats") {
+      opts.stats = argv[i + 1];
+    } else {
+      usage(argv[0]);
+    }
+  }
+
+  auto before = read_counters(opts.stats);
+  Result result;
+  auto start = Clock::now();
+  if (opts.workload == "seqwrite") {
+    seq_write(opts, result);
+  } else if (opts.workload == "seqread") {
+    seq_read(opts, result);
+  } else if (opts.workload == "randwrite") {
+    random_io(opts, result, true);
+  } else if (opts.workload == "randread") {
+    random_io(opts, result, false);
+  } else if (opts.workload == "smallfiles") {
+    small_files(opts, result);
+  } else if (opts.workload == "dedup") {
+    dedup(opts, result);
+  } else {
+    usage(argv[0]);
+  }
+  sync();
+  auto seconds = elapsed_us(start) / 1e6;
+  auto after = read_counters(opts.stats);
+
+  std::sort(result.latencies_.begin(), result.latencies_.end());
+  printf("{\"workload\":\"%s\",\"ops\":%zu,\"bytes\":%zu,\"seconds\":%.3f,"
+         "\"mb_per_s\":%.2f,\"ops_per_s\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f",
+         opts.workload.c_str(), result.latencies_.size(), result.bytes_,
+         seconds, result.bytes_ / 1048576.0 / seconds,
+         result.latencies_.size() / seconds,
+         percentile(result.latencies_, 0.5),
+         percentile(result.latencies_, 0.99));
+  printf(",\"counters\":{");
+  bool first = true;
+  for (auto &counter : after) {
+    printf("%s\"%s\":%lld", first ? "" : ",", counter.first.c_str(),
+           counter.second - before[counter.first]);
+    first = false;
+  }
+  printf("}}\n");
+  return 0;
+}
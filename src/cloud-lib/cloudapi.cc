@@ -28,6 +28,7 @@
 #include <unistd.h>
 
 #include "cloudapi.h"
+#include "cloudapi_sim.h"
 #define UNUSED __attribute__((unused))
 
 #if CLOUD_LOCAL_DEBUG
@@ -45,10 +46,25 @@ static const char secretAccessKeyG[16] = "";
 
 
 
-// Request results, saved as globals -------------------------------------------
+// Request results, saved as thread-local globals ------------------------------
+// Requests may be issued by the FUSE thread and by the background collector at
+// the same time, each thread sees the result of its own last request
 
-static int statusG = 0;
-static char errorDetailsG[4096] = { 0 };
+static __thread int statusG = 0;
+static __thread char errorDetailsG[4096] = { 0 };
+
+// Simulated backend ----------------------------------------------------------
+// A "sim:" hostname routes every request to cloudapi_sim.cc, see cloudapi_sim.h
+
+static bool simG = false;
+
+// Save the result of a simulated request like responseCompleteCallback does
+static S3Status sim_status(S3Status status)
+{
+    statusG = status;
+    errorDetailsG[0] = 0;
+    return status;
+}
 
 // response properties callback ------------------------------------------------
 
@@ -138,10 +154,18 @@ static void responseCompleteCallback(S3Status status,
 
 
 S3Status cloud_init(const char* hostname) {
+  simG = cloud_sim_selected(hostname);
+  if (simG) {
+    return sim_status(cloud_sim_init(hostname));
+  }
   return S3_initialize("s3", S3_INIT_ALL, hostname);
 }
 
 void cloud_destroy() {
+  if (simG) {
+    cloud_sim_destroy();
+    return;
+  }
   S3_deinitialize();
 }
 
@@ -177,6 +201,10 @@ static S3Status listServiceCallback(const char *ownerId UNUSED,
 
 S3Status cloud_list_service(list_service_filler_t filler)
 {
+  if (simG) {
+    return sim_status(cloud_sim_list_service(filler));
+  }
+
   list_service_data data;
 
   data.filler = filler;
@@ -196,6 +224,10 @@ S3Status cloud_list_service(list_service_filler_t filler)
 
 
 S3Status cloud_create_bucket(const char *bucketName) {
+  if (simG) {
+    return sim_status(cloud_sim_create_bucket(bucketName));
+  }
+
   S3ResponseHandler responseHandler =
   {
     &responsePropertiesCallback, &responseCompleteCallback
@@ -208,6 +240,10 @@ S3Status cloud_create_bucket(const char *bucketName) {
 }
 
 S3Status cloud_delete_bucket(const char *bucketName) {
+  if (simG) {
+    return sim_status(cloud_sim_delete_bucket(bucketName));
+  }
+
   S3ResponseHandler responseHandler =
   {
     &responsePropertiesCallback, &responseCompleteCallback
@@ -266,6 +302,10 @@ static S3Status listBucketCallback(int isTruncated, const char *nextMarker,
 }
 
 S3Status cloud_list_bucket(const char *bucketName, list_bucket_filler_t filler) {
+  if (simG) {
+    return sim_status(cloud_sim_list_bucket(bucketName, filler));
+  }
+
   S3BucketContext bucketContext =
   {
     0,
@@ -345,6 +385,11 @@ static int putObjectDataCallback(int bufferSize, char *buffer,
 S3Status cloud_put_object(const char *bucketName, const char *key,
                           uint64_t contentLength, put_filler_t filler) {
 
+    if (simG) {
+        return sim_status(cloud_sim_put_object(bucketName, key, contentLength,
+                                               filler));
+    }
+
     S3BucketContext bucketContext =
     {
         0,
@@ -402,8 +447,19 @@ static S3Status getObjectDataCallback(int bufferSize, const char *buffer,
 
 S3Status cloud_get_object(const char *bucketName, const char *key,
                     get_filler_t filler) {
+  return cloud_get_object_range(bucketName, key, 0, 0, filler);
+}
+
+// Get byteCount bytes starting at startByte, byteCount 0 reads to the end
+S3Status cloud_get_object_range(const char *bucketName, const char *key,
+                                uint64_t startByte, uint64_t byteCount,
+                                get_filler_t filler) {
+
+  if (simG) {
+    return sim_status(cloud_sim_get_object_range(bucketName, key, startByte,
+                                                 byteCount, filler));
+  }
 
-  uint64_t startByte = 0, byteCount = 0;
   int64_t ifModifiedSince = -1, ifNotModifiedSince = -1;
   const char *ifMatch = 0, *ifNotMatch = 0;
 
@@ -438,6 +494,10 @@ S3Status cloud_get_object(const char *bucketName, const char *key,
 }
 
 S3Status cloud_delete_object(const char *bucketName, const char *key) {
+  if (simG) {
+    return sim_status(cloud_sim_delete_object(bucketName, key));
+  }
+
   S3BucketContext bucketContext =
   {
       0,
@@ -459,4 +519,49 @@ S3Status cloud_delete_object(const char *bucketName, const char *key) {
   return static_cast<S3Status>(statusG);
 }
 
+// Delete objects ---------------------------------------------------------------
+// libs3 has no multi-object delete, keys are deleted one by one over the same
+// bucket context. Returns the first failure, remaining keys are still tried
+
+S3Status cloud_delete_objects(const char *bucketName, const char *const *keys,
+                              int count) {
+  if (simG) {
+    S3Status result = S3StatusOK;
+    for (int i = 0; i < count; i++) {
+      S3Status status = cloud_sim_delete_object(bucketName, keys[i]);
+      if (result == S3StatusOK) {
+        result = status;
+      }
+    }
+    return sim_status(result);
+  }
+
+  S3BucketContext bucketContext =
+  {
+      0,
+      bucketName,
+      protocolG,
+      uriStyleG,
+      accessKeyIdG,
+      secretAccessKeyG
+  };
+
+  S3ResponseHandler responseHandler =
+  { 
+      0,
+      &responseCompleteCallback
+  };
+
+  int result = S3StatusOK;
+  for (int i = 0; i < count; i++) {
+    S3_delete_object(&bucketContext, keys[i], 0, &responseHandler, 0);
+    if (result == S3StatusOK && statusG != S3StatusOK) {
+      result = statusG;
+    }
+  }
+  statusG = result;
+
+  return static_cast<S3Status>(result);
+}
+
 #endif
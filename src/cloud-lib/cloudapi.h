@@ -44,6 +44,15 @@ S3Status cloud_put_object(const char *bucketName, const char *key,
 S3Status cloud_get_object(const char *bucketName, const char *key,
                           get_filler_t filler);
 
+// Ranged GET, byteCount 0 reads to the end of the object
+S3Status cloud_get_object_range(const char *bucketName, const char *key,
+                                uint64_t startByte, uint64_t byteCount,
+                                get_filler_t filler);
+
 S3Status cloud_delete_object(const char *bucketName, const char *key);
 
+// Delete several objects, the batch is not atomic
+S3Status cloud_delete_objects(const char *bucketName, const char *const *keys,
+                              int count);
+
 #endif
@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <chrono>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mutex>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "cloudapi_sim.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static const char SIM_PREFIX[] = "sim:";
+static const size_t TRANSFER_SIZE = 64 * 1024; // bytes per filler call
+static const char TMP_DIR_NAME[] = ".tmp";     // staging of PUT bodies
+
+// One direction of the network link, shared by all requests ------------------
+
+struct SimLink
+{
+  double bytesPerSecond; // 0 means unlimited
+  Clock::time_point freeAt; // end of the last scheduled transfer
+
+  SimLink() : bytesPerSecond(0) {}
+};
+
+static std::string rootG;       // directory holding the buckets
+static double latencyMsG = 0;   // latency before the first byte
+static double jitterMsG = 0;    // uniform extra latency
+static double errorRateG = 0;   // probability of a failed request
+static SimLink upG;             // PUT direction
+static SimLink downG;           // GET direction
+static std::mt19937_64 randomG; // jitter and error draws
+static std::mutex mutexG;       // protects the links and randomG
+
+// Request timing --------------------------------------------------------------
+
+// Draw the delay before the first byte and whether the request fails
+static Clock::duration draw_latency(bool &fail)
+{
+  std::lock_guard<std::mutex> lock(mutexG);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  double ms = latencyMsG + jitterMsG * uniform(randomG);
+  fail = errorRateG > 0 && uniform(randomG) < errorRateG;
+  return std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double, std::milli>(ms));
+}
+
+// Schedule bytes on a link after start, returns when the transfer is done
+static Clock::time_point reserve(SimLink &link, Clock::time_point start,
+                                 uint64_t bytes)
+{
+  if (link.bytesPerSecond <= 0) {
+    return start;
+  }
+  std::lock_guard<std::mutex> lock(mutexG);
+  auto begin = std::max(start, link.freeAt);
+  link.freeAt = begin + std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(bytes / link.bytesPerSecond));
+  return link.freeAt;
+}
+
+// Wait for the latency of a request, false if the request is to fail
+static bool begin_request()
+{
+  bool fail;
+  std::this_thread::sleep_for(draw_latency(fail));
+  return !fail;
+}
+
+// Wait until bytes have crossed a link
+static void transfer(SimLink &link, uint64_t bytes)
+{
+  std::this_thread::sleep_until(reserve(link, Clock::now(), bytes));
+}
+
+// Object paths ----------------------------------------------------------------
+
+// Keys may contain '/', escape it so every object is one file
+static std::string escape_key(const char *key)
+{
+  std::string escaped;
+  for (const char *c = key; *c; c++) {
+    if (*c == '/') {
+      escaped += "%2F";
+    } else if (*c == '%') {
+      escaped += "%25";
+    } else {
+      escaped += *c;
+    }
+  }
+  return escaped;
+}
+
+static std::string unescape_key(const std::string &name)
+{
+  std::string key;
+  for (size_t i = 0; i < name.size(); i++) {
+    if (name[i] == '%' && name.compare(i, 3, "%2F") == 0) {
+      key += '/';
+      i += 2;
+    } else if (name[i] == '%' && name.compare(i, 3, "%25") == 0) {
+      key += '%';
+      i += 2;
+    } else {
+      key += name[i];
+    }
+  }
+  return key;
+}
+
+static std::string bucket_path(const char *bucketName)
+{
+  return rootG + "/" + bucketName;
+}
+
+static std::string object_path(const char *bucketName, const char *key)
+{
+  return bucket_path(bucketName) + "/" + escape_key(key);
+}
+
+// Parse a double option value, false if the value is malformed
+static bool parse_value(const std::string &value, double &out)
+{
+  char *end;
+  errno = 0;
+  out = strtod(value.c_str(), &end);
+  return errno == 0 && end != value.c_str() && *end == '\0' && out >= 0;
+}
+
+// API -------------------------------------------------------------------------
+
+bool cloud_sim_selected(const char *hostname)
+{
+  return strncmp(hostname, SIM_PREFIX, sizeof(SIM_PREFIX) - 1) == 0;
+}
+
+S3Status cloud_sim_init(const char *hostname)
+{
+  std::string spec(hostname + sizeof(SIM_PREFIX) - 1);
+  auto comma = spec.find(',');
+  rootG = spec.substr(0, comma);
+  if (rootG.empty()) {
+    fprintf(stderr, "cloud_sim_init: no directory in %s\n", hostname);
+    return S3StatusInternalError;
+  }
+
+  latencyMsG = jitterMsG = errorRateG = 0;
+  double bandwidth = 0, up = -1, down = -1, seed = 0;
+  while (comma != std::string::npos) {
+    auto next = spec.find(',', comma + 1);
+    auto option = spec.substr(comma + 1, next == std::string::npos
+                                             ? std::string::npos
+                                             : next - comma - 1);
+    comma = next;
+    auto eq = option.find('=');
+    double value;
+    if (eq == std::string::npos || !parse_value(option.substr(eq + 1), value)) {
+      fprintf(stderr, "cloud_sim_init: bad option %s\n", option.c_str());
+      return S3StatusInternalError;
+    }
+    auto name = option.substr(0, eq);
+    if (name == "latency") {
+      latencyMsG = value;
+    } else if (name == "jitter") {
+      jitterMsG = value;
+    } else if (name == "bandwidth") {
+      bandwidth = value;
+    } else if (name == "up") {
+      up = value;
+    } else if (name == "down") {
+      down = value;
+    } else if (name == "error") {
+      errorRateG = value;
+    } else if (name == "seed") {
+      seed = value;
+    } else {
+      fprintf(stderr, "cloud_sim_init: unknown option %s\n", option.c_str());
+      return S3StatusInternalError;
+    }
+  }
+  upG.bytesPerSecond = (up >= 0 ? up : bandwidth) * 1024 * 1024;
+  downG.bytesPerSecond = (down >= 0 ? down : bandwidth) * 1024 * 1024;
+  upG.freeAt = downG.freeAt = Clock::now();
+  randomG.seed((uint64_t)seed);
+
+  mkdir(rootG.c_str(), 0755);
+  mkdir((rootG + "/" + TMP_DIR_NAME).c_str(), 0755);
+  struct stat st;
+  if (stat(rootG.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    return S3StatusInternalError;
+  }
+  return S3StatusOK;
+}
+
+void cloud_sim_destroy()
+{
+}
+
+S3Status cloud_sim_list_service(list_service_filler_t filler)
+{
+  if (!begin_request()) {
+    return S3StatusErrorServiceUnavailable;
+  }
+  DIR *dir = opendir(rootG.c_str());
+  if (dir == NULL) {
+    return S3StatusInternalError;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      filler(entry->d_name);
+    }
+  }
+  closedir(dir);
+  return S3StatusOK;
+}
+
+S3Status cloud_sim_create_bucket(const char *bucketName)
+{
+  if (!begin_request()) {
+    return S3StatusErrorServiceUnavailable;
+  }
+  if (bucketName[0] == '.') {
+    return S3StatusInvalidBucketNameFirstCharacter;
+  }
+  if (mkdir(bucket_path(bucketName).c_str(), 0755) != 0 && errno != EEXIST) {
+    return S3StatusInternalError;
+  }
+  return S3StatusOK;
+}
+
+S3Status cloud_sim_delete_bucket(const char *bucketName)
+{
+  if (!begin_request()) {
+    return S3StatusErrorServiceUnavailable;
+  }
+  if (rmdir(bucket_path(bucketName).c_str()) != 0) {
+    if (errno == ENOENT) {
+      return S3StatusErrorNoSuchBucket;
+    }
+    return errno == ENOTEMPTY ? S3StatusErrorBucketNotEmpty
+                              : S3StatusInternalError;
+  }
+  return S3StatusOK;
+}
+
+S3Status cloud_sim_list_bucket(const char *bucketName,
+                               list_bucket_filler_t filler)
+{
+  if (!begin_request()) {
+    return S3StatusErrorServiceUnavailable;
+  }
+  auto path = bucket_path(bucketName);
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL) {
+    return S3StatusErrorNoSuchBucket;
+  }
+  // S3 lists keys in lexicographic order
+  std::vector<std::string> names;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::vector<std::pair<std::string, std::string>> keys;
+  for (auto &name : names) {
+    keys.emplace_back(unescape_key(name), name);
+  }
+  std::sort(keys.begin(), keys.end());
+
+  for (auto &key : keys) {
+    struct stat st;
+    if (stat((path + "/" + key.second).c_str(), &st) == 0) {
+      filler(key.first.c_str(), st.st_mtime, st.st_size);
+    }
+  }
+  return S3StatusOK;
+}
+
+S3Status cloud_sim_put_object(const char *bucketName, const char *key,
+                              uint64_t contentLength, put_filler_t filler)
+{
+  if (!begin_request()) {
+    return S3StatusErrorServiceUnavailable;
+  }
+  struct stat st;
+  if (stat(bucket_path(bucketName).c_str(), &st) != 0) {
+    return S3StatusErrorNoSuchBucket;
+  }
+
+  // the body is staged and renamed, a reader never sees a partial object
+  auto tmp_path = rootG + "/" + TMP_DIR_NAME + "/put-XXXXXX";
+  std::vector<char> tmp_name(tmp_path.begin(), tmp_path.end());
+  tmp_name.push_back('\0');
+  int fd = mkstemp(tmp_name.data());
+  if (fd == -1) {
+    return S3StatusInternalError;
+  }
+
+  std::vector<char> buf(TRANSFER_SIZE);
+  uint64_t remaining = contentLength;
+  S3Status status = S3StatusOK;
+  while (remaining > 0) {
+    int len = (int)std::min<uint64_t>(remaining, buf.size());
+    int got = filler(buf.data(), len);
+    if (got <= 0) {
+      status = S3StatusAbortedByCallback;
+      break;
+    }
+    if (write(fd, buf.data(), got) != got) {
+      status = S3StatusInternalError;
+      break;
+    }
+    transfer(upG, got);
+    remaining -= got;
+  }
+  close(fd);
+
+  if (status == S3StatusOK &&
+      rename(tmp_name.data(), object_path(bucketName, key).c_str()) != 0) {
+    status = S3StatusInternalError;
+  }
+  if (status != S3StatusOK) {
+    unlink(tmp_name.data());
+  }
+  return status;
+}
+
+S3Status cloud_sim_get_object_range(const char *bucketName, const char *key,
+                                    uint64_t startByte, uint64_t byteCount,
+                                    get_filler_t filler)
+{
+  if (!begin_request()) {
+    return S3StatusErrorServiceUnavailable;
+  }
+  int fd = open(object_path(bucketName, key).c_str(), O_RDONLY);
+  if (fd == -1) {
+    return S3StatusErrorNoSuchKey;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return S3StatusInternalError;
+  }
+  uint64_t size = st.st_size;
+  if (startByte > size || (startByte == size && size > 0)) {
+    close(fd);
+    return S3StatusErrorInvalidRange;
+  }
+  uint64_t remaining = size - startByte;
+  if (byteCount > 0) {
+    remaining = std::min(remaining, byteCount);
+  }
+
+  std::vector<char> buf(TRANSFER_SIZE);
+  off_t offset = startByte;
+  S3Status status = S3StatusOK;
+  while (remaining > 0) {
+    auto len = std::min<uint64_t>(remaining, buf.size());
+    auto got = pread(fd, buf.data(), len, offset);
+    if (got <= 0) {
+      status = S3StatusInternalError;
+      break;
+    }
+    transfer(downG, got);
+    if (filler(buf.data(), (int)got) < got) {
+      status = S3StatusAbortedByCallback;
+      break;
+    }
+    offset += got;
+    remaining -= got;
+  }
+  close(fd);
+  return status;
+}
+
+S3Status cloud_sim_delete_object(const char *bucketName, const char *key)
+{
+  if (!begin_request()) {
+    return S3StatusErrorServiceUnavailable;
+  }
+  // S3 deletes of missing keys succeed
+  if (unlink(object_path(bucketName, key).c_str()) != 0 && errno != ENOENT) {
+    return S3StatusInternalError;
+  }
+  return S3StatusOK;
+}
@@ -0,0 +1,51 @@
+#ifndef __CLOUD_API_SIM_H__
+#define __CLOUD_API_SIM_H__
+
+#include "cloudapi.h"
+
+// Simulated S3 backend for testing and benchmarking ---------------------------
+//
+// Passing a hostname of the form
+//
+//   sim:<dir>[,latency=<ms>][,jitter=<ms>][,bandwidth=<MB/s>]
+//            [,up=<MB/s>][,down=<MB/s>][,error=<rate>][,seed=<n>]
+//
+// to cloud_init routes every request of the process to an in-process
+// simulator instead of libs3. Buckets are directories under <dir> and objects
+// are files, so the contents survive a remount like with s3server.py.
+//
+// Every request waits latency plus a uniform jitter in [0, jitter] before its
+// first byte, then its bytes are sent over a link of the given bandwidth that
+// is shared by all concurrent requests in the same direction, so parallel
+// requests overlap their latency but not their transfer time. bandwidth sets
+// both directions, up and down override it, 0 means unlimited. A request
+// fails with S3StatusErrorServiceUnavailable with probability error, after its
+// latency and without side effects. Random draws come from seed, so a single
+// threaded run is reproducible.
+
+// Check whether a hostname selects the simulated backend
+bool cloud_sim_selected(const char *hostname);
+
+S3Status cloud_sim_init(const char *hostname);
+
+void cloud_sim_destroy();
+
+S3Status cloud_sim_list_service(list_service_filler_t filler);
+
+S3Status cloud_sim_create_bucket(const char *bucketName);
+
+S3Status cloud_sim_delete_bucket(const char *bucketName);
+
+S3Status cloud_sim_list_bucket(const char *bucketName,
+                               list_bucket_filler_t filler);
+
+S3Status cloud_sim_put_object(const char *bucketName, const char *key,
+                              uint64_t contentLength, put_filler_t filler);
+
+S3Status cloud_sim_get_object_range(const char *bucketName, const char *key,
+                                    uint64_t startByte, uint64_t byteCount,
+                                    get_filler_t filler);
+
+S3Status cloud_sim_delete_object(const char *bucketName, const char *key);
+
+#endif
@@ -0,0 +1,67 @@
+#include "bloom_filter.h"
+
+#include <algorithm>
+
+namespace {
+
+/**
+ * FNV-1a 64-bit hash with a seed
+ */
+uint64_t hash64(const std::string &key, uint64_t seed) {
+  uint64_t hash = 14695981039346656037ull ^ seed;
+  for (auto c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ull;
+  }
+  // final mix, spreads the low entropy of short keys over all bits
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+} // namespace
+
+BloomFilter::BloomFilter() : num_bits_(0), num_hashes_(0) {}
+
+BloomFilter::BloomFilter(uint64_t num_bits, uint32_t num_hashes)
+    : bits_((num_bits + 7) / 8, 0), num_bits_(num_bits),
+      num_hashes_(num_hashes) {}
+
+BloomFilter BloomFilter::with_capacity(uint64_t expected_keys,
+                                       uint32_t bits_per_key) {
+  auto num_bits = std::max<uint64_t>(expected_keys * bits_per_key, 64);
+  // optimal number of probes is bits_per_key * ln(2)
+  auto num_hashes =
+      std::min<uint32_t>(std::max<uint32_t>(bits_per_key * 69 / 100, 1), 30);
+  return BloomFilter(num_bits, num_hashes);
+}
+
+void BloomFilter::add(const std::string &key) {
+  if (num_bits_ == 0) {
+    return;
+  }
+  auto h1 = hash64(key, 0);
+  auto h2 = hash64(key, 0x9e3779b97f4a7c15ull) | 1;
+  for (uint32_t i = 0; i < num_hashes_; i++) {
+    auto bit = (h1 + i * h2) % num_bits_;
+    bits_[bit / 8] |= (1 << (bit % 8));
+  }
+}
+
+bool BloomFilter::may_contain(const std::string &key) const {
+  if (num_bits_ == 0) {
+    return false;
+  }
+  auto h1 = hash64(key, 0);
+  auto h2 = hash64(key, 0x9e3779b97f4a7c15ull) | 1;
+  for (uint32_t i = 0; i < num_hashes_; i++) {
+    auto bit = (h1 + i * h2) % num_bits_;
+    if ((bits_[bit / 8] & (1 << (bit % 8))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void BloomFilter::clear() { std::fill(bits_.begin(), bits_.end(), 0); }
@@ -0,0 +1,79 @@
+/**
+ * @file bloom_filter.h
+ * @brief Bloom filter over string keys
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Bloom filter over string keys
+ *
+ * Uses double hashing to derive the probe positions from two 64-bit hashes.
+ */
+class BloomFilter {
+  std::vector<uint8_t> bits_; // bit array
+  uint64_t num_bits_;         // number of bits
+  uint32_t num_hashes_;       // number of probes per key
+
+public:
+  BloomFilter();
+
+  /**
+   * Constructor
+   * @param num_bits number of bits of the filter
+   * @param num_hashes number of probes per key
+   */
+  BloomFilter(uint64_t num_bits, uint32_t num_hashes);
+
+  /**
+   * Create a filter sized for the expected number of keys
+   * @param expected_keys expected number of keys
+   * @param bits_per_key bits per key, 10 gives about 1% false positives
+   * @return the filter
+   */
+  static BloomFilter with_capacity(uint64_t expected_keys,
+                                   uint32_t bits_per_key = 10);
+
+  /**
+   * Add a key
+   * @param key key to add
+   */
+  void add(const std::string &key);
+
+  /**
+   * Check if a key may be in the filter
+   * @param key key to check
+   * @return false if the key is definitely not in the filter
+   */
+  bool may_contain(const std::string &key) const;
+
+  /**
+   * Remove all keys
+   */
+  void clear();
+
+  /**
+   * Get number of bits
+   * @return number of bits
+   */
+  uint64_t num_bits() const { return num_bits_; }
+
+  /**
+   * Get number of probes per key
+   * @return number of probes per key
+   */
+  uint32_t num_hashes() const { return num_hashes_; }
+
+  /**
+   * Get the underlying bit array, used for persistence
+   * @return bit array
+   */
+  std::vector<uint8_t> &data() { return bits_; }
+  const std::vector<uint8_t> &data() const { return bits_; }
+};
@@ -1,5 +1,6 @@
 #include "buffer_file.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <dirent.h>
@@ -11,6 +12,7 @@
 
 #include "cloudapi.h"
 #include "cloudfs.h"
+#include "metrics.h"
 #include "util.h"
 
 BufferFileController::BufferFileController(struct cloudfs_state *state,
@@ -19,9 +21,9 @@ BufferFileController::BufferFileController(struct cloudfs_state *state,
     : bucket_name_(std::move(bucket_name)), logger_(std::move(logger)) {
   // init s3
   cloud_init(state->hostname);
-  cloud_print_error(logger_->get_file());
+  print_cloud_error();
   cloud_create_bucket(bucket_name_.c_str());
-  cloud_print_error(logger_->get_file());
+  print_cloud_error();
 
   // init cache
   cache_replacer_ = std::make_shared<LRUCacheReplacer>(state, logger_);
@@ -29,6 +31,11 @@ BufferFileController::BufferFileController(struct cloudfs_state *state,
   cache_used_ = 0;
   cache_root_ = std::string(state->ssd_path) + "/.cache";
 
+  if (state->gc_grace >= 0) {
+    collector_ = std::make_shared<ChunkCollector>(
+        state->ssd_path, bucket_name_, logger_, state->gc_grace, state->gc_rate);
+  }
+
   logger_->info("BufferFileController: cache_size: " + std::to_string(cache_size_));
 
   // create cache root if not exists
@@ -83,9 +90,9 @@ BufferFileController::BufferFileController(struct cloudfs_state *state,
   closedir(dir);
 
   for (auto &object : cached_objects_) {
-    logger_->debug("BufferFileController: load cached object: " + object.first +
-                   ", size: " + std::to_string(object.second.size_) +
-                   ", dirty: " + std::to_string(object.second.dirty_));
+    logger_->debug("BufferFileController: load cached object: ", object.first,
+                   ", size: ", object.second.size_, ", dirty: ",
+                   object.second.dirty_);
   }
   logger_->info("BufferFileController: cache state loaded, cache_used: " +
                 std::to_string(cache_used_));
@@ -97,24 +104,47 @@ int64_t BufferFileController::infd_ = 0;
 int64_t BufferFileController::outfd_ = 0;
 off_t BufferFileController::in_offset_ = 0;
 off_t BufferFileController::out_offset_ = 0;
+std::string *BufferFileController::outbuf_ = NULL;
+const char *BufferFileController::inbuf_ = NULL;
+size_t BufferFileController::inbuf_len_ = 0;
 std::vector<std::string> BufferFileController::bucket_list_;
 std::vector<std::pair<std::string, uint64_t>> BufferFileController::object_list_;
 
-BufferFileController::~BufferFileController() { cloud_destroy(); }
+BufferFileController::~BufferFileController() {
+  stop_collector();
+  cloud_destroy();
+}
 
 int BufferFileController::download_chunk(const std::string &key, uint64_t fd,
                                      off_t offset, size_t size) {
+  return download_chunk_range(key, key, 0, fd, offset, size);
+}
+
+int BufferFileController::download_chunk_range(const std::string &key,
+                                               const std::string &object_key,
+                                               off_t object_offset,
+                                               uint64_t fd, off_t offset,
+                                               size_t size) {
+  ScopedTimer timer(Metrics::OP_DOWNLOAD_CHUNK);
+  auto &metrics = Metrics::instance();
+  // a standalone chunk object is fetched whole, a chunk packed in a container
+  // by range
+  auto range_size = object_key == key ? 0 : size;
   if ((int64_t)size > cache_size_) {
     // cannot fit in cache, download directly
+    metrics.add(Metrics::CACHE_MISSES);
+    metrics.add(Metrics::S3_GETS);
     outfd_ = fd;
     out_offset_ = offset;
-    cloud_get_object(bucket_name_.c_str(), key.c_str(), get_buffer_fd);
-    cloud_print_error(logger_->get_file());
+    cloud_get_object_range(bucket_name_.c_str(), object_key.c_str(),
+                           object_offset, range_size, get_buffer_fd);
+    print_cloud_error();
     return 0;
   }
 
   auto cached_path = cache_root_ + "." + key;
   if (cached_objects_.find(key) == cached_objects_.end()) {
+    metrics.add(Metrics::CACHE_MISSES);
     // evict cache to make space
     auto ret = evict_to_size(size);
     if (ret != 0) {
@@ -131,13 +161,17 @@ int BufferFileController::download_chunk(const std::string &key, uint64_t fd,
           cached_path);
     }
     out_offset_ = 0;
-    cloud_get_object(bucket_name_.c_str(), key.c_str(), get_buffer_fd);
-    cloud_print_error(logger_->get_file());
+    metrics.add(Metrics::S3_GETS);
+    cloud_get_object_range(bucket_name_.c_str(), object_key.c_str(),
+                           object_offset, range_size, get_buffer_fd);
+    print_cloud_error();
     close(outfd_);
 
     // update cache state
     cached_objects_[key] = CachedObject(size, false);
     cache_used_ += size;
+  } else {
+    metrics.add(Metrics::CACHE_HITS);
   }
 
   // open cached chunk file
@@ -179,12 +213,14 @@ int BufferFileController::download_chunk(const std::string &key, uint64_t fd,
 
 int BufferFileController::upload_chunk(const std::string &key, uint64_t fd,
                                    off_t offset, size_t size) {
+  ScopedTimer timer(Metrics::OP_UPLOAD_CHUNK);
   if ((int64_t)size > cache_size_) {
     // cannot fit in cache, upload directly
+    Metrics::instance().add(Metrics::S3_PUTS);
     infd_ = fd;
     in_offset_ = offset;
     cloud_put_object(bucket_name_.c_str(), key.c_str(), size, put_buffer_fd);
-    cloud_print_error(logger_->get_file());
+    print_cloud_error();
     return 0;
   }
 
@@ -247,32 +283,77 @@ int BufferFileController::upload_chunk(const std::string &key, uint64_t fd,
 
 int BufferFileController::download_file(const std::string &key,
                                     const std::string &buffer_path) {
+  ScopedTimer timer(Metrics::OP_DOWNLOAD_OBJECT);
   outfile_ = fopen(buffer_path.c_str(), "w");
   if (outfile_ == NULL) {
     return -1;
   }
 
+  Metrics::instance().add(Metrics::S3_GETS);
   cloud_get_object(bucket_name_.c_str(), key.c_str(), get_buffer);
   fclose(outfile_);
-  cloud_print_error(logger_->get_file());
+  print_cloud_error();
 
   return 0;
 }
 
 int BufferFileController::upload_file(const std::string &key,
                                   const std::string &buffer_path, size_t size) {
+  ScopedTimer timer(Metrics::OP_UPLOAD_OBJECT);
   infile_ = fopen(buffer_path.c_str(), "r");
   if (infile_ == NULL) {
     return -1;
   }
 
+  Metrics::instance().add(Metrics::S3_PUTS);
   cloud_put_object(bucket_name_.c_str(), key.c_str(), size, put_buffer);
   fclose(infile_);
-  cloud_print_error(logger_->get_file());
+  print_cloud_error();
 
   return 0;
 }
 
+int BufferFileController::download_buffer(const std::string &key,
+                                          std::string &data) {
+  ScopedTimer timer(Metrics::OP_DOWNLOAD_OBJECT);
+  data.clear();
+  outbuf_ = &data;
+
+  Metrics::instance().add(Metrics::S3_GETS);
+  auto status = cloud_get_object(bucket_name_.c_str(), key.c_str(),
+                                 get_buffer_mem);
+  outbuf_ = NULL;
+  if (status != S3StatusOK) {
+    print_cloud_error();
+    errno = EIO;
+    return logger_->error("BufferFileController::download_buffer: get object "
+                          "failed, key: " +
+                          key);
+  }
+  return 0;
+}
+
+int BufferFileController::upload_buffer(const std::string &key,
+                                        const char *data, size_t size) {
+  ScopedTimer timer(Metrics::OP_UPLOAD_OBJECT);
+  inbuf_ = data;
+  inbuf_len_ = size;
+  in_offset_ = 0;
+
+  Metrics::instance().add(Metrics::S3_PUTS);
+  auto status = cloud_put_object(bucket_name_.c_str(), key.c_str(), size,
+                                 put_buffer_mem);
+  inbuf_ = NULL;
+  if (status != S3StatusOK) {
+    print_cloud_error();
+    errno = EIO;
+    return logger_->error("BufferFileController::upload_buffer: put object "
+                          "failed, key: " +
+                          key);
+  }
+  return 0;
+}
+
 int BufferFileController::clear_file(const std::string &buffer_path) {
   auto ret = truncate(buffer_path.c_str(), 0);
   if (ret == -1) {
@@ -291,7 +372,7 @@ int BufferFileController::clear_file(uint64_t fd) {
   return 0;
 }
 
-int BufferFileController::delete_object(const std::string &key) {
+bool BufferFileController::drop_cached_object(const std::string &key) {
   if (cached_objects_.find(key) != cached_objects_.end()) {
     // found in cache, delete cached file
     cache_used_ -= cached_objects_[key].size_;
@@ -306,16 +387,54 @@ int BufferFileController::delete_object(const std::string &key) {
     if (dirty) {
       // dirty means the object hasn't been uploaded to cloud, no need to delete
       // the object on cloud
-      return 0;
+      return false;
     }
   }
+  return true;
+}
+
+int BufferFileController::delete_object(const std::string &key) {
+  if (!drop_cached_object(key)) {
+    return 0;
+  }
 
   // delete object on cloud
+  Metrics::instance().add(Metrics::S3_DELETES);
   cloud_delete_object(bucket_name_.c_str(), key.c_str());
-  cloud_print_error(logger_->get_file());
+  print_cloud_error();
   return 0;
 }
 
+int BufferFileController::retire_object(const std::string &key) {
+  if (collector_ == nullptr) {
+    return delete_object(key);
+  }
+
+  // the cached copy is dropped right away, only the cloud copy waits
+  if (drop_cached_object(key)) {
+    collector_->enqueue(key);
+  }
+  return 0;
+}
+
+bool BufferFileController::revive_object(const std::string &key) {
+  if (collector_ == nullptr) {
+    return false;
+  }
+  return collector_->cancel(key);
+}
+
+void BufferFileController::sync_retired() {
+  if (collector_ != nullptr) {
+    collector_->sync();
+  }
+}
+
+void BufferFileController::stop_collector() {
+  // destroying the collector joins the worker and persists the queue
+  collector_.reset();
+}
+
 int BufferFileController::persist_cache_state() {
   cache_replacer_->persist(); // persist cache replacer
 
@@ -359,9 +478,10 @@ int BufferFileController::persist_cache_state() {
             path: " + path);
       }
       in_offset_ = 0;
+      Metrics::instance().add(Metrics::S3_PUTS);
       cloud_put_object(bucket_name_.c_str(), objects.first.c_str(),
                        objects.second.size_, put_buffer_fd);
-      cloud_print_error(logger_->get_file());
+      print_cloud_error();
       close(infd_);
 
       objects.second.dirty_ = false;
@@ -375,9 +495,9 @@ int BufferFileController::persist_cache_state() {
           path);
     }
     logger_->debug(
-        "BufferFileController::persist_cache_state: persist cached object: " +
-        objects.first + ", size: " + std::to_string(objects.second.size_) +
-        ", dirty: " + std::to_string(objects.second.dirty_));
+        "BufferFileController::persist_cache_state: persist cached object: ",
+        objects.first, ", size: ", objects.second.size_, ", dirty: ",
+        objects.second.dirty_);
   }
 
   return 0;
@@ -385,6 +505,21 @@ int BufferFileController::persist_cache_state() {
 
 void BufferFileController::print_cache() { cache_replacer_->print_cache(); }
 
+void BufferFileController::print_cloud_error() {
+  auto status = static_cast<S3Status>(cloud_get_status());
+  if (status == S3StatusOK || !logger_->enabled(LOG_LEVEL_ERROR)) {
+    return;
+  }
+  // the details are only set by requests the server answered
+  std::string details;
+  if (status >= S3StatusErrorAccessDenied) {
+    details = cloud_get_ErrorDetails();
+    std::replace(details.begin(), details.end(), '\n', ' ');
+  }
+  logger_->error("cloud request failed: ", S3_get_status_name(status),
+                 details);
+}
+
 int BufferFileController::evict_to_size(size_t required_size) {
   while (cache_size_ - cache_used_ < (int64_t)required_size) {
     std::string to_evict;
@@ -392,6 +527,7 @@ int BufferFileController::evict_to_size(size_t required_size) {
 
     auto victim_path = cache_root_ + "." + to_evict;
     auto dirty = cached_objects_[to_evict].dirty_;
+    Metrics::instance().add(Metrics::CACHE_EVICTIONS);
 
     if (dirty) {
       // write back to cloud
@@ -401,9 +537,11 @@ int BufferFileController::evict_to_size(size_t required_size) {
                               victim_path);
       }
       in_offset_ = 0;
+      Metrics::instance().add(Metrics::CACHE_WRITEBACKS);
+      Metrics::instance().add(Metrics::S3_PUTS);
       cloud_put_object(bucket_name_.c_str(), to_evict.c_str(),
                        cached_objects_[to_evict].size_, put_buffer_fd);
-      cloud_print_error(logger_->get_file());
+      print_cloud_error();
       close(infd_);
     }
 
@@ -6,8 +6,10 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <sys/types.h>
@@ -16,7 +18,9 @@
 #include <vector>
 
 #include "cache_replacer.h"
+#include "chunk_collector.h"
 #include "cloudfs.h"
+#include "metrics.h"
 #include "util.h"
 
 /**
@@ -39,6 +43,9 @@ class BufferFileController {
   static int64_t infd_;                 // file descriptor for upload
   static off_t out_offset_;             // offset for download
   static off_t in_offset_;              // offset for upload
+  static std::string *outbuf_;          // memory buffer for download
+  static const char *inbuf_;            // memory buffer for upload
+  static size_t inbuf_len_;             // length of the memory buffer for upload
   static std::vector<std::string>
       bucket_list_; // tmp bucket list for list service
   static std::vector<std::pair<std::string, uint64_t>>
@@ -62,6 +69,9 @@ class BufferFileController {
   std::string cache_root_; // cache root
 
   std::shared_ptr<CacheReplacer> cache_replacer_; // cache replacer
+  std::shared_ptr<ChunkCollector>
+      collector_; // background collector of dead objects, null if dead objects
+                  // are deleted inline
 
 public:
   /**
@@ -89,6 +99,21 @@ public:
   int download_chunk(const std::string &key, uint64_t fd, off_t offset,
                      size_t size);
 
+  /**
+   * Download a chunk stored inside a larger cloud object to buffer file at the
+   * given offset, the chunk is cached under its own key
+   * @param key chunk key
+   * @param object_key key of the object holding the chunk
+   * @param object_offset offset of the chunk in the object
+   * @param fd file descriptor
+   * @param offset offset
+   * @param size size
+   * @return 0 on success, negative errno on failure
+   */
+  int download_chunk_range(const std::string &key,
+                           const std::string &object_key, off_t object_offset,
+                           uint64_t fd, off_t offset, size_t size);
+
   /**
    * Upload a chunk of data from buffer file to cloud at the given offset
    * @param key object key
@@ -118,6 +143,23 @@ public:
   int upload_file(const std::string &key, const std::string &buffer_path,
                   size_t size);
 
+  /**
+   * Download an object from cloud to memory
+   * @param key object key
+   * @param data object contents, used as output
+   * @return 0 on success, negative errno on failure
+   */
+  int download_buffer(const std::string &key, std::string &data);
+
+  /**
+   * Upload an object from memory to cloud
+   * @param key object key
+   * @param data object contents
+   * @param size size
+   * @return 0 on success, negative errno on failure
+   */
+  int upload_buffer(const std::string &key, const char *data, size_t size);
+
   /**
    * Clear a buffer file
    * @param buffer_path buffer file path
@@ -139,6 +181,40 @@ public:
    */
   int delete_object(const std::string &key);
 
+  /**
+   * Retire a dead object, its cloud copy is deleted by the background
+   * collector after the grace period, or right away if there is no collector
+   * @param key object key
+   * @return 0 on success, negative errno on failure
+   */
+  int retire_object(const std::string &key);
+
+  /**
+   * Drop the cached copy of an object
+   * @param key object key
+   * @return true if the object may be on cloud, false if it was never uploaded
+   */
+  bool drop_cached_object(const std::string &key);
+
+  /**
+   * Revive a retired object that is used again
+   * @param key object key
+   * @return true if the object is still on cloud and needs no upload
+   */
+  bool revive_object(const std::string &key);
+
+  /**
+   * Journal the objects retired since the last call, called once their
+   * release is committed
+   */
+  void sync_retired();
+
+  /**
+   * Stop the background collector, pending deletions are persisted and
+   * resumed on the next mount
+   */
+  void stop_collector();
+
   /**
    * Persist the cache state to cloud
    * @return 0 on success, negative errno on failure
@@ -152,25 +228,43 @@ public:
 
 private:
   static int get_buffer(const char *buffer, int len) {
+    Metrics::instance().add(Metrics::S3_GET_BYTES, len);
     return fwrite(buffer, 1, len, outfile_);
   }
 
   static int get_buffer_fd(const char *buffer, int len) {
+    Metrics::instance().add(Metrics::S3_GET_BYTES, len);
     auto ret = pwrite(outfd_, buffer, len, out_offset_);
     out_offset_ += len;
     return ret;
   }
 
   static int put_buffer(char *buffer, int len) {
+    Metrics::instance().add(Metrics::S3_PUT_BYTES, len);
     return fread(buffer, 1, len, infile_);
   }
 
   static int put_buffer_fd(char *buffer, int len) {
+    Metrics::instance().add(Metrics::S3_PUT_BYTES, len);
     auto ret = pread(infd_, buffer, len, in_offset_);
     in_offset_ += len;
     return ret;
   }
 
+  static int get_buffer_mem(const char *buffer, int len) {
+    Metrics::instance().add(Metrics::S3_GET_BYTES, len);
+    outbuf_->append(buffer, len);
+    return len;
+  }
+
+  static int put_buffer_mem(char *buffer, int len) {
+    len = std::min((size_t)len, inbuf_len_ - (size_t)in_offset_);
+    Metrics::instance().add(Metrics::S3_PUT_BYTES, len);
+    memcpy(buffer, inbuf_ + in_offset_, len);
+    in_offset_ += len;
+    return len;
+  }
+
   static int list_service(const char *bucketName) {
     bucket_list_.push_back(bucketName);
     return 0;
@@ -182,6 +276,11 @@ private:
     return 0;
   }
 
+  /**
+   * Log the status of the last cloud request if it failed
+   */
+  void print_cloud_error();
+
   /**
    * Evict objects to free up space
    * @param required_size required size
@@ -39,7 +39,7 @@ LRUCacheReplacer::LRUCacheReplacer(struct cloudfs_state *state,
     std::vector<char> key(key_len);
     fread(key.data(), sizeof(char), key_len, persist_file);
     auto key_str = std::string(key.begin(), key.end());
-    logger_->info("CacheReplacer::LRUCacheReplacer: load key: " + key_str);
+    logger_->debug("CacheReplacer::LRUCacheReplacer: load key: ", key_str);
 
     auto new_entry = new CacheEntry();
     new_entry->key_ = key_str;
@@ -195,7 +195,7 @@ void LRUCacheReplacer::persist() {
 void LRUCacheReplacer::print_cache() {
   auto cur = head_;
   while (cur != nullptr) {
-    logger_->debug("CacheReplacer::PrintCache: key: " + cur->key_);
+    logger_->debug("CacheReplacer::PrintCache: key: ", cur->key_);
     cur = cur->next_;
   }
 }
@@ -0,0 +1,124 @@
+#include "change_journal.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+const uint32_t ChangeJournal::MAGIC = 0x4a434643; // "CFCJ"
+const std::string ChangeJournal::FILE_NAME = ".snapshot_journal";
+
+ChangeJournal::ChangeJournal(const std::string &ssd_path,
+                             std::shared_ptr<DebugLogger> logger)
+    : path_(ssd_path + "/" + FILE_NAME), logger_(std::move(logger)), base_(0),
+      fd_(-1) {
+  load();
+}
+
+ChangeJournal::~ChangeJournal() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+}
+
+void ChangeJournal::record(const std::string &path) {
+  if (base_ == 0 || !paths_.insert(path).second) {
+    // without a base the next snapshot is a full one anyway
+    return;
+  }
+  uint32_t len = path.size();
+  std::string record(reinterpret_cast<const char *>(&len), sizeof(len));
+  record += path;
+  if (write(fd_, record.data(), record.size()) != (ssize_t)record.size()) {
+    logger_->error("ChangeJournal: append failed, path: ", path);
+    invalidate();
+  }
+}
+
+void ChangeJournal::reset(unsigned long base) {
+  paths_.clear();
+  base_ = 0;
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  fd_ = open(path_.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644);
+  if (fd_ == -1) {
+    logger_->error("ChangeJournal: open failed, path: ", path_);
+    return;
+  }
+  uint64_t base64 = base;
+  std::string header(reinterpret_cast<const char *>(&MAGIC), sizeof(MAGIC));
+  header.append(reinterpret_cast<const char *>(&base64), sizeof(base64));
+  if (write(fd_, header.data(), header.size()) != (ssize_t)header.size()) {
+    logger_->error("ChangeJournal: write header failed, path: ", path_);
+    return;
+  }
+  base_ = base;
+}
+
+void ChangeJournal::load() {
+  int fd = open(path_.c_str(), O_RDONLY);
+  if (fd == -1) {
+    // no journal yet, the next snapshot is a full one
+    reset(0);
+    return;
+  }
+  std::vector<char> data;
+  char buf[MEM_BUFFER_LEN];
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    data.insert(data.end(), buf, buf + n);
+  }
+  close(fd);
+
+  uint32_t magic = 0;
+  uint64_t base = 0;
+  size_t pos = sizeof(magic) + sizeof(base);
+  if (data.size() < pos) {
+    reset(0);
+    return;
+  }
+  memcpy(&magic, data.data(), sizeof(magic));
+  memcpy(&base, data.data() + sizeof(magic), sizeof(base));
+  if (magic != MAGIC) {
+    logger_->error("ChangeJournal: bad magic, path: ", path_);
+    reset(0);
+    return;
+  }
+
+  std::vector<std::string> paths;
+  while (pos + sizeof(uint32_t) <= data.size()) {
+    uint32_t len;
+    memcpy(&len, data.data() + pos, sizeof(len));
+    if (pos + sizeof(len) + len > data.size()) {
+      break; // torn record of a crash, its change was never made
+    }
+    paths.emplace_back(data.data() + pos + sizeof(len), len);
+    pos += sizeof(len) + len;
+  }
+
+  // rewrite the journal without a torn tail
+  reset(base);
+  for (auto &path : paths) {
+    record(path);
+  }
+  logger_->info("ChangeJournal: loaded ", paths_.size(),
+                " changed paths since snapshot ", base_);
+}
+
+void ChangeJournal::invalidate() {
+  base_ = 0;
+  paths_.clear();
+  // pwrite ignores the offset on the O_APPEND descriptor, patch the header
+  // through a separate one
+  uint64_t base64 = 0;
+  int fd = open(path_.c_str(), O_WRONLY);
+  if (fd == -1 ||
+      pwrite(fd, &base64, sizeof(base64), sizeof(MAGIC)) != sizeof(base64)) {
+    // a stale base on the SSD must not survive a remount
+    unlink(path_.c_str());
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+}
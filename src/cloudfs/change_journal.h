@@ -0,0 +1,92 @@
+/**
+ * @file change_journal.h
+ * @brief Journal of the paths changed since the last snapshot
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_set>
+
+#include "util.h"
+
+/**
+ * Journal of the paths changed since the last snapshot
+ *
+ * Mutating file system operations record their path before they run, so an
+ * incremental snapshot only has to look at the recorded paths instead of
+ * walking the whole tree. A path is appended to a file on the SSD the first
+ * time it is recorded, the journal survives a remount.
+ *
+ * The journal is relative to a base snapshot. A journal without a base, e.g.
+ * before the first snapshot or after an append failed, cannot describe the
+ * changes and forces the next snapshot to be a full one.
+ *
+ * File layout: [u32 magic][u64 base], then [u32 len][path] per path.
+ */
+class ChangeJournal {
+
+  static const uint32_t MAGIC; // magic of the journal file
+
+  std::string path_;                      // path of the journal file
+  std::shared_ptr<DebugLogger> logger_;   // logger
+  unsigned long base_;                    // snapshot the journal is relative
+                                          // to, 0 if none
+  std::unordered_set<std::string> paths_; // changed paths
+  int fd_;                                // journal file, -1 if unavailable
+
+public:
+  static const std::string FILE_NAME; // name of the journal file on the SSD
+
+  /**
+   * Constructor, loads the journal left by the previous mount
+   * @param ssd_path path of the SSD
+   * @param logger logger
+   */
+  ChangeJournal(const std::string &ssd_path,
+                std::shared_ptr<DebugLogger> logger);
+
+  /**
+   * Destructor
+   */
+  ~ChangeJournal();
+
+  /**
+   * Record a changed path, called before the change is made
+   * @param path path relative to the mount point
+   */
+  void record(const std::string &path);
+
+  /**
+   * Get the snapshot the journal is relative to
+   * @return timestamp of the base snapshot, 0 if the journal has no base
+   */
+  unsigned long base() const { return base_; }
+
+  /**
+   * Get the changed paths
+   * @return paths relative to the mount point
+   */
+  const std::unordered_set<std::string> &paths() const { return paths_; }
+
+  /**
+   * Start an empty journal relative to a snapshot
+   * @param base timestamp of the base snapshot, 0 for none
+   */
+  void reset(unsigned long base);
+
+private:
+  /**
+   * Load the journal file
+   */
+  void load();
+
+  /**
+   * Drop the base after a failed append, the journal can no longer describe
+   * all changes
+   */
+  void invalidate();
+};
@@ -0,0 +1,299 @@
+#include "chunk_collector.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <fstream>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "cloudapi.h"
+#include "metrics.h"
+
+const std::string ChunkCollector::QUEUE_FILE_NAME = ".gc_queue";
+const size_t ChunkCollector::BATCH_SIZE = 128;
+const size_t ChunkCollector::COMPACT_RECORDS = 4096;
+
+ChunkCollector::ChunkCollector(const std::string &ssd_path,
+                               std::string bucket_name,
+                               std::shared_ptr<DebugLogger> logger,
+                               int grace_seconds, int rate)
+    : bucket_name_(std::move(bucket_name)),
+      queue_path_(ssd_path + "/" + QUEUE_FILE_NAME), logger_(std::move(logger)),
+      grace_(std::chrono::milliseconds((int64_t)grace_seconds * 1000)),
+      rate_(rate), next_generation_(0), tokens_(BATCH_SIZE),
+      last_refill_(Clock::now()), stop_(false), queue_fd_(-1),
+      queue_records_(0) {
+  load();
+  logger_->info("ChunkCollector: grace " + std::to_string(grace_seconds) +
+                "s, rate " + std::to_string(rate) + "/s, " +
+                std::to_string(pending_.size()) + " pending deletions");
+  worker_ = std::thread(&ChunkCollector::run, this);
+}
+
+ChunkCollector::~ChunkCollector() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+
+  // the queue is only kept for the deletions left, resumed on the next mount
+  rewrite_queue(true);
+  if (queue_fd_ != -1) {
+    close(queue_fd_);
+  }
+  if (pending_.empty()) {
+    remove(queue_path_.c_str());
+  } else {
+    logger_->info("ChunkCollector: persisted " +
+                  std::to_string(pending_.size()) + " pending deletions");
+  }
+}
+
+void ChunkCollector::enqueue(const std::string &key) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto generation = next_generation_++;
+    pending_[key] = generation;
+    queue_.push_back(PendingDelete{key, Clock::now() + grace_, generation});
+    unsynced_.push_back(key);
+  }
+  cv_.notify_all();
+}
+
+void ChunkCollector::sync() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (unsynced_.empty()) {
+    return;
+  }
+  std::string records;
+  size_t count = 0;
+  for (const auto &key : unsynced_) {
+    if (pending_.count(key)) {
+      records += key + "\n";
+      count++;
+    }
+  }
+  unsynced_.clear();
+  append_records(records, count);
+}
+
+bool ChunkCollector::cancel(const std::string &key) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // a deletion that has been sent must finish before the object is uploaded
+  // again, otherwise it could remove the new upload
+  cv_.wait(lock, [&]() { return in_flight_.count(key) == 0; });
+
+  // the queue entry becomes stale and is skipped by the worker
+  if (pending_.erase(key) == 0) {
+    return false;
+  }
+  auto it = std::find(unsynced_.begin(), unsynced_.end(), key);
+  if (it != unsynced_.end()) {
+    unsynced_.erase(it); // never journaled
+    return true;
+  }
+
+  // a restarted mount must not delete the object once it is used again
+  append_records("-" + key + "\n", 1);
+  return true;
+}
+
+size_t ChunkCollector::pending() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size();
+}
+
+void ChunkCollector::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    // drop deletions cancelled since they were queued
+    while (!queue_.empty()) {
+      auto it = pending_.find(queue_.front().key_);
+      if (it != pending_.end() && it->second == queue_.front().generation_) {
+        break;
+      }
+      queue_.pop_front();
+    }
+    if (queue_.empty()) {
+      cv_.wait(lock);
+      continue;
+    }
+
+    auto now = Clock::now();
+    if (queue_.front().due_ > now) {
+      cv_.wait_until(lock, queue_.front().due_);
+      continue;
+    }
+
+    // token bucket, at most one batch of burst
+    size_t allowed = BATCH_SIZE;
+    if (rate_ > 0) {
+      tokens_ = std::min<double>(
+          BATCH_SIZE,
+          tokens_ + std::chrono::duration<double>(now - last_refill_).count() *
+                        rate_);
+      last_refill_ = now;
+      if (tokens_ < 1) {
+        cv_.wait_for(lock, std::chrono::duration<double>((1 - tokens_) / rate_));
+        continue;
+      }
+      allowed = std::min<size_t>(BATCH_SIZE, (size_t)tokens_);
+    }
+
+    std::vector<std::string> batch;
+    while (!queue_.empty() && batch.size() < allowed &&
+           queue_.front().due_ <= now) {
+      auto entry = queue_.front();
+      queue_.pop_front();
+      auto it = pending_.find(entry.key_);
+      if (it == pending_.end() || it->second != entry.generation_) {
+        continue; // cancelled
+      }
+      pending_.erase(it);
+      in_flight_.insert(entry.key_);
+      batch.push_back(entry.key_);
+    }
+    if (batch.empty()) {
+      continue;
+    }
+    if (rate_ > 0) {
+      tokens_ -= batch.size();
+    }
+
+    lock.unlock();
+    std::vector<const char *> keys;
+    keys.reserve(batch.size());
+    for (const auto &key : batch) {
+      keys.push_back(key.c_str());
+    }
+    Metrics::instance().add(Metrics::S3_DELETES, keys.size());
+    auto status =
+        cloud_delete_objects(bucket_name_.c_str(), keys.data(), keys.size());
+    if (status != S3StatusOK) {
+      logger_->error("ChunkCollector: delete objects failed, status: " +
+                     std::to_string(status));
+    }
+    logger_->debug("ChunkCollector: deleted " + std::to_string(batch.size()) +
+                   " objects");
+    lock.lock();
+
+    // journaled before the keys can be uploaded again, a restarted mount
+    // must not delete the new objects
+    std::string records;
+    for (const auto &key : batch) {
+      records += "-" + key + "\n";
+    }
+    append_records(records, batch.size());
+    if (queue_records_ >= COMPACT_RECORDS &&
+        queue_records_ > 2 * pending_.size()) {
+      rewrite_queue(false);
+    }
+
+    for (const auto &key : batch) {
+      in_flight_.erase(key);
+    }
+    cv_.notify_all();
+  }
+}
+
+void ChunkCollector::load() {
+  std::ifstream queue_file(queue_path_);
+  if (queue_file) {
+    // the grace period restarts, a restarted mount may still use the objects
+    auto due = Clock::now() + grace_;
+    std::string key;
+    std::unordered_map<std::string, bool> keys;
+    std::vector<std::string> order;
+    while (std::getline(queue_file, key)) {
+      if (key.empty()) {
+        continue;
+      }
+      if (key[0] == '-') {
+        keys[key.substr(1)] = false; // cancelled or deleted
+        continue;
+      }
+      if (!keys.count(key)) {
+        order.push_back(key);
+      }
+      keys[key] = true;
+    }
+    queue_file.close();
+    for (const auto &queued : order) {
+      if (keys[queued] && !pending_.count(queued)) {
+        auto generation = next_generation_++;
+        pending_[queued] = generation;
+        queue_.push_back(PendingDelete{queued, due, generation});
+      }
+    }
+  }
+
+  // the finished deletions are dropped from the file
+  rewrite_queue(false);
+}
+
+void ChunkCollector::append_records(const std::string &records, size_t count) {
+  if (count == 0) {
+    return;
+  }
+  if (queue_fd_ == -1 ||
+      write(queue_fd_, records.data(), records.size()) !=
+          (ssize_t)records.size() ||
+      fdatasync(queue_fd_) != 0) {
+    logger_->error("ChunkCollector: append to queue file failed, path: " +
+                   queue_path_);
+    return;
+  }
+  queue_records_ += count;
+}
+
+void ChunkCollector::rewrite_queue(bool with_unsynced) {
+  std::unordered_set<std::string> unsynced;
+  if (!with_unsynced) {
+    unsynced.insert(unsynced_.begin(), unsynced_.end());
+  }
+  std::string records;
+  size_t count = 0;
+  for (const auto &entry : pending_) {
+    if (!unsynced.count(entry.first)) {
+      records += entry.first + "\n";
+      count++;
+    }
+  }
+
+  // written aside and renamed, a crash leaves either file complete
+  auto tmp_path = queue_path_ + ".tmp";
+  int fd = open(tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd == -1 ||
+      write(fd, records.data(), records.size()) != (ssize_t)records.size() ||
+      fsync(fd) != 0 || rename(tmp_path.c_str(), queue_path_.c_str()) != 0) {
+    logger_->error("ChunkCollector: write queue file failed, path: " +
+                   tmp_path);
+    if (fd != -1) {
+      close(fd);
+    }
+    remove(tmp_path.c_str());
+    if (queue_fd_ == -1) {
+      // keep journaling to the old file
+      queue_fd_ = open(queue_path_.c_str(), O_CREAT | O_WRONLY | O_APPEND,
+                       0644);
+    }
+    return;
+  }
+  close(fd);
+
+  if (queue_fd_ != -1) {
+    close(queue_fd_);
+  }
+  queue_fd_ = open(queue_path_.c_str(), O_WRONLY | O_APPEND);
+  if (queue_fd_ == -1) {
+    logger_->error("ChunkCollector: open queue file failed, path: " +
+                   queue_path_);
+  }
+  queue_records_ = count;
+  if (with_unsynced) {
+    unsynced_.clear();
+  }
+}
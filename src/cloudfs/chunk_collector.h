@@ -0,0 +1,149 @@
+/**
+ * @file chunk_collector.h
+ * @brief Background collector of dead cloud objects
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "util.h"
+
+/**
+ * Background collector of dead cloud objects
+ *
+ * Dead chunks are queued instead of being deleted on the FUSE thread. A worker
+ * thread deletes them in batches after a grace period, limited to a maximum
+ * rate. A chunk that is used again before its deletion is taken out of the
+ * queue, the object is still on cloud and does not need to be uploaded again.
+ *
+ * Pending deletions are journaled in a queue file on the SSD. A queued key is
+ * appended by sync() once the release of the object is committed, so a crash
+ * in between leaks the object instead of deleting a live one. A cancelled key
+ * is journaled before the object is used again, a deleted one before it can
+ * be uploaded again. The file is compacted when it holds mostly finished
+ * deletions.
+ */
+class ChunkCollector {
+  typedef std::chrono::steady_clock Clock;
+
+  /**
+   * Queued deletion
+   */
+  struct PendingDelete {
+    std::string key_;       // object key
+    Clock::time_point due_; // time after which the object can be deleted
+    uint64_t generation_;   // generation of the deletion, stale if it does not
+                            // match pending_
+  };
+
+  static const size_t BATCH_SIZE;      // maximum objects deleted per batch
+  static const size_t COMPACT_RECORDS; // queue file records that allow a
+                                       // compaction
+
+  std::string bucket_name_;             // bucket name
+  std::string queue_path_;              // path of the persisted queue
+  std::shared_ptr<DebugLogger> logger_; // logger
+  std::chrono::milliseconds grace_;     // grace period
+  double rate_;                         // maximum deletions per second, 0 for
+                                        // unlimited
+
+  std::mutex mutex_;                                // protects the states below
+  std::condition_variable cv_;                      // signals queue changes
+  std::deque<PendingDelete> queue_;                 // deletions in due order
+  std::unordered_map<std::string, uint64_t> pending_; // queued key to its
+                                                      // generation
+  std::unordered_set<std::string> in_flight_; // keys being deleted
+  uint64_t next_generation_;                  // next deletion generation
+  double tokens_;                             // rate limiter tokens
+  Clock::time_point last_refill_;             // last rate limiter refill
+  bool stop_;                                 // worker should exit
+  int queue_fd_;                              // queue file, appended to
+  size_t queue_records_;                      // records in the queue file
+  std::vector<std::string> unsynced_;         // queued keys not yet in the
+                                              // queue file
+
+  std::thread worker_; // worker thread
+
+public:
+  static const std::string QUEUE_FILE_NAME; // name of the persisted queue file
+
+  /**
+   * Constructor, loads the persisted queue and starts the worker
+   * @param ssd_path path of the SSD
+   * @param bucket_name bucket name
+   * @param logger logger
+   * @param grace_seconds grace period before a dead object is deleted
+   * @param rate maximum deletions per second, 0 for unlimited
+   */
+  ChunkCollector(const std::string &ssd_path, std::string bucket_name,
+                 std::shared_ptr<DebugLogger> logger, int grace_seconds,
+                 int rate);
+
+  /**
+   * Destructor, stops the worker and compacts the queue file
+   */
+  ~ChunkCollector();
+
+  /**
+   * Queue a dead object for deletion
+   * @param key object key
+   */
+  void enqueue(const std::string &key);
+
+  /**
+   * Journal the deletions queued since the last call, called once the
+   * release of the objects is committed
+   */
+  void sync();
+
+  /**
+   * Take an object out of the queue because it is used again
+   * Waits if the object is being deleted right now
+   * @param key object key
+   * @return true if the object was queued and is still on cloud
+   */
+  bool cancel(const std::string &key);
+
+  /**
+   * Get number of queued deletions
+   * @return number of queued deletions
+   */
+  size_t pending();
+
+private:
+  /**
+   * Worker thread main loop
+   */
+  void run();
+
+  /**
+   * Load the persisted queue
+   */
+  void load();
+
+  /**
+   * Append records to the queue file and sync it
+   * @param records records, one key per line, cancelled or deleted keys
+   * prefixed by '-'
+   * @param count number of records
+   */
+  void append_records(const std::string &records, size_t count);
+
+  /**
+   * Replace the queue file by the pending deletions
+   * @param with_unsynced true to include the deletions not journaled yet
+   */
+  void rewrite_queue(bool with_unsynced);
+};
@@ -0,0 +1,1151 @@
+#include "chunk_index.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <set>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint64_t ChunkIndex::RUN_MAGIC = 0x34544b4353464443;      // "CDFSCKT4"
+const uint64_t ChunkIndex::RUN_MAGIC_V3 = 0x33544b4353464443;   // "CDFSCKT3"
+const uint64_t ChunkIndex::RUN_MAGIC_V2 = 0x32544b4353464443;   // "CDFSCKT2"
+const uint64_t ChunkIndex::LEGACY_MAGIC = 0x31544b4353464443;   // "CDFSCKT1"
+const uint64_t ChunkIndex::MANIFEST_MAGIC = 0x314e4d4353464443; // "CDFSCMN1"
+const uint32_t ChunkIndex::RECORDS_PER_BLOCK = 512;
+const size_t ChunkIndex::LEVEL_RUNS = 4;
+const uint64_t ChunkIndex::MERGE_STEP = 4096;
+
+namespace {
+
+/**
+ * Get key of a run record
+ */
+std::string record_key(const char *key, size_t max_len) {
+  return std::string(key, strnlen(key, max_len));
+}
+
+/**
+ * Compare a zero padded record key with a key
+ */
+int compare_key(const char *record_key, const std::string &key,
+                size_t max_len) {
+  auto len = std::min(key.size(), max_len);
+  auto cmp = memcmp(record_key, key.data(), len);
+  if (cmp != 0) {
+    return cmp;
+  }
+  if (len < max_len && record_key[len] != '\0') {
+    return 1; // record key is longer
+  }
+  return 0;
+}
+
+/**
+ * Sync the directory of a path, makes renames and removals in it durable
+ */
+bool sync_dir(const std::string &path) {
+  auto slash = path.rfind('/');
+  auto dir = slash == std::string::npos ? std::string(".")
+                                        : path.substr(0, slash + 1);
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd == -1) {
+    return false;
+  }
+  auto ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+} // namespace
+
+/**
+ * Sorted source of a merge, either a memtable or a run read sequentially
+ */
+class ChunkIndex::Cursor {
+  std::vector<const Memtable::value_type *> entries_; // memtable entries in
+                                                      // key order
+  size_t pos_;             // next memtable entry
+  RunPtr run_;             // run, NULL for a memtable
+  std::vector<char> buf_;  // block of run records
+  size_t buf_pos_;         // next record in buf_
+  size_t buf_len_;         // records in buf_
+  uint64_t next_record_;   // next run record to read into buf_
+  bool valid_;             // key_ and counts_ hold an entry
+  bool failed_;            // the run could not be read
+  std::string key_;        // key of the current entry
+  RefCounts counts_;       // counts of the current entry
+
+public:
+  explicit Cursor(const Memtable &memtable)
+      : pos_(0), buf_pos_(0), buf_len_(0), next_record_(0), valid_(false),
+        failed_(false) {
+    entries_.reserve(memtable.size());
+    for (const auto &entry : memtable) {
+      entries_.push_back(&entry);
+    }
+    std::sort(entries_.begin(), entries_.end(),
+              [](const Memtable::value_type *a, const Memtable::value_type *b) {
+                return a->first < b->first;
+              });
+    next();
+  }
+
+  explicit Cursor(RunPtr run)
+      : pos_(0), run_(std::move(run)), buf_pos_(0), buf_len_(0),
+        next_record_(0), valid_(false), failed_(false) {
+    next();
+  }
+
+  bool valid() const { return valid_; }
+  bool failed() const { return failed_; }
+  const std::string &key() const { return key_; }
+  const RefCounts &counts() const { return counts_; }
+
+  /**
+   * Get number of entries of the source
+   */
+  uint64_t size() const {
+    return run_ ? run_->header_.num_records_ : entries_.size();
+  }
+
+  /**
+   * Move to the next entry
+   */
+  void next() {
+    valid_ = false;
+    if (!run_) {
+      if (pos_ < entries_.size()) {
+        key_ = entries_[pos_]->first;
+        counts_ = entries_[pos_]->second;
+        pos_++;
+        valid_ = true;
+      }
+      return;
+    }
+
+    if (buf_pos_ == buf_len_) {
+      auto left = run_->header_.num_records_ - next_record_;
+      if (left == 0 || failed_) {
+        return;
+      }
+      // a block at a time through pread, the run may be read by several
+      // threads
+      buf_len_ = std::min<uint64_t>(left, RECORDS_PER_BLOCK);
+      buf_.resize(buf_len_ * run_->record_size_);
+      if (pread(run_->fd_, buf_.data(), buf_.size(),
+                sizeof(RunHeader) + next_record_ * run_->record_size_) !=
+          (ssize_t)buf_.size()) {
+        failed_ = true;
+        return;
+      }
+      next_record_ += buf_len_;
+      buf_pos_ = 0;
+    }
+    decode_record(buf_.data() + buf_pos_ * run_->record_size_,
+                  run_->record_size_, key_, counts_);
+    buf_pos_++;
+    valid_ = true;
+  }
+};
+
+/**
+ * Entries of the index at the time of view(), the cursors are created by the
+ * first scan on the thread scanning the view
+ */
+class ChunkIndex::View {
+public:
+  std::shared_ptr<const Memtable> memtable_; // copy of the memtable
+  std::shared_ptr<const Memtable> frozen_;   // frozen memtable, may be NULL
+  std::shared_ptr<const Levels> levels_;     // runs
+  std::vector<Cursor> sources_;              // sources, newest first
+  bool started_;                             // sources_ is created
+  View() : started_(false) {}
+};
+
+ChunkIndex::Run::~Run() {
+  if (fd_ != -1) {
+    close(fd_);
+  }
+  if (obsolete_) {
+    // replaced by a merged run, the readers holding it are done
+    unlink(path_.c_str());
+  }
+}
+
+ChunkIndex::ChunkIndex(const std::string &path,
+                       std::shared_ptr<DebugLogger> logger,
+                       size_t cache_capacity, size_t memtable_limit)
+    : path_(path), logger_(std::move(logger)), memtable_limit_(memtable_limit),
+      force_flush_(false), levels_(std::make_shared<const Levels>()),
+      frozen_lsn_(0), lsn_(0), next_id_(1), busy_(false), paused_(false),
+      failed_(false), stop_(false), cache_capacity_(cache_capacity) {
+  worker_ = std::thread(&ChunkIndex::work, this);
+}
+
+ChunkIndex::~ChunkIndex() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+std::string ChunkIndex::run_path(uint64_t id) const {
+  return path_ + "." + std::to_string(id);
+}
+
+bool ChunkIndex::open(uint64_t &lsn, std::string &state) {
+  state.clear();
+  int fd = ::open(path_.c_str(), O_RDONLY);
+  if (fd == -1) {
+    // runs of a first flush that did not reach the manifest
+    remove_stale_runs(Levels());
+    return false;
+  }
+  uint64_t magic = 0;
+  auto len = pread(fd, &magic, sizeof(magic), 0);
+  close(fd);
+  if (len != (ssize_t)sizeof(magic)) {
+    logger_->error("ChunkIndex: bad manifest, path: " + path_);
+    throw std::runtime_error("ChunkIndex: bad manifest");
+  }
+
+  if (magic == LEGACY_MAGIC) {
+    load_legacy(lsn);
+    return true;
+  }
+  if (magic == MANIFEST_MAGIC) {
+    load_manifest(lsn, state);
+    return true;
+  }
+  if (magic != RUN_MAGIC && magic != RUN_MAGIC_V3 && magic != RUN_MAGIC_V2) {
+    logger_->error("ChunkIndex: bad manifest, path: " + path_);
+    throw std::runtime_error("ChunkIndex: bad manifest");
+  }
+
+  // a single run of an older version becomes the only run of the last
+  // level, the manifest then replaces it
+  auto path = run_path(1);
+  unlink(path.c_str());
+  if (link(path_.c_str(), path.c_str()) != 0) {
+    logger_->error("ChunkIndex: link run file failed, path: " + path);
+    throw std::runtime_error("ChunkIndex: link run file failed");
+  }
+  auto run = open_run(1, path, &state);
+  Levels levels(1);
+  levels[0].push_back(run);
+  lsn = run->header_.lsn_;
+  remove_stale_runs(levels);
+  if (!write_manifest(levels, lsn, state, 2)) {
+    throw std::runtime_error("ChunkIndex: write manifest failed");
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  levels_ = std::make_shared<const Levels>(std::move(levels));
+  lsn_ = lsn;
+  state_ = state;
+  next_id_ = 2;
+  logger_->info("ChunkIndex: converted run with " +
+                std::to_string(run->header_.num_records_) + " records, lsn " +
+                std::to_string(lsn));
+  return true;
+}
+
+void ChunkIndex::load_manifest(uint64_t &lsn, std::string &state) {
+  FILE *manifest = fopen(path_.c_str(), "r");
+  if (manifest == NULL) {
+    logger_->error("ChunkIndex: open manifest failed, path: " + path_);
+    throw std::runtime_error("ChunkIndex: open manifest failed");
+  }
+  ManifestHeader header;
+  auto ok = fread(&header, sizeof(header), 1, manifest) == 1;
+  Levels levels(ok ? header.num_levels_ : 0);
+  uint64_t num_records = 0;
+  size_t num_runs = 0;
+  for (auto &level : levels) {
+    uint32_t count = 0;
+    ok = ok && fread(&count, sizeof(count), 1, manifest) == 1;
+    for (uint32_t i = 0; ok && i < count; i++) {
+      uint64_t id;
+      ok = fread(&id, sizeof(id), 1, manifest) == 1;
+      if (ok) {
+        level.push_back(open_run(id, run_path(id), NULL));
+        num_records += level.back()->header_.num_records_;
+        num_runs++;
+      }
+    }
+  }
+  if (ok) {
+    state.resize(header.state_len_);
+    ok = fread(&state[0], 1, state.size(), manifest) == state.size();
+  }
+  fclose(manifest);
+  if (!ok) {
+    logger_->error("ChunkIndex: manifest truncated, path: " + path_);
+    throw std::runtime_error("ChunkIndex: manifest truncated");
+  }
+
+  remove_stale_runs(levels);
+  lsn = header.lsn_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  levels_ = std::make_shared<const Levels>(std::move(levels));
+  lsn_ = lsn;
+  state_ = state;
+  next_id_ = header.next_id_;
+  cv_.notify_all(); // a level may be full
+  logger_->info("ChunkIndex: opened " + std::to_string(num_runs) +
+                " runs with " + std::to_string(num_records) +
+                " records, lsn " + std::to_string(lsn));
+}
+
+void ChunkIndex::remove_stale_runs(const Levels &levels) {
+  std::set<std::string> live;
+  for (const auto &level : levels) {
+    for (const auto &run : level) {
+      live.insert(run->path_.substr(run->path_.rfind('/') + 1));
+    }
+  }
+
+  // run files and temporary files are named after the manifest
+  auto slash = path_.rfind('/');
+  auto dir = slash == std::string::npos ? std::string(".")
+                                        : path_.substr(0, slash);
+  auto prefix = path_.substr(slash + 1) + ".";
+  DIR *dp = opendir(dir.c_str());
+  if (dp == NULL) {
+    return;
+  }
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL) {
+    std::string name = de->d_name;
+    if (name.compare(0, prefix.size(), prefix) == 0 && !live.count(name)) {
+      logger_->info("ChunkIndex: removing stale file " + name);
+      unlink((dir + "/" + name).c_str());
+    }
+  }
+  closedir(dp);
+}
+
+bool ChunkIndex::write_manifest(const Levels &levels, uint64_t lsn,
+                                const std::string &state, uint64_t next_id) {
+  ManifestHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic_ = MANIFEST_MAGIC;
+  header.lsn_ = lsn;
+  header.next_id_ = next_id;
+  header.num_levels_ = levels.size();
+  header.state_len_ = state.size();
+
+  std::string buf(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (const auto &level : levels) {
+    uint32_t count = level.size();
+    buf.append(reinterpret_cast<const char *>(&count), sizeof(count));
+    for (const auto &run : level) {
+      buf.append(reinterpret_cast<const char *>(&run->id_), sizeof(uint64_t));
+    }
+  }
+  buf += state;
+
+  auto tmp_path = path_ + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd == -1) {
+    logger_->error("ChunkIndex: open manifest failed, path: " + tmp_path);
+    return false;
+  }
+  auto failed = write(fd, buf.data(), buf.size()) != (ssize_t)buf.size() ||
+                fsync(fd) != 0;
+  close(fd);
+  if (failed) {
+    logger_->error("ChunkIndex: write manifest failed, path: " + tmp_path);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+
+  // the new run files and the rename are durable before the owner drops
+  // its log
+  if (rename(tmp_path.c_str(), path_.c_str()) != 0 || !sync_dir(path_)) {
+    logger_->error("ChunkIndex: replace manifest failed, path: " + path_);
+    return false;
+  }
+  return true;
+}
+
+ChunkIndex::RunPtr ChunkIndex::open_run(uint64_t id, const std::string &path,
+                                        std::string *state) {
+  auto run = std::make_shared<Run>();
+  run->id_ = id;
+  run->path_ = path;
+  run->fd_ = ::open(path.c_str(), O_RDONLY);
+  auto &header = run->header_;
+  if (run->fd_ == -1 ||
+      pread(run->fd_, &header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+    logger_->error("ChunkIndex: bad run file, path: " + path);
+    throw std::runtime_error("ChunkIndex: bad run file");
+  }
+  if (header.magic_ == RUN_MAGIC_V2) {
+    // older runs have no chunk locations, rewritten by the next merge
+    run->record_size_ = offsetof(Record, container_);
+  } else if (header.magic_ == RUN_MAGIC_V3) {
+    // chunks of older runs predate every snapshot epoch
+    run->record_size_ = offsetof(Record, birth_);
+  } else if (header.magic_ != RUN_MAGIC) {
+    logger_->error("ChunkIndex: bad run file, path: " + path);
+    throw std::runtime_error("ChunkIndex: bad run file");
+  }
+
+  // fence keys and bloom filter are the only parts kept in memory
+  std::vector<char> fence_buf(header.num_fences_ * MAX_KEY_LEN);
+  if (pread(run->fd_, fence_buf.data(), fence_buf.size(),
+            header.fence_offset_) != (ssize_t)fence_buf.size()) {
+    logger_->error("ChunkIndex: read fence keys failed, path: " + path);
+    throw std::runtime_error("ChunkIndex: read fence keys failed");
+  }
+  run->fences_.reserve(header.num_fences_);
+  for (uint64_t i = 0; i < header.num_fences_; i++) {
+    run->fences_.push_back(
+        record_key(fence_buf.data() + i * MAX_KEY_LEN, MAX_KEY_LEN));
+  }
+
+  run->filter_ = BloomFilter(header.bloom_bits_, header.bloom_hashes_);
+  auto &bits = run->filter_.data();
+  if (pread(run->fd_, bits.data(), bits.size(), header.bloom_offset_) !=
+      (ssize_t)bits.size()) {
+    logger_->error("ChunkIndex: read bloom filter failed, path: " + path);
+    throw std::runtime_error("ChunkIndex: read bloom filter failed");
+  }
+
+  // runs written before the manifest end with the state of the owner, the
+  // oldest ones with the bloom filter
+  struct stat st;
+  auto state_offset = header.bloom_offset_ + bits.size();
+  if (state != NULL && fstat(run->fd_, &st) == 0 &&
+      (uint64_t)st.st_size > state_offset) {
+    state->resize(st.st_size - state_offset);
+    if (pread(run->fd_, &(*state)[0], state->size(), state_offset) !=
+        (ssize_t)state->size()) {
+      logger_->error("ChunkIndex: read owner state failed, path: " + path);
+      throw std::runtime_error("ChunkIndex: read owner state failed");
+    }
+  }
+  return run;
+}
+
+void ChunkIndex::load_legacy(uint64_t &lsn) {
+  FILE *legacy_file = fopen(path_.c_str(), "r");
+  if (legacy_file == NULL) {
+    logger_->error("ChunkIndex: open legacy checkpoint failed, path: " + path_);
+    throw std::runtime_error("ChunkIndex: open legacy checkpoint failed");
+  }
+  uint64_t magic;
+  fread(&magic, sizeof(uint64_t), 1, legacy_file);
+  fread(&lsn, sizeof(uint64_t), 1, legacy_file);
+  size_t num_entries;
+  fread(&num_entries, sizeof(size_t), 1, legacy_file);
+  memtable_.reserve(num_entries);
+  for (size_t i = 0; i < num_entries; i++) {
+    size_t key_len;
+    fread(&key_len, sizeof(size_t), 1, legacy_file);
+    std::vector<char> key(key_len);
+    fread(key.data(), sizeof(char), key_len, legacy_file);
+    int ref_count;
+    fread(&ref_count, sizeof(int), 1, legacy_file);
+    int snapshot_ref_count;
+    fread(&snapshot_ref_count, sizeof(int), 1, legacy_file);
+    put(std::string(key.begin(), key.end()),
+        RefCounts(ref_count, snapshot_ref_count));
+  }
+  fclose(legacy_file);
+
+  // converted into a run by the next flush, which replaces the file with a
+  // manifest
+  force_flush_ = true;
+  std::lock_guard<std::mutex> lock(mutex_);
+  lsn_ = lsn;
+  logger_->info("ChunkIndex: loaded " + std::to_string(num_entries) +
+                " entries from legacy checkpoint");
+}
+
+bool ChunkIndex::get(const std::string &key, RefCounts &counts) {
+  auto mem_it = memtable_.find(key);
+  if (mem_it != memtable_.end()) {
+    if (mem_it->second.is_zero()) {
+      // a tombstone, its location belongs to the deleted chunk
+      counts = RefCounts();
+      return false;
+    }
+    counts = mem_it->second;
+    return true;
+  }
+
+  std::shared_ptr<const Memtable> frozen;
+  std::shared_ptr<const Levels> levels;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frozen = frozen_;
+    levels = levels_;
+  }
+  if (frozen) {
+    auto frozen_it = frozen->find(key);
+    if (frozen_it != frozen->end()) {
+      if (frozen_it->second.is_zero()) {
+        counts = RefCounts();
+        return false;
+      }
+      counts = frozen_it->second;
+      return true;
+    }
+  }
+
+  auto cache_it = cache_map_.find(key);
+  if (cache_it != cache_map_.end()) {
+    cache_list_.splice(cache_list_.begin(), cache_list_, cache_it->second);
+    counts = cache_it->second->second;
+    return true;
+  }
+
+  // newer runs first, the first run holding the key has its counts
+  for (const auto &level : *levels) {
+    for (const auto &run : level) {
+      if (!run->filter_.may_contain(key) || !search_run(*run, key, counts)) {
+        continue;
+      }
+      if (counts.is_zero()) {
+        return false; // deleted after an older run was written
+      }
+      cache_insert(key, counts);
+      return true;
+    }
+  }
+  counts = RefCounts();
+  return false;
+}
+
+bool ChunkIndex::may_contain(const std::string &key) {
+  if (memtable_.count(key)) {
+    return true;
+  }
+  std::shared_ptr<const Memtable> frozen;
+  std::shared_ptr<const Levels> levels;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frozen = frozen_;
+    levels = levels_;
+  }
+  if (frozen && frozen->count(key)) {
+    return true;
+  }
+  for (const auto &level : *levels) {
+    for (const auto &run : level) {
+      if (run->filter_.may_contain(key)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void ChunkIndex::put(const std::string &key, const RefCounts &counts) {
+  if (key.size() > MAX_KEY_LEN) {
+    logger_->error("ChunkIndex: key too long: " + key);
+    throw std::runtime_error("ChunkIndex: key too long");
+  }
+  cache_erase(key);
+  memtable_[key] = counts;
+}
+
+bool ChunkIndex::needs_flush() const {
+  return force_flush_ || memtable_.size() >= memtable_limit_;
+}
+
+bool ChunkIndex::search_run(const Run &run, const std::string &key,
+                            RefCounts &counts) {
+  if (run.fences_.empty()) {
+    return false;
+  }
+
+  // the block that may contain the key starts at the last fence <= key
+  auto fence_it = std::upper_bound(run.fences_.begin(), run.fences_.end(), key);
+  if (fence_it == run.fences_.begin()) {
+    return false;
+  }
+  uint64_t block = fence_it - run.fences_.begin() - 1;
+  uint64_t first = block * run.header_.records_per_block_;
+  uint64_t count = std::min<uint64_t>(run.header_.records_per_block_,
+                                      run.header_.num_records_ - first);
+
+  std::vector<char> block_buf(count * run.record_size_);
+  if (pread(run.fd_, block_buf.data(), block_buf.size(),
+            sizeof(RunHeader) + first * run.record_size_) !=
+      (ssize_t)block_buf.size()) {
+    logger_->error("ChunkIndex: read run block failed, path: " + run.path_);
+    return false;
+  }
+
+  // the key is the first field of every record version
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    auto mid = (lo + hi) / 2;
+    auto record = block_buf.data() + mid * run.record_size_;
+    auto cmp = compare_key(record, key, MAX_KEY_LEN);
+    if (cmp == 0) {
+      std::string record_key;
+      decode_record(record, run.record_size_, record_key, counts);
+      return true;
+    }
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return false;
+}
+
+void ChunkIndex::decode_record(const char *buf, size_t record_size,
+                               std::string &key, RefCounts &counts) {
+  Record rec;
+  memset(&rec, 0, sizeof(Record));
+  memcpy(&rec, buf, record_size);
+  key = record_key(rec.key_, MAX_KEY_LEN);
+  counts = RefCounts(rec.ref_count_, rec.snapshot_ref_count_);
+  counts.birth_ = rec.birth_;
+  counts.death_ = rec.death_;
+  counts.location_ = ChunkLocation(rec.container_, rec.offset_, rec.len_);
+}
+
+bool ChunkIndex::merge_next(std::vector<Cursor> &sources, std::string &key,
+                            RefCounts &counts, bool &failed) {
+  // the smallest key, taken from the newest source holding it
+  Cursor *first = NULL;
+  failed = false;
+  for (auto &source : sources) {
+    if (source.failed()) {
+      logger_->error("ChunkIndex: read run file failed, path: " + path_);
+      failed = true;
+      return false;
+    }
+    if (source.valid() && (first == NULL || source.key() < first->key())) {
+      first = &source;
+    }
+  }
+  if (first == NULL) {
+    return false;
+  }
+  key = first->key();
+  counts = first->counts();
+  for (auto &source : sources) {
+    if (source.valid() && source.key() == key) {
+      source.next();
+    }
+  }
+  return true;
+}
+
+bool ChunkIndex::merge(std::vector<Cursor> &sources, bool keep_deleted,
+                       bool worker, const Visitor &emit) {
+  uint64_t merged = 0;
+  std::string key;
+  RefCounts counts;
+  bool failed;
+  while (true) {
+    if (!merge_next(sources, key, counts, failed)) {
+      return !failed;
+    }
+    if (keep_deleted || !counts.is_zero()) {
+      emit(key, counts);
+    }
+    if (worker && ++merged % MERGE_STEP == 0 && !merge_step()) {
+      return false;
+    }
+  }
+}
+
+ChunkIndex::RunPtr ChunkIndex::write_run(uint64_t id,
+                                         std::vector<Cursor> &sources,
+                                         bool keep_deleted, bool worker,
+                                         uint64_t lsn,
+                                         const Visitor &visitor) {
+  auto path = run_path(id);
+  auto tmp_path = path + ".tmp";
+  FILE *out = fopen(tmp_path.c_str(), "w");
+  if (out == NULL) {
+    logger_->error("ChunkIndex: open run file failed, path: " + tmp_path);
+    return NULL;
+  }
+
+  // sized for the upper bound of the merged records
+  uint64_t capacity = 1;
+  for (const auto &source : sources) {
+    capacity += source.size();
+  }
+  auto filter = BloomFilter::with_capacity(capacity);
+  std::vector<std::string> fences;
+
+  RunHeader header;
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(RunHeader), 1, out); // filled in at the end
+  header.magic_ = RUN_MAGIC;
+  header.lsn_ = lsn;
+  header.records_per_block_ = RECORDS_PER_BLOCK;
+  auto merged = merge(sources, keep_deleted, worker,
+                      [&](const std::string &key, RefCounts &counts) {
+    if (visitor && !counts.is_zero()) {
+      visitor(key, counts);
+      if (counts.is_zero() && !keep_deleted) {
+        return;
+      }
+    }
+    Record out_rec;
+    memset(&out_rec, 0, sizeof(Record));
+    memcpy(out_rec.key_, key.data(), key.size());
+    out_rec.ref_count_ = counts.ref_count_;
+    out_rec.snapshot_ref_count_ = counts.snapshot_ref_count_;
+    out_rec.container_ = counts.location_.container_;
+    out_rec.offset_ = counts.location_.offset_;
+    out_rec.len_ = counts.location_.len_;
+    out_rec.birth_ = counts.birth_;
+    out_rec.death_ = counts.death_;
+    fwrite(&out_rec, sizeof(Record), 1, out);
+    if (header.num_records_ % RECORDS_PER_BLOCK == 0) {
+      fences.push_back(key);
+    }
+    // deleted keys too, they hide the older runs
+    filter.add(key);
+    header.num_records_++;
+  });
+  if (!merged) {
+    fclose(out);
+    remove(tmp_path.c_str());
+    return NULL;
+  }
+
+  header.num_fences_ = fences.size();
+  header.fence_offset_ =
+      sizeof(RunHeader) + header.num_records_ * sizeof(Record);
+  std::vector<char> fence_buf(MAX_KEY_LEN, 0);
+  for (const auto &fence : fences) {
+    std::fill(fence_buf.begin(), fence_buf.end(), 0);
+    memcpy(fence_buf.data(), fence.data(), fence.size());
+    fwrite(fence_buf.data(), 1, MAX_KEY_LEN, out);
+  }
+
+  header.bloom_offset_ = header.fence_offset_ + fences.size() * MAX_KEY_LEN;
+  header.bloom_bits_ = filter.num_bits();
+  header.bloom_hashes_ = filter.num_hashes();
+  fwrite(filter.data().data(), 1, filter.data().size(), out);
+
+  fseek(out, 0, SEEK_SET);
+  fwrite(&header, sizeof(RunHeader), 1, out);
+  auto failed = fflush(out) != 0 || ferror(out) || fsync(fileno(out)) != 0;
+  fclose(out);
+  if (failed) {
+    logger_->error("ChunkIndex: write run file failed, path: " + tmp_path);
+    remove(tmp_path.c_str());
+    return NULL;
+  }
+  if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+    logger_->error("ChunkIndex: rename run file failed, path: " + path);
+    remove(tmp_path.c_str());
+    return NULL;
+  }
+
+  auto run = std::make_shared<Run>();
+  run->id_ = id;
+  run->path_ = path;
+  run->fd_ = ::open(path.c_str(), O_RDONLY);
+  if (run->fd_ == -1) {
+    logger_->error("ChunkIndex: reopen run file failed, path: " + path);
+    run->obsolete_ = true;
+    return NULL;
+  }
+  run->header_ = header;
+  run->fences_.swap(fences);
+  run->filter_ = std::move(filter);
+  return run;
+}
+
+bool ChunkIndex::flush(uint64_t lsn, const std::string &state) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (frozen_) {
+    // the memtable keeps growing while the worker writes the previous one,
+    // past twice its limit the caller waits for the worker to catch up
+    if (failed_ || memtable_.size() < 2 * memtable_limit_) {
+      return false;
+    }
+    cv_.wait(lock, [this]() { return !frozen_ || failed_; });
+    if (frozen_) {
+      return false;
+    }
+  }
+  frozen_ = std::make_shared<const Memtable>(std::move(memtable_));
+  frozen_lsn_ = lsn;
+  frozen_state_ = state;
+  lock.unlock();
+  cv_.notify_all();
+
+  memtable_.clear();
+  force_flush_ = false;
+  return true;
+}
+
+bool ChunkIndex::rewrite(uint64_t lsn, const std::string &state,
+                         const Visitor &visitor) {
+  std::shared_ptr<const Memtable> frozen;
+  std::shared_ptr<const Levels> levels;
+  uint64_t id;
+  {
+    // no merge of the worker may replace the runs meanwhile
+    std::unique_lock<std::mutex> lock(mutex_);
+    paused_ = true;
+    cv_.wait(lock, [this]() { return !busy_; });
+    frozen = frozen_;
+    levels = levels_;
+    id = next_id_++;
+  }
+
+  std::vector<Cursor> sources;
+  sources.emplace_back(memtable_);
+  if (frozen) {
+    sources.emplace_back(*frozen);
+  }
+  for (const auto &level : *levels) {
+    for (const auto &run : level) {
+      sources.emplace_back(run);
+    }
+  }
+  auto run = write_run(id, sources, false, false, lsn, visitor);
+  sources.clear();
+
+  // the single run is the last level
+  Levels new_levels(std::max<size_t>(levels->size(), 1));
+  if (run && run->header_.num_records_ > 0) {
+    new_levels.back().push_back(run);
+  }
+  auto ok = run && write_manifest(new_levels, lsn, state, id + 1);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ok) {
+      levels_ = std::make_shared<const Levels>(std::move(new_levels));
+      frozen_.reset();
+      lsn_ = lsn;
+      state_ = state;
+      failed_ = false;
+    }
+    paused_ = false;
+  }
+  cv_.notify_all();
+  if (!ok) {
+    if (run) {
+      run->obsolete_ = true;
+    }
+    logger_->error("ChunkIndex: rewrite failed");
+    return false;
+  }
+  if (run->header_.num_records_ == 0) {
+    run->obsolete_ = true;
+  }
+  for (const auto &level : *levels) {
+    for (const auto &old_run : level) {
+      old_run->obsolete_ = true;
+    }
+  }
+
+  memtable_.clear();
+  force_flush_ = false;
+  // the visitor may have changed any entry
+  cache_list_.clear();
+  cache_map_.clear();
+  logger_->debug("ChunkIndex: rewrote run with " +
+                 std::to_string(run->header_.num_records_) + " records, lsn " +
+                 std::to_string(lsn));
+  return true;
+}
+
+uint64_t ChunkIndex::durable_lsn() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lsn_;
+}
+
+void ChunkIndex::scan(const Visitor &visitor) {
+  std::shared_ptr<const Memtable> frozen;
+  std::shared_ptr<const Levels> levels;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frozen = frozen_;
+    levels = levels_;
+  }
+  std::vector<Cursor> sources;
+  sources.emplace_back(memtable_);
+  if (frozen) {
+    sources.emplace_back(*frozen);
+  }
+  for (const auto &level : *levels) {
+    for (const auto &run : level) {
+      sources.emplace_back(run);
+    }
+  }
+  merge(sources, false, false, visitor);
+}
+
+std::shared_ptr<ChunkIndex::View> ChunkIndex::view() {
+  auto view = std::make_shared<View>();
+  view->memtable_ = std::make_shared<const Memtable>(memtable_);
+  std::lock_guard<std::mutex> lock(mutex_);
+  view->frozen_ = frozen_;
+  view->levels_ = levels_;
+  return view;
+}
+
+bool ChunkIndex::scan(View &view, size_t limit, const Visitor &visitor,
+                      bool &done) {
+  if (!view.started_) {
+    // sorting the memtables is left to the scanning thread
+    view.sources_.emplace_back(*view.memtable_);
+    if (view.frozen_) {
+      view.sources_.emplace_back(*view.frozen_);
+    }
+    for (const auto &level : *view.levels_) {
+      for (const auto &run : level) {
+        view.sources_.emplace_back(run);
+      }
+    }
+    view.started_ = true;
+  }
+
+  std::string key;
+  RefCounts counts;
+  bool failed;
+  done = false;
+  for (size_t visited = 0; visited < limit;) {
+    if (!merge_next(view.sources_, key, counts, failed)) {
+      done = !failed;
+      return !failed;
+    }
+    if (!counts.is_zero()) {
+      visitor(key, counts);
+      visited++;
+    }
+  }
+  return true;
+}
+
+uint64_t ChunkIndex::run_size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  uint64_t num_records = 0;
+  for (const auto &level : *levels_) {
+    for (const auto &run : level) {
+      num_records += run->header_.num_records_;
+    }
+  }
+  return num_records;
+}
+
+void ChunkIndex::work() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stop_) {
+    // frozen memtables first, the foreground waits for them
+    auto level = levels_->size();
+    if (!frozen_ && !paused_) {
+      for (level = 0; level < levels_->size(); level++) {
+        if ((*levels_)[level].size() >= LEVEL_RUNS) {
+          break;
+        }
+      }
+    }
+    if (!frozen_ && level == levels_->size()) {
+      cv_.wait(lock);
+      continue;
+    }
+
+    auto flush = frozen_ != NULL;
+    busy_ = true;
+    lock.unlock();
+    auto ok = flush ? flush_frozen() : compact(level);
+    lock.lock();
+    busy_ = false;
+    cv_.notify_all();
+    if (!ok && !stop_ && !paused_) {
+      // retried later, the owner keeps its log meanwhile
+      cv_.wait_for(lock, std::chrono::seconds(1));
+    }
+  }
+}
+
+bool ChunkIndex::flush_frozen() {
+  std::shared_ptr<const Memtable> frozen;
+  uint64_t lsn, id;
+  std::string state;
+  bool older_runs = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!frozen_) {
+      return true;
+    }
+    frozen = frozen_;
+    lsn = frozen_lsn_;
+    state = frozen_state_;
+    id = next_id_++;
+    for (const auto &level : *levels_) {
+      older_runs = older_runs || !level.empty();
+    }
+  }
+
+  // a memtable without entries only moves the lsn and the state
+  RunPtr run;
+  if (!frozen->empty()) {
+    std::vector<Cursor> sources;
+    sources.emplace_back(*frozen);
+    run = write_run(id, sources, older_runs, false, lsn, Visitor());
+    if (!run) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      failed_ = true;
+      return false;
+    }
+  }
+
+  // the worker is the only writer of the levels while it is busy
+  Levels levels;
+  uint64_t next_id;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    levels = *levels_;
+    next_id = next_id_;
+  }
+  if (run) {
+    if (levels.empty()) {
+      levels.resize(1);
+    }
+    levels[0].insert(levels[0].begin(), run);
+  }
+  if (!write_manifest(levels, lsn, state, next_id)) {
+    if (run) {
+      run->obsolete_ = true;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    failed_ = true;
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    levels_ = std::make_shared<const Levels>(std::move(levels));
+    frozen_.reset();
+    lsn_ = lsn;
+    state_ = state;
+    failed_ = false;
+  }
+  cv_.notify_all();
+  logger_->debug("ChunkIndex: flushed run with " +
+                 std::to_string(run ? run->header_.num_records_ : 0) +
+                 " records, lsn " + std::to_string(lsn));
+  return true;
+}
+
+bool ChunkIndex::compact(size_t level) {
+  std::vector<RunPtr> inputs;
+  uint64_t id;
+  bool older_runs = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    inputs = (*levels_)[level];
+    id = next_id_++;
+    for (auto i = level + 1; i < levels_->size(); i++) {
+      older_runs = older_runs || !(*levels_)[i].empty();
+    }
+  }
+
+  // deleted entries are dropped once no older run is left below them
+  std::vector<Cursor> sources;
+  for (const auto &run : inputs) {
+    sources.emplace_back(run);
+  }
+  auto run = write_run(id, sources, older_runs, true,
+                       inputs.front()->header_.lsn_, Visitor());
+  sources.clear();
+  if (!run) {
+    return false;
+  }
+
+  // frozen memtables written meanwhile are newer than the merged runs and
+  // stay in front of them
+  Levels levels;
+  uint64_t lsn, next_id;
+  std::string state;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    levels = *levels_;
+    lsn = lsn_;
+    state = state_;
+    next_id = next_id_;
+  }
+  auto &runs = levels[level];
+  for (const auto &input : inputs) {
+    runs.erase(std::find(runs.begin(), runs.end(), input));
+  }
+  if (level + 1 == levels.size()) {
+    levels.resize(level + 2);
+  }
+  if (run->header_.num_records_ > 0) {
+    levels[level + 1].insert(levels[level + 1].begin(), run);
+  }
+  if (!write_manifest(levels, lsn, state, next_id)) {
+    run->obsolete_ = true;
+    return false;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    levels_ = std::make_shared<const Levels>(std::move(levels));
+  }
+  if (run->header_.num_records_ == 0) {
+    run->obsolete_ = true;
+  }
+  for (const auto &input : inputs) {
+    input->obsolete_ = true;
+  }
+  logger_->debug("ChunkIndex: merged " + std::to_string(inputs.size()) +
+                 " runs of level " + std::to_string(level) + " into " +
+                 std::to_string(run->header_.num_records_) + " records");
+  return true;
+}
+
+bool ChunkIndex::merge_step() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (stop_ || paused_) {
+    return false;
+  }
+  if (frozen_) {
+    // a merge of a deep level takes long, the foreground must not wait for
+    // it when its next memtable fills up
+    lock.unlock();
+    flush_frozen();
+  }
+  return true;
+}
+
+void ChunkIndex::cache_insert(const std::string &key, const RefCounts &counts) {
+  if (cache_capacity_ == 0) {
+    return;
+  }
+  cache_list_.emplace_front(key, counts);
+  cache_map_[key] = cache_list_.begin();
+  if (cache_map_.size() > cache_capacity_) {
+    cache_map_.erase(cache_list_.back().first);
+    cache_list_.pop_back();
+  }
+}
+
+void ChunkIndex::cache_erase(const std::string &key) {
+  auto it = cache_map_.find(key);
+  if (it == cache_map_.end()) {
+    return;
+  }
+  cache_list_.erase(it->second);
+  cache_map_.erase(it);
+}
@@ -0,0 +1,465 @@
+/**
+ * @file chunk_index.h
+ * @brief SSD-resident index of chunk reference counts
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "bloom_filter.h"
+#include "util.h"
+
+/**
+ * Cloud location of a chunk packed into a container object
+ */
+struct ChunkLocation {
+  uint64_t container_; // container id, 0 if the chunk is its own object
+  uint32_t offset_;    // offset of the chunk in the container
+  uint32_t len_;       // length of the chunk
+  ChunkLocation() : container_(0), offset_(0), len_(0) {}
+  ChunkLocation(uint64_t container, uint32_t offset, uint32_t len)
+      : container_(container), offset_(offset), len_(len) {}
+};
+
+/**
+ * SSD-resident index of chunk reference counts
+ *
+ * Entries live in sorted runs of fixed-size records on the SSD, organized in
+ * size-tiered levels. Modified entries are kept in a memtable, flush()
+ * freezes it and a background worker writes it into a new run on level 0
+ * while the next memtable takes the changes. A level that collects
+ * LEVEL_RUNS runs is merged by the worker into one run on the next level, so
+ * an entry is rewritten once per level instead of once per flush. Deleted
+ * entries are kept as zero counts until they reach the last level.
+ *
+ * Every run keeps a sparse fence index (first key of every block) and a bloom
+ * filter in memory, so a lookup costs at most one block read per run whose
+ * filter matches. The runs, the last delta log batch they include and the
+ * state of the owner are listed in a manifest, which is atomically replaced
+ * whenever the runs change. Recently read entries are kept in a bounded LRU
+ * cache. Memory usage depends on the working set rather than the number of
+ * chunks in the store.
+ */
+class ChunkIndex {
+public:
+  /**
+   * Chunk reference count entry
+   */
+  struct RefCounts {
+    int ref_count_;          // reference count of the chunk
+    int snapshot_ref_count_; // indicates how many snapshots of older versions
+                             // are using this chunk, or hold it as the
+                             // contents of a small file
+    uint32_t birth_;         // snapshot epoch the chunk was first used in
+    uint32_t death_;         // snapshot epoch the chunk lost its last
+                             // reference in, 0 while it is referenced
+    ChunkLocation location_; // where the chunk is stored on cloud
+    RefCounts() : ref_count_(0), snapshot_ref_count_(0), birth_(0), death_(0) {}
+    RefCounts(int ref_count, int snapshot_ref_count)
+        : ref_count_(ref_count), snapshot_ref_count_(snapshot_ref_count),
+          birth_(0), death_(0) {}
+
+    bool is_zero() const {
+      return ref_count_ == 0 && snapshot_ref_count_ == 0 && death_ == 0;
+    }
+  };
+
+  /**
+   * Visitor of the entries in key order, may modify the counts when used by
+   * rewrite()
+   */
+  typedef std::function<void(const std::string &, RefCounts &)> Visitor;
+
+  /**
+   * Entries of the index at the time the view was taken, scanned in steps
+   */
+  class View;
+
+  static const size_t MAX_KEY_LEN = 64; // maximum key length
+
+private:
+  /**
+   * Record of a run file
+   */
+  struct Record {
+    char key_[MAX_KEY_LEN];      // key, zero padded
+    int32_t ref_count_;          // reference count
+    int32_t snapshot_ref_count_; // snapshot reference count
+    uint64_t container_;         // container id, not in RUN_MAGIC_V2 runs
+    uint32_t offset_;            // offset in the container
+    uint32_t len_;               // length in the container
+    uint32_t birth_;             // birth epoch, not in RUN_MAGIC_V3 runs
+    uint32_t death_;             // death epoch
+  };
+
+  /**
+   * Header of a run file, followed by the records, the fence keys and the
+   * bloom filter bits. Runs written before the manifest also hold the state
+   * of the owner up to the end of the file
+   */
+  struct RunHeader {
+    uint64_t magic_;             // RUN_MAGIC
+    uint64_t lsn_;               // last delta log batch included in the run
+    uint64_t num_records_;       // number of records
+    uint64_t num_fences_;        // number of fence keys
+    uint64_t fence_offset_;      // offset of the fence keys
+    uint64_t bloom_offset_;      // offset of the bloom filter bits
+    uint64_t bloom_bits_;        // number of bloom filter bits
+    uint32_t bloom_hashes_;      // number of bloom filter probes
+    uint32_t records_per_block_; // records covered by one fence key
+  };
+
+  /**
+   * Header of the manifest, followed by the run count and the run ids of
+   * every level, newest run first, and the state of the owner
+   */
+  struct ManifestHeader {
+    uint64_t magic_;      // MANIFEST_MAGIC
+    uint64_t lsn_;        // last delta log batch included in the runs
+    uint64_t next_id_;    // id of the next run file
+    uint32_t num_levels_; // number of levels
+    uint32_t state_len_;  // length of the state of the owner
+  };
+
+  /**
+   * Sorted run, shared by the lookups and the merges reading it
+   */
+  struct Run {
+    uint64_t id_;                     // id of the run file
+    std::string path_;                // path of the run file
+    int fd_;                          // file descriptor of the run file
+    RunHeader header_;                // header of the run
+    size_t record_size_;              // size of a record in the run
+    std::vector<std::string> fences_; // first key of every block
+    BloomFilter filter_;              // bloom filter of the run keys
+    std::atomic<bool> obsolete_;      // the file is removed with the run
+    Run() : id_(0), fd_(-1), record_size_(sizeof(Record)), obsolete_(false) {}
+    ~Run();
+  };
+
+  class Cursor;
+
+  typedef std::shared_ptr<Run> RunPtr;
+  typedef std::vector<std::vector<RunPtr>> Levels; // runs of every level,
+                                                   // newest first
+  typedef std::unordered_map<std::string, RefCounts> Memtable;
+  typedef std::list<std::pair<std::string, RefCounts>> CacheList;
+
+  static const uint64_t RUN_MAGIC;      // run file magic
+  static const uint64_t RUN_MAGIC_V3;   // magic of runs without epochs
+  static const uint64_t RUN_MAGIC_V2;   // magic of runs without chunk
+                                        // locations
+  static const uint64_t LEGACY_MAGIC;   // magic of the older unsorted
+                                        // checkpoint
+  static const uint64_t MANIFEST_MAGIC; // manifest magic
+  static const uint32_t RECORDS_PER_BLOCK; // records covered by one fence key
+  static const size_t LEVEL_RUNS;  // runs of a level that are merged into the
+                                   // next level
+  static const uint64_t MERGE_STEP; // records merged between checks for a
+                                    // frozen memtable or a stop request
+
+  std::string path_;                    // path of the manifest, the run files
+                                        // are named after it
+  std::shared_ptr<DebugLogger> logger_; // logger
+
+  Memtable memtable_;     // entries modified since the last flush, zero
+                          // counts mark deleted entries
+  size_t memtable_limit_; // memtable size that requests a flush
+  bool force_flush_;      // memtable holds a migrated table
+
+  std::mutex mutex_;            // protects the state shared with the worker
+  std::condition_variable cv_;  // signals changes of the shared state
+  std::shared_ptr<const Levels> levels_;   // current runs
+  std::shared_ptr<const Memtable> frozen_; // memtable being written, NULL if
+                                           // none
+  uint64_t frozen_lsn_;      // last delta log batch in the frozen memtable
+  std::string frozen_state_; // state of the owner at frozen_lsn_
+  uint64_t lsn_;             // last delta log batch included in the runs
+  std::string state_;        // state of the owner stored in the manifest
+  uint64_t next_id_;         // id of the next run file
+  bool busy_;                // the worker is writing a run
+  bool paused_;              // the worker must not start a merge
+  bool failed_;              // the last flush of the worker failed
+  bool stop_;                // the worker has to exit
+  std::thread worker_;       // writes frozen memtables and merges levels
+
+  CacheList cache_list_; // clean entries, most recently used first
+  std::unordered_map<std::string, CacheList::iterator> cache_map_; // key to
+                                                                   // entry
+  size_t cache_capacity_; // maximum number of cached entries
+
+public:
+  /**
+   * Constructor, starts the background worker
+   * @param path path of the manifest
+   * @param logger logger
+   * @param cache_capacity maximum number of cached clean entries
+   * @param memtable_limit memtable size that requests a flush
+   */
+  ChunkIndex(const std::string &path, std::shared_ptr<DebugLogger> logger,
+             size_t cache_capacity, size_t memtable_limit);
+
+  /**
+   * Destructor, a merge in progress is abandoned and a frozen memtable that
+   * is not written yet is dropped, the owner replays it from its log
+   */
+  ~ChunkIndex();
+
+  /**
+   * Open the manifest and its runs, only their headers, fence keys and bloom
+   * filters are read. A checkpoint of an older version is converted
+   * @param lsn returns the last delta log batch included in the runs
+   * @param state returns the state of the owner stored in the manifest
+   * @return true if a manifest or an older checkpoint was found
+   */
+  bool open(uint64_t &lsn, std::string &state);
+
+  /**
+   * Look up a key
+   * @param key key of the chunk
+   * @param counts returns the counts of the chunk, default counts if it is
+   *               not in the index
+   * @return true if the chunk is in the index
+   */
+  bool get(const std::string &key, RefCounts &counts);
+
+  /**
+   * Check if a key may be in the index, without touching the SSD
+   * @param key key of the chunk
+   * @return false if the chunk is definitely not in the index
+   */
+  bool may_contain(const std::string &key);
+
+  /**
+   * Set the counts of a key, zero counts remove the key
+   * @param key key of the chunk
+   * @param counts counts of the chunk
+   */
+  void put(const std::string &key, const RefCounts &counts);
+
+  /**
+   * Check if the memtable should be flushed
+   * @return true if a flush is needed
+   */
+  bool needs_flush() const;
+
+  /**
+   * Freeze the memtable, the worker writes it into a new run. Only waits if
+   * the memtable has grown to twice its limit while the previous one is
+   * still being written
+   * @param lsn last delta log batch included in the memtable
+   * @param state state of the owner, stored with the run
+   * @return true if the memtable was frozen, false if the previous one is
+   * still being written or the worker failed to write it
+   */
+  bool flush(uint64_t lsn, const std::string &state);
+
+  /**
+   * Merge the memtable and every run into a single run and atomically
+   * replace the runs, waits for the worker
+   * @param lsn last delta log batch included in the new run
+   * @param state state of the owner, stored with the run
+   * @param visitor called on every live entry before it is written
+   * @return true on success
+   */
+  bool rewrite(uint64_t lsn, const std::string &state, const Visitor &visitor);
+
+  /**
+   * Get the last delta log batch the runs on the SSD include
+   * @return sequence number of the batch
+   */
+  uint64_t durable_lsn();
+
+  /**
+   * Visit every live entry in key order, modifications are discarded
+   * @param visitor visitor
+   */
+  void scan(const Visitor &visitor);
+
+  /**
+   * Take a view of the entries, the runs it reads are kept until the view is
+   * released. Copies the memtable, the scans of the view do not touch it
+   * @return the view
+   */
+  std::shared_ptr<View> view();
+
+  /**
+   * Visit the next live entries of a view in key order, may be called by
+   * another thread while the index is modified
+   * @param view view
+   * @param limit maximum number of entries visited
+   * @param visitor visitor, modifications are discarded
+   * @param done returns true once every entry of the view was visited
+   * @return false if a run could not be read
+   */
+  bool scan(View &view, size_t limit, const Visitor &visitor, bool &done);
+
+  /**
+   * Get number of records in the runs, an entry may be counted once per run
+   * @return number of records
+   */
+  uint64_t run_size();
+
+  /**
+   * Get number of memtable entries
+   * @return number of memtable entries
+   */
+  size_t memtable_size() const { return memtable_.size(); }
+
+private:
+  /**
+   * Load an older unsorted checkpoint into the memtable
+   * @param lsn returns the last delta log batch included in the checkpoint
+   */
+  void load_legacy(uint64_t &lsn);
+
+  /**
+   * Read the manifest and open its runs
+   * @param lsn returns the last delta log batch included in the runs
+   * @param state returns the state of the owner
+   */
+  void load_manifest(uint64_t &lsn, std::string &state);
+
+  /**
+   * Atomically replace the manifest
+   * @param levels runs of every level
+   * @param lsn last delta log batch included in the runs
+   * @param state state of the owner
+   * @param next_id id of the next run file
+   * @return true on success
+   */
+  bool write_manifest(const Levels &levels, uint64_t lsn,
+                      const std::string &state, uint64_t next_id);
+
+  /**
+   * Remove run files the manifest does not list
+   * @param levels runs of every level
+   */
+  void remove_stale_runs(const Levels &levels);
+
+  /**
+   * Get the path of a run file
+   * @param id id of the run
+   * @return path of the run file
+   */
+  std::string run_path(uint64_t id) const;
+
+  /**
+   * Open a run file, only its header, fence keys and bloom filter are read
+   * @param id id of the run
+   * @param path path of the run file
+   * @param state returns the state of the owner stored with runs of older
+   * versions, may be NULL
+   * @return the run
+   */
+  RunPtr open_run(uint64_t id, const std::string &path, std::string *state);
+
+  /**
+   * Search a key in a run
+   * @param run run
+   * @param key key of the chunk
+   * @param counts returns the counts of the chunk
+   * @return true if found, the counts are zero if the key was deleted
+   */
+  bool search_run(const Run &run, const std::string &key, RefCounts &counts);
+
+  /**
+   * Decode a record of a run
+   * @param buf record bytes, record_size long
+   * @param record_size size of a record in the run
+   * @param key returns the key
+   * @param counts returns the counts
+   */
+  static void decode_record(const char *buf, size_t record_size,
+                            std::string &key, RefCounts &counts);
+
+  /**
+   * Take the smallest key of sorted sources from the first source holding it
+   * and move every source holding it to its next entry
+   * @param sources sources, newest first
+   * @param key returns the key
+   * @param counts returns the counts
+   * @param failed returns true if a source could not be read
+   * @return false once the sources are exhausted or one could not be read
+   */
+  bool merge_next(std::vector<Cursor> &sources, std::string &key,
+                  RefCounts &counts, bool &failed);
+
+  /**
+   * Merge sorted sources in key order, a key is taken from the first source
+   * holding it
+   * @param sources sources, newest first
+   * @param keep_deleted false to drop deleted entries, only allowed if no
+   * older run is left out of the merge
+   * @param worker true if called by the worker, which writes frozen
+   * memtables in between and abandons the merge when paused or stopped
+   * @param emit called on every merged entry
+   * @return false if a source could not be read or the merge was abandoned
+   */
+  bool merge(std::vector<Cursor> &sources, bool keep_deleted, bool worker,
+             const Visitor &emit);
+
+  /**
+   * Merge sorted sources into a new run file
+   * @param id id of the new run
+   * @param sources sources, newest first
+   * @param keep_deleted false to drop deleted entries
+   * @param worker true if called by the worker
+   * @param lsn last delta log batch included in the run
+   * @param visitor called on every live entry before it is written, may be
+   * empty
+   * @return the run, NULL on failure
+   */
+  RunPtr write_run(uint64_t id, std::vector<Cursor> &sources,
+                   bool keep_deleted, bool worker, uint64_t lsn,
+                   const Visitor &visitor);
+
+  /**
+   * Main loop of the worker
+   */
+  void work();
+
+  /**
+   * Write the frozen memtable into a new run on level 0
+   * @return true on success or if no memtable is frozen
+   */
+  bool flush_frozen();
+
+  /**
+   * Merge the runs of a level into one run on the next level
+   * @param level level
+   * @return true on success
+   */
+  bool compact(size_t level);
+
+  /**
+   * Let the worker write a frozen memtable in the middle of a merge
+   * @return false if the merge has to be abandoned
+   */
+  bool merge_step();
+
+  /**
+   * Insert a clean entry into the cache
+   * @param key key of the chunk
+   * @param counts counts of the chunk
+   */
+  void cache_insert(const std::string &key, const RefCounts &counts);
+
+  /**
+   * Remove an entry from the cache
+   * @param key key of the chunk
+   */
+  void cache_erase(const std::string &key);
+};
@@ -1,18 +1,144 @@
 #include "chunk_table.h"
 
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
 #include <stdexcept>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <vector>
 
 const std::string ChunkTable::TABLE_FILE_NAME = ".chunk_table";
+const std::string ChunkTable::CHECKPOINT_FILE_NAME = ".chunk_table_checkpoint";
+const std::string ChunkTable::LOG_FILE_NAME = ".chunk_table_log";
+const uint32_t ChunkTable::LOG_BATCH_MAGIC = 0x4c424643; // "CFBL"
+const uint32_t ChunkTable::LOG_LOCATION_FLAG = 0x80000000;
+const uint32_t ChunkTable::LOG_EPOCH_FLAG = 0x40000000;
+const off_t ChunkTable::CHECKPOINT_LOG_SIZE = 8 * 1024 * 1024;
+const size_t ChunkTable::CACHE_ENTRIES = 256 * 1024;
+const size_t ChunkTable::MEMTABLE_ENTRIES = 256 * 1024;
+const size_t ChunkTable::ENTRIES_UNTIL_END = SIZE_MAX;
+const size_t ChunkTable::EPOCH_ONLY = SIZE_MAX - 1;
+const size_t ChunkTable::SWEEP_BATCH = 256;
+
+namespace {
+
+/**
+ * Header of a batch in the delta log, followed by payload_len_ bytes of
+ * encoded deltas
+ */
+struct LogBatchHeader {
+  uint32_t magic_;       // LOG_BATCH_MAGIC
+  uint32_t count_;       // number of deltas in the batch
+  uint64_t lsn_;         // sequence number of the batch
+  uint32_t payload_len_; // length of the payload
+  uint32_t checksum_;    // checksum of lsn, count and payload
+};
+
+/**
+ * FNV-1a hash, used as checksum of the delta log batches
+ */
+uint32_t fnv1a(const void *data, size_t len, uint32_t hash = 2166136261u) {
+  auto p = static_cast<const unsigned char *>(data);
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint32_t batch_checksum(const LogBatchHeader &header, const char *payload) {
+  auto hash = fnv1a(&header.lsn_, sizeof(header.lsn_));
+  hash = fnv1a(&header.count_, sizeof(header.count_), hash);
+  return fnv1a(payload, header.payload_len_, hash);
+}
+
+} // namespace
 
 ChunkTable::ChunkTable(const std::string &ssd_path,
                        std::shared_ptr<DebugLogger> logger,
                        std::shared_ptr<BufferFileController> buffer_controller)
     : ssd_path_(ssd_path), logger_(std::move(logger)),
-      buffer_controller_(std::move(buffer_controller)) {
+      buffer_controller_(std::move(buffer_controller)), log_fd_(-1),
+      log_size_(0), log_torn_(false), lsn_(0), pending_count_(0), epoch_(1),
+      sweep_requested_(0), sweep_done_(0), checkpoints_(0), sweep_started_(0),
+      sweep_scanned_(false), sweep_failed_(false), sweep_stop_(false) {
+  dead_chunk_handler_ = [this](const std::string &key, const ChunkLocation &) {
+    if (buffer_controller_) {
+      buffer_controller_->retire_object(key);
+    }
+  };
 
+  index_.reset(new ChunkIndex(ssd_path_ + "/" + CHECKPOINT_FILE_NAME, logger_,
+                              CACHE_ENTRIES, MEMTABLE_ENTRIES));
+
+  auto log_path = ssd_path_ + "/" + LOG_FILE_NAME;
+  bool migrated = false;
+  std::string state;
+  if (!index_->open(lsn_, state) && buffer_controller_ &&
+      access(log_path.c_str(), F_OK) != 0) {
+    // nothing on the SSD yet, the table may have been persisted on cloud
+    load_legacy_table();
+    migrated = index_->memtable_size() > 0;
+  }
+  decode_epochs(state);
+  replay_log();
+
+  log_fd_ = open(log_path.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644);
+  if (log_fd_ == -1) {
+    logger_->error("ChunkTable: open delta log failed, path: " + log_path);
+    throw std::runtime_error("ChunkTable: open delta log failed");
+  }
+  struct stat st;
+  if (fstat(log_fd_, &st) == 0) {
+    log_size_ = st.st_size;
+  }
+  sweeper_ = std::thread(&ChunkTable::sweep_work, this);
+
+  drop_sealed_logs();
+  if (migrated) {
+    // move a legacy table into the index, the cloud copy is no longer needed
+    // once it is on the SSD
+    if (rewrite(ChunkIndex::Visitor())) {
+      buffer_controller_->delete_object(TABLE_FILE_NAME);
+    }
+  } else if (index_->needs_flush() || !sealed_.empty()) {
+    // the replayed segments are only removed once the index holds them
+    checkpoint();
+  }
+  logger_->info("ChunkTable: recovered " + std::to_string(index_->run_size()) +
+                " checkpointed entries, " +
+                std::to_string(index_->memtable_size()) +
+                " replayed entries, lsn " + std::to_string(lsn_) + ", epoch " +
+                std::to_string(epoch_) + ", " + std::to_string(epochs_.size()) +
+                " retained epochs");
+}
+
+ChunkTable::~ChunkTable() {
+  {
+    std::lock_guard<std::mutex> lock(sweep_mutex_);
+    sweep_stop_ = true;
+  }
+  sweep_cv_.notify_all();
+  sweeper_.join();
+  if (log_fd_ != -1) {
+    close(log_fd_);
+  }
+}
+
+bool ChunkTable::is_table_file(const std::string &name) {
+  // the runs of the index and the sealed log segments are named after the
+  // checkpoint and the log
+  auto named_after = [&name](const std::string &base) {
+    return name.compare(0, base.size(), base) == 0 &&
+           (name.size() == base.size() || name[base.size()] == '.');
+  };
+  return named_after(CHECKPOINT_FILE_NAME) || named_after(LOG_FILE_NAME);
+}
+
+void ChunkTable::load_legacy_table() {
   // download chunk table persistence file from cloud
   auto table_path = ssd_path_ + "/" + TABLE_FILE_NAME;
   buffer_controller_->download_file(TABLE_FILE_NAME, table_path);
@@ -40,139 +166,711 @@ ChunkTable::ChunkTable(const std::string &ssd_path,
     fread(&ref_count, sizeof(int), 1, table_file);
     int snapshot_ref_count;
     fread(&snapshot_ref_count, sizeof(int), 1, table_file);
-    chunk_table_[std::string(key.begin(), key.end())] =
-        RefCounts(ref_count, snapshot_ref_count);
+    index_->put(std::string(key.begin(), key.end()),
+                RefCounts(ref_count, snapshot_ref_count));
   }
   fclose(table_file);
   remove(table_path.c_str());
 }
 
-ChunkTable::~ChunkTable() {}
+void ChunkTable::replay_log() {
+  // sealed segments are named after the last batch they hold and replayed
+  // in that order before the log
+  auto prefix = LOG_FILE_NAME + ".";
+  DIR *dp = opendir(ssd_path_.c_str());
+  if (dp != NULL) {
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+      std::string name = de->d_name;
+      if (name.compare(0, prefix.size(), prefix) != 0 ||
+          name.size() == prefix.size() ||
+          name.find_first_not_of("0123456789", prefix.size()) !=
+              std::string::npos) {
+        continue;
+      }
+      sealed_[strtoull(name.c_str() + prefix.size(), NULL, 10)] =
+          ssd_path_ + "/" + name;
+    }
+    closedir(dp);
+  }
+
+  size_t replayed = 0;
+  for (const auto &segment : sealed_) {
+    replay_file(segment.second, replayed);
+  }
+  auto log_path = ssd_path_ + "/" + LOG_FILE_NAME;
+  auto valid_end = replay_file(log_path, replayed);
+  if (valid_end != -1) {
+    // drop the torn tail so that new batches are appended after valid ones
+    truncate(log_path.c_str(), valid_end);
+  }
+  logger_->info("ChunkTable: replayed " + std::to_string(replayed) +
+                " batches from " + std::to_string(sealed_.size() + 1) +
+                " delta log files");
+}
+
+off_t ChunkTable::replay_file(const std::string &path, size_t &replayed) {
+  FILE *log_file = fopen(path.c_str(), "r");
+  if (log_file == NULL) {
+    return -1;
+  }
+
+  off_t valid_end = 0; // end of the last complete batch
+  LogBatchHeader header;
+  std::vector<char> payload;
+  while (fread(&header, sizeof(LogBatchHeader), 1, log_file) == 1) {
+    if (header.magic_ != LOG_BATCH_MAGIC) {
+      break;
+    }
+    payload.resize(header.payload_len_);
+    if (fread(payload.data(), 1, header.payload_len_, log_file) !=
+        header.payload_len_) {
+      break; // torn batch
+    }
+    if (batch_checksum(header, payload.data()) != header.checksum_) {
+      break; // corrupted batch
+    }
+    valid_end += sizeof(LogBatchHeader) + header.payload_len_;
+
+    if (header.lsn_ <= lsn_) {
+      // already included in the checkpoint
+      continue;
+    }
+    size_t pos = 0;
+    for (uint32_t i = 0; i < header.count_; i++) {
+      int32_t ref_delta, snapshot_ref_delta;
+      uint32_t key_len;
+      memcpy(&ref_delta, payload.data() + pos, sizeof(int32_t));
+      pos += sizeof(int32_t);
+      memcpy(&snapshot_ref_delta, payload.data() + pos, sizeof(int32_t));
+      pos += sizeof(int32_t);
+      memcpy(&key_len, payload.data() + pos, sizeof(uint32_t));
+      pos += sizeof(uint32_t);
+      if (key_len & LOG_EPOCH_FLAG) {
+        // epoch entry without a key, the first delta is the epoch
+        apply_epoch(ref_delta, snapshot_ref_delta);
+        continue;
+      }
+      if (key_len & LOG_LOCATION_FLAG) {
+        // location entry, the deltas are unused
+        key_len &= ~LOG_LOCATION_FLAG;
+        std::string key(payload.data() + pos, key_len);
+        pos += key_len;
+        ChunkLocation location;
+        memcpy(&location.container_, payload.data() + pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
+        memcpy(&location.offset_, payload.data() + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        memcpy(&location.len_, payload.data() + pos, sizeof(uint32_t));
+        pos += sizeof(uint32_t);
+        RefCounts entry;
+        if (index_->get(key, entry)) {
+          entry.location_ = location;
+          index_->put(key, entry);
+        }
+        continue;
+      }
+      apply_delta(std::string(payload.data() + pos, key_len), ref_delta,
+                  snapshot_ref_delta);
+      pos += key_len;
+    }
+    lsn_ = header.lsn_;
+    replayed++;
+  }
+  fclose(log_file);
+  return valid_end;
+}
+
+void ChunkTable::apply_delta(const std::string &key, int ref_delta,
+                             int snapshot_ref_delta) {
+  RefCounts entry;
+  index_->get(key, entry);
+  auto old_ref_count = entry.ref_count_;
+  entry.ref_count_ += ref_delta;
+  entry.snapshot_ref_count_ += snapshot_ref_delta;
+  update_lifetime(old_ref_count, entry);
+  index_->put(key, entry);
+}
+
+void ChunkTable::apply_epoch(uint32_t epoch, int delta) {
+  if (delta > 0) {
+    epochs_.insert(epoch);
+    epoch_ = epoch + 1;
+  } else {
+    // the chunks held only by this snapshot are found by the next sweep
+    epochs_.erase(epoch);
+    sweep_requested_++;
+  }
+}
+
+bool ChunkTable::is_pinned(const std::set<uint32_t> &epochs,
+                           const RefCounts &entry) {
+  auto it = epochs.lower_bound(entry.birth_);
+  return it != epochs.end() && *it < entry.death_;
+}
+
+bool ChunkTable::update_lifetime(int old_ref_count, RefCounts &entry) const {
+  if (old_ref_count <= 0 && entry.ref_count_ > 0) {
+    if (entry.death_ == 0 && entry.snapshot_ref_count_ == 0) {
+      entry.birth_ = epoch_; // a new chunk
+    }
+    // a revived chunk keeps its birth, its lifetime then also covers the
+    // epochs it was unreferenced in, which only keeps it longer
+    entry.death_ = 0;
+  } else if (old_ref_count > 0 && entry.ref_count_ <= 0) {
+    entry.death_ = epoch_;
+  }
+
+  if (entry.ref_count_ > 0 || entry.snapshot_ref_count_ > 0 ||
+      is_pinned(epochs_, entry)) {
+    return false;
+  }
+  entry = RefCounts();
+  return true;
+}
+
+void ChunkTable::sweep(const std::string &key, RefCounts &entry) {
+  if (entry.ref_count_ > 0 || entry.is_zero()) {
+    return;
+  }
+  auto location = entry.location_;
+  if (update_lifetime(entry.ref_count_, entry)) {
+    dead_chunk_handler_(key, location);
+  }
+}
+
+std::string ChunkTable::encode_epochs() const {
+  std::string state;
+  uint32_t count = epochs_.size();
+  state.append(reinterpret_cast<const char *>(&epoch_), sizeof(uint32_t));
+  state.append(reinterpret_cast<const char *>(&count), sizeof(uint32_t));
+  for (auto epoch : epochs_) {
+    state.append(reinterpret_cast<const char *>(&epoch), sizeof(uint32_t));
+  }
+  // an unfinished sweep starts over after a mount
+  uint32_t sweep = sweep_done_ != sweep_requested_;
+  state.append(reinterpret_cast<const char *>(&sweep), sizeof(uint32_t));
+  return state;
+}
+
+void ChunkTable::decode_epochs(const std::string &state) {
+  epoch_ = 1;
+  epochs_.clear();
+  sweep_requested_ = sweep_done_;
+  if (state.size() < 2 * sizeof(uint32_t)) {
+    return; // no snapshot of this version taken yet
+  }
+  uint32_t count;
+  memcpy(&epoch_, state.data(), sizeof(uint32_t));
+  memcpy(&count, state.data() + sizeof(uint32_t), sizeof(uint32_t));
+  for (uint32_t i = 0;
+       i < count && (i + 3) * sizeof(uint32_t) <= state.size(); i++) {
+    uint32_t epoch;
+    memcpy(&epoch, state.data() + (i + 2) * sizeof(uint32_t),
+           sizeof(uint32_t));
+    epochs_.insert(epoch);
+  }
+  uint32_t sweep = 0;
+  if ((count + 3) * sizeof(uint32_t) <= state.size()) {
+    memcpy(&sweep, state.data() + (count + 2) * sizeof(uint32_t),
+           sizeof(uint32_t));
+  }
+  if (sweep != 0) {
+    sweep_requested_++;
+  }
+}
+
+void ChunkTable::log_delta(const std::string &key, int ref_delta,
+                           int snapshot_ref_delta) {
+  int32_t deltas[2] = {ref_delta, snapshot_ref_delta};
+  uint32_t key_len = key.size();
+  pending_.append(reinterpret_cast<const char *>(deltas), sizeof(deltas));
+  pending_.append(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+  pending_.append(key);
+  pending_count_++;
+}
+
+void ChunkTable::log_location(const std::string &key,
+                              const ChunkLocation &location) {
+  int32_t deltas[2] = {0, 0};
+  uint32_t key_len = key.size() | LOG_LOCATION_FLAG;
+  pending_.append(reinterpret_cast<const char *>(deltas), sizeof(deltas));
+  pending_.append(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+  pending_.append(key);
+  pending_.append(reinterpret_cast<const char *>(&location.container_),
+                  sizeof(uint64_t));
+  pending_.append(reinterpret_cast<const char *>(&location.offset_),
+                  sizeof(uint32_t));
+  pending_.append(reinterpret_cast<const char *>(&location.len_),
+                  sizeof(uint32_t));
+  pending_count_++;
+}
+
+void ChunkTable::log_epoch(uint32_t epoch, int delta) {
+  int32_t deltas[2] = {(int32_t)epoch, delta};
+  uint32_t key_len = LOG_EPOCH_FLAG;
+  pending_.append(reinterpret_cast<const char *>(deltas), sizeof(deltas));
+  pending_.append(reinterpret_cast<const char *>(&key_len), sizeof(key_len));
+  pending_count_++;
+}
+
+bool ChunkTable::commit() {
+  drop_sealed_logs();
+  sweep_step();
+  if (pending_count_ == 0) {
+    if (buffer_controller_) {
+      buffer_controller_->sync_retired();
+    }
+    return true;
+  }
+  if (log_torn_) {
+    // replay stops at a torn batch, nothing may be appended after it
+    if (ftruncate(log_fd_, log_size_) != 0) {
+      logger_->error("ChunkTable: drop failed batch from delta log failed");
+      return false;
+    }
+    log_torn_ = false;
+  }
+
+  LogBatchHeader header;
+  header.magic_ = LOG_BATCH_MAGIC;
+  header.count_ = pending_count_;
+  header.lsn_ = lsn_ + 1;
+  header.payload_len_ = pending_.size();
+  header.checksum_ = batch_checksum(header, pending_.data());
+
+  // header and payload are written with a single write, a crash leaves at
+  // most one torn batch at the tail which is discarded on replay
+  std::string batch(reinterpret_cast<const char *>(&header), sizeof(header));
+  batch += pending_;
+  auto written = write(log_fd_, batch.data(), batch.size());
+
+  // a committed batch survives a crash, the chunks it references are already
+  // on cloud. A batch that is not known to be on the SSD is cut off, the
+  // changes stay pending and are written again by the next commit
+  if (written != (ssize_t)batch.size() || fdatasync(log_fd_) != 0) {
+    auto err = errno;
+    logger_->error(written != (ssize_t)batch.size()
+                       ? "ChunkTable: append to delta log failed"
+                       : "ChunkTable: sync delta log failed");
+    log_torn_ = ftruncate(log_fd_, log_size_) != 0;
+    errno = err;
+    return false;
+  }
+  log_size_ += written;
+  lsn_ = header.lsn_;
+  pending_.clear();
+  pending_count_ = 0;
+
+  // the objects released by the batch are only journaled for deletion now,
+  // a crash before leaks them instead of deleting live ones
+  if (buffer_controller_) {
+    buffer_controller_->sync_retired();
+  }
+
+  if (log_size_ >= CHECKPOINT_LOG_SIZE || index_->needs_flush()) {
+    checkpoint();
+  }
+  return true;
+}
+
+void ChunkTable::checkpoint() {
+  if (!commit()) {
+    // the run would hold the pending changes, which the next commit logs
+    // again on top of it
+    logger_->error("ChunkTable: checkpoint skipped, commit failed");
+    return;
+  }
+
+  // the worker of the index writes the memtable and the epochs, a flush
+  // still in progress is retried by the next commit
+  if (!index_->flush(lsn_, encode_epochs())) {
+    return;
+  }
+  checkpoints_++;
+  if (log_size_ == 0) {
+    return;
+  }
+
+  // the batches up to lsn_ are sealed into a segment, which is removed once
+  // the index holds them. A crash before replays it on mount
+  auto log_path = ssd_path_ + "/" + LOG_FILE_NAME;
+  auto segment_path = log_path + "." + std::to_string(lsn_);
+  if (log_torn_ && ftruncate(log_fd_, log_size_) != 0) {
+    logger_->error("ChunkTable: drop failed batch from delta log failed");
+    return;
+  }
+  if (rename(log_path.c_str(), segment_path.c_str()) != 0) {
+    logger_->error("ChunkTable: seal delta log failed, path: " + segment_path);
+    return;
+  }
+  auto fd = open(log_path.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644);
+  if (fd == -1) {
+    // batches must not be appended to a sealed segment
+    logger_->error("ChunkTable: open delta log failed, path: " + log_path);
+    rename(segment_path.c_str(), log_path.c_str());
+    return;
+  }
+
+  // the new log has to be found after a crash once batches are committed
+  // to it
+  auto dir_fd = open(ssd_path_.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1 || fsync(dir_fd) != 0) {
+    logger_->error("ChunkTable: sync SSD directory failed");
+  }
+  if (dir_fd != -1) {
+    close(dir_fd);
+  }
+  close(log_fd_);
+  log_fd_ = fd;
+  log_size_ = 0;
+  log_torn_ = false;
+  sealed_[lsn_] = segment_path;
+  logger_->debug("ChunkTable: checkpoint started, lsn " + std::to_string(lsn_));
+}
+
+bool ChunkTable::rewrite(const ChunkIndex::Visitor &visitor) {
+  if (!commit()) {
+    logger_->error("ChunkTable: rewrite skipped, commit failed");
+    return false;
+  }
+
+  // chunks released by deleted snapshots are swept while the index is
+  // merged, which finishes a sweep in progress
+  auto requested = sweep_requested_;
+  auto merge_visitor = [&](const std::string &key, RefCounts &entry) {
+    if (visitor) {
+      visitor(key, entry);
+    }
+    sweep(key, entry);
+  };
+
+  // the index writes a single run and atomically replaces the old ones, the
+  // epochs are stored with it
+  if (!index_->rewrite(lsn_, encode_epochs(), merge_visitor)) {
+    logger_->error("ChunkTable: write checkpoint failed");
+    return false;
+  }
+  sweep_done_ = requested;
+  abandon_sweep();
+
+  // batches up to lsn_ are in the index now, a crash before the truncation
+  // only makes replay skip them
+  drop_sealed_logs();
+  if (ftruncate(log_fd_, 0) != 0) {
+    logger_->error("ChunkTable: truncate delta log failed");
+    return true;
+  }
+  log_size_ = 0;
+  log_torn_ = false;
+  checkpoints_++;
+  logger_->debug("ChunkTable: checkpoint written, lsn " + std::to_string(lsn_));
+  return true;
+}
+
+void ChunkTable::sweep_step() {
+  std::vector<std::string> keys;
+  bool finished = false;
+  uint64_t started = 0;
+  {
+    std::lock_guard<std::mutex> lock(sweep_mutex_);
+    if (!sweep_view_) {
+      if (sweep_done_ == sweep_requested_) {
+        return;
+      }
+      // the view holds every change applied so far, later changes update the
+      // lifetimes with the current epochs themselves
+      sweep_view_ = index_->view();
+      sweep_epochs_ = epochs_;
+      sweep_started_ = sweep_requested_;
+      sweep_scanned_ = false;
+      sweep_failed_ = false;
+      sweep_cv_.notify_one();
+      logger_->debug("ChunkTable: sweep started, epochs ", epochs_.size());
+      return;
+    }
+    while (!sweep_candidates_.empty() && keys.size() < SWEEP_BATCH) {
+      keys.push_back(std::move(sweep_candidates_.front()));
+      sweep_candidates_.pop_front();
+    }
+    if (sweep_scanned_ && sweep_candidates_.empty()) {
+      finished = !sweep_failed_;
+      started = sweep_started_;
+      sweep_view_.reset();
+    }
+  }
+  sweep_cv_.notify_one();
+
+  // the sweeper read the entries as of the view, they are checked again
+  size_t swept = 0;
+  for (const auto &key : keys) {
+    RefCounts entry;
+    if (!index_->get(key, entry)) {
+      continue;
+    }
+    sweep(key, entry);
+    if (entry.is_zero()) {
+      // a delta without change is replayed as a sweep of the entry
+      index_->put(key, entry);
+      log_delta(key, 0, 0);
+      swept++;
+    }
+  }
+  if (swept > 0) {
+    logger_->debug("ChunkTable: swept ", swept, " chunks");
+  }
+  if (finished) {
+    // a sweep that failed to read the view is started again
+    sweep_done_ = started;
+    logger_->debug("ChunkTable: sweep finished");
+  }
+}
+
+void ChunkTable::abandon_sweep() {
+  std::lock_guard<std::mutex> lock(sweep_mutex_);
+  sweep_view_.reset();
+  sweep_candidates_.clear();
+}
+
+void ChunkTable::sweep_work() {
+  std::unique_lock<std::mutex> lock(sweep_mutex_);
+  while (!sweep_stop_) {
+    if (!sweep_view_ || sweep_scanned_ ||
+        sweep_candidates_.size() >= SWEEP_BATCH) {
+      sweep_cv_.wait(lock);
+      continue;
+    }
+    auto view = sweep_view_;
+    auto epochs = sweep_epochs_;
+    lock.unlock();
+
+    std::vector<std::string> found;
+    bool done;
+    auto ok = index_->scan(
+        *view, SWEEP_BATCH,
+        [&](const std::string &key, RefCounts &entry) {
+          if (entry.ref_count_ <= 0 && entry.snapshot_ref_count_ == 0 &&
+              !is_pinned(epochs, entry)) {
+            found.push_back(key);
+          }
+        },
+        done);
+
+    lock.lock();
+    if (sweep_view_ != view) {
+      continue; // abandoned by a rewrite
+    }
+    sweep_candidates_.insert(sweep_candidates_.end(), found.begin(),
+                             found.end());
+    sweep_scanned_ = done || !ok;
+    sweep_failed_ = !ok;
+  }
+}
+
+void ChunkTable::drop_sealed_logs() {
+  if (sealed_.empty()) {
+    return;
+  }
+  auto durable_lsn = index_->durable_lsn();
+  while (!sealed_.empty() && sealed_.begin()->first <= durable_lsn) {
+    unlink(sealed_.begin()->second.c_str());
+    sealed_.erase(sealed_.begin());
+  }
+}
+
+uint64_t ChunkTable::checkpoints() const { return checkpoints_; }
 
 bool ChunkTable::use(const std::string &key) {
-  chunk_table_[key].ref_count_++;
+  RefCounts entry;
+  if (!index_->may_contain(key)) {
+    // definite miss, typical for fresh data, the chunk is new without probing
+    // the index
+    entry.ref_count_ = 1;
+    entry.birth_ = epoch_;
+    index_->put(key, entry);
+    log_delta(key, 1, 0);
+    return true;
+  }
+  auto found = index_->get(key, entry);
+  entry.ref_count_++;
+  update_lifetime(entry.ref_count_ - 1, entry);
+  index_->put(key, entry);
+  log_delta(key, 1, 0);
 
-  // only when this chunk is the first one in this snapshot,
-  // and no other snapshot is using this chunk, it is a new chunk
-  return chunk_table_[key].ref_count_ == 1 &&
-         chunk_table_[key].snapshot_ref_count_ == 0;
+  // an unreferenced chunk is only in the table while a snapshot holds it, so
+  // the chunk is new if it is not in the table
+  return !found;
 }
 
-bool ChunkTable::release(const std::string &key) {
-  if (chunk_table_.find(key) == chunk_table_.end()) {
+bool ChunkTable::release(const std::string &key, ChunkLocation *location) {
+  RefCounts entry;
+  if (!index_->get(key, entry)) {
     logger_->error("ChunkTable: chunk not found in table");
     throw std::runtime_error("Chunk not found in table");
   }
-  chunk_table_[key].ref_count_--;
+  if (location != NULL) {
+    *location = entry.location_;
+  }
+  entry.ref_count_--;
 
   // only when this chunk is the last one in this snapshot,
   // and no other snapshot is using this chunk, it is no longer in use
-  auto is_last = chunk_table_[key].ref_count_ == 0 &&
-                 chunk_table_[key].snapshot_ref_count_ == 0;
-  if (is_last) {
-    chunk_table_.erase(key);
+  auto dead = update_lifetime(entry.ref_count_ + 1, entry);
+  index_->put(key, entry);
+  log_delta(key, -1, 0);
+  return dead;
+}
+
+bool ChunkTable::snapshot_use(const std::string &key) {
+  RefCounts entry;
+  auto found = index_->get(key, entry);
+  entry.snapshot_ref_count_++;
+  index_->put(key, entry);
+  log_delta(key, 0, 1);
+  return !found;
+}
+
+bool ChunkTable::snapshot_release(const std::string &key,
+                                  ChunkLocation *location) {
+  RefCounts entry;
+  if (!index_->get(key, entry)) {
+    logger_->error("ChunkTable: snapshot release of unknown chunk " + key);
+    return false;
+  }
+  if (location != NULL) {
+    *location = entry.location_;
   }
-  return is_last;
+  entry.snapshot_ref_count_--;
+  auto dead = update_lifetime(entry.ref_count_, entry);
+  index_->put(key, entry);
+  log_delta(key, 0, -1);
+  return dead;
 }
 
-void ChunkTable::persist() {
-  if (chunk_table_.empty()) {
-    // no chunk info, no need to persist
-    return;
+bool ChunkTable::get_location(const std::string &key, ChunkLocation &location) {
+  RefCounts entry;
+  if (!index_->get(key, entry)) {
+    return false;
   }
+  location = entry.location_;
+  return true;
+}
 
-  // save chunk table to file
-  auto table_path = ssd_path_ + "/" + TABLE_FILE_NAME;
-  FILE *table_file = fopen(table_path.c_str(), "w+");
-  ftruncate(fileno(table_file), 0);
-  size_t num_entries = chunk_table_.size();
-  fwrite(&num_entries, sizeof(size_t), 1, table_file);
-  for (const auto &entry : chunk_table_) {
-    size_t key_len = entry.first.size();
-    fwrite(&key_len, sizeof(size_t), 1, table_file);
-    fwrite(entry.first.c_str(), sizeof(char), key_len, table_file);
-    fwrite(&entry.second.ref_count_, sizeof(int), 1, table_file);
-    fwrite(&entry.second.snapshot_ref_count_, sizeof(int), 1, table_file);
+void ChunkTable::set_location(const std::string &key,
+                              const ChunkLocation &location) {
+  RefCounts entry;
+  if (!index_->get(key, entry)) {
+    logger_->error("ChunkTable: set location of unknown chunk " + key);
+    return;
   }
-  fclose(table_file);
+  entry.location_ = location;
+  index_->put(key, entry);
+  log_location(key, location);
+}
 
-  struct stat st;
-  stat(table_path.c_str(), &st);
+void ChunkTable::set_dead_chunk_handler(DeadChunkHandler handler) {
+  dead_chunk_handler_ = std::move(handler);
+}
 
-  // upload to cloud
-  buffer_controller_->upload_file(TABLE_FILE_NAME, table_path, st.st_size);
-  remove(table_path.c_str());
+void ChunkTable::persist() {
+  // every committed change is already durable in the delta log, a sweep in
+  // progress starts over after the next mount
+  commit();
 }
 
 void ChunkTable::print() {
-  for (const auto &entry : chunk_table_) {
-    logger_->debug("ChunkTable: key " + entry.first + ", ref_count " +
-                   std::to_string(entry.second.ref_count_) +
-                   ", snapshot_ref_count " +
-                   std::to_string(entry.second.snapshot_ref_count_));
-  }
+  index_->scan([this](const std::string &key, RefCounts &entry) {
+    logger_->debug("ChunkTable: key ", key, ", ref_count ", entry.ref_count_,
+                   ", snapshot_ref_count ", entry.snapshot_ref_count_,
+                   ", birth ", entry.birth_, ", death ", entry.death_);
+  });
 }
 
-void ChunkTable::snapshot(FILE *snapshot_file) {
-  // save chunk table of current snapshot
-  size_t num_entries = chunk_table_.size();
+uint32_t ChunkTable::snapshot(FILE *snapshot_file) {
+  // the snapshot holds exactly the chunks alive in the current epoch, so only
+  // the epoch is saved instead of the chunk table
+  size_t num_entries = EPOCH_ONLY;
+  uint64_t epoch = epoch_;
   fwrite(&num_entries, sizeof(size_t), 1, snapshot_file);
-  for (auto &entry : chunk_table_) {
-    size_t key_len = entry.first.size();
-    fwrite(&key_len, sizeof(size_t), 1, snapshot_file);
-    fwrite(entry.first.c_str(), sizeof(char), key_len, snapshot_file);
-    fwrite(&entry.second.ref_count_, sizeof(int), 1,
-           snapshot_file); // only ref_count is needed for snapshot
+  fwrite(&epoch, sizeof(uint64_t), 1, snapshot_file);
+  return epoch_;
+}
 
-    // add snapshot ref count
-    if (entry.second.ref_count_ > 0) {
-      // ref_count > 0 means the chunk is used by this snapshot
-      entry.second.snapshot_ref_count_++; // increase snapshot ref count
-    }
-  }
+bool ChunkTable::retain_epoch(uint32_t epoch) {
+  log_epoch(epoch, 1);
+  apply_epoch(epoch, 1);
+  return commit();
 }
 
-void ChunkTable::restore(FILE *snapshot_file) {
+bool ChunkTable::release_epoch(uint32_t epoch) {
+  log_epoch(epoch, -1);
+  apply_epoch(epoch, -1);
+  return commit();
+}
+
+bool ChunkTable::restore(FILE *snapshot_file) {
   // restore chunk table from snapshot
-  size_t num_entries;
+  size_t num_entries = 0;
   fread(&num_entries, sizeof(size_t), 1, snapshot_file);
-  for (size_t i = 0; i < num_entries; i++) {
-    size_t key_len;
-    fread(&key_len, sizeof(size_t), 1, snapshot_file);
-    std::vector<char> key(key_len);
-    fread(key.data(), sizeof(char), key_len, snapshot_file);
-    std::string key_str(key.begin(), key.end());
-    int ref_count;
-    fread(&ref_count, sizeof(int), 1, snapshot_file);
+  if (num_entries == EPOCH_ONLY) {
+    // every chunk loses its references, the chunks of the restored snapshot
+    // are held by its epoch until the restored files use them again
+    rewrite([this](const std::string &key, RefCounts &entry) {
+      if (entry.ref_count_ > 0) {
+        entry.ref_count_ = 0;
+        entry.death_ = epoch_;
+      }
+    });
+    return false;
+  }
 
-    if (chunk_table_.find(key_str) == chunk_table_.end()) {
+  std::string key_str;
+  int ref_count;
+  while (read_snapshot_entry(snapshot_file, num_entries, key_str, ref_count)) {
+    RefCounts entry;
+    if (!index_->get(key_str, entry)) {
       if (ref_count > 0) {
         logger_->error("ChunkTable: restore key " + key_str +
                        " not found, but ref_count > 0");
-        continue;
       }
-      chunk_table_[key_str] = RefCounts(0, 0);
-    } else {
-      chunk_table_[key_str].ref_count_ = ref_count;
+      continue;
+    }
+    auto old_ref_count = entry.ref_count_;
+    auto location = entry.location_;
+    entry.ref_count_ = ref_count;
+    if (update_lifetime(old_ref_count, entry)) {
+      dead_chunk_handler_(key_str, location);
+    }
+    index_->put(key_str, entry);
+    log_delta(key_str, ref_count - old_ref_count, 0);
+    if (index_->needs_flush()) {
+      // keep the memtable bounded for large snapshots
+      checkpoint();
     }
   }
+  checkpoint();
+  return true;
 }
 
 void ChunkTable::snapshot_deleted(FILE *snapshot_file) {
   // delete a snapshot, so snapshot ref count needs to be decreased
 
-  size_t num_entries;
+  size_t num_entries = 0;
   fread(&num_entries, sizeof(size_t), 1, snapshot_file);
-  for (size_t i = 0; i < num_entries; i++) {
-    size_t key_len;
-    fread(&key_len, sizeof(size_t), 1, snapshot_file);
-    std::vector<char> key(key_len);
-    fread(key.data(), sizeof(char), key_len, snapshot_file);
-    std::string key_str(key.begin(), key.end());
-    int ref_count;
-    fread(&ref_count, sizeof(int), 1, snapshot_file);
+  if (num_entries == EPOCH_ONLY) {
+    // the chunks only this snapshot holds are released lazily by the
+    // sweeper
+    uint64_t epoch = 0;
+    fread(&epoch, sizeof(uint64_t), 1, snapshot_file);
+    release_epoch(epoch);
+    return;
+  }
 
-    if (chunk_table_.find(key_str) == chunk_table_.end()) {
+  std::string key_str;
+  int ref_count;
+  while (read_snapshot_entry(snapshot_file, num_entries, key_str, ref_count)) {
+    RefCounts entry;
+    if (!index_->get(key_str, entry)) {
       if (ref_count > 0) {
         logger_->error("ChunkTable: delete snapshot key " + key_str +
                        " not found, but ref_count > 0");
@@ -180,28 +878,55 @@ void ChunkTable::snapshot_deleted(FILE *snapshot_file) {
       continue;
     }
 
-    if (ref_count > 0) {
-      // ref_count > 0 means the chunk is used by this snapshot
-      chunk_table_[key_str]
-          .snapshot_ref_count_--; // decrease snapshot ref count
+    if (ref_count <= 0) {
+      continue;
     }
-    if (chunk_table_[key_str].snapshot_ref_count_ == 0 &&
-        chunk_table_[key_str].ref_count_ == 0) {
-      // remove the key if both ref_count and snapshot_ref_count are 0
-      chunk_table_.erase(key_str);
-      buffer_controller_->delete_object(key_str);
+    // ref_count > 0 means the chunk is used by this snapshot
+    entry.snapshot_ref_count_--; // decrease snapshot ref count
+    auto location = entry.location_;
+    if (update_lifetime(entry.ref_count_, entry)) {
+      // the key is removed if no reference and no snapshot holds it
+      dead_chunk_handler_(key_str, location);
+    }
+    index_->put(key_str, entry);
+    log_delta(key_str, 0, -1);
+    if (index_->needs_flush()) {
+      // keep the memtable bounded for large snapshots
+      checkpoint();
     }
   }
+  checkpoint();
 }
 
 void ChunkTable::skip_snapshot(FILE *snapshot_file) {
   // skip chunk table part of a snapshot
-  size_t num_entries;
+  size_t num_entries = 0;
   fread(&num_entries, sizeof(size_t), 1, snapshot_file);
-  for (size_t i = 0; i < num_entries; i++) {
-    size_t key_len;
-    fread(&key_len, sizeof(size_t), 1, snapshot_file);
-    fseek(snapshot_file, key_len, SEEK_CUR);     // skip key
-    fseek(snapshot_file, sizeof(int), SEEK_CUR); // skip ref_count
+  if (num_entries == EPOCH_ONLY) {
+    fseek(snapshot_file, sizeof(uint64_t), SEEK_CUR);
+    return;
+  }
+  std::string key;
+  int ref_count;
+  while (read_snapshot_entry(snapshot_file, num_entries, key, ref_count)) {
+  }
+}
+
+bool ChunkTable::read_snapshot_entry(FILE *snapshot_file, size_t &remaining,
+                                     std::string &key, int &ref_count) {
+  if (remaining == 0) {
+    return false;
+  }
+  size_t key_len;
+  if (fread(&key_len, sizeof(size_t), 1, snapshot_file) != 1 ||
+      key_len == ENTRIES_UNTIL_END) {
+    return false;
+  }
+  if (remaining != ENTRIES_UNTIL_END) {
+    remaining--;
   }
+  key.resize(key_len);
+  fread(&key[0], sizeof(char), key_len, snapshot_file);
+  fread(&ref_count, sizeof(int), 1, snapshot_file);
+  return true;
 }
@@ -7,28 +7,47 @@
 #pragma once
 
 #include "util.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
-#include <unordered_map>
+#include <thread>
 
 #include "buffer_file.h"
+#include "chunk_index.h"
 
 /**
  * Chunk reference count table
+ *
+ * Reference count changes are recorded in an append-only delta log on the SSD.
+ * A checkpoint hands the memtable of the SSD-resident ChunkIndex to its
+ * background worker and seals the log into a segment, which is removed once
+ * the index has written the memtable into a run. On mount, only the index
+ * metadata is loaded and the sealed segments and the log are replayed,
+ * entries are read from the SSD on demand.
+ *
+ * Snapshots are tracked by epochs. Taking a snapshot retains the current
+ * epoch and starts the next one, every chunk records the epoch it was first
+ * used in and the epoch it lost its last reference in. A snapshot holds
+ * exactly the chunks alive during its epoch, so an unreferenced chunk is kept
+ * while a retained epoch lies within its lifetime. Creating and deleting a
+ * snapshot only changes the set of retained epochs. The chunks released by a
+ * deleted snapshot are found by a background sweeper, which scans a view of
+ * the index taken after the deletion in steps, and retired in batches of
+ * SWEEP_BATCH by the following commits. A sweep that is not finished when the
+ * table is closed starts over after the next mount.
+ *
+ * A snapshot may also hold chunks of its own, such as the contents of small
+ * files, which are counted by the snapshot ref count of the chunk.
  */
 class ChunkTable {
 
-  /**
-   * Chunk reference count entry
-   */
-  struct RefCounts {
-    int ref_count_;          // reference count of the chunk
-    int snapshot_ref_count_; // indicates how many snapshots are using this
-                             // chunk
-    RefCounts() : ref_count_(0), snapshot_ref_count_(0) {}
-    RefCounts(int ref_count, int snapshot_ref_count)
-        : ref_count_(ref_count), snapshot_ref_count_(snapshot_ref_count) {}
-  };
+  typedef ChunkIndex::RefCounts RefCounts;
 
   std::string ssd_path_; // path of the SSD
 
@@ -36,11 +55,78 @@ class ChunkTable {
   std::shared_ptr<BufferFileController> buffer_controller_; // buffer controller
 
   static const std::string
-      TABLE_FILE_NAME; // name of the chunk table persistence file
+      TABLE_FILE_NAME; // name of the chunk table persistence file on cloud
+                       // (legacy, only read for migration)
+  static const std::string CHECKPOINT_FILE_NAME; // name of the checkpoint file
+  static const std::string LOG_FILE_NAME;        // name of the delta log file
+  static const uint32_t LOG_BATCH_MAGIC;         // delta log batch magic
+  static const uint32_t LOG_LOCATION_FLAG; // key length flag of location
+                                           // entries in the delta log
+  static const uint32_t LOG_EPOCH_FLAG;    // key length flag of snapshot
+                                           // epoch entries in the delta log
+  static const off_t CHECKPOINT_LOG_SIZE; // log size that triggers a checkpoint
+  static const size_t CACHE_ENTRIES;      // clean entries cached in memory
+  static const size_t MEMTABLE_ENTRIES;   // modified entries that trigger a
+                                          // checkpoint
+  static const size_t ENTRIES_UNTIL_END;  // entry count of a snapshot whose
+                                          // entries end with this key length
+  static const size_t EPOCH_ONLY;         // entry count of a snapshot that
+                                          // only records its epoch
+  static const size_t SWEEP_BATCH;        // entries the sweeper scans and a
+                                          // commit retires at a time
+
+  std::unique_ptr<ChunkIndex> index_; // SSD-resident chunk index
+
+  int log_fd_;          // file descriptor of the delta log
+  std::map<uint64_t, std::string> sealed_; // sealed log segments by the
+                                           // last batch they hold
+  off_t log_size_;      // end of the last committed batch in the delta log
+  bool log_torn_;       // the log may hold a failed batch after log_size_
+  uint64_t lsn_;        // sequence number of the last committed batch
+  std::string pending_; // encoded deltas not yet committed to the log
+  uint32_t pending_count_; // number of deltas in pending_
 
-  std::unordered_map<std::string, RefCounts> chunk_table_; // chunk table
+  uint32_t epoch_;            // current snapshot epoch, starts at 1
+  std::set<uint32_t> epochs_; // epochs of the retained snapshots
+  uint64_t sweep_requested_;  // snapshots deleted, each requests a sweep
+  uint64_t sweep_done_;       // value of sweep_requested_ when the last
+                              // finished sweep started
+  uint64_t checkpoints_;      // checkpoints written since the table was opened
+
+  std::mutex sweep_mutex_;           // protects the sweeper state below
+  std::condition_variable sweep_cv_; // signals changes of the sweeper state
+  std::shared_ptr<ChunkIndex::View> sweep_view_; // view being swept, NULL if
+                                                 // no sweep runs
+  std::set<uint32_t> sweep_epochs_;   // retained epochs when the view was
+                                      // taken
+  uint64_t sweep_started_;            // sweep_requested_ when the view was
+                                      // taken
+  bool sweep_scanned_;                // the whole view is scanned
+  bool sweep_failed_;                 // the view could not be read
+  std::deque<std::string> sweep_candidates_; // keys found unreferenced and
+                                             // not pinned by the sweeper
+  bool sweep_stop_;                   // the sweeper has to exit
+  std::thread sweeper_;               // scans the view in the background
 
 public:
+  /**
+   * Called when a chunk is no longer used by the file system or any snapshot
+   */
+  typedef std::function<void(const std::string &, const ChunkLocation &)>
+      DeadChunkHandler;
+
+private:
+  DeadChunkHandler dead_chunk_handler_; // handler of chunks dead after a
+                                        // snapshot is deleted
+
+public:
+  /**
+   * Constructor, recovers the table from the checkpoint and the delta log
+   * @param ssd_path path of the SSD
+   * @param logger logger
+   * @param buffer_controller buffer controller, may be NULL for a table that
+   * is neither migrated from nor retires objects on cloud
+   */
   ChunkTable(const std::string &ssd_path, std::shared_ptr<DebugLogger> logger,
              std::shared_ptr<BufferFileController> buffer_controller);
   ~ChunkTable();
@@ -55,34 +141,109 @@ public:
   /**
    * Release a chunk
    * @param key key of the chunk
+   * @param location returns the cloud location of the chunk, may be NULL
    * @return true if this chunk is no longer in use, false if it is still in use
    */
-  bool release(const std::string &key);
+  bool release(const std::string &key, ChunkLocation *location = NULL);
+
+  /**
+   * Hold a chunk for a snapshot, independent of the epochs
+   * @param key key of the chunk
+   * @return true if this chunk is new, false if it already exists
+   */
+  bool snapshot_use(const std::string &key);
+
+  /**
+   * Release a chunk held for a snapshot
+   * @param key key of the chunk
+   * @param location returns the cloud location of the chunk, may be NULL
+   * @return true if this chunk is no longer in use, false if it is still in use
+   */
+  bool snapshot_release(const std::string &key,
+                        ChunkLocation *location = NULL);
+
+  /**
+   * Get the cloud location of a chunk
+   * @param key key of the chunk
+   * @param location returns the location
+   * @return true if the chunk is in the table
+   */
+  bool get_location(const std::string &key, ChunkLocation &location);
+
+  /**
+   * Set the cloud location of a chunk in the table
+   * @param key key of the chunk
+   * @param location location of the chunk
+   */
+  void set_location(const std::string &key, const ChunkLocation &location);
+
+  /**
+   * Set the handler of chunks that die when a snapshot is deleted, the
+   * default retires the chunk object
+   * @param handler handler
+   */
+  void set_dead_chunk_handler(DeadChunkHandler handler);
+
+  /**
+   * Commit the reference count changes made since the last commit to the
+   * delta log as one atomic batch, synced to the SSD before returning
+   * @return false if the batch could not be written or synced, the log is
+   * cut back to the last committed batch and the changes stay pending
+   */
+  bool commit();
 
   /**
    * Persist the chunk table to the disk
+   * Only commits the delta log, a sweep in progress is not waited for
    */
   void persist();
 
+  /**
+   * Get the number of checkpoints written since the table was opened
+   * @return number of checkpoints
+   */
+  uint64_t checkpoints() const;
+
   /**
    * Print the chunk table
    */
   void print();
 
   /**
-   * Snapshot the chunk table into a snapshot file
+   * Snapshot the chunk table into a snapshot file, only the current epoch is
+   * written, it is retained by retain_epoch() once the snapshot is stored
    * @param snapshot_file file pointer to the snapshot file
+   * @return epoch of the snapshot
+   */
+  uint32_t snapshot(FILE *snapshot_file);
+
+  /**
+   * Retain the epoch of a stored snapshot, the chunks alive in it are kept
+   * until the epoch is released
+   * @param epoch epoch returned by snapshot()
+   * @return false if the change could not be committed
+   */
+  bool retain_epoch(uint32_t epoch);
+
+  /**
+   * Release a retained epoch, the chunks only it holds are released lazily
+   * by the sweeper
+   * @param epoch epoch
+   * @return false if the change could not be committed
    */
-  void snapshot(FILE *snapshot_file);
+  bool release_epoch(uint32_t epoch);
 
   /**
    * Restore the chunk table from a snapshot file
    * @param snapshot_file file pointer to the snapshot file
+   * @return true if the reference counts were restored, false if they were
+   * dropped and the restored files have to use their chunks again
    */
-  void restore(FILE *snapshot_file);
+  bool restore(FILE *snapshot_file);
 
   /**
-   * A snapshot is deleted, decrease the snapshot ref count of the chunks
+   * A snapshot is deleted, release its epoch, or decrease the snapshot ref
+   * count of the chunks for a snapshot of an older version
    * @param snapshot_file file pointer to the snapshot file
    */
   void snapshot_deleted(FILE *snapshot_file);
@@ -92,4 +253,154 @@ public:
    * @param snapshot_file file pointer to the snapshot file
    */
   void skip_snapshot(FILE *snapshot_file);
-};
\ No newline at end of file
+
+  /**
+   * Check if a file name belongs to the chunk table persistence files
+   * @param name file name
+   * @return true if the file is used by the chunk table
+   */
+  static bool is_table_file(const std::string &name);
+
+private:
+  /**
+   * Record a reference count change of a chunk
+   * @param key key of the chunk
+   * @param ref_delta change of ref_count
+   * @param snapshot_ref_delta change of snapshot_ref_count
+   */
+  void log_delta(const std::string &key, int ref_delta, int snapshot_ref_delta);
+
+  /**
+   * Record a location change of a chunk
+   * @param key key of the chunk
+   * @param location new location
+   */
+  void log_location(const std::string &key, const ChunkLocation &location);
+
+  /**
+   * Record a change of the retained epochs
+   * @param epoch epoch of the snapshot
+   * @param delta 1 if the snapshot is taken, -1 if it is deleted
+   */
+  void log_epoch(uint32_t epoch, int delta);
+
+  /**
+   * Apply a change of the retained epochs
+   * @param epoch epoch of the snapshot
+   * @param delta 1 if the snapshot is taken, -1 if it is deleted
+   */
+  void apply_epoch(uint32_t epoch, int delta);
+
+  /**
+   * Update the lifetime of a chunk after its ref count changed
+   * @param old_ref_count ref count before the change
+   * @param entry entry of the chunk, zeroed if the chunk is dead
+   * @return true if the chunk is no longer used by the file system or any
+   * snapshot
+   */
+  bool update_lifetime(int old_ref_count, RefCounts &entry) const;
+
+  /**
+   * Check if a retained snapshot holds an unreferenced chunk
+   * @param epochs retained epochs
+   * @param entry entry of the chunk
+   * @return true if a retained epoch lies within the lifetime of the chunk
+   */
+  static bool is_pinned(const std::set<uint32_t> &epochs,
+                        const RefCounts &entry);
+
+  /**
+   * Release an unreferenced chunk that no retained snapshot holds anymore
+   * @param key key of the chunk
+   * @param entry entry of the chunk, zeroed if the chunk is dead
+   */
+  void sweep(const std::string &key, RefCounts &entry);
+
+  /**
+   * Encode the epochs and whether a sweep is pending, stored with the
+   * checkpoint
+   * @return encoded epochs
+   */
+  std::string encode_epochs() const;
+
+  /**
+   * Decode the epochs and the pending sweep stored with the checkpoint
+   * @param state encoded epochs, empty for a checkpoint of an older version
+   */
+  void decode_epochs(const std::string &state);
+
+  /**
+   * Hand the modified entries to the index and seal the delta log into a
+   * segment, the index writes them into a run in the background
+   */
+  void checkpoint();
+
+  /**
+   * Merge the whole index into a single run and reset the delta log, the
+   * released chunks are swept on the way
+   * @param visitor called on every entry written into the run, may be empty
+   * @return true on success
+   */
+  bool rewrite(const ChunkIndex::Visitor &visitor);
+
+  /**
+   * Start a sweep after a snapshot deletion and retire the next batch of
+   * chunks found by the sweeper, logged as deltas of the next batch
+   */
+  void sweep_step();
+
+  /**
+   * Drop the sweep in progress
+   */
+  void abandon_sweep();
+
+  /**
+   * Main loop of the sweeper
+   */
+  void sweep_work();
+
+  /**
+   * Remove the sealed log segments the runs of the index include
+   */
+  void drop_sealed_logs();
+
+  /**
+   * Replay committed batches of the sealed log segments and the delta log
+   * newer than the checkpoint
+   * Torn or corrupted batches at the tail of the delta log are discarded
+   */
+  void replay_log();
+
+  /**
+   * Replay committed batches of a log file newer than the checkpoint
+   * @param path path of the log file
+   * @param replayed number of replayed batches, used as output
+   * @return end of the last complete batch, -1 if the file does not exist
+   */
+  off_t replay_file(const std::string &path, size_t &replayed);
+
+  /**
+   * Load the chunk table persisted on cloud by older versions
+   */
+  void load_legacy_table();
+
+  /**
+   * Apply a reference count change to the index
+   * @param key key of the chunk
+   * @param ref_delta change of ref_count
+   * @param snapshot_ref_delta change of snapshot_ref_count
+   */
+  void apply_delta(const std::string &key, int ref_delta,
+                   int snapshot_ref_delta);
+
+  /**
+   * Read the next entry of the chunk table part of a snapshot
+   * @param snapshot_file file pointer to the snapshot file
+   * @param remaining entries left, ENTRIES_UNTIL_END if unknown
+   * @param key key of the chunk, used as output
+   * @param ref_count ref count of the chunk, used as output
+   * @return false after the last entry
+   */
+  bool read_snapshot_entry(FILE *snapshot_file, size_t &remaining,
+                           std::string &key, int &ref_count);
+};
@@ -53,6 +53,7 @@
 #include "cloudfs.h"
 #include "util.h"
 #include "buffer_file.h"
+#include "metrics.h"
 #include "snapshot.h"
 #include "snapshot-api.h"
 
@@ -66,18 +67,59 @@ static const std::string log_path = "/tmp/cloudfs.log"; // log file path
 
 static std::string snapshot_stub_path_; // absolute path to the ".snapshot" file
 
+static const char *stats_path = "/.stats";           // metrics as text
+static const char *stats_json_path = "/.stats.json"; // metrics as JSON
+static std::unordered_map<uint64_t, std::string> stats_files_; // contents of open stats files by handle
+static uint64_t next_stats_fh_ = 0;                            // handle of the next opened stats file
+
 static std::shared_ptr<DebugLogger> logger_; // logger
 
 static std::shared_ptr<CloudfsController> controller_;           // cloudfs controller
 static std::unique_ptr<SnapshotController> snapshot_controller_; // snapshot controller
 
+/*
+ * Check whether a path is one of the virtual stats files.
+ */
+static bool is_stats_path(const char *path)
+{
+  return strcmp(path, stats_path) == 0 || strcmp(path, stats_json_path) == 0;
+}
+
+/*
+ * Render the contents of a stats file.
+ */
+static std::string render_stats(const char *path)
+{
+  auto &metrics = Metrics::instance();
+  return strcmp(path, stats_json_path) == 0 ? metrics.to_json() : metrics.to_text();
+}
+
+/*
+ * Read from an open stats file.
+ * @return number of bytes read
+ */
+static size_t read_stats(uint64_t fh, char *buf, size_t count, off_t offset)
+{
+  auto &contents = stats_files_[fh];
+  if (offset >= (off_t)contents.size())
+  {
+    return 0;
+  }
+  count = std::min(count, contents.size() - offset);
+  memcpy(buf, contents.data() + offset, count);
+  return count;
+}
+
 /*
  * Initializes the FUSE file system (cloudfs) by checking if the mount points
  * are valid, and if all is well, it mounts the file system ready for usage.
  */
-void *cloudfs_init(struct fuse_conn_info *conn UNUSED)
+void *cloudfs_init(struct fuse_conn_info *conn)
 {
-  logger_ = std::make_shared<DebugLogger>(log_path);
+  logger_ = std::make_shared<DebugLogger>(log_path, (LogLevel)state_.log_level);
+
+  // read_buf hands out buffer file descriptors, let the kernel splice them
+  conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_MOVE);
 
   // create the cloudfs controller
   if (state_.no_dedup)
@@ -116,6 +158,7 @@ void cloudfs_destroy(void *data UNUSED)
  */
 int cloudfs_getattr(const char *path, struct stat *statbuf)
 {
+  ScopedTimer timer(Metrics::OP_GETATTR);
   if (strcmp(path, "/.snapshot") == 0)
   {
     auto ret = lstat(snapshot_stub_path_.c_str(), statbuf);
@@ -125,6 +168,22 @@ int cloudfs_getattr(const char *path, struct stat *statbuf)
     }
     return 0;
   }
+  if (is_stats_path(path))
+  {
+    // read-only file owned by the mounting user, stamped now
+    memset(statbuf, 0, sizeof(struct stat));
+    statbuf->st_mode = S_IFREG | 0444;
+    statbuf->st_nlink = 1;
+    statbuf->st_uid = getuid();
+    statbuf->st_gid = getgid();
+    statbuf->st_size = render_stats(path).size();
+    statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+    return 0;
+  }
+  if (snapshot_controller_->is_view_path(path))
+  {
+    return snapshot_controller_->view_getattr(path, statbuf);
+  }
   return controller_->stat_file(std::string(path), statbuf);
 }
 
@@ -133,6 +192,7 @@ int cloudfs_getattr(const char *path, struct stat *statbuf)
  */
 int cloudfs_getxattr(const char *path, const char *attr_name, char *buf, size_t size)
 {
+  ScopedTimer timer(Metrics::OP_GETXATTR);
   if (strcmp(path, "/.snapshot") == 0)
   {
     auto ret = lgetxattr(snapshot_stub_path_.c_str(), attr_name, buf, size);
@@ -142,6 +202,11 @@ int cloudfs_getxattr(const char *path, const char *attr_name, char *buf, size_t
     }
     return ret;
   }
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = ENODATA;
+    return -errno;
+  }
 
   auto ssd_path = state_.ssd_path + std::string(path);
   auto ret = lgetxattr(ssd_path.c_str(), attr_name, buf, size);
@@ -157,18 +222,27 @@ int cloudfs_getxattr(const char *path, const char *attr_name, char *buf, size_t
  */
 int cloudfs_setxattr(const char *path, const char *attr_name, const char *attr_value, size_t size, int flags)
 {
+  ScopedTimer timer(Metrics::OP_SETXATTR);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EACCES;
     return logger_->error("setxattr: .snapshot directory is read-only");
   }
 
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("setxattr: installed snapshots are read-only");
+  }
+
+  snapshot_controller_->record_change(path);
   auto ssd_path = state_.ssd_path + std::string(path);
   auto ret = lsetxattr(ssd_path.c_str(), attr_name, attr_value, size, flags);
   if (ret < 0)
   {
     return logger_->error("setxattr: failed");
   }
+  controller_->forget_attr(std::string(path));
   return 0;
 }
 
@@ -177,18 +251,27 @@ int cloudfs_setxattr(const char *path, const char *attr_name, const char *attr_v
  */
 int cloudfs_mkdir(const char *path, mode_t mode)
 {
+  ScopedTimer timer(Metrics::OP_MKDIR);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EEXIST;
     return logger_->error("mkdir: .snapshot directory cannot be created");
   }
 
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("mkdir: installed snapshots are read-only");
+  }
+
+  snapshot_controller_->record_change(path);
   auto ssd_path = state_.ssd_path + std::string(path);
   auto ret = mkdir(ssd_path.c_str(), mode);
   if (ret != 0)
   {
     return logger_->error("mkdir: failed");
   }
+  controller_->forget_attr(std::string(path));
   return 0;
 }
 
@@ -197,21 +280,45 @@ int cloudfs_mkdir(const char *path, mode_t mode)
  */
 int cloudfs_mknod(const char *path, mode_t mode, dev_t dev)
 {
+  ScopedTimer timer(Metrics::OP_MKNOD);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EEXIST;
     return logger_->error("mknod: .snapshot directory cannot be created");
   }
 
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("mknod: installed snapshots are read-only");
+  }
+
+  snapshot_controller_->record_change(path);
   auto ssd_path = state_.ssd_path + std::string(path);
   auto ret = mknod(ssd_path.c_str(), mode, dev);
   if (ret != 0)
   {
     return logger_->error("mknod: failed");
   }
+  controller_->forget_attr(std::string(path));
   return 0;
 }
 
+/*
+ * Choose how the kernel caches the data of a newly opened file.
+ * Streaming mounts bypass the page cache, otherwise the page cache survives
+ * the open if the data is unchanged since the previous open.
+ */
+static void set_cache_mode(struct fuse_file_info *fi)
+{
+  if (state_.direct_io)
+  {
+    fi->direct_io = 1;
+    return;
+  }
+  fi->keep_cache = controller_->keep_cache(fi->fh) ? 1 : 0;
+}
+
 /*
  * Create a file.
  * will open the file after creation and return a file descriptor
@@ -219,21 +326,36 @@ int cloudfs_mknod(const char *path, mode_t mode, dev_t dev)
  */
 int cloudfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+  ScopedTimer timer(Metrics::OP_CREATE);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EEXIST;
     return logger_->error("create: .snapshot directory cannot be created");
   }
 
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("create: installed snapshots are read-only");
+  }
+
+  snapshot_controller_->record_change(path);
   // create the file
   auto ret = controller_->create_file(std::string(path), mode);
+  controller_->forget_attr(std::string(path));
   if (ret != 0)
   {
     return logger_->error("create: failed");
   }
 
   // open the file
-  return controller_->open_file(std::string(path), fi->flags, &fi->fh);
+  ret = controller_->open_file(std::string(path), fi->flags, &fi->fh);
+  if (ret != 0)
+  {
+    return ret;
+  }
+  set_cache_mode(fi);
+  return 0;
 }
 
 /*
@@ -242,6 +364,7 @@ int cloudfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
  */
 int cloudfs_open(const char *path, struct fuse_file_info *fi)
 {
+  ScopedTimer timer(Metrics::OP_OPEN);
   if (strcmp(path, "/.snapshot") == 0)
   {
     // only allow read-only access to .snapshot directory
@@ -260,7 +383,45 @@ int cloudfs_open(const char *path, struct fuse_file_info *fi)
     return 0;
   }
 
-  return controller_->open_file(std::string(path), fi->flags, &fi->fh);
+  if (is_stats_path(path))
+  {
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+      errno = EACCES;
+      return logger_->error("open: stats files are read-only");
+    }
+    // take a snapshot of the metrics, its size is only known now
+    fi->fh = next_stats_fh_++;
+    stats_files_[fi->fh] = render_stats(path);
+    fi->direct_io = 1;
+    return 0;
+  }
+
+  if (snapshot_controller_->is_view_path(path))
+  {
+    // installed snapshots never change
+    auto ret = snapshot_controller_->view_open(path, fi->flags, &fi->fh);
+    if (ret != 0)
+    {
+      return ret;
+    }
+    fi->keep_cache = 1;
+    return 0;
+  }
+
+  if (fi->flags & O_TRUNC)
+  {
+    snapshot_controller_->record_change(path);
+    controller_->forget_attr(std::string(path));
+    controller_->bump_data_version(std::string(path));
+  }
+  auto ret = controller_->open_file(std::string(path), fi->flags, &fi->fh);
+  if (ret != 0)
+  {
+    return ret;
+  }
+  set_cache_mode(fi);
+  return 0;
 }
 
 /*
@@ -269,6 +430,7 @@ int cloudfs_open(const char *path, struct fuse_file_info *fi)
  */
 int cloudfs_read(const char *path, char *buf, size_t count, off_t offset, struct fuse_file_info *fi)
 {
+  ScopedTimer timer(Metrics::OP_READ);
   if (strcmp(path, "/.snapshot") == 0)
   {
     auto ret = pread(fi->fh, buf, count, offset);
@@ -278,20 +440,99 @@ int cloudfs_read(const char *path, char *buf, size_t count, off_t offset, struct
     }
     return ret;
   }
+  if (is_stats_path(path))
+  {
+    return read_stats(fi->fh, buf, count, offset);
+  }
+  if (snapshot_controller_->is_view_path(path))
+  {
+    auto ret = snapshot_controller_->view_locate_read(fi->fh, count, offset);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    ret = pread(fi->fh, buf, count, offset);
+    if (ret < 0)
+    {
+      return logger_->error("read: failed");
+    }
+    return ret;
+  }
   return controller_->read_file(std::string(path), fi->fh, buf, count, offset);
 }
 
+/*
+ * Read data from an open file(need file descriptor) at the given offset.
+ * The data is returned as a range of the buffer file instead of a copy, so
+ * FUSE can splice it to the kernel.
+ * will be handled by the cloudfs controller
+ */
+int cloudfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t count, off_t offset, struct fuse_file_info *fi)
+{
+  ScopedTimer timer(Metrics::OP_READ);
+  if (is_stats_path(path))
+  {
+    // stats files live in memory, FUSE frees the copy
+    auto bufvec = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+    auto mem = (char *)malloc(count);
+    if (bufvec == NULL || mem == NULL)
+    {
+      free(bufvec);
+      free(mem);
+      return -ENOMEM;
+    }
+    *bufvec = FUSE_BUFVEC_INIT(read_stats(fi->fh, mem, count, offset));
+    bufvec->buf[0].mem = mem;
+    *bufp = bufvec;
+    return 0;
+  }
+
+  off_t fd_offset = offset;
+  if (snapshot_controller_->is_view_path(path))
+  {
+    auto ret = snapshot_controller_->view_locate_read(fi->fh, count, offset);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+  else if (strcmp(path, "/.snapshot") != 0)
+  {
+    auto ret = controller_->locate_read(std::string(path), fi->fh, count, offset, fd_offset);
+    if (ret < 0)
+    {
+      return ret;
+    }
+  }
+
+  auto bufvec = (struct fuse_bufvec *)malloc(sizeof(struct fuse_bufvec));
+  if (bufvec == NULL)
+  {
+    return -ENOMEM;
+  }
+  *bufvec = FUSE_BUFVEC_INIT(count);
+  bufvec->buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+  bufvec->buf[0].fd = fi->fh;
+  bufvec->buf[0].pos = fd_offset;
+  *bufp = bufvec; // freed by FUSE
+  return 0;
+}
+
 /*
  * Write data to an open file(need file descriptor) at the given offset.
  * will be handled by the cloudfs controller
  */
 int cloud_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+  ScopedTimer timer(Metrics::OP_WRITE);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EACCES;
     return logger_->error("write: .snapshot directory is read-only");
   }
+  snapshot_controller_->record_change(path);
+  controller_->forget_attr(std::string(path));
+  controller_->bump_data_version(fi->fh);
   return controller_->write_file(std::string(path), fi->fh, buf, size, offset);
 }
 
@@ -301,6 +542,7 @@ int cloud_write(const char *path, const char *buf, size_t size, off_t offset, st
  */
 int cloud_release(const char *path, struct fuse_file_info *fi)
 {
+  ScopedTimer timer(Metrics::OP_RELEASE);
   if (strcmp(path, "/.snapshot") == 0)
   {
     auto ret = close(fi->fh);
@@ -310,14 +552,46 @@ int cloud_release(const char *path, struct fuse_file_info *fi)
     }
     return 0;
   }
+  if (is_stats_path(path))
+  {
+    stats_files_.erase(fi->fh);
+    return 0;
+  }
+  if (snapshot_controller_->is_view_path(path))
+  {
+    return snapshot_controller_->view_release(fi->fh);
+  }
+  controller_->forget_attr(std::string(path));
   return controller_->close_file(std::string(path), fi->fh);
 }
 
+/*
+ * Synchronize an open file.
+ * will be handled by the cloudfs controller
+ */
+int cloud_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  ScopedTimer timer(Metrics::OP_FSYNC);
+  if (strcmp(path, "/.snapshot") == 0 || snapshot_controller_->is_view_path(path))
+  {
+    return 0;
+  }
+  return controller_->fsync_file(std::string(path), fi->fh, datasync);
+}
+
 /*
  * Open a directory.
  */
 int cloud_opendir(const char *path, struct fuse_file_info *fi)
 {
+  ScopedTimer timer(Metrics::OP_OPENDIR);
+  if (snapshot_controller_->is_view_path(path))
+  {
+    // listed from the snapshot entries in readdir
+    std::vector<std::string> names;
+    fi->fh = 0;
+    return snapshot_controller_->view_readdir(path, names);
+  }
 
   auto ssd_path = state_.ssd_path + std::string(path);
   auto dir = opendir(ssd_path.c_str());
@@ -334,7 +608,28 @@ int cloud_opendir(const char *path, struct fuse_file_info *fi)
  */
 int cloud_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
+  ScopedTimer timer(Metrics::OP_READDIR);
+  if (snapshot_controller_->is_view_path(path))
+  {
+    std::vector<std::string> names;
+    auto ret = snapshot_controller_->view_readdir(path, names);
+    if (ret != 0)
+    {
+      return ret;
+    }
+    names.insert(names.begin(), {".", ".."});
+    for (auto &name : names)
+    {
+      if (filler(buf, name.c_str(), NULL, 0) != 0)
+      {
+        return logger_->error("readdir: filler failed");
+      }
+    }
+    return 0;
+  }
+
   auto dir = (DIR *)fi->fh;
+  auto dir_path = std::string(path);
   auto entry = readdir(dir);
   if (entry == NULL)
   {
@@ -353,8 +648,11 @@ int cloud_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
     {
       continue;
     }
-    // add the entry to buf
-    if (filler(buf, entry->d_name, NULL, 0) != 0)
+    // add the entry with its attributes to buf, this also warms the
+    // attribute cache for the getattr calls that usually follow a listing
+    struct stat stbuf;
+    auto ret = controller_->stat_entry(dir_path, dirfd(dir), name, &stbuf);
+    if (filler(buf, entry->d_name, ret == 0 ? &stbuf : NULL, 0) != 0)
     {
       return logger_->error("readdir: filler failed");
     }
@@ -367,6 +665,17 @@ int cloud_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
     {
       return logger_->error("readdir: filler failed");
     }
+
+    // add the roots of installed snapshots
+    std::vector<std::string> names;
+    snapshot_controller_->get_view_names(names);
+    for (auto &name : names)
+    {
+      if (filler(buf, name.c_str(), NULL, 0) != 0)
+      {
+        return logger_->error("readdir: filler failed");
+      }
+    }
   }
   return 0;
 }
@@ -376,6 +685,7 @@ int cloud_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
  */
 int cloud_access(const char *path, int mask)
 {
+  ScopedTimer timer(Metrics::OP_ACCESS);
   if (strcmp(path, "/.snapshot") == 0)
   {
     // only allow read-only access to .snapshot directory
@@ -391,6 +701,25 @@ int cloud_access(const char *path, int mask)
     }
     return 0;
   }
+  if (is_stats_path(path))
+  {
+    if (mask & W_OK)
+    {
+      errno = EACCES;
+      return logger_->error("access: stats files are read-only");
+    }
+    return 0;
+  }
+  if (snapshot_controller_->is_view_path(path))
+  {
+    if (mask & W_OK)
+    {
+      errno = EACCES;
+      return logger_->error("access: installed snapshots are read-only");
+    }
+    struct stat stbuf;
+    return snapshot_controller_->view_getattr(path, &stbuf);
+  }
   auto ssd_path = state_.ssd_path + std::string(path);
   auto ret = access(ssd_path.c_str(), mask);
   if (ret < 0)
@@ -405,18 +734,27 @@ int cloud_access(const char *path, int mask)
  */
 int cloud_utimens(const char *path, const struct timespec tv[2])
 {
+  ScopedTimer timer(Metrics::OP_UTIMENS);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EACCES;
     return logger_->error("utimens: .snapshot directory is read-only");
   }
 
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("utimens: installed snapshots are read-only");
+  }
+
+  snapshot_controller_->record_change(path);
   auto ssd_path = state_.ssd_path + std::string(path);
   auto ret = utimensat(AT_FDCWD, ssd_path.c_str(), tv, AT_SYMLINK_NOFOLLOW);
   if (ret < 0)
   {
     return logger_->error("utimens: failed");
   }
+  controller_->forget_attr(std::string(path));
   return 0;
 }
 
@@ -425,6 +763,7 @@ int cloud_utimens(const char *path, const struct timespec tv[2])
  */
 int cloud_chmod(const char *path, mode_t mode)
 {
+  ScopedTimer timer(Metrics::OP_CHMOD);
   if (strcmp(path, "/.snapshot") == 0)
   {
     // cannot change the mode of .snapshot directory
@@ -432,12 +771,20 @@ int cloud_chmod(const char *path, mode_t mode)
     return logger_->error("chmod: .snapshot directory is read-only");
   }
 
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("chmod: installed snapshots are read-only");
+  }
+
+  snapshot_controller_->record_change(path);
   auto ssd_path = state_.ssd_path + std::string(path);
   auto ret = chmod(ssd_path.c_str(), mode);
   if (ret < 0)
   {
     return logger_->error("chmod: ssd failed");
   }
+  controller_->forget_attr(std::string(path));
   return 0;
 }
 
@@ -446,20 +793,31 @@ int cloud_chmod(const char *path, mode_t mode)
  */
 int cloud_link(const char *path, const char *newpath)
 {
+  ScopedTimer timer(Metrics::OP_LINK);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EACCES;
     return logger_->error("link: .snapshot directory is read-only");
   }
 
+  if (snapshot_controller_->is_view_path(path) || snapshot_controller_->is_view_path(newpath))
+  {
+    errno = EACCES;
+    return logger_->error("link: installed snapshots are read-only");
+  }
+
   auto ssd_path = state_.ssd_path + std::string(path);
   auto new_ssd_path = state_.ssd_path + std::string(newpath);
+  snapshot_controller_->record_change(path);
+  snapshot_controller_->record_change(newpath);
 
   auto ret = link(ssd_path.c_str(), new_ssd_path.c_str());
   if (ret < 0)
   {
     return logger_->error("link: ssd failed");
   }
+  controller_->forget_links(std::string(path)); // link count changes
+  controller_->forget_attr(std::string(newpath));
   return 0;
 }
 
@@ -468,18 +826,27 @@ int cloud_link(const char *path, const char *newpath)
  */
 int cloud_symlink(const char *target, const char *linkpath)
 {
+  ScopedTimer timer(Metrics::OP_SYMLINK);
   if (strcmp(linkpath, "/.snapshot") == 0)
   {
     errno = EACCES;
     return logger_->error("symlink: .snapshot directory is read-only");
   }
 
+  if (snapshot_controller_->is_view_path(linkpath))
+  {
+    errno = EACCES;
+    return logger_->error("symlink: installed snapshots are read-only");
+  }
+
   auto ssd_linkpath = state_.ssd_path + std::string(linkpath);
+  snapshot_controller_->record_change(linkpath);
   auto ret = symlink(target, ssd_linkpath.c_str());
   if (ret < 0)
   {
     return logger_->error("symlink: ssd failed");
   }
+  controller_->forget_attr(std::string(linkpath));
   return 0;
 }
 
@@ -488,6 +855,12 @@ int cloud_symlink(const char *target, const char *linkpath)
  */
 int cloud_readlink(const char *path, char *buf, size_t size)
 {
+  ScopedTimer timer(Metrics::OP_READLINK);
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EINVAL; // installed snapshots hold no symbolic links
+    return -errno;
+  }
   auto ssd_path = state_.ssd_path + std::string(path);
 
   auto ret = readlink(ssd_path.c_str(), buf, size);
@@ -510,11 +883,19 @@ int cloud_readlink(const char *path, char *buf, size_t size)
  */
 int cloud_unlink(const char *path)
 {
+  ScopedTimer timer(Metrics::OP_UNLINK);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EACCES;
     return logger_->error("unlink: .snapshot directory cannot be deleted");
   }
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("unlink: installed snapshots are read-only");
+  }
+  snapshot_controller_->record_change(path);
+  controller_->forget_links(std::string(path)); // link count changes
   return controller_->unlink_file(std::string(path));
 }
 
@@ -523,13 +904,21 @@ int cloud_unlink(const char *path)
  */
 int cloud_rmdir(const char *path)
 {
+  ScopedTimer timer(Metrics::OP_RMDIR);
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("rmdir: installed snapshots are read-only");
+  }
   auto ssd_path = state_.ssd_path + std::string(path);
+  snapshot_controller_->record_change(path);
 
   auto ret = rmdir(ssd_path.c_str());
   if (ret < 0)
   {
     return logger_->error("rmdir: ssd failed");
   }
+  controller_->forget_attr(std::string(path));
   return 0;
 }
 
@@ -538,11 +927,20 @@ int cloud_rmdir(const char *path)
  */
 int cloud_truncate(const char *path, off_t size)
 {
+  ScopedTimer timer(Metrics::OP_TRUNCATE);
   if (strcmp(path, "/.snapshot") == 0)
   {
     errno = EACCES;
     return logger_->error("truncate: .snapshot directory is read-only");
   }
+  if (snapshot_controller_->is_view_path(path))
+  {
+    errno = EACCES;
+    return logger_->error("truncate: installed snapshots are read-only");
+  }
+  snapshot_controller_->record_change(path);
+  controller_->forget_attr(std::string(path));
+  controller_->bump_data_version(std::string(path));
   return controller_->truncate_file(std::string(path), size);
 }
 
@@ -552,14 +950,19 @@ int cloud_truncate(const char *path, off_t size)
  */
 int cloud_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data)
 {
+  ScopedTimer timer(Metrics::OP_IOCTL);
   if (strcmp(path, "/.snapshot") != 0)
   {
     errno = EACCES;
     return logger_->error("ioctl: only .snapshot supports ioctl");
   }
 
+  // snapshot operations may rewrite any part of the tree
+  controller_->forget_attrs();
+
   unsigned long *timestamp;
   unsigned long *snapshot_list;
+  struct cloudfs_restore_path *restore;
   switch (cmd)
   {
   case CLOUDFS_SNAPSHOT:
@@ -570,6 +973,14 @@ int cloud_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
     // restore snapshot
     timestamp = (unsigned long *)data;
     return snapshot_controller_->restore_snapshot(timestamp);
+  case CLOUDFS_RESTORE_PATH:
+    // restore a file or directory subtree
+    restore = (struct cloudfs_restore_path *)data;
+    return snapshot_controller_->restore_subtree(&restore->timestamp,
+                                                 std::string(restore->path, strnlen(restore->path, sizeof(restore->path))));
+  case CLOUDFS_DIFF:
+    // changes between two snapshots or a snapshot and the live tree
+    return snapshot_controller_->diff_snapshots((struct cloudfs_diff *)data);
   case CLOUDFS_SNAPSHOT_LIST:
     // list snapshots
     snapshot_list = (unsigned long *)data;
@@ -618,8 +1029,10 @@ int cloudfs_start(struct cloudfs_state *state,
   cloudfs_operations.create = cloudfs_create;
   cloudfs_operations.open = cloudfs_open;
   cloudfs_operations.read = cloudfs_read;
+  cloudfs_operations.read_buf = cloudfs_read_buf;
   cloudfs_operations.write = cloud_write;
   cloudfs_operations.release = cloud_release;
+  cloudfs_operations.fsync = cloud_fsync;
   cloudfs_operations.opendir = cloud_opendir;
   cloudfs_operations.readdir = cloud_readdir;
   cloudfs_operations.access = cloud_access;
@@ -641,6 +1054,33 @@ int cloudfs_start(struct cloudfs_state *state,
   strcpy(argv[argc++], state->fuse_path);
   argv[argc] = (char *)malloc(strlen("-s") + 1);
   strcpy(argv[argc++], "-s"); // set the fuse mode to single thread
+
+  // mount options for kernel attribute/lookup caching and request sizes,
+  // negative timeouts and a zero size keep the FUSE defaults
+  std::string mount_opts;
+  if (state->attr_timeout >= 0)
+  {
+    mount_opts += "attr_timeout=" + std::to_string(state->attr_timeout);
+  }
+  if (state->entry_timeout >= 0)
+  {
+    mount_opts += (mount_opts.empty() ? "" : ",");
+    mount_opts += "entry_timeout=" + std::to_string(state->entry_timeout);
+  }
+  if (state->max_io_size > 0)
+  {
+    // larger requests for large sequential I/O
+    mount_opts += (mount_opts.empty() ? "" : ",");
+    mount_opts += "big_writes,max_write=" + std::to_string(state->max_io_size) +
+                  ",max_read=" + std::to_string(state->max_io_size);
+  }
+  if (!mount_opts.empty())
+  {
+    argv[argc] = (char *)malloc(strlen("-o") + 1);
+    strcpy(argv[argc++], "-o");
+    argv[argc] = (char *)malloc(mount_opts.size() + 1);
+    strcpy(argv[argc++], mount_opts.c_str());
+  }
   // argv[argc] = (char *) malloc(sizeof("-f") * sizeof(char));
   // argv[argc++] = "-f"; // run fuse in foreground
 
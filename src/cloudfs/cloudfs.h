@@ -17,6 +17,24 @@ struct cloudfs_state {
   int cache_size;
   int rabin_window_size;
   char no_dedup;
+  int gc_grace; // seconds before a dead chunk is deleted in background, -1 to
+                // delete inline
+  int gc_rate;  // maximum background deletions per second, 0 for unlimited
+  int container_size; // target size of chunk containers in bytes, 0 to store
+                      // every chunk as its own object
+  double attr_timeout;  // seconds the kernel caches attributes, negative for
+                        // the FUSE default
+  double entry_timeout; // seconds the kernel caches lookups, negative for the
+                        // FUSE default
+  int max_io_size; // largest read/write request in bytes, 0 for the FUSE
+                   // default
+  char direct_io;  // true to bypass the kernel page cache for file data
+  int log_level;   // minimum LogLevel written to the log file
+  int snapshot_threads; // threads walking the SSD and compressing a snapshot,
+                        // 0 for one per core
+  char snapshot_compression[8]; // filter of snapshot objects, "zstd" or "gzip"
+  int snapshot_level; // compression level of snapshot objects, 0 for the
+                      // default of the filter
 };
 
 int cloudfs_start(struct cloudfs_state* state,
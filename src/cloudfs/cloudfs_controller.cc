@@ -15,8 +15,26 @@
 
 #include "chunk_splitter.h"
 #include "buffer_file.h"
+#include "metrics.h"
+
+const size_t CloudfsController::METADATA_CACHE_ENTRIES = 64 * 1024;
 
 int CloudfsController::get_buffer_path(const std::string &path, std::string &buffer_path)
+{
+  if (metadata_cache_.get_buffer_path(path, buffer_path))
+  {
+    return 0;
+  }
+
+  if (read_buffer_path(path, buffer_path) != 0)
+  {
+    return -1;
+  }
+  metadata_cache_.set_buffer_path(path, buffer_path);
+  return 0;
+}
+
+int CloudfsController::read_buffer_path(const std::string &path, std::string &buffer_path)
 {
   char buf[PATH_MAX + 1];
   auto ret = lgetxattr(path.c_str(), "user.cloudfs.buffer_path", buf, PATH_MAX);
@@ -36,10 +54,26 @@ int CloudfsController::set_buffer_path(const std::string &path, const std::strin
   {
     return -1;
   }
+  metadata_cache_.set_buffer_path(path, buffer_path);
   return 0;
 }
 
 int CloudfsController::get_size(const std::string &path, off_t &size)
+{
+  if (metadata_cache_.get_size(path, size))
+  {
+    return 0;
+  }
+
+  if (read_size(path, size) != 0)
+  {
+    return -1;
+  }
+  metadata_cache_.set_size(path, size, false);
+  return 0;
+}
+
+int CloudfsController::read_size(const std::string &path, off_t &size)
 {
   char buf[sizeof(off_t)];
   auto ret = lgetxattr(path.c_str(), "user.cloudfs.size", buf, sizeof(off_t));
@@ -53,6 +87,12 @@ int CloudfsController::get_size(const std::string &path, off_t &size)
 
 int CloudfsController::get_size(uint64_t fd, off_t &size)
 {
+  std::string buffer_path;
+  if (metadata_cache_.get_open_path(fd, buffer_path))
+  {
+    return get_size(buffer_path, size);
+  }
+
   char buf[sizeof(off_t)];
   auto ret = fgetxattr(fd, "user.cloudfs.size", buf, sizeof(off_t));
   if (ret == -1)
@@ -70,11 +110,20 @@ int CloudfsController::set_size(const std::string &path, off_t size)
   {
     return -1;
   }
+  metadata_cache_.set_size(path, size, false);
   return 0;
 }
 
 int CloudfsController::set_size(uint64_t fd, off_t size)
 {
+  std::string buffer_path;
+  if (metadata_cache_.get_open_path(fd, buffer_path))
+  {
+    // written back when the file is closed or synced
+    metadata_cache_.set_size(buffer_path, size, true);
+    return 0;
+  }
+
   auto ret = fsetxattr(fd, "user.cloudfs.size", &size, sizeof(off_t), 0);
   if (ret == -1)
   {
@@ -85,6 +134,13 @@ int CloudfsController::set_size(uint64_t fd, off_t size)
 
 int CloudfsController::get_is_on_cloud(const std::string &path, bool &is_on_cloud)
 {
+  std::string buffer_path;
+  auto cached = get_buffer_path(path, buffer_path) == 0;
+  if (cached && metadata_cache_.get_is_on_cloud(buffer_path, is_on_cloud))
+  {
+    return 0;
+  }
+
   char buf[sizeof(bool)];
   auto ret = lgetxattr(path.c_str(), "user.cloudfs.is_on_cloud", buf, sizeof(bool));
   if (ret == -1)
@@ -92,6 +148,10 @@ int CloudfsController::get_is_on_cloud(const std::string &path, bool &is_on_clou
     return -1;
   }
   is_on_cloud = *(bool *)buf;
+  if (cached)
+  {
+    metadata_cache_.set_is_on_cloud(buffer_path, is_on_cloud);
+  }
   return 0;
 }
 
@@ -102,6 +162,11 @@ int CloudfsController::set_is_on_cloud(const std::string &path, bool is_on_cloud
   {
     return -1;
   }
+  std::string buffer_path;
+  if (get_buffer_path(path, buffer_path) == 0)
+  {
+    metadata_cache_.set_is_on_cloud(buffer_path, is_on_cloud);
+  }
   return 0;
 }
 
@@ -136,6 +201,21 @@ int CloudfsController::get_chunkinfo(const std::string &main_path, std::vector<C
   return 0;
 }
 
+int CloudfsController::fetch_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len)
+{
+  return buffer_controller_->download_chunk(key, fd, offset, len);
+}
+
+int CloudfsController::store_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len)
+{
+  return buffer_controller_->upload_chunk(key, fd, offset, len);
+}
+
+int CloudfsController::retire_chunk(const std::string &key, const ChunkLocation &)
+{
+  return buffer_controller_->retire_object(key);
+}
+
 int CloudfsController::set_chunkinfo(const std::string &main_path, std::vector<Chunk> &chunks)
 {
   FILE *file = fopen(main_path.c_str(), "w");
@@ -183,11 +263,23 @@ int CloudfsController::set_truncated(const std::string &path, bool truncated)
   {
     return -1;
   }
+  std::string buffer_path;
+  if (get_buffer_path(path, buffer_path) == 0)
+  {
+    metadata_cache_.set_truncated(buffer_path, truncated);
+  }
   return 0;
 }
 
 int CloudfsController::get_truncated(const std::string &path, bool &truncated)
 {
+  std::string buffer_path;
+  auto cached = get_buffer_path(path, buffer_path) == 0;
+  if (cached && metadata_cache_.get_truncated(buffer_path, truncated))
+  {
+    return 0;
+  }
+
   char buf[sizeof(bool)];
   auto ret = lgetxattr(path.c_str(), "user.cloudfs.truncated", buf, sizeof(bool));
   if (ret == -1)
@@ -195,11 +287,122 @@ int CloudfsController::get_truncated(const std::string &path, bool &truncated)
     return -1;
   }
   truncated = *(bool *)buf;
+  if (cached)
+  {
+    metadata_cache_.set_truncated(buffer_path, truncated);
+  }
+  return 0;
+}
+
+int CloudfsController::flush_metadata(uint64_t fd)
+{
+  std::string buffer_path;
+  off_t size;
+  if (!metadata_cache_.get_open_path(fd, buffer_path) || !metadata_cache_.take_dirty(buffer_path, size))
+  {
+    return 0;
+  }
+  auto ret = fsetxattr(fd, "user.cloudfs.size", &size, sizeof(off_t), 0);
+  if (ret == -1)
+  {
+    return logger_->error("flush_metadata: set size failed, " + buffer_path);
+  }
+  return 0;
+}
+
+void CloudfsController::flush_metadata()
+{
+  std::vector<std::pair<std::string, off_t>> dirty;
+  metadata_cache_.take_all_dirty(dirty);
+  for (auto &d : dirty)
+  {
+    auto ret = lsetxattr(d.first.c_str(), "user.cloudfs.size", &d.second, sizeof(off_t), 0);
+    if (ret == -1)
+    {
+      logger_->error("flush_metadata: set size failed, " + d.first);
+    }
+  }
+}
+
+void CloudfsController::forget_attr(const std::string &path)
+{
+  metadata_cache_.forget_attr(state_->ssd_path + path);
+  // the parent directory changes on entry creation and removal
+  auto pos = path.find_last_of('/');
+  if (pos != std::string::npos)
+  {
+    metadata_cache_.forget_attr(state_->ssd_path + path.substr(0, pos == 0 ? 1 : pos));
+  }
+}
+
+void CloudfsController::forget_links(const std::string &path)
+{
+  // every path to the inode caches the link count
+  struct stat st;
+  auto main_path = state_->ssd_path + path;
+  if (metadata_cache_.get_attr(main_path, &st) || lstat(main_path.c_str(), &st) == 0)
+  {
+    metadata_cache_.forget_inode_attrs(st.st_ino);
+  }
+  forget_attr(path);
+}
+
+void CloudfsController::forget_attrs()
+{
+  metadata_cache_.clear_attrs();
+}
+
+void CloudfsController::invalidate_metadata()
+{
+  flush_metadata();
+  metadata_cache_.clear();
+}
+
+bool CloudfsController::keep_cache(uint64_t fd)
+{
+  std::string buffer_path;
+  if (!metadata_cache_.get_open_path(fd, buffer_path))
+  {
+    return false;
+  }
+  return metadata_cache_.keep_cache(buffer_path);
+}
+
+void CloudfsController::bump_data_version(uint64_t fd)
+{
+  std::string buffer_path;
+  if (metadata_cache_.get_open_path(fd, buffer_path))
+  {
+    metadata_cache_.bump_version(buffer_path);
+  }
+}
+
+void CloudfsController::bump_data_version(const std::string &path)
+{
+  std::string buffer_path;
+  if (get_buffer_path(state_->ssd_path + path, buffer_path) == 0)
+  {
+    metadata_cache_.bump_version(buffer_path);
+  }
+}
+
+int CloudfsController::fsync_file(const std::string &path, uint64_t fd, int datasync)
+{
+  auto ret = flush_metadata(fd);
+  if (ret != 0)
+  {
+    return ret;
+  }
+  ret = datasync ? fdatasync(fd) : fsync(fd);
+  if (ret == -1)
+  {
+    return logger_->error("fsync_file: fsync failed");
+  }
   return 0;
 }
 
 CloudfsController::CloudfsController(struct cloudfs_state *state, const std::string &host_name, std::string bucket_name, std::shared_ptr<DebugLogger> logger)
-    : state_(state), bucket_name_(std::move(bucket_name)), logger_(std::move(logger)), buffer_controller_(std::make_shared<BufferFileController>(state, bucket_name_, logger_)), chunk_table_(std::make_shared<ChunkTable>(state->ssd_path, logger_, buffer_controller_))
+    : state_(state), bucket_name_(std::move(bucket_name)), logger_(std::move(logger)), buffer_controller_(std::make_shared<BufferFileController>(state, bucket_name_, logger_)), chunk_table_(std::make_shared<ChunkTable>(state->ssd_path, logger_, buffer_controller_)), metadata_cache_(METADATA_CACHE_ENTRIES)
 {
 }
 
@@ -220,30 +423,68 @@ int CloudfsController::stat_file(const std::string &path, struct stat *stbuf)
 {
   auto main_path = state_->ssd_path + path;
 
-  auto ret = lstat(main_path.c_str(), stbuf);
+  if (!metadata_cache_.get_attr(main_path, stbuf))
+  {
+    auto ret = lstat(main_path.c_str(), stbuf);
+    if (ret != 0)
+    {
+      return logger_->error("stat_file: stat main_path failed");
+    }
+    metadata_cache_.set_attr(main_path, *stbuf);
+  }
+
+  auto ret = fill_size(main_path, stbuf);
   if (ret != 0)
   {
-    return logger_->error("stat_file: stat main_path failed");
+    return logger_->error("stat_file: fill_size failed");
   }
 
-  if (S_ISREG(stbuf->st_mode))
+  logger_->debug("stat_file: path ", path, ", size ", stbuf->st_size);
+  return 0;
+}
+
+int CloudfsController::stat_entry(const std::string &dir_path, int dir_fd, const std::string &name, struct stat *stbuf)
+{
+  auto main_path = state_->ssd_path + dir_path + (dir_path == "/" ? "" : "/") + name;
+
+  if (!metadata_cache_.get_attr(main_path, stbuf))
   {
-    // get real size of a regular file from xattr of buffer file
-    std::string buffer_path;
-    ret = get_buffer_path(main_path, buffer_path);
+    auto ret = fstatat(dir_fd, name.c_str(), stbuf, AT_SYMLINK_NOFOLLOW);
     if (ret != 0)
     {
-      return logger_->error("stat_file: get_buffer_path failed");
+      return logger_->error("stat_entry: stat main_path failed");
     }
+    metadata_cache_.set_attr(main_path, *stbuf);
+  }
 
-    ret = get_size(buffer_path, stbuf->st_size);
-    if (ret != 0)
-    {
-      return logger_->error("stat_file: get_size failed");
-    }
+  auto ret = fill_size(main_path, stbuf);
+  if (ret != 0)
+  {
+    return logger_->error("stat_entry: fill_size failed");
+  }
+  return 0;
+}
+
+int CloudfsController::fill_size(const std::string &main_path, struct stat *stbuf)
+{
+  if (!S_ISREG(stbuf->st_mode))
+  {
+    return 0;
+  }
+
+  // get real size of a regular file from xattr of buffer file
+  std::string buffer_path;
+  auto ret = get_buffer_path(main_path, buffer_path);
+  if (ret != 0)
+  {
+    return logger_->error("fill_size: get_buffer_path failed");
   }
 
-  logger_->info("stat_file: path " + path + ", size " + std::to_string(stbuf->st_size));
+  ret = get_size(buffer_path, stbuf->st_size);
+  if (ret != 0)
+  {
+    return logger_->error("fill_size: get_size failed");
+  }
   return 0;
 }
 
@@ -338,6 +579,7 @@ int CloudfsControllerNoDedup::open_file(const std::string &path, int flags, uint
 
   *fd = ret;                                           // give user the fd of buffer file
   open_files_[*fd] = OpenFile(main_path, 0, 0, false); // add a open file entry
+  metadata_cache_.open(*fd, buffer_path);
   return 0;
 }
 
@@ -351,6 +593,12 @@ int CloudfsControllerNoDedup::read_file(const std::string &path, uint64_t fd, ch
   return ret;
 }
 
+int CloudfsControllerNoDedup::locate_read(const std::string &path, uint64_t fd, size_t size, off_t offset, off_t &fd_offset)
+{
+  fd_offset = offset; // the buffer file holds the whole file
+  return 0;
+}
+
 int CloudfsControllerNoDedup::write_file(const std::string &path, uint64_t fd, const char *buf, size_t size, off_t offset)
 {
   auto written = pwrite(fd, buf, size, offset);
@@ -386,6 +634,8 @@ int CloudfsControllerNoDedup::close_file(const std::string &path, uint64_t fd)
     return logger_->error("close_file: get_buffer_path failed");
   }
 
+  flush_metadata(fd); // write back the size before the fd is gone
+  metadata_cache_.close(fd);
   ret = close(fd);
   if (ret == -1)
   {
@@ -521,6 +771,7 @@ int CloudfsControllerNoDedup::unlink_file(const std::string &path)
     {
       return logger_->error("unlink_file: unlink buffer_path failed");
     }
+    metadata_cache_.forget_inode(buffer_path);
   }
 
   // unlink main file
@@ -529,6 +780,7 @@ int CloudfsControllerNoDedup::unlink_file(const std::string &path)
   {
     return logger_->error("unlink_file: unlink main_path failed");
   }
+  metadata_cache_.forget_path(main_path);
   return 0;
 }
 
@@ -555,15 +807,24 @@ int CloudfsControllerNoDedup::truncate_file(const std::string &path, off_t size)
 
 void CloudfsControllerNoDedup::destroy()
 {
+  flush_metadata();
 }
 
 const size_t CloudfsControllerDedup::RECHUNK_BUF_SIZE = 4 * 1024;
 
 CloudfsControllerDedup::CloudfsControllerDedup(struct cloudfs_state *state, const std::string &host_name, std::string bucket_name,
                                                std::shared_ptr<DebugLogger> logger, int window_size, int avg_seg_size, int min_seg_size, int max_seg_size) : CloudfsController(state, host_name, std::move(bucket_name), logger),
-                                                                                                                                                             chunk_splitter_(window_size, avg_seg_size, min_seg_size, max_seg_size)
+                                                                                                                                                             chunk_splitter_(window_size, avg_seg_size, min_seg_size, max_seg_size), compacted_checkpoints_(0)
 {
   logger_->debug("CloudfsControllerDedup: window_size " + std::to_string(window_size) + ", avg_seg_size " + std::to_string(avg_seg_size) + ", min_seg_size " + std::to_string(min_seg_size) + ", max_seg_size " + std::to_string(max_seg_size));
+
+  // chunks packed by an earlier mount stay readable when packing is turned off
+  if (state->container_size > 0 || ContainerStore::exists(state->ssd_path))
+  {
+    container_store_.reset(new ContainerStore(state->ssd_path, bucket_name_, logger_, buffer_controller_, state->container_size));
+    chunk_table_->set_dead_chunk_handler([this](const std::string &key, const ChunkLocation &location)
+                                         { retire_chunk(key, location); });
+  }
 }
 
 CloudfsControllerDedup::~CloudfsControllerDedup()
@@ -572,7 +833,7 @@ CloudfsControllerDedup::~CloudfsControllerDedup()
 
 int CloudfsControllerDedup::open_file(const std::string &path, int flags, uint64_t *fd)
 {
-  logger_->info("open_file: " + path + ", flags: " + std::to_string(flags));
+  logger_->info("open_file: ", path, ", flags: ", flags);
 
   auto main_path = state_->ssd_path + path;
 
@@ -609,18 +870,34 @@ int CloudfsControllerDedup::open_file(const std::string &path, int flags, uint64
 
   auto op_fd = open(buffer_path.c_str(), O_RDWR);                     // get a buffer file fd with read and write permission
   open_files_[*fd] = OpenFile(main_path, 0, 0, false, chunks, op_fd); // add a open file entry
+  metadata_cache_.open(*fd, buffer_path);
   return 0;
 }
 
 int CloudfsControllerDedup::read_file(const std::string &path, uint64_t fd, char *buf, size_t read_size, off_t read_offset)
 {
-  auto main_path = open_files_[fd].main_path_;
+  off_t fd_offset;
+  auto ret = locate_read(path, fd, read_size, read_offset, fd_offset);
+  if (ret < 0)
+  {
+    return ret;
+  }
+
+  auto read_cnt = pread(fd, buf, read_size, fd_offset);
+  if (read_cnt < 0)
+  {
+    return logger_->error("read_file: pread failed");
+  }
+  return read_cnt;
+}
 
+int CloudfsControllerDedup::locate_read(const std::string &path, uint64_t fd, size_t read_size, off_t read_offset, off_t &fd_offset)
+{
   off_t file_size;
   auto ret = get_size(fd, file_size);
   if (ret != 0)
   {
-    return logger_->error("read_file: get_size failed");
+    return logger_->error("locate_read: get_size failed");
   }
 
   off_t buffer_offset;
@@ -630,7 +907,7 @@ int CloudfsControllerDedup::read_file(const std::string &path, uint64_t fd, char
     auto ret = prepare_read_data(read_offset, read_size, fd);
     if (ret < 0)
     {
-      logger_->error("read_file: prepare_read_data failed");
+      logger_->error("locate_read: prepare_read_data failed");
       return ret;
     }
     buffer_offset = open_files_[fd].start_;
@@ -641,12 +918,8 @@ int CloudfsControllerDedup::read_file(const std::string &path, uint64_t fd, char
     buffer_offset = 0;
   }
 
-  auto read_cnt = pread(fd, buf, read_size, read_offset - buffer_offset);
-  if (read_cnt < 0)
-  {
-    return logger_->error("read_file: pread failed");
-  }
-  return read_cnt;
+  fd_offset = read_offset - buffer_offset;
+  return 0;
 }
 
 int CloudfsControllerDedup::write_file(const std::string &path, uint64_t fd, const char *buf, size_t size, off_t write_offset)
@@ -756,14 +1029,15 @@ int CloudfsControllerDedup::write_file(const std::string &path, uint64_t fd, con
     {
       return logger_->error("CloudfsControllerDedup::write_file: pread(rechunk buf) failed");
     }
+    Metrics::instance().add(Metrics::RECHUNK_BYTES, read_cnt);
     auto next_chunks = chunk_splitter_.get_chunks_next(rechunk_buf, read_cnt);
     for (auto &c : next_chunks)
     {
       auto is_first = chunk_table_->use(c.key_); // add reference count
-      if (is_first)
+      if (is_first && !buffer_controller_->revive_object(c.key_))
       {
-        // this is the first time this chunk is used, upload to cloud
-        ret = buffer_controller_->upload_chunk(c.key_, op_fd, c.start_ - buffer_offset, c.len_);
+        // first use of this chunk and not still on cloud, upload to cloud
+        ret = store_chunk(c.key_, op_fd, c.start_ - buffer_offset, c.len_);
       }
       new_chunks.push_back(c);
     }
@@ -774,9 +1048,9 @@ int CloudfsControllerDedup::write_file(const std::string &path, uint64_t fd, con
   if (last_chunk.len_ > 0)
   {
     auto is_first = chunk_table_->use(last_chunk.key_);
-    if (is_first)
+    if (is_first && !buffer_controller_->revive_object(last_chunk.key_))
     {
-      ret = buffer_controller_->upload_chunk(last_chunk.key_, op_fd, last_chunk.start_ - buffer_offset, last_chunk.len_);
+      ret = store_chunk(last_chunk.key_, op_fd, last_chunk.start_ - buffer_offset, last_chunk.len_);
     }
     new_chunks.push_back(last_chunk);
   }
@@ -795,11 +1069,12 @@ int CloudfsControllerDedup::write_file(const std::string &path, uint64_t fd, con
 
   for (int i = rechunk_start_idx; i <= release_end_index; i++)
   {
-    auto is_last = chunk_table_->release(chunks[i].key_); // release the chunk
+    ChunkLocation location;
+    auto is_last = chunk_table_->release(chunks[i].key_, &location); // release the chunk
     if (is_last)
     {
-      // this is the last reference to the chunk, delete the chunk on cloud
-      ret = buffer_controller_->delete_object(chunks[i].key_);
+      // this is the last reference to the chunk, retire it on cloud
+      ret = retire_chunk(chunks[i].key_, location);
     }
   }
 
@@ -825,13 +1100,21 @@ int CloudfsControllerDedup::write_file(const std::string &path, uint64_t fd, con
   {
     return logger_->error("CloudfsControllerDedup::write_file: set_chunkinfo failed");
   }
+  // chunks list and ref counts are consistent again
+  if (!chunk_table_->commit())
+  {
+    return logger_->error("CloudfsControllerDedup::write_file: commit chunk table failed");
+  }
+  compact_containers();
   return written;
 }
 
 int CloudfsControllerDedup::close_file(const std::string &path, uint64_t fd)
 {
-  logger_->info("close_file: " + path + ", fd: " + std::to_string(fd));
+  logger_->info("close_file: ", path, ", fd: ", fd);
 
+  flush_metadata(fd); // write back the size before the fd is gone
+  metadata_cache_.close(fd);
   close(open_files_[fd].op_fd_);
   auto ret = close(fd);
   if (ret == -1)
@@ -845,7 +1128,7 @@ int CloudfsControllerDedup::close_file(const std::string &path, uint64_t fd)
 
 int CloudfsControllerDedup::unlink_file(const std::string &path)
 {
-  logger_->info("unlink_file: " + path);
+  logger_->info("unlink_file: ", path);
 
   auto main_path = state_->ssd_path + path;
 
@@ -872,6 +1155,7 @@ int CloudfsControllerDedup::unlink_file(const std::string &path)
     {
       return logger_->error("unlink_file: unlink buffer_path failed");
     }
+    metadata_cache_.forget_inode(buffer_path);
 
     // derease reference count of all chunks
     std::vector<Chunk> chunks;
@@ -883,13 +1167,19 @@ int CloudfsControllerDedup::unlink_file(const std::string &path)
 
     for (auto &c : chunks)
     {
-      auto is_last = chunk_table_->release(c.key_);
+      ChunkLocation location;
+      auto is_last = chunk_table_->release(c.key_, &location);
       if (is_last)
       {
-        // this is the last reference to the chunk, delete the chunk on cloud
-        ret = buffer_controller_->delete_object(c.key_);
+        // this is the last reference to the chunk, retire it on cloud
+        ret = retire_chunk(c.key_, location);
       }
     }
+    if (!chunk_table_->commit())
+    {
+      return logger_->error("unlink_file: commit chunk table failed");
+    }
+    compact_containers();
   }
 
   // unlink main file
@@ -898,12 +1188,13 @@ int CloudfsControllerDedup::unlink_file(const std::string &path)
   {
     return logger_->error("unlink_file: unlink main_path failed");
   }
+  metadata_cache_.forget_path(main_path);
   return 0;
 }
 
 int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncate_size)
 {
-  logger_->debug("truncate_file: " + path + ", size: " + std::to_string(truncate_size));
+  logger_->debug("truncate_file: ", path, ", size: ", truncate_size);
 
   auto main_path = state_->ssd_path + path;
   std::string buffer_path;
@@ -968,7 +1259,7 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
     for (int i = 0; i <= truncate_point_idx; i++)
     {
       auto &chunk = chunks[i];
-      auto ret = buffer_controller_->download_chunk(chunk.key_, op_fd, cur_offset, chunk.len_);
+      auto ret = fetch_chunk(chunk.key_, op_fd, cur_offset, chunk.len_);
       if (ret != 0)
       {
         return logger_->error("truncate_file: download_chunk failed");
@@ -986,10 +1277,11 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
     // delete all chunks
     for (auto &c : chunks)
     {
-      auto is_last = chunk_table_->release(c.key_);
+      ChunkLocation location;
+      auto is_last = chunk_table_->release(c.key_, &location);
       if (is_last)
       {
-        ret = buffer_controller_->delete_object(c.key_);
+        ret = retire_chunk(c.key_, location);
       }
     }
     chunks.clear();
@@ -998,6 +1290,11 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
     {
       return logger_->error("truncate_file: set_chunkinfo failed");
     }
+    if (!chunk_table_->commit())
+    {
+      return logger_->error("truncate_file: commit chunk table failed");
+    }
+    compact_containers();
 
     ret = set_truncated(main_path, true);
     if (ret != 0)
@@ -1026,7 +1323,7 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
 
   // load truncate_point_idx chunk
   buffer_controller_->clear_file(op_fd);
-  ret = buffer_controller_->download_chunk(chunks[truncate_point_idx].key_, op_fd, 0, chunks[truncate_point_idx].len_);
+  ret = fetch_chunk(chunks[truncate_point_idx].key_, op_fd, 0, chunks[truncate_point_idx].len_);
   if (ret != 0)
   {
     return logger_->error("truncate_file: download_chunk failed");
@@ -1043,11 +1340,12 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
   // delete all chunks after truncate_point_idx(inclusive)
   for (int i = truncate_point_idx; i < (int)chunks.size(); i++)
   {
-    auto is_last = chunk_table_->release(chunks[i].key_);
+    ChunkLocation location;
+    auto is_last = chunk_table_->release(chunks[i].key_, &location);
     if (is_last)
     {
-      // this is the last reference to the chunk, delete the chunk on cloud
-      ret = buffer_controller_->delete_object(chunks[i].key_);
+      // this is the last reference to the chunk, retire it on cloud
+      ret = retire_chunk(chunks[i].key_, location);
     }
   }
 
@@ -1068,10 +1366,10 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
     for (auto &c : next_chunks)
     {
       auto is_first = chunk_table_->use(c.key_);
-      if (is_first)
+      if (is_first && !buffer_controller_->revive_object(c.key_))
       {
-        // this is the first time this chunk is used, upload to cloud
-        ret = buffer_controller_->upload_chunk(c.key_, op_fd, c.start_ - buffer_offset, c.len_);
+        // first use of this chunk and not still on cloud, upload to cloud
+        ret = store_chunk(c.key_, op_fd, c.start_ - buffer_offset, c.len_);
       }
       chunks.push_back(c);
     }
@@ -1082,10 +1380,10 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
   if (last_chunk.len_ > 0)
   {
     auto is_first = chunk_table_->use(last_chunk.key_);
-    if (is_first)
+    if (is_first && !buffer_controller_->revive_object(last_chunk.key_))
     {
-      // this is the first time this chunk is used, upload to cloud
-      ret = buffer_controller_->upload_chunk(last_chunk.key_, op_fd, last_chunk.start_ - buffer_offset, last_chunk.len_);
+      // first use of this chunk and not still on cloud, upload to cloud
+      ret = store_chunk(last_chunk.key_, op_fd, last_chunk.start_ - buffer_offset, last_chunk.len_);
     }
     chunks.push_back(last_chunk);
   }
@@ -1097,6 +1395,11 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
   {
     return logger_->error("truncate_file: set_chunkinfo failed");
   }
+  if (!chunk_table_->commit())
+  {
+    return logger_->error("truncate_file: commit chunk table failed");
+  }
+  compact_containers();
 
   ret = set_truncated(main_path, true);
   if (ret != 0)
@@ -1114,8 +1417,71 @@ int CloudfsControllerDedup::truncate_file(const std::string &path, off_t truncat
 
 void CloudfsControllerDedup::destroy()
 {
+  flush_metadata();
+  if (container_store_ != nullptr)
+  {
+    container_store_->flush(); // upload the open container first
+  }
   chunk_table_->persist();
+  if (container_store_ != nullptr)
+  {
+    container_store_->collect();
+  }
   buffer_controller_->persist_cache_state();
+  buffer_controller_->stop_collector();
+}
+
+int CloudfsControllerDedup::store_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len)
+{
+  if (state_->container_size <= 0)
+  {
+    return buffer_controller_->upload_chunk(key, fd, offset, len);
+  }
+
+  ChunkLocation location;
+  auto ret = container_store_->append(key, fd, offset, len, location);
+  if (ret != 0)
+  {
+    return logger_->error("store_chunk: append to container failed");
+  }
+  chunk_table_->set_location(key, location);
+  return 0;
+}
+
+int CloudfsControllerDedup::fetch_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len)
+{
+  ChunkLocation location;
+  if (container_store_ != nullptr && chunk_table_->get_location(key, location) && location.container_ != 0)
+  {
+    return container_store_->read(key, location, fd, offset);
+  }
+  return buffer_controller_->download_chunk(key, fd, offset, len);
+}
+
+int CloudfsControllerDedup::retire_chunk(const std::string &key, const ChunkLocation &location)
+{
+  if (location.container_ == 0)
+  {
+    return buffer_controller_->retire_object(key);
+  }
+
+  // a packed chunk is cached clean, the container keeps its cloud copy until
+  // none of its chunks is live
+  buffer_controller_->drop_cached_object(key);
+  container_store_->release(location);
+  return 0;
+}
+
+void CloudfsControllerDedup::compact_containers()
+{
+  // a compaction downloads and uploads a whole container, keep it off the
+  // per-write path and run it at most once per chunk table checkpoint
+  if (container_store_ == nullptr || chunk_table_->checkpoints() == compacted_checkpoints_)
+  {
+    return;
+  }
+  compacted_checkpoints_ = chunk_table_->checkpoints();
+  container_store_->compact(chunk_table_.get());
 }
 
 int CloudfsControllerDedup::prepare_read_data(off_t offset, size_t r_size, uint64_t fd)
@@ -1151,7 +1517,7 @@ int CloudfsControllerDedup::prepare_read_data(off_t offset, size_t r_size, uint6
   {
     auto &chunk = chunks[i];
     // download chunk
-    auto ret = buffer_controller_->download_chunk(chunk.key_, op_fd, buffer_len, chunk.len_);
+    auto ret = fetch_chunk(chunk.key_, op_fd, buffer_len, chunk.len_);
     if (ret != 0)
     {
       return logger_->error("prepare_read_data: download_chunk failed");
@@ -1183,7 +1549,7 @@ int CloudfsControllerDedup::prepare_write_data(off_t offset, size_t w_size, uint
     {
       // read the last chunk, to make convinent for rechunking
       auto &chunk = chunks.back();
-      auto ret = buffer_controller_->download_chunk(chunk.key_, op_fd, 0, chunk.len_);
+      auto ret = fetch_chunk(chunk.key_, op_fd, 0, chunk.len_);
       if (ret != 0)
       {
         return logger_->error("prepare_write_data: download_chunk failed");
@@ -1224,7 +1590,7 @@ int CloudfsControllerDedup::prepare_write_data(off_t offset, size_t w_size, uint
   {
     auto &chunk = chunks[i];
     // download chunk
-    auto ret = buffer_controller_->download_chunk(chunk.key_, op_fd, buffer_len, chunk.len_);
+    auto ret = fetch_chunk(chunk.key_, op_fd, buffer_len, chunk.len_);
     if (ret != 0)
     {
       return logger_->error("prepare_read_data: download_chunk failed");
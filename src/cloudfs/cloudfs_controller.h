@@ -15,6 +15,8 @@
 #include "chunk_splitter.h"
 #include "chunk_table.h"
 #include "cloudfs.h"
+#include "container_store.h"
+#include "metadata_cache.h"
 #include "util.h"
 #include "buffer_file.h"
 
@@ -55,6 +57,8 @@ protected:
   std::unordered_map<uint64_t, OpenFile> open_files_;       // open files
   std::shared_ptr<BufferFileController> buffer_controller_; // buffer file controller
   std::shared_ptr<ChunkTable> chunk_table_;                 // chunk table
+  MetadataCache metadata_cache_;                            // cached file metadata
+  static const size_t METADATA_CACHE_ENTRIES;               // cached inodes before clean ones are dropped
 
 public:
   /**
@@ -84,6 +88,18 @@ public:
    */
   int stat_file(const std::string &path, struct stat *stbuf);
 
+  /**
+   * Stat an entry while listing its directory
+   * Looks the entry up relative to the open directory and caches the result,
+   * so the 'getattr' calls following a listing are served from the cache.
+   * @param dir_path directory path
+   * @param dir_fd file descriptor of the open directory on the SSD
+   * @param name entry name
+   * @param stbuf stat buffer
+   * @return 0 on success, negative errno on failure
+   */
+  int stat_entry(const std::string &dir_path, int dir_fd, const std::string &name, struct stat *stbuf);
+
   /**
    * Handling 'create' fuse operation
    * This function won't open the file and return a file descriptor after creation
@@ -115,6 +131,20 @@ public:
    */
   virtual int read_file(const std::string &path, uint64_t fd, char *buf, size_t size, off_t offset) = 0;
 
+  /**
+   * Handling 'read_buf' fuse operation
+   * Makes the read range available in the buffer file, so FUSE can splice it
+   * to the kernel instead of copying it through a user buffer
+   * This fuction should be implemented by derived classes
+   * @param path file path
+   * @param fd file descriptor
+   * @param size size
+   * @param offset offset
+   * @param fd_offset returns the offset of the range in fd
+   * @return 0 on success, negative errno on failure
+   */
+  virtual int locate_read(const std::string &path, uint64_t fd, size_t size, off_t offset, off_t &fd_offset) = 0;
+
   /**
    * Handling 'write' fuse operation
    * This fuction should be implemented by derived classes
@@ -159,6 +189,66 @@ public:
    */
   virtual void destroy() = 0;
 
+  /**
+   * Handling 'fsync' fuse operation
+   * Writes back the cached size and syncs the buffer file
+   * @param path file path
+   * @param fd file descriptor
+   * @param datasync true to sync data only
+   * @return 0 on success, negative errno on failure
+   */
+  int fsync_file(const std::string &path, uint64_t fd, int datasync);
+
+  /**
+   * Write back all cached sizes
+   */
+  void flush_metadata();
+
+  /**
+   * Forget the cached attributes of a path and its parent directory
+   * Called after the path is changed
+   * @param path file path
+   */
+  void forget_attr(const std::string &path);
+
+  /**
+   * Forget the cached attributes of every hard link to the file of a path
+   * Called when its link count changes, before the path is unlinked
+   * @param path file path
+   */
+  void forget_links(const std::string &path);
+
+  /**
+   * Forget all cached attributes
+   * Called after changes that may affect any path, e.g. snapshot operations
+   */
+  void forget_attrs();
+
+  /**
+   * Write back and drop all cached metadata
+   * Called before files are replaced behind the cache, e.g. snapshot restore
+   */
+  void invalidate_metadata();
+
+  /**
+   * Check whether the kernel may keep the page cache of a newly opened file
+   * @param fd file descriptor of the buffer file
+   * @return true if the data is unchanged since the previous open
+   */
+  bool keep_cache(uint64_t fd);
+
+  /**
+   * Record a data change of an open file
+   * @param fd file descriptor of the buffer file
+   */
+  void bump_data_version(uint64_t fd);
+
+  /**
+   * Record a data change of a file
+   * @param path file path
+   */
+  void bump_data_version(const std::string &path);
+
   /**
    * Get buffer path of a file
    * @param path main file path
@@ -167,6 +257,15 @@ public:
    */
   int get_buffer_path(const std::string &path, std::string &buffer_path);
 
+  /**
+   * Read buffer path of a file from its xattr, bypassing the metadata cache
+   * Safe to call from other threads, cached sizes must be written back first
+   * @param path main file path
+   * @param buffer_path buffer file path
+   * @return 0 on success, negative errno on failure
+   */
+  static int read_buffer_path(const std::string &path, std::string &buffer_path);
+
   /**
    * Set buffer path of a file
    * @param path main file path
@@ -183,6 +282,15 @@ public:
    */
   int get_size(const std::string &path, off_t &size);
 
+  /**
+   * Read size of a file from its xattr, bypassing the metadata cache
+   * Safe to call from other threads, cached sizes must be written back first
+   * @param path buffer file path
+   * @param size file size
+   * @return 0 on success, negative errno on failure
+   */
+  static int read_size(const std::string &path, off_t &size);
+
   /**
    * Get size of a file
    * @param fd file descriptor of the buffer file
@@ -239,13 +347,41 @@ public:
    */
   int get_chunkinfo(const std::string &main_path, std::vector<Chunk> &chunks);
 
+  /**
+   * Fetch a chunk from cloud to a file
+   * @param key chunk key
+   * @param fd file descriptor
+   * @param offset offset in fd
+   * @param len length of the chunk
+   * @return 0 on success, negative errno on failure
+   */
+  virtual int fetch_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len);
+
+  /**
+   * Store a new chunk on cloud
+   * @param key chunk key
+   * @param fd file descriptor
+   * @param offset offset of the chunk in fd
+   * @param len length of the chunk
+   * @return 0 on success, negative errno on failure
+   */
+  virtual int store_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len);
+
+  /**
+   * Retire a chunk that is no longer used
+   * @param key chunk key
+   * @param location location of the chunk
+   * @return 0 on success, negative errno on failure
+   */
+  virtual int retire_chunk(const std::string &key, const ChunkLocation &location);
+
   /**
    * Get the index of the chunk that contains the given offset
    * @param chunks chunks list
    * @param offset file offset
-   * @return chunk index
+   * @return chunk index, -1 if the offset is past the last chunk
    */
-  int get_chunk_idx(const std::vector<Chunk> &chunks, off_t offset);
+  static int get_chunk_idx(const std::vector<Chunk> &chunks, off_t offset);
 
   /**
    * Set truncated attribute of a file
@@ -267,6 +403,24 @@ public:
    */
   int get_truncated(const std::string &path, bool &truncated);
 
+protected:
+  /**
+   * Replace the size in a stat result of a main file with its real size
+   * @param main_path main file path
+   * @param stbuf stat buffer
+   * @return 0 on success, negative errno on failure
+   */
+  int fill_size(const std::string &main_path, struct stat *stbuf);
+
+  /**
+   * Write back the cached size of an open file
+   * @param fd file descriptor of the buffer file
+   * @return 0 on success, negative errno on failure
+   */
+  int flush_metadata(uint64_t fd);
+
+public:
+
   /**
    * Get chunk table
    * @return chunk table
@@ -315,6 +469,18 @@ public:
    */
   int read_file(const std::string &path, uint64_t fd, char *buf, size_t size, off_t offset) override;
 
+  /**
+   * Handling 'read_buf' fuse operation
+   * implementation without deduplication
+   * @param path file path
+   * @param fd file descriptor
+   * @param size size
+   * @param offset offset
+   * @param fd_offset returns the offset of the range in fd
+   * @return 0 on success, negative errno on failure
+   */
+  int locate_read(const std::string &path, uint64_t fd, size_t size, off_t offset, off_t &fd_offset) override;
+
   /**
    * Handling 'write' fuse operation
    * implementation without deduplication
@@ -368,6 +534,8 @@ class CloudfsControllerDedup : public CloudfsController
 
   ChunkSplitter chunk_splitter_;        // chunk splitter
   static const size_t RECHUNK_BUF_SIZE; // rechunk buffer size
+  std::unique_ptr<ContainerStore> container_store_; // packs chunks into containers, null if every chunk is its own object
+  uint64_t compacted_checkpoints_;                  // chunk table checkpoints at the last compaction
 
 public:
   /**
@@ -407,6 +575,18 @@ public:
    */
   int read_file(const std::string &path, uint64_t fd, char *buf, size_t size, off_t offset) override;
 
+  /**
+   * Handling 'read_buf' fuse operation
+   * implementation with deduplication
+   * @param path file path
+   * @param fd file descriptor
+   * @param size size
+   * @param offset offset
+   * @param fd_offset returns the offset of the range in fd
+   * @return 0 on success, negative errno on failure
+   */
+  int locate_read(const std::string &path, uint64_t fd, size_t size, off_t offset, off_t &fd_offset) override;
+
   /**
    * Handling 'write' fuse operation
    * implementation with deduplication
@@ -451,6 +631,34 @@ public:
    */
   void destroy() override;
 
+  /**
+   * Fetch a chunk from cloud to a file, from its container if it is packed
+   * @param key chunk key
+   * @param fd file descriptor
+   * @param offset offset in fd
+   * @param len length of the chunk
+   * @return 0 on success, negative errno on failure
+   */
+  int fetch_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len) override;
+
+  /**
+   * Store a new chunk on cloud, packed into a container if enabled
+   * @param key chunk key
+   * @param fd file descriptor
+   * @param offset offset of the chunk in fd
+   * @param len length of the chunk
+   * @return 0 on success, negative errno on failure
+   */
+  int store_chunk(const std::string &key, uint64_t fd, off_t offset, size_t len) override;
+
+  /**
+   * Retire a chunk that is no longer used
+   * @param key chunk key
+   * @param location location of the chunk
+   * @return 0 on success, negative errno on failure
+   */
+  int retire_chunk(const std::string &key, const ChunkLocation &location) override;
+
 private:
   /**
    * Prepare data for read operation
@@ -473,4 +681,11 @@ private:
    * @return 0 on success, negative errno on failure
    */
   int prepare_write_data(off_t offset, size_t w_size, uint64_t fd, int &rechunk_start_idx, int &buffer_end_idx);
+
+  /**
+   * Retire dead containers and compact a mostly dead one
+   * Called after the chunk table is committed, only does the work once the
+   * chunk table has written a checkpoint since the last compaction
+   */
+  void compact_containers();
 };
@@ -0,0 +1,485 @@
+#include "container_store.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cloudapi.h"
+
+const uint32_t ContainerStore::TABLE_MAGIC = 0x54434643;  // "CFCT"
+const uint32_t ContainerStore::OBJECT_MAGIC = 0x4f434643; // "CFCO"
+const std::string ContainerStore::DIR_NAME = ".containers";
+const std::string ContainerStore::TABLE_FILE_NAME = "table";
+const std::string ContainerStore::STAGING_FILE_NAME = "open";
+const std::string ContainerStore::MANIFEST_FILE_NAME = "open.manifest";
+const std::string ContainerStore::SEAL_FILE_NAME = "seal";
+const std::string ContainerStore::COMPACT_FILE_NAME = "compact";
+
+/**
+ * Copy a range between two file descriptors
+ * @return 0 on success, -1 on failure
+ */
+static int copy_range(int from_fd, off_t from_offset, int to_fd,
+                      off_t to_offset, size_t len) {
+  char buffer[MEM_BUFFER_LEN];
+  size_t copied = 0;
+  while (copied < len) {
+    auto size = std::min(len - copied, (size_t)MEM_BUFFER_LEN);
+    auto ret = pread(from_fd, buffer, size, from_offset + copied);
+    if (ret != (ssize_t)size) {
+      return -1;
+    }
+    ret = pwrite(to_fd, buffer, size, to_offset + copied);
+    if (ret != (ssize_t)size) {
+      return -1;
+    }
+    copied += size;
+  }
+  return 0;
+}
+
+ContainerStore::ContainerStore(
+    const std::string &ssd_path, std::string bucket_name,
+    std::shared_ptr<DebugLogger> logger,
+    std::shared_ptr<BufferFileController> buffer_controller,
+    uint64_t container_size)
+    : bucket_name_(std::move(bucket_name)), root_(ssd_path + "/" + DIR_NAME),
+      logger_(std::move(logger)),
+      buffer_controller_(std::move(buffer_controller)),
+      container_size_(container_size), next_id_(1), open_id_(0), open_fd_(-1),
+      manifest_file_(NULL) {
+  if (mkdir(root_.c_str(), 0777) != 0 && errno != EEXIST) {
+    logger_->error("ContainerStore: create directory failed, path: " + root_);
+  }
+  load();
+  logger_->info("ContainerStore: container size " +
+                std::to_string(container_size_) + ", " +
+                std::to_string(containers_.size()) + " containers, " +
+                std::to_string(candidates_.size()) + " to compact");
+}
+
+ContainerStore::~ContainerStore() { close_container(); }
+
+bool ContainerStore::exists(const std::string &ssd_path) {
+  auto table_path = ssd_path + "/" + DIR_NAME + "/" + TABLE_FILE_NAME;
+  return access(table_path.c_str(), F_OK) == 0;
+}
+
+std::string ContainerStore::object_key(uint64_t id) {
+  return "container_" + std::to_string(id);
+}
+
+int ContainerStore::append(const std::string &key, uint64_t fd, off_t offset,
+                           size_t len, ChunkLocation &location) {
+  if (open_id_ != 0 && containers_[open_id_].total_ + len > UINT32_MAX) {
+    // offsets are 32-bit
+    auto ret = seal();
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  if (open_id_ == 0) {
+    auto ret = open_container();
+    if (ret != 0) {
+      return ret;
+    }
+  }
+
+  auto &container = containers_[open_id_];
+  if (copy_range(fd, offset, open_fd_, container.total_, len) != 0) {
+    return logger_->error("ContainerStore::append: copy chunk failed, key: " +
+                          key);
+  }
+
+  // the manifest entry follows the data, a torn entry is dropped at seal
+  uint32_t key_len = key.size();
+  uint32_t chunk_offset = container.total_;
+  uint32_t chunk_len = len;
+  fwrite(&key_len, sizeof(uint32_t), 1, manifest_file_);
+  fwrite(key.data(), sizeof(char), key_len, manifest_file_);
+  fwrite(&chunk_offset, sizeof(uint32_t), 1, manifest_file_);
+  fwrite(&chunk_len, sizeof(uint32_t), 1, manifest_file_);
+  fflush(manifest_file_);
+
+  location = ChunkLocation(open_id_, chunk_offset, chunk_len);
+  container.total_ += len;
+  container.live_ += len;
+
+  if (container.total_ >= container_size_) {
+    // the chunk is staged and readable either way, a failed seal keeps the
+    // container open and is retried by the next append or by flush()
+    seal();
+  }
+  return 0;
+}
+
+int ContainerStore::read(const std::string &key, const ChunkLocation &location,
+                         uint64_t fd, off_t offset) {
+  if (location.container_ == open_id_) {
+    // not uploaded yet, read from the staging file
+    if (copy_range(open_fd_, location.offset_, fd, offset, location.len_) !=
+        0) {
+      return logger_->error(
+          "ContainerStore::read: read staging file failed, key: " + key);
+    }
+    return 0;
+  }
+  return buffer_controller_->download_chunk_range(
+      key, object_key(location.container_), location.offset_, fd, offset,
+      location.len_);
+}
+
+void ContainerStore::release(const ChunkLocation &location) {
+  auto it = containers_.find(location.container_);
+  if (it == containers_.end()) {
+    logger_->error("ContainerStore::release: unknown container " +
+                   std::to_string(location.container_));
+    return;
+  }
+  auto &container = it->second;
+  if (container.live_ == 0) {
+    return;
+  }
+  container.live_ -= std::min<uint64_t>(container.live_, location.len_);
+  if (!container.sealed_) {
+    // the open container is checked when it is sealed
+    return;
+  }
+  if (container.live_ == 0) {
+    candidates_.erase(it->first);
+    dead_.push_back(it->first);
+  } else if (container.live_ * 2 < container.total_) {
+    candidates_.insert(it->first);
+  }
+}
+
+void ContainerStore::collect() {
+  if (dead_.empty()) {
+    return;
+  }
+  for (auto id : dead_) {
+    buffer_controller_->retire_object(object_key(id));
+    containers_.erase(id);
+  }
+  logger_->debug("ContainerStore: retired " + std::to_string(dead_.size()) +
+                 " containers");
+  dead_.clear();
+  persist();
+}
+
+int ContainerStore::compact(ChunkTable *chunk_table) {
+  collect();
+  if (candidates_.empty()) {
+    return 0;
+  }
+  auto id = *candidates_.begin();
+  candidates_.erase(candidates_.begin());
+
+  auto compact_path = root_ + "/" + COMPACT_FILE_NAME;
+  auto ret = buffer_controller_->download_file(object_key(id), compact_path);
+  if (ret != 0) {
+    return logger_->error("ContainerStore::compact: download container failed");
+  }
+  auto fd = open(compact_path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    return logger_->error("ContainerStore::compact: open container failed");
+  }
+
+  // read the trailer and the manifest
+  struct stat st;
+  uint64_t data_len = 0;
+  uint32_t trailer[2] = {0, 0};
+  const off_t trailer_size = sizeof(uint64_t) + sizeof(trailer);
+  if (fstat(fd, &st) != 0 || st.st_size < trailer_size ||
+      pread(fd, &data_len, sizeof(uint64_t), st.st_size - trailer_size) !=
+          (ssize_t)sizeof(uint64_t) ||
+      pread(fd, trailer, sizeof(trailer), st.st_size - sizeof(trailer)) !=
+          (ssize_t)sizeof(trailer) ||
+      trailer[1] != OBJECT_MAGIC ||
+      data_len > (uint64_t)(st.st_size - trailer_size)) {
+    close(fd);
+    remove(compact_path.c_str());
+    return logger_->error("ContainerStore::compact: bad container " +
+                          object_key(id));
+  }
+  std::string manifest(st.st_size - trailer_size - data_len, '\0');
+  pread(fd, &manifest[0], manifest.size(), data_len);
+
+  // move chunks that still live in this container
+  size_t pos = 0;
+  uint64_t moved = 0;
+  for (uint32_t i = 0; i < trailer[0]; i++) {
+    uint32_t key_len, chunk_offset, chunk_len;
+    if (pos + sizeof(uint32_t) > manifest.size()) {
+      break;
+    }
+    memcpy(&key_len, manifest.data() + pos, sizeof(uint32_t));
+    if (pos + sizeof(uint32_t) * 3 + key_len > manifest.size()) {
+      break;
+    }
+    pos += sizeof(uint32_t);
+    std::string key(manifest.data() + pos, key_len);
+    pos += key_len;
+    memcpy(&chunk_offset, manifest.data() + pos, sizeof(uint32_t));
+    pos += sizeof(uint32_t);
+    memcpy(&chunk_len, manifest.data() + pos, sizeof(uint32_t));
+    pos += sizeof(uint32_t);
+
+    ChunkLocation current;
+    if (!chunk_table->get_location(key, current) || current.container_ != id ||
+        current.offset_ != chunk_offset) {
+      continue; // dead or already moved
+    }
+    ChunkLocation location;
+    ret = append(key, fd, chunk_offset, chunk_len, location);
+    if (ret != 0) {
+      logger_->error("ContainerStore::compact: move chunk failed, key: " + key);
+      break;
+    }
+    chunk_table->set_location(key, location);
+    release(current);
+    moved += chunk_len;
+  }
+  close(fd);
+  remove(compact_path.c_str());
+
+  // the old container is only retired once the new locations are committed
+  if (!chunk_table->commit()) {
+    return logger_->error("ContainerStore::compact: commit chunk table failed");
+  }
+  collect();
+  logger_->info("ContainerStore: compacted " + object_key(id) + ", moved " +
+                std::to_string(moved) + " bytes");
+  return ret;
+}
+
+int ContainerStore::flush() {
+  auto ret = 0;
+  if (open_id_ != 0) {
+    ret = seal();
+  }
+  persist();
+  return ret;
+}
+
+int ContainerStore::open_container() {
+  auto id = next_id_++;
+  containers_[id] = Container();
+  open_id_ = id;
+  auto staging_path = root_ + "/" + STAGING_FILE_NAME;
+  auto manifest_path = root_ + "/" + MANIFEST_FILE_NAME;
+  open_fd_ = open(staging_path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0777);
+  manifest_file_ = fopen(manifest_path.c_str(), "w+");
+  if (open_fd_ == -1 || manifest_file_ == NULL) {
+    close_container();
+    containers_.erase(id);
+    return logger_->error("ContainerStore::open_container: open staging "
+                          "files failed");
+  }
+  // the id is never reused, even after a crash
+  persist();
+  return 0;
+}
+
+void ContainerStore::close_container() {
+  if (open_fd_ != -1) {
+    close(open_fd_);
+    open_fd_ = -1;
+  }
+  if (manifest_file_ != NULL) {
+    fclose(manifest_file_);
+    manifest_file_ = NULL;
+  }
+  open_id_ = 0;
+}
+
+int ContainerStore::seal() {
+  auto id = open_id_;
+  auto &container = containers_[id];
+  auto staging_path = root_ + "/" + STAGING_FILE_NAME;
+  auto manifest_path = root_ + "/" + MANIFEST_FILE_NAME;
+  auto seal_path = root_ + "/" + SEAL_FILE_NAME;
+
+  if (container.live_ == 0) {
+    // every chunk died before upload
+    close_container();
+    containers_.erase(id);
+    persist();
+    remove(staging_path.c_str());
+    remove(manifest_path.c_str());
+    return 0;
+  }
+
+  // keep complete manifest entries only
+  fflush(manifest_file_);
+  std::string manifest;
+  char buffer[MEM_BUFFER_LEN];
+  ssize_t read_size;
+  auto manifest_fd = fileno(manifest_file_);
+  off_t manifest_offset = 0;
+  while ((read_size = pread(manifest_fd, buffer, MEM_BUFFER_LEN,
+                            manifest_offset)) > 0) {
+    manifest.append(buffer, read_size);
+    manifest_offset += read_size;
+  }
+  size_t pos = 0;
+  uint32_t count = 0;
+  while (pos + sizeof(uint32_t) <= manifest.size()) {
+    uint32_t key_len;
+    memcpy(&key_len, manifest.data() + pos, sizeof(uint32_t));
+    auto entry_size = sizeof(uint32_t) * 3 + key_len;
+    if (pos + entry_size > manifest.size()) {
+      break;
+    }
+    pos += entry_size;
+    count++;
+  }
+  manifest.resize(pos);
+
+  // the object is built in a separate file, the staging files stay valid
+  // until the container table records the seal
+  auto seal_fd = open(seal_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0777);
+  if (seal_fd == -1) {
+    return logger_->error("ContainerStore::seal: create seal file failed");
+  }
+  uint64_t data_len = container.total_;
+  uint32_t trailer[2] = {count, OBJECT_MAGIC};
+  auto ret = copy_range(open_fd_, 0, seal_fd, 0, data_len);
+  if (ret == 0 &&
+      (pwrite(seal_fd, manifest.data(), manifest.size(), data_len) !=
+           (ssize_t)manifest.size() ||
+       pwrite(seal_fd, &data_len, sizeof(uint64_t),
+              data_len + manifest.size()) != (ssize_t)sizeof(uint64_t) ||
+       pwrite(seal_fd, trailer, sizeof(trailer),
+              data_len + manifest.size() + sizeof(uint64_t)) !=
+           (ssize_t)sizeof(trailer))) {
+    ret = -1;
+  }
+  close(seal_fd);
+  auto object_size =
+      data_len + manifest.size() + sizeof(uint64_t) + sizeof(trailer);
+  if (ret == 0) {
+    buffer_controller_->upload_file(object_key(id), seal_path, object_size);
+    if (cloud_get_status() != S3StatusOK) {
+      ret = -1;
+    }
+  }
+  remove(seal_path.c_str());
+  if (ret != 0) {
+    // the container stays open and is sealed again later
+    return logger_->error("ContainerStore::seal: upload " + object_key(id) +
+                          " failed");
+  }
+
+  container.sealed_ = true;
+  close_container();
+  if (container.live_ * 2 < container.total_) {
+    candidates_.insert(id);
+  }
+  persist();
+  remove(staging_path.c_str());
+  remove(manifest_path.c_str());
+  logger_->debug("ContainerStore: sealed " + object_key(id) + ", " +
+                 std::to_string(count) + " chunks, " +
+                 std::to_string(object_size) + " bytes");
+  return 0;
+}
+
+void ContainerStore::load() {
+  auto table_path = root_ + "/" + TABLE_FILE_NAME;
+  FILE *table_file = fopen(table_path.c_str(), "r");
+  if (table_file == NULL) {
+    return; // new store
+  }
+
+  uint32_t magic = 0;
+  uint64_t count = 0;
+  if (fread(&magic, sizeof(uint32_t), 1, table_file) != 1 ||
+      magic != TABLE_MAGIC ||
+      fread(&next_id_, sizeof(uint64_t), 1, table_file) != 1 ||
+      fread(&open_id_, sizeof(uint64_t), 1, table_file) != 1 ||
+      fread(&count, sizeof(uint64_t), 1, table_file) != 1) {
+    fclose(table_file);
+    logger_->error("ContainerStore: bad container table, path: " + table_path);
+    // container ids must never be reused, chunk locations point to them
+    throw std::runtime_error("Bad container table");
+  }
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t id;
+    Container container;
+    uint8_t sealed = 0;
+    fread(&id, sizeof(uint64_t), 1, table_file);
+    fread(&container.total_, sizeof(uint64_t), 1, table_file);
+    fread(&container.live_, sizeof(uint64_t), 1, table_file);
+    fread(&sealed, sizeof(uint8_t), 1, table_file);
+    container.sealed_ = sealed != 0;
+    containers_[id] = container;
+    if (!container.sealed_) {
+      continue;
+    }
+    if (container.live_ == 0) {
+      dead_.push_back(id);
+    } else if (container.live_ * 2 < container.total_) {
+      candidates_.insert(id);
+    }
+  }
+  fclose(table_file);
+
+  if (open_id_ == 0) {
+    return;
+  }
+
+  // reopen the open container, chunks appended after the last persist are
+  // counted as live, an over-count only delays its compaction
+  auto staging_path = root_ + "/" + STAGING_FILE_NAME;
+  auto manifest_path = root_ + "/" + MANIFEST_FILE_NAME;
+  open_fd_ = open(staging_path.c_str(), O_CREAT | O_RDWR, 0777);
+  manifest_file_ = fopen(manifest_path.c_str(), "a+");
+  struct stat st;
+  if (open_fd_ == -1 || manifest_file_ == NULL || fstat(open_fd_, &st) != 0) {
+    logger_->error("ContainerStore: reopen staging files failed");
+    close_container();
+    return;
+  }
+  auto &container = containers_[open_id_];
+  if ((uint64_t)st.st_size > container.total_) {
+    container.live_ += st.st_size - container.total_;
+    container.total_ = st.st_size;
+  }
+}
+
+void ContainerStore::persist() {
+  auto table_path = root_ + "/" + TABLE_FILE_NAME;
+  auto tmp_path = table_path + ".tmp";
+  FILE *table_file = fopen(tmp_path.c_str(), "w");
+  if (table_file == NULL) {
+    logger_->error("ContainerStore: open container table failed, path: " +
+                   tmp_path);
+    return;
+  }
+  uint64_t count = containers_.size();
+  fwrite(&TABLE_MAGIC, sizeof(uint32_t), 1, table_file);
+  fwrite(&next_id_, sizeof(uint64_t), 1, table_file);
+  fwrite(&open_id_, sizeof(uint64_t), 1, table_file);
+  fwrite(&count, sizeof(uint64_t), 1, table_file);
+  for (const auto &entry : containers_) {
+    uint8_t sealed = entry.second.sealed_;
+    fwrite(&entry.first, sizeof(uint64_t), 1, table_file);
+    fwrite(&entry.second.total_, sizeof(uint64_t), 1, table_file);
+    fwrite(&entry.second.live_, sizeof(uint64_t), 1, table_file);
+    fwrite(&sealed, sizeof(uint8_t), 1, table_file);
+  }
+  fflush(table_file);
+  fsync(fileno(table_file));
+  fclose(table_file);
+  if (rename(tmp_path.c_str(), table_path.c_str()) != 0) {
+    logger_->error("ContainerStore: rename container table failed, path: " +
+                   table_path);
+  }
+}
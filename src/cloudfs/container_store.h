@@ -0,0 +1,183 @@
+/**
+ * @file container_store.h
+ * @brief Packing of small chunks into large cloud container objects
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#include "buffer_file.h"
+#include "chunk_index.h"
+#include "chunk_table.h"
+#include "util.h"
+
+/**
+ * Packing of small chunks into large cloud container objects
+ *
+ * New chunks are appended to an open container staged on the SSD. Once the
+ * container reaches its target size it is sealed: a manifest of its chunks and
+ * a trailer are appended and it is uploaded as one object. Chunks are read
+ * back with ranged GETs. The store tracks the live bytes of every container,
+ * a container without live chunks is retired, and a sealed container that is
+ * mostly dead is compacted by moving its live chunks into the open container.
+ *
+ * Object layout: [chunk data][manifest entries][u64 data_len][u32 count]
+ * [u32 magic], a manifest entry is [u32 key_len][key][u32 offset][u32 len].
+ */
+class ContainerStore {
+
+  /**
+   * Container state
+   */
+  struct Container {
+    uint64_t total_; // bytes of chunk data in the container
+    uint64_t live_;  // bytes of chunk data still in use, may over-count after
+                     // a crash
+    bool sealed_;    // true if the container has been uploaded
+
+    Container() : total_(0), live_(0), sealed_(false) {}
+  };
+
+  static const uint32_t TABLE_MAGIC;  // magic of the container table file
+  static const uint32_t OBJECT_MAGIC; // magic of the container object trailer
+  static const std::string TABLE_FILE_NAME;    // container table file
+  static const std::string STAGING_FILE_NAME;  // open container data
+  static const std::string MANIFEST_FILE_NAME; // open container manifest
+  static const std::string SEAL_FILE_NAME;     // container being uploaded
+  static const std::string COMPACT_FILE_NAME;  // container being compacted
+
+  std::string bucket_name_;             // bucket name
+  std::string root_;                    // directory of the store on the SSD
+  std::shared_ptr<DebugLogger> logger_; // logger
+  std::shared_ptr<BufferFileController> buffer_controller_; // buffer controller
+  uint64_t container_size_; // target size of a container
+
+  std::map<uint64_t, Container> containers_; // containers by id
+  uint64_t next_id_;         // id of the next container
+  uint64_t open_id_;         // id of the open container, 0 if none
+  int open_fd_;              // file descriptor of the staging file
+  FILE *manifest_file_;      // manifest of the open container
+  std::vector<uint64_t> dead_;   // sealed containers without live chunks
+  std::set<uint64_t> candidates_; // sealed containers worth compacting
+
+public:
+  static const std::string DIR_NAME; // name of the store directory on the SSD
+
+  /**
+   * Constructor, loads the container table and reopens the open container
+   * @param ssd_path path of the SSD
+   * @param bucket_name bucket name
+   * @param logger logger
+   * @param buffer_controller buffer controller
+   * @param container_size target size of a container
+   */
+  ContainerStore(const std::string &ssd_path, std::string bucket_name,
+                 std::shared_ptr<DebugLogger> logger,
+                 std::shared_ptr<BufferFileController> buffer_controller,
+                 uint64_t container_size);
+
+  /**
+   * Destructor
+   */
+  ~ContainerStore();
+
+  /**
+   * Check whether a container store exists on the SSD
+   * @param ssd_path path of the SSD
+   * @return true if a container table exists
+   */
+  static bool exists(const std::string &ssd_path);
+
+  /**
+   * Get the object key of a container
+   * @param id container id
+   * @return object key
+   */
+  static std::string object_key(uint64_t id);
+
+  /**
+   * Append a chunk to the open container
+   * @param key chunk key
+   * @param fd file descriptor holding the chunk
+   * @param offset offset of the chunk in fd
+   * @param len length of the chunk
+   * @param location returns the location of the chunk
+   * @return 0 on success, negative errno if the chunk was not appended
+   */
+  int append(const std::string &key, uint64_t fd, off_t offset, size_t len,
+             ChunkLocation &location);
+
+  /**
+   * Read a chunk to a buffer file
+   * @param key chunk key
+   * @param location location of the chunk
+   * @param fd file descriptor
+   * @param offset offset in fd
+   * @return 0 on success, negative errno on failure
+   */
+  int read(const std::string &key, const ChunkLocation &location, uint64_t fd,
+           off_t offset);
+
+  /**
+   * Release a dead chunk
+   * The container is retired by collect() once none of its chunks is live
+   * @param location location of the chunk
+   */
+  void release(const ChunkLocation &location);
+
+  /**
+   * Retire containers without live chunks
+   * Must only be called after the chunk table has committed the releases
+   */
+  void collect();
+
+  /**
+   * Retire dead containers and compact one mostly dead container
+   * Must only be called after the chunk table has been committed
+   * @param chunk_table chunk table holding the chunk locations
+   * @return 0 on success, negative errno on failure
+   */
+  int compact(ChunkTable *chunk_table);
+
+  /**
+   * Seal the open container and persist the container table
+   * @return 0 on success, negative errno on failure
+   */
+  int flush();
+
+private:
+  /**
+   * Open a new container
+   * @return 0 on success, negative errno on failure
+   */
+  int open_container();
+
+  /**
+   * Close the files of the open container
+   */
+  void close_container();
+
+  /**
+   * Upload the open container
+   * @return 0 on success, negative errno on failure
+   */
+  int seal();
+
+  /**
+   * Load the container table
+   */
+  void load();
+
+  /**
+   * Persist the container table
+   */
+  void persist();
+};
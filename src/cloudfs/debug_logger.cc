@@ -0,0 +1,105 @@
+#include "debug_logger.h"
+
+#include <chrono>
+#include <cstring>
+
+static const std::chrono::milliseconds DRAIN_INTERVAL(10); // idle poll period
+
+const size_t DebugLogger::SLOT_SIZE; // bound by reference in std::min
+
+DebugLogger::DebugLogger(const std::string &log_path, LogLevel level)
+    : level_(level), ring_(new Slot[RING_SIZE]), head_(0), tail_(0),
+      stop_(false) {
+  file_ = fopen(log_path.c_str(), "w");
+  for (size_t i = 0; i < RING_SIZE; i++) {
+    ring_[i].seq_.store(i, std::memory_order_relaxed);
+  }
+  drainer_ = std::thread(&DebugLogger::run, this);
+}
+
+DebugLogger::~DebugLogger() {
+  stop_.store(true);
+  drainer_.join();
+  drain();
+  fclose(file_);
+}
+
+int DebugLogger::error(const std::string &error_str) {
+  int err = errno;
+  if (enabled(LOG_LEVEL_ERROR)) {
+    push("[CloudFS Error] ", error_str + ", errno = " + std::to_string(err));
+  }
+  errno = err;
+  return -err;
+}
+
+void DebugLogger::info(const std::string &info_str) {
+  if (enabled(LOG_LEVEL_INFO)) {
+    push("[CloudFS Info] ", info_str);
+  }
+}
+
+void DebugLogger::debug(const std::string &debug_str) {
+  if (enabled(LOG_LEVEL_DEBUG)) {
+    push("[CloudFS Debug] ", debug_str);
+  }
+}
+
+void DebugLogger::push(const char *prefix, const std::string &msg) {
+  // claim a slot, multiple producers race on head_
+  auto pos = head_.load(std::memory_order_relaxed);
+  Slot *slot;
+  for (;;) {
+    slot = &ring_[pos & (RING_SIZE - 1)];
+    auto seq = slot->seq_.load(std::memory_order_acquire);
+    auto diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+    if (diff == 0) {
+      if (head_.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // ring is full, wait for the drainer
+      wake_.notify_one();
+      std::this_thread::yield();
+      pos = head_.load(std::memory_order_relaxed);
+    } else {
+      pos = head_.load(std::memory_order_relaxed);
+    }
+  }
+
+  auto prefix_len = std::min(strlen(prefix), SLOT_SIZE);
+  auto msg_len = std::min(msg.size(), SLOT_SIZE - prefix_len);
+  memcpy(slot->msg_, prefix, prefix_len);
+  memcpy(slot->msg_ + prefix_len, msg.data(), msg_len);
+  slot->len_ = prefix_len + msg_len;
+  slot->seq_.store(pos + 1, std::memory_order_release);
+}
+
+size_t DebugLogger::drain() {
+  size_t count = 0;
+  for (;;) {
+    auto &slot = ring_[tail_ & (RING_SIZE - 1)];
+    if (slot.seq_.load(std::memory_order_acquire) != tail_ + 1) {
+      break; // empty, or the next message is still being copied
+    }
+    fwrite(slot.msg_, 1, slot.len_, file_);
+    fputc('\n', file_);
+    slot.seq_.store(tail_ + RING_SIZE, std::memory_order_release);
+    tail_++;
+    count++;
+  }
+  if (count > 0) {
+    fflush(file_);
+  }
+  return count;
+}
+
+void DebugLogger::run() {
+  while (!stop_.load()) {
+    if (drain() == 0) {
+      std::unique_lock<std::mutex> lock(wake_mutex_);
+      wake_.wait_for(lock, DRAIN_INTERVAL);
+    }
+  }
+}
@@ -0,0 +1,182 @@
+/**
+ * @file debug_logger.h
+ * @brief Asynchronous leveled logger
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * Log levels, a logger prints messages at or above its level
+ */
+enum LogLevel {
+  LOG_LEVEL_DEBUG = 0,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_ERROR,
+  LOG_LEVEL_OFF
+};
+
+/**
+ * Debug logger
+ *
+ * Messages below the log level are dropped before they are formatted. The
+ * variadic overloads format their arguments only when the level is enabled,
+ * so hot paths should pass pieces instead of building strings:
+ * logger->debug("read_file: ", path, ", size ", size).
+ *
+ * Enabled messages are copied into a lock-free ring buffer, and a background
+ * thread writes them to the log file. Producers wake the writer and wait when
+ * the ring is full, messages are never dropped. Overlong messages are
+ * truncated.
+ */
+class DebugLogger {
+
+  static const size_t RING_SIZE = 4096; // number of slots, a power of 2
+  static const size_t SLOT_SIZE = 512;  // maximum message length
+
+  /**
+   * Ring buffer slot
+   */
+  struct Slot {
+    std::atomic<size_t> seq_; // position the slot is ready for
+    size_t len_;              // message length
+    char msg_[SLOT_SIZE];     // message
+  };
+
+  /*
+   * File pointer to the log file, written by the drainer only
+   */
+  FILE *file_;
+
+  LogLevel level_;                // minimum level printed
+  std::unique_ptr<Slot[]> ring_;  // ring buffer of pending messages
+  std::atomic<size_t> head_;      // next position to write
+  size_t tail_;                   // next position to drain, drainer only
+  std::atomic<bool> stop_;        // true when the drainer should exit
+  std::mutex wake_mutex_;         // mutex of wake_
+  std::condition_variable wake_;  // wakes the idle drainer when the ring fills
+  std::thread drainer_;           // background writer
+
+public:
+  /**
+   * Constructor, opens the log file and starts the drainer
+   * @param log_path path of the log file
+   * @param level minimum level printed
+   */
+  DebugLogger(const std::string &log_path, LogLevel level = LOG_LEVEL_DEBUG);
+
+  /**
+   * Destructor, writes the pending messages and closes the log file
+   */
+  ~DebugLogger();
+
+  /**
+   * Check whether a level is printed
+   * @param level log level
+   * @return true if messages at the level are printed
+   */
+  bool enabled(LogLevel level) const { return level >= level_; }
+
+  /**
+   * Print error message to the log file
+   * @param error_str The error message to print
+   * @return negative errno on failure, 0 on success
+   */
+  int error(const std::string &error_str);
+
+  /**
+   * Print error message built from the arguments to the log file
+   * @param args pieces of the message
+   * @return negative errno on failure, 0 on success
+   */
+  template <typename... Args> int error(const Args &...args) {
+    int err = errno;
+    if (enabled(LOG_LEVEL_ERROR)) {
+      std::string msg;
+      format(msg, args...);
+      error(msg);
+    }
+    errno = err;
+    return -err;
+  }
+
+  /**
+   * Print info message to the log file
+   * @param info_str The info message to print
+   */
+  void info(const std::string &info_str);
+
+  /**
+   * Print info message built from the arguments to the log file
+   * @param args pieces of the message
+   */
+  template <typename... Args> void info(const Args &...args) {
+    if (enabled(LOG_LEVEL_INFO)) {
+      std::string msg;
+      format(msg, args...);
+      info(msg);
+    }
+  }
+
+  /**
+   * Print debug message to the log file
+   * @param debug_str The debug message to print
+   */
+  void debug(const std::string &debug_str);
+
+  /**
+   * Print debug message built from the arguments to the log file
+   * @param args pieces of the message
+   */
+  template <typename... Args> void debug(const Args &...args) {
+    if (enabled(LOG_LEVEL_DEBUG)) {
+      std::string msg;
+      format(msg, args...);
+      debug(msg);
+    }
+  }
+
+private:
+  /**
+   * Queue a message for the drainer
+   * @param prefix level prefix
+   * @param msg message
+   */
+  void push(const char *prefix, const std::string &msg);
+
+  /**
+   * Write queued messages to the log file
+   * @return number of messages written
+   */
+  size_t drain();
+
+  /**
+   * Drainer thread body
+   */
+  void run();
+
+  static void format(std::string &) {}
+
+  template <typename T, typename... Args>
+  static void format(std::string &out, const T &first, const Args &...rest) {
+    append(out, first);
+    format(out, rest...);
+  }
+
+  static void append(std::string &out, const std::string &s) { out += s; }
+  static void append(std::string &out, const char *s) { out += s; }
+  static void append(std::string &out, char c) { out += c; }
+  template <typename T> static void append(std::string &out, const T &v) {
+    out += std::to_string(v);
+  }
+};
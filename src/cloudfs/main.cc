@@ -4,6 +4,8 @@
 #include <string.h>
 #include <strings.h>
 #include "cloudfs.h"
+#include "debug_logger.h"
+#include "snapshot_stream.h"
 
 
 static void usageExit(FILE *out)
@@ -14,7 +16,8 @@ static void usageExit(FILE *out)
 "   -s/--ssd-path        :  The mount directory of SSD disk\n"
 "   -f/--fuse-path       :  The directory where cloudfs mounts\n"
 "   -h/--hostname        :  The hostname of S3 server, e.g. (localhost,"
-                            "localhost:80)\n"
+                            "localhost:80), or sim:<dir>[,latency=<ms>,...]"
+                            " for the simulated backend of cloudapi_sim.h\n"
 "   -a/--ssd-size        :  The size of SSD disk(in KB)\n"
 "   -t/--threshold       :  The maximum size of files in SSD(in KB)\n"
 "   -/--no-dedup        :  Turn off deduplication\n"
@@ -23,6 +26,24 @@ static void usageExit(FILE *out)
 "   -/--max-seg-size    :  Desired maximum segment size for deduplication(in KB)\n"
 "   -/--rabin-window-size: Size of the internal rolling window used for"
 "                           calculating Rabin fingerprint(in bytes)\n"
+"   -/--gc-grace        :  Delete dead chunks in background after this many"
+"                           seconds(-1 deletes them inline)\n"
+"   -/--gc-rate         :  Maximum background chunk deletions per second"
+"                           (0 for unlimited)\n"
+"   -/--container-size  :  Pack new chunks into cloud containers of this size"
+"                           (in KB, 0 stores each chunk as its own object)\n"
+"   -/--attr-timeout    :  Seconds the kernel caches file attributes\n"
+"   -/--entry-timeout   :  Seconds the kernel caches name lookups\n"
+"   -/--max-io-size     :  Largest read/write request from the kernel\n"
+"                           (in KB, 0 keeps the FUSE default)\n"
+"   -/--direct-io       :  Bypass the kernel page cache for file data\n"
+"   -/--log-level       :  Minimum level logged: debug, info, error or off\n"
+"   -/--snapshot-threads:  Threads walking the SSD and compressing a"
+"                           snapshot (0 for one per core)\n"
+"   -/--snapshot-compression: Compression of snapshots: zstd or gzip"
+"                           (zstd if libarchive supports it)\n"
+"   -/--snapshot-level  :  Compression level of snapshots"
+"                           (0 for the default of the compression)\n"
 "\n"
 " Commands (with <required parameters> and [optional parameters]) :\n"
 "\n");
@@ -42,6 +63,17 @@ static struct option longOptionsG[] =
     { "min-seg-size",		required_argument,			0,  'm' },
     { "max-seg-size",		required_argument,			0,  'M' },
     { "cache-size",		required_argument,			0,  'c' },
+    { "gc-grace",		required_argument,			0,  'g' },
+    { "gc-rate",		required_argument,			0,  'R' },
+    { "container-size",	required_argument,			0,  'C' },
+    { "attr-timeout",		required_argument,			0,  'A' },
+    { "entry-timeout",		required_argument,			0,  'E' },
+    { "max-io-size",		required_argument,			0,  'I' },
+    { "direct-io",		no_argument,				0,  'D' },
+    { "log-level",		required_argument,			0,  'L' },
+    { "snapshot-threads",	required_argument,			0,  'T' },
+    { "snapshot-compression",	required_argument,			0,  'z' },
+    { "snapshot-level",	required_argument,			0,  'Z' },
     { 0,					0,							0,   0	}
 };
 
@@ -60,6 +92,19 @@ static void parse_arguments(int argc, char* argv[],
     state->max_seg_size = 6144;
     state->rabin_window_size = 48;
     state->cache_size = 0; // Default: no cache.
+    state->gc_grace = -1;  // Default: delete dead chunks inline.
+    state->gc_rate = 0;
+    state->container_size = 0; // Default: no chunk containers.
+    state->attr_timeout = -1;  // Default: FUSE default timeouts.
+    state->entry_timeout = -1;
+    state->max_io_size = 0;    // Default: FUSE default request sizes.
+    state->direct_io = 0;      // Default: use the kernel page cache.
+    state->log_level = LOG_LEVEL_INFO; // Default: no debug messages.
+    state->snapshot_threads = 0; // Default: one per core.
+    // Default: zstd if the linked libarchive can write it.
+    strcpy(state->snapshot_compression,
+           SnapshotStream::zstd_supported() ? "zstd" : "gzip");
+    state->snapshot_level = 0;   // Default: level of the compression.
 
     // Parse args
     while (1) {
@@ -105,6 +150,58 @@ static void parse_arguments(int argc, char* argv[],
        case 'w': 
             state->rabin_window_size = atoi(optarg);
             break;
+       case 'g':
+            state->gc_grace = atoi(optarg);
+            break;
+       case 'R':
+            state->gc_rate = atoi(optarg);
+            break;
+       case 'C':
+            state->container_size = atoi(optarg)*1024;
+            break;
+       case 'A':
+            state->attr_timeout = atof(optarg);
+            break;
+       case 'E':
+            state->entry_timeout = atof(optarg);
+            break;
+       case 'I':
+            state->max_io_size = atoi(optarg)*1024;
+            break;
+       case 'D':
+            state->direct_io = 1;
+            break;
+       case 'L':
+            if (strcmp(optarg, "debug") == 0)
+              state->log_level = LOG_LEVEL_DEBUG;
+            else if (strcmp(optarg, "info") == 0)
+              state->log_level = LOG_LEVEL_INFO;
+            else if (strcmp(optarg, "error") == 0)
+              state->log_level = LOG_LEVEL_ERROR;
+            else if (strcmp(optarg, "off") == 0)
+              state->log_level = LOG_LEVEL_OFF;
+            else {
+              fprintf(stderr, "\nERROR: Unknown log level: %s\n", optarg);
+              usageExit(stderr);
+            }
+            break;
+       case 'T':
+            state->snapshot_threads = atoi(optarg);
+            break;
+       case 'z':
+            if (strcmp(optarg, "zstd") != 0 && strcmp(optarg, "gzip") != 0) {
+              fprintf(stderr, "\nERROR: Unknown snapshot compression: %s\n", optarg);
+              usageExit(stderr);
+            }
+            if (strcmp(optarg, "zstd") == 0 && !SnapshotStream::zstd_supported()) {
+              fprintf(stderr, "\nERROR: libarchive does not support zstd, use gzip\n");
+              usageExit(stderr);
+            }
+            strcpy(state->snapshot_compression, optarg);
+            break;
+       case 'Z':
+            state->snapshot_level = atoi(optarg);
+            break;
         default:
             fprintf(stderr, "\nERROR: Unknown option: -%c\n", c);
             // Usage exit
@@ -0,0 +1,226 @@
+#include "metadata_cache.h"
+
+MetadataCache::MetadataCache(size_t capacity) : capacity_(capacity) {}
+
+bool MetadataCache::get_buffer_path(const std::string &main_path,
+                                    std::string &buffer_path) {
+  auto cached = buffer_paths_.find(main_path);
+  if (cached == NULL) {
+    return false;
+  }
+  buffer_path = *cached;
+  return true;
+}
+
+void MetadataCache::set_buffer_path(const std::string &main_path,
+                                    const std::string &buffer_path) {
+  buffer_paths_[main_path] = buffer_path;
+  // reloaded from xattrs on demand
+  buffer_paths_.evict(
+      capacity_, [](const std::string &) { return false; },
+      [](const std::string &, const std::string &) {});
+}
+
+bool MetadataCache::get_open_path(uint64_t fd, std::string &buffer_path) {
+  auto it = open_fds_.find(fd);
+  if (it == open_fds_.end()) {
+    return false;
+  }
+  buffer_path = it->second;
+  return true;
+}
+
+void MetadataCache::open(uint64_t fd, const std::string &buffer_path) {
+  entry(buffer_path).open_count_++;
+  open_fds_[fd] = buffer_path;
+}
+
+void MetadataCache::close(uint64_t fd) {
+  auto it = open_fds_.find(fd);
+  if (it == open_fds_.end()) {
+    return;
+  }
+  auto inode = inodes_.find(it->second);
+  if (inode != NULL && inode->open_count_ > 0) {
+    inode->open_count_--;
+  }
+  open_fds_.erase(it);
+}
+
+bool MetadataCache::get_size(const std::string &buffer_path, off_t &size) {
+  auto inode = inodes_.find(buffer_path);
+  if (inode == NULL || !inode->has_size_) {
+    return false;
+  }
+  size = inode->size_;
+  return true;
+}
+
+void MetadataCache::set_size(const std::string &buffer_path, off_t size,
+                             bool dirty) {
+  auto &inode = entry(buffer_path);
+  inode.size_ = size;
+  inode.has_size_ = true;
+  inode.size_dirty_ = dirty;
+}
+
+bool MetadataCache::get_is_on_cloud(const std::string &buffer_path,
+                                    bool &is_on_cloud) {
+  auto inode = inodes_.find(buffer_path);
+  if (inode == NULL || !inode->has_is_on_cloud_) {
+    return false;
+  }
+  is_on_cloud = inode->is_on_cloud_;
+  return true;
+}
+
+void MetadataCache::set_is_on_cloud(const std::string &buffer_path,
+                                    bool is_on_cloud) {
+  auto &inode = entry(buffer_path);
+  inode.is_on_cloud_ = is_on_cloud;
+  inode.has_is_on_cloud_ = true;
+}
+
+bool MetadataCache::get_truncated(const std::string &buffer_path,
+                                  bool &truncated) {
+  auto inode = inodes_.find(buffer_path);
+  if (inode == NULL || !inode->has_truncated_) {
+    return false;
+  }
+  truncated = inode->truncated_;
+  return true;
+}
+
+void MetadataCache::set_truncated(const std::string &buffer_path,
+                                  bool truncated) {
+  auto &inode = entry(buffer_path);
+  inode.truncated_ = truncated;
+  inode.has_truncated_ = true;
+}
+
+bool MetadataCache::take_dirty(const std::string &buffer_path, off_t &size) {
+  auto inode = inodes_.find(buffer_path);
+  if (inode == NULL || !inode->size_dirty_) {
+    return false;
+  }
+  inode->size_dirty_ = false;
+  size = inode->size_;
+  return true;
+}
+
+void MetadataCache::take_all_dirty(
+    std::vector<std::pair<std::string, off_t>> &dirty) {
+  for (auto &it : inodes_) {
+    if (it.second.size_dirty_) {
+      it.second.size_dirty_ = false;
+      dirty.emplace_back(it.first, it.second.size_);
+    }
+  }
+}
+
+void MetadataCache::bump_version(const std::string &buffer_path) {
+  entry(buffer_path).data_version_++;
+}
+
+bool MetadataCache::keep_cache(const std::string &buffer_path) {
+  auto &inode = entry(buffer_path);
+  auto keep = inode.cached_version_ == inode.data_version_;
+  inode.cached_version_ = inode.data_version_;
+  return keep;
+}
+
+void MetadataCache::forget_path(const std::string &main_path) {
+  buffer_paths_.erase(main_path);
+}
+
+void MetadataCache::forget_inode(const std::string &buffer_path) {
+  inodes_.erase(buffer_path);
+}
+
+bool MetadataCache::get_attr(const std::string &main_path,
+                             struct stat *stbuf) {
+  auto attr = attrs_.find(main_path);
+  if (attr == NULL) {
+    return false;
+  }
+  *stbuf = *attr;
+  return true;
+}
+
+void MetadataCache::set_attr(const std::string &main_path,
+                             const struct stat &stbuf) {
+  auto &attr = attrs_[main_path];
+  if (attr.st_ino != stbuf.st_ino) {
+    unlink_attr(main_path, attr.st_ino); // a new file under the same path
+  }
+  attr = stbuf;
+  attr_links_[stbuf.st_ino].insert(main_path);
+
+  // reloaded by lstat on demand
+  attrs_.evict(
+      capacity_, [](const struct stat &) { return false; },
+      [this](const std::string &path, const struct stat &dropped) {
+        unlink_attr(path, dropped.st_ino);
+      });
+}
+
+void MetadataCache::forget_attr(const std::string &main_path) {
+  auto attr = attrs_.find(main_path);
+  if (attr == NULL) {
+    return;
+  }
+  unlink_attr(main_path, attr->st_ino);
+  attrs_.erase(main_path);
+}
+
+void MetadataCache::forget_inode_attrs(ino_t ino) {
+  auto it = attr_links_.find(ino);
+  if (it == attr_links_.end()) {
+    return;
+  }
+  for (const auto &main_path : it->second) {
+    attrs_.erase(main_path);
+  }
+  attr_links_.erase(it);
+}
+
+void MetadataCache::clear_attrs() {
+  attrs_.clear();
+  attr_links_.clear();
+}
+
+void MetadataCache::unlink_attr(const std::string &main_path, ino_t ino) {
+  auto it = attr_links_.find(ino);
+  if (it == attr_links_.end()) {
+    return;
+  }
+  it->second.erase(main_path);
+  if (it->second.empty()) {
+    attr_links_.erase(it);
+  }
+}
+
+void MetadataCache::clear() {
+  buffer_paths_.clear();
+  inodes_.clear();
+  clear_attrs();
+
+  // open files stay open, only their open counts are kept
+  for (const auto &open_fd : open_fds_) {
+    inodes_[open_fd.second].open_count_++;
+  }
+}
+
+MetadataCache::Inode &MetadataCache::entry(const std::string &buffer_path) {
+  auto &inode = inodes_[buffer_path];
+  // clean entries of closed files are reloaded from xattrs, the new entry is
+  // the most recently used one and kept
+  inodes_.evict(
+      capacity_,
+      [&inode](const Inode &cached) {
+        return &cached == &inode || cached.size_dirty_ ||
+               cached.open_count_ > 0;
+      },
+      [](const std::string &, const Inode &) {});
+  return inode;
+}
@@ -0,0 +1,349 @@
+/**
+ * @file metadata_cache.h
+ * @brief In-memory cache of per-inode file metadata
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/**
+ * In-memory cache of per-inode file metadata
+ *
+ * CloudFS keeps file metadata in xattrs: the buffer path, cloud residency and
+ * truncated flag on the main file, the real size on the buffer file. The cache
+ * maps a main path to its buffer path, and a buffer path (one per inode, shared
+ * by hard links) to its metadata, so data operations need no xattr syscalls.
+ *
+ * Sizes set through an open file are written back when the file is closed or
+ * synced, all other updates are written through by the caller.
+ *
+ * The lstat results of main paths are cached for getattr as well, callers
+ * forget them whenever a path or its directory is changed. They are indexed
+ * by inode number, so the other hard links of a file can be forgotten when
+ * its link count changes.
+ *
+ * A data version per inode tells whether the kernel page cache filled by the
+ * previous open is still valid, a dropped entry counts as changed.
+ *
+ * Every map keeps at most capacity entries and drops the least recently used
+ * ones, inodes of open files and dirty sizes are kept.
+ */
+class MetadataCache {
+
+  /**
+   * Map of paths to values in least recently used order
+   */
+  template <typename Value> class LruMap {
+    typedef std::list<std::pair<std::string, Value>> List;
+
+    List list_; // entries, most recently used first
+    std::unordered_map<std::string, typename List::iterator> map_; // key to
+                                                                   // entry
+
+  public:
+    typedef typename List::iterator iterator;
+
+    iterator begin() { return list_.begin(); }
+    iterator end() { return list_.end(); }
+    size_t size() const { return map_.size(); }
+
+    /**
+     * Look up a key and mark it as recently used
+     * @param key key
+     * @return the value, NULL on miss
+     */
+    Value *find(const std::string &key) {
+      auto it = map_.find(key);
+      if (it == map_.end()) {
+        return NULL;
+      }
+      list_.splice(list_.begin(), list_, it->second);
+      return &it->second->second;
+    }
+
+    /**
+     * Get or create the value of a key and mark it as recently used
+     * @param key key
+     * @return the value
+     */
+    Value &operator[](const std::string &key) {
+      auto value = find(key);
+      if (value != NULL) {
+        return *value;
+      }
+      list_.emplace_front(key, Value());
+      map_[key] = list_.begin();
+      return list_.front().second;
+    }
+
+    /**
+     * Remove a key
+     * @param key key
+     */
+    void erase(const std::string &key) {
+      auto it = map_.find(key);
+      if (it == map_.end()) {
+        return;
+      }
+      list_.erase(it->second);
+      map_.erase(it);
+    }
+
+    /**
+     * Drop the least recently used entries beyond a capacity
+     * @param capacity maximum number of entries
+     * @param pinned tells which entries must be kept, they are moved to the
+     * front
+     * @param dropped called on every dropped entry
+     */
+    template <typename Pinned, typename Dropped>
+    void evict(size_t capacity, const Pinned &pinned, const Dropped &dropped) {
+      for (auto checked = map_.size(); map_.size() > capacity && checked > 0;
+           checked--) {
+        auto last = std::prev(list_.end());
+        if (pinned(last->second)) {
+          list_.splice(list_.begin(), list_, last);
+          continue;
+        }
+        dropped(last->first, last->second);
+        map_.erase(last->first);
+        list_.erase(last);
+      }
+    }
+
+    /**
+     * Remove all entries
+     */
+    void clear() {
+      list_.clear();
+      map_.clear();
+    }
+  };
+
+  /**
+   * Cached metadata of an inode
+   */
+  struct Inode {
+    off_t size_;       // real size of the file
+    bool is_on_cloud_; // true if the file is stored on cloud
+    bool truncated_;   // true if the file has been truncated after last write
+    bool has_size_;        // size_ is valid
+    bool has_is_on_cloud_; // is_on_cloud_ is valid
+    bool has_truncated_;   // truncated_ is valid
+    bool size_dirty_;      // size_ has not been written back
+    int open_count_;       // number of open file descriptors
+    uint64_t data_version_;   // bumped whenever the data changes
+    uint64_t cached_version_; // data version the kernel page cache holds,
+                              // 0 if unknown
+
+    Inode()
+        : size_(0), is_on_cloud_(false), truncated_(false), has_size_(false),
+          has_is_on_cloud_(false), has_truncated_(false), size_dirty_(false),
+          open_count_(0), data_version_(1), cached_version_(0) {}
+  };
+
+  LruMap<std::string> buffer_paths_; // main path to buffer path
+  LruMap<Inode> inodes_;             // buffer path to metadata
+  std::unordered_map<uint64_t, std::string>
+      open_fds_;               // open buffer file descriptor to buffer path
+  LruMap<struct stat> attrs_;  // main path to its lstat result
+  std::unordered_map<ino_t, std::unordered_set<std::string>>
+      attr_links_;             // inode number to the main paths in attrs_
+  size_t capacity_;            // maximum entries of every map
+
+public:
+  /**
+   * Constructor
+   * @param capacity maximum entries of every map
+   */
+  explicit MetadataCache(size_t capacity);
+
+  /**
+   * Get the cached buffer path of a main file
+   * @param main_path main file path
+   * @param buffer_path returns the buffer path
+   * @return true on hit
+   */
+  bool get_buffer_path(const std::string &main_path, std::string &buffer_path);
+
+  /**
+   * Cache the buffer path of a main file
+   * @param main_path main file path
+   * @param buffer_path buffer path
+   */
+  void set_buffer_path(const std::string &main_path,
+                       const std::string &buffer_path);
+
+  /**
+   * Get the buffer path of an open buffer file descriptor
+   * @param fd file descriptor
+   * @param buffer_path returns the buffer path
+   * @return true if the descriptor is bound
+   */
+  bool get_open_path(uint64_t fd, std::string &buffer_path);
+
+  /**
+   * Bind an open buffer file descriptor to its buffer path
+   * @param fd file descriptor
+   * @param buffer_path buffer path
+   */
+  void open(uint64_t fd, const std::string &buffer_path);
+
+  /**
+   * Unbind a buffer file descriptor, its dirty size must have been flushed
+   * @param fd file descriptor
+   */
+  void close(uint64_t fd);
+
+  /**
+   * Get the cached size of a file
+   * @param buffer_path buffer path
+   * @param size returns the size
+   * @return true on hit
+   */
+  bool get_size(const std::string &buffer_path, off_t &size);
+
+  /**
+   * Cache the size of a file
+   * @param buffer_path buffer path
+   * @param size size
+   * @param dirty true if the size still has to be written back
+   */
+  void set_size(const std::string &buffer_path, off_t size, bool dirty);
+
+  /**
+   * Get the cached cloud residency of a file
+   * @param buffer_path buffer path
+   * @param is_on_cloud returns the cloud residency
+   * @return true on hit
+   */
+  bool get_is_on_cloud(const std::string &buffer_path, bool &is_on_cloud);
+
+  /**
+   * Cache the cloud residency of a file
+   * @param buffer_path buffer path
+   * @param is_on_cloud cloud residency
+   */
+  void set_is_on_cloud(const std::string &buffer_path, bool is_on_cloud);
+
+  /**
+   * Get the cached truncated flag of a file
+   * @param buffer_path buffer path
+   * @param truncated returns the truncated flag
+   * @return true on hit
+   */
+  bool get_truncated(const std::string &buffer_path, bool &truncated);
+
+  /**
+   * Cache the truncated flag of a file
+   * @param buffer_path buffer path
+   * @param truncated truncated flag
+   */
+  void set_truncated(const std::string &buffer_path, bool truncated);
+
+  /**
+   * Take the dirty size of a file, the entry becomes clean
+   * @param buffer_path buffer path
+   * @param size returns the size
+   * @return true if the size was dirty
+   */
+  bool take_dirty(const std::string &buffer_path, off_t &size);
+
+  /**
+   * Take all dirty sizes, the entries become clean
+   * @param dirty returns buffer paths and sizes
+   */
+  void take_all_dirty(std::vector<std::pair<std::string, off_t>> &dirty);
+
+  /**
+   * Bump the data version of a file, called when its data changes
+   * @param buffer_path buffer path
+   */
+  void bump_version(const std::string &buffer_path);
+
+  /**
+   * Check whether the page cache of a file is still valid on open
+   * The current data version is recorded as cached.
+   * @param buffer_path buffer path
+   * @return true if the data is unchanged since the previous open
+   */
+  bool keep_cache(const std::string &buffer_path);
+
+  /**
+   * Forget a main path, called when it is unlinked
+   * @param main_path main file path
+   */
+  void forget_path(const std::string &main_path);
+
+  /**
+   * Forget an inode, called when its buffer file is removed
+   * @param buffer_path buffer path
+   */
+  void forget_inode(const std::string &buffer_path);
+
+  /**
+   * Get the cached lstat result of a main path
+   * @param main_path main file path
+   * @param stbuf returns the lstat result
+   * @return true on hit
+   */
+  bool get_attr(const std::string &main_path, struct stat *stbuf);
+
+  /**
+   * Cache the lstat result of a main path
+   * @param main_path main file path
+   * @param stbuf lstat result
+   */
+  void set_attr(const std::string &main_path, const struct stat &stbuf);
+
+  /**
+   * Forget the lstat result of a main path
+   * @param main_path main file path
+   */
+  void forget_attr(const std::string &main_path);
+
+  /**
+   * Forget the lstat results of every main path to an inode
+   * @param ino inode number
+   */
+  void forget_inode_attrs(ino_t ino);
+
+  /**
+   * Forget all lstat results
+   */
+  void clear_attrs();
+
+  /**
+   * Forget all cached metadata, dirty sizes must have been taken
+   * Open file descriptors are kept
+   */
+  void clear();
+
+private:
+  /**
+   * Get or create the entry of an inode, drops the least recently used clean
+   * entry of a closed file when full
+   * @param buffer_path buffer path
+   * @return entry
+   */
+  Inode &entry(const std::string &buffer_path);
+
+  /**
+   * Remove a main path from the inode index of the lstat results
+   * @param main_path main file path
+   * @param ino inode number of its lstat result
+   */
+  void unlink_attr(const std::string &main_path, ino_t ino);
+};
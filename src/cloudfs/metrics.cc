@@ -0,0 +1,134 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+
+static const char *OP_NAMES[Metrics::NUM_OPS] = {
+    "getattr",  "getxattr", "setxattr", "mkdir",    "mknod",
+    "create",   "open",     "read",     "write",    "release",
+    "fsync",    "opendir",  "readdir",  "access",   "utimens",
+    "chmod",    "link",     "symlink",  "readlink", "unlink",
+    "rmdir",    "truncate", "ioctl",    "download_chunk", "upload_chunk",
+    "download_object", "upload_object"};
+
+static const char *COUNTER_NAMES[Metrics::NUM_COUNTERS] = {
+    "cache_hits", "cache_misses", "cache_evictions", "cache_writebacks",
+    "rechunk_bytes", "s3_gets", "s3_get_bytes", "s3_puts", "s3_put_bytes",
+    "s3_deletes"};
+
+static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+static const char *QUANTILE_NAMES[] = {"p50", "p90", "p99", "p999"};
+
+LatencyHistogram::LatencyHistogram() : count_(0), sum_(0), max_(0) {
+  for (auto &bucket : buckets_) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+}
+
+void LatencyHistogram::record(uint64_t value) {
+  buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+  auto max = max_.load(std::memory_order_relaxed);
+  while (value > max &&
+         !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t LatencyHistogram::percentile(double quantile) const {
+  auto total = count();
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = (uint64_t)(quantile * (total - 1)) + 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < NUM_BUCKETS; i++) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      return std::min(bucket_upper(i), max());
+    }
+  }
+  return max();
+}
+
+int LatencyHistogram::bucket_of(uint64_t value) {
+  if (value < (uint64_t)SUB_BUCKETS) {
+    return (int)value;
+  }
+  int msb = 63 - __builtin_clzll(value);
+  int shift = msb - SUB_BUCKET_BITS;
+  return SUB_BUCKETS * (shift + 1) + (int)((value >> shift) - SUB_BUCKETS);
+}
+
+uint64_t LatencyHistogram::bucket_upper(int bucket) {
+  if (bucket < SUB_BUCKETS) {
+    return bucket;
+  }
+  int shift = bucket / SUB_BUCKETS - 1;
+  uint64_t lower = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+  return lower + ((uint64_t)1 << shift) - 1;
+}
+
+Metrics::Metrics() {
+  for (auto &counter : counters_) {
+    counter.store(0, std::memory_order_relaxed);
+  }
+}
+
+Metrics &Metrics::instance() {
+  static Metrics metrics;
+  return metrics;
+}
+
+std::string Metrics::to_text() const {
+  std::string out;
+  char line[256];
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    snprintf(line, sizeof(line), "%-18s %llu\n", COUNTER_NAMES[i],
+             (unsigned long long)counters_[i].load(std::memory_order_relaxed));
+    out += line;
+  }
+  out += "\n# latency in us: op count mean p50 p90 p99 p999 max\n";
+  for (int i = 0; i < NUM_OPS; i++) {
+    auto &op = ops_[i];
+    auto count = op.count();
+    if (count == 0) {
+      continue;
+    }
+    snprintf(line, sizeof(line),
+             "%-18s %llu %.1f %.1f %.1f %.1f %.1f %.1f\n", OP_NAMES[i],
+             (unsigned long long)count, op.sum() / 1e3 / count,
+             op.percentile(0.5) / 1e3, op.percentile(0.9) / 1e3,
+             op.percentile(0.99) / 1e3, op.percentile(0.999) / 1e3,
+             op.max() / 1e3);
+    out += line;
+  }
+  return out;
+}
+
+std::string Metrics::to_json() const {
+  std::string out = "{\"counters\":{";
+  for (int i = 0; i < NUM_COUNTERS; i++) {
+    out += std::string(i == 0 ? "" : ",") + "\"" + COUNTER_NAMES[i] + "\":" +
+           std::to_string(counters_[i].load(std::memory_order_relaxed));
+  }
+  out += "},\"latency_ns\":{";
+  bool first = true;
+  for (int i = 0; i < NUM_OPS; i++) {
+    auto &op = ops_[i];
+    if (op.count() == 0) {
+      continue;
+    }
+    out += std::string(first ? "" : ",") + "\"" + OP_NAMES[i] + "\":{";
+    out += "\"count\":" + std::to_string(op.count());
+    out += ",\"sum\":" + std::to_string(op.sum());
+    for (size_t q = 0; q < sizeof(QUANTILES) / sizeof(QUANTILES[0]); q++) {
+      out += std::string(",\"") + QUANTILE_NAMES[q] +
+             "\":" + std::to_string(op.percentile(QUANTILES[q]));
+    }
+    out += ",\"max\":" + std::to_string(op.max()) + "}";
+    first = false;
+  }
+  out += "}}\n";
+  return out;
+}
@@ -0,0 +1,188 @@
+/**
+ * @file metrics.h
+ * @brief Process-wide operation counters and latency histograms
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Latency histogram with HDR-style log-linear buckets
+ *
+ * Values below 16 have a bucket each, larger values are split into 16
+ * sub-buckets per power of two, so a reported percentile is within 1/16 of
+ * the real value. Recording is wait-free.
+ */
+class LatencyHistogram {
+  static const int SUB_BUCKET_BITS = 4; // 16 sub-buckets per power of two
+  static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+  static const int NUM_BUCKETS = SUB_BUCKETS * (64 - SUB_BUCKET_BITS + 1);
+
+  std::atomic<uint64_t> buckets_[NUM_BUCKETS]; // value counts per bucket
+  std::atomic<uint64_t> count_;                // number of values
+  std::atomic<uint64_t> sum_;                  // sum of values
+  std::atomic<uint64_t> max_;                  // largest value
+
+public:
+  LatencyHistogram();
+
+  /**
+   * Record a value
+   * @param value value, in nanoseconds for latencies
+   */
+  void record(uint64_t value);
+
+  /**
+   * Get the number of recorded values
+   * @return number of values
+   */
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+  /**
+   * Get the sum of recorded values
+   * @return sum of values
+   */
+  uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+  /**
+   * Get the largest recorded value
+   * @return largest value
+   */
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+  /**
+   * Get a percentile of the recorded values
+   * @param quantile quantile in [0, 1]
+   * @return upper bound of the bucket holding the percentile, 0 if empty
+   */
+  uint64_t percentile(double quantile) const;
+
+private:
+  static int bucket_of(uint64_t value);
+  static uint64_t bucket_upper(int bucket);
+};
+
+/**
+ * Process-wide operation counters and latency histograms
+ *
+ * Read through the /.stats (text) and /.stats.json (JSON) virtual files.
+ */
+class Metrics {
+public:
+  /**
+   * Timed operations
+   */
+  enum Op {
+    OP_GETATTR,
+    OP_GETXATTR,
+    OP_SETXATTR,
+    OP_MKDIR,
+    OP_MKNOD,
+    OP_CREATE,
+    OP_OPEN,
+    OP_READ,
+    OP_WRITE,
+    OP_RELEASE,
+    OP_FSYNC,
+    OP_OPENDIR,
+    OP_READDIR,
+    OP_ACCESS,
+    OP_UTIMENS,
+    OP_CHMOD,
+    OP_LINK,
+    OP_SYMLINK,
+    OP_READLINK,
+    OP_UNLINK,
+    OP_RMDIR,
+    OP_TRUNCATE,
+    OP_IOCTL,
+    OP_DOWNLOAD_CHUNK,
+    OP_UPLOAD_CHUNK,
+    OP_DOWNLOAD_OBJECT, // whole object GET of a container or snapshot part
+    OP_UPLOAD_OBJECT,   // whole object PUT of a container or snapshot part
+    NUM_OPS
+  };
+
+  /**
+   * Counters
+   */
+  enum Counter {
+    CACHE_HITS,       // chunk reads served by the local cache
+    CACHE_MISSES,     // chunk reads fetched from cloud
+    CACHE_EVICTIONS,  // chunks evicted from the local cache
+    CACHE_WRITEBACKS, // dirty chunks written to cloud on eviction
+    RECHUNK_BYTES,    // bytes run through the chunker on writes
+    S3_GETS,          // GET requests
+    S3_GET_BYTES,     // bytes received by GET requests
+    S3_PUTS,          // PUT requests
+    S3_PUT_BYTES,     // bytes sent by PUT requests
+    S3_DELETES,       // deleted objects
+    NUM_COUNTERS
+  };
+
+private:
+  LatencyHistogram ops_[NUM_OPS];              // latency per operation
+  std::atomic<uint64_t> counters_[NUM_COUNTERS]; // counter values
+
+  Metrics();
+
+public:
+  /**
+   * Get the metrics of the process
+   * @return metrics
+   */
+  static Metrics &instance();
+
+  /**
+   * Add to a counter
+   * @param counter counter
+   * @param n amount
+   */
+  void add(Counter counter, uint64_t n = 1) {
+    counters_[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /**
+   * Record the latency of an operation
+   * @param op operation
+   * @param ns latency in nanoseconds
+   */
+  void record(Op op, uint64_t ns) { ops_[op].record(ns); }
+
+  /**
+   * Render all metrics as text, one line per counter and operation
+   * @return text
+   */
+  std::string to_text() const;
+
+  /**
+   * Render all metrics as a JSON object
+   * @return JSON
+   */
+  std::string to_json() const;
+};
+
+/**
+ * Records the latency of an operation when it goes out of scope
+ */
+class ScopedTimer {
+  Metrics::Op op_;                                    // operation
+  std::chrono::steady_clock::time_point start_; // start time
+
+public:
+  explicit ScopedTimer(Metrics::Op op)
+      : op_(op), start_(std::chrono::steady_clock::now()) {}
+
+  ~ScopedTimer() {
+    auto elapsed = std::chrono::steady_clock::now() - start_;
+    Metrics::instance().record(
+        op_,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+  }
+};
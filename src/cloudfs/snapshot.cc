@@ -6,6 +6,8 @@
 #include <cstdio>
 #include <dirent.h>
 #include <fcntl.h>
+#include <ftw.h>
+#include <openssl/evp.h>
 #include <queue>
 #include <sys/stat.h>
 #include <sys/xattr.h>
@@ -13,11 +15,78 @@
 #include <unordered_set>
 
 #include "snapshot-api.h"
+#include "snapshot_stream.h"
+#include "snapshot_walker.h"
+
+const uint64_t SnapshotController::SNAPSHOT_MAGIC = 0x3350414e53534643;    // "CFSSNAP3"
+const uint64_t SnapshotController::SNAPSHOT_MAGIC_V2 = 0x3250414e53534643; // "CFSSNAP2"
+const uint64_t SnapshotController::INDEX_MAGIC = 0x3358444e49534643;       // "CFSINDX3"
+const uint64_t SnapshotController::PARENTS_MAGIC = 0x544e524150534643;  // "CFSPARNT"
+const std::string SnapshotController::INFO_FILE_NAME = ".snapshot_info";
+const int SnapshotController::MAX_CHAIN_LENGTH = 16;
+const size_t SnapshotController::ENTRY_COUNT_AT_END = SIZE_MAX;
+const std::string SnapshotController::BLOB_PREFIX = "snapblob_";
+
+/**
+ * Remove a file or an emptied directory, called by nftw
+ */
+static int remove_tree_entry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+  remove(path);
+  return 0;
+}
+
+/**
+ * Hash the contents of a small file, as lowercase hex
+ */
+static std::string hash_contents(const std::string &data)
+{
+  static const char digits[] = "0123456789abcdef";
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int md_len = 0;
+  EVP_Digest(data.data(), data.size(), md, &md_len, EVP_md5(), NULL);
+  std::string hex;
+  for (unsigned int i = 0; i < md_len; i++)
+  {
+    hex += digits[md[i] >> 4];
+    hex += digits[md[i] & 0xf];
+  }
+  return hex;
+}
+
+/**
+ * Format a record of a snapshot diff, see struct cloudfs_diff
+ */
+static std::string format_diff_record(char type, bool dir, size_t old_size, size_t new_size,
+                                      const std::vector<std::pair<off_t, size_t>> &ranges,
+                                      const std::string &path)
+{
+  size_t changed = 0;
+  std::string list;
+  for (size_t i = 0; i < ranges.size(); i++)
+  {
+    changed += ranges[i].second;
+    if (i < CLOUDFS_DIFF_MAX_RANGES)
+    {
+      list += (i > 0 ? "," : "") + std::to_string(ranges[i].first) + "+" + std::to_string(ranges[i].second);
+    }
+    else if (i == CLOUDFS_DIFF_MAX_RANGES)
+    {
+      list += ",...";
+    }
+  }
+  if (list.empty())
+  {
+    list = "-";
+  }
+  return std::string(1, type) + (dir ? " d " : " f ") + std::to_string(old_size) + " " +
+         std::to_string(new_size) + " " + std::to_string(changed) + " " + list + " " + path + "\n";
+}
 
 SnapshotController::SnapshotController(
     struct cloudfs_state *state, std::shared_ptr<DebugLogger> logger,
     std::shared_ptr<CloudfsController> cloudfs_controller)
-    : state_(state), logger_(logger), cloudfs_controller_(cloudfs_controller)
+    : state_(state), logger_(logger), cloudfs_controller_(cloudfs_controller), diff_from_(0), diff_to_(0)
 {
   // try to create ".snapshot" file
   snapshot_stub_path_ = std::string(state_->ssd_path) + "/.snapshot";
@@ -33,49 +102,39 @@ SnapshotController::SnapshotController(
   }
   close(ret);
 
-  // try to download snapshot info persisted before from cloud
-  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
-  auto object_key = generate_object_key(snapshot_stub_path_);
-  buffer_controller->download_file(object_key, snapshot_stub_path_);
+  journal_.reset(new ChangeJournal(state_->ssd_path, logger_));
 
-  struct stat st;
-  if (stat(snapshot_stub_path_.c_str(), &st) != 0)
-  {
-    logger_->error("SnapshotController::SnapshotController: stat snapshot stub "
-                   "file failed, " +
-                   snapshot_stub_path_);
-  }
-  if (st.st_size == 0)
+  // snapshot info is kept in a file on the SSD, older versions kept it in
+  // xattrs of the stub file
+  info_path_ = std::string(state_->ssd_path) + "/" + INFO_FILE_NAME;
+  if (read_snapshot_info(info_path_) != 0)
   {
-    // no snapshot info persisted before
-    logger_->debug("SnapshotController::SnapshotController: no snapshot info persisted before");
-    return;
+    load_legacy_snapshot_info();
   }
 
-  // recover .snapshot
-  FILE *file = fopen(snapshot_stub_path_.c_str(), "r");
-  if (file == NULL)
+  // installed snapshots are loaded on first access, older versions wrote
+  // them to the SSD
+  std::vector<unsigned long> installed_snapshot_list;
+  get_installed_snapshot_list(installed_snapshot_list);
+  for (auto ts : installed_snapshot_list)
   {
-    logger_->error("SnapshotController::SnapshotController: open snapshot stub "
-                   "file failed, " +
-                   snapshot_stub_path_);
+    views_[ts] = nullptr;
+    auto root_path = std::string(state_->ssd_path) + "/snapshot_" + std::to_string(ts);
+    nftw(root_path.c_str(), remove_tree_entry, 16, FTW_DEPTH | FTW_PHYS);
   }
-  size_t entry_count;
-  fread(&entry_count, sizeof(size_t), 1, file);
 
-  std::vector<unsigned long> snapshot_list;
-  for (size_t i = 0; i < entry_count; i++)
+  // snapshot info persisted on cloud takes precedence, the SSD may have been
+  // replaced
+  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
+  auto object_key = generate_object_key(snapshot_stub_path_);
+  buffer_controller->download_file(object_key, snapshot_stub_path_);
+  if (read_snapshot_info(snapshot_stub_path_) != 0)
   {
-    unsigned long ts;
-    fread(&ts, sizeof(unsigned long), 1, file);
-    snapshot_list.push_back(ts);
-    logger_->debug("SnapshotController::SnapshotController: recovered snapshot " + std::to_string(ts));
+    // no snapshot info persisted before
+    logger_->debug("SnapshotController::SnapshotController: no snapshot info persisted before");
   }
-  ftruncate(fileno(file), 0);
-  fclose(file);
-
-  set_snapshot_count(entry_count);
-  set_snapshot_list(snapshot_list);
+  truncate(snapshot_stub_path_.c_str(), 0);
+  write_snapshot_info();
 }
 
 SnapshotController::~SnapshotController() {}
@@ -133,489 +192,461 @@ int SnapshotController::create_snapshot(unsigned long *timestamp)
   }
   // create snapshot
 
-  auto tmp_path = std::string(state_->ssd_path) + "/.snapshot_tmp";
-  FILE *tmp_file = fopen(tmp_path.c_str(), "w");
-  if (tmp_file == NULL)
+  // record only the changes since the latest snapshot if the journal covers
+  // all of them, long chains are cut by a full snapshot to bound restores
+  unsigned long parent = 0;
+  if (snapshot_list.size() > 0)
   {
-    return logger_->error(
-        "SnapshotController::generate_snapshot: open tmp file failed");
+    auto latest = *std::max_element(snapshot_list.begin(), snapshot_list.end());
+    if (journal_->base() == latest && get_chain_length(latest) < MAX_CHAIN_LENGTH)
+    {
+      parent = latest;
+    }
   }
 
-  // write a entry count to tmp file
-  size_t entry_count = 0;
-  fwrite(&entry_count, sizeof(size_t), 1, tmp_file);
-
-  // snapshot chunk table
-  cloudfs_controller_->get_chunk_table()->snapshot(tmp_file);
-
-  // read all files in ssd path and write to tmp file
-  char buf[PATH_MAX + 1];
-  std::queue<std::string> dir_queue;
-  dir_queue.push(std::string(state_->ssd_path));
-  while (!dir_queue.empty())
+  std::vector<std::pair<std::string, struct stat>> changed;
+  std::vector<std::string> removed;
+  if (parent != 0)
   {
-    auto dir = dir_queue.front();
-    dir_queue.pop();
-    DIR *dirp = opendir(dir.c_str());
-    if (dirp == NULL)
+    auto ret = collect_changes(changed, removed);
+    if (ret < 0)
     {
-      return logger_->error(
-          "SnapshotController::generate_snapshot: opendir failed, " + dir);
+      return ret;
     }
-    auto entry = readdir(dirp);
-    if (entry == NULL)
+    if (ret == 1)
     {
-      return logger_->error(
-          "SnapshotController::generate_snapshot: readdir failed, " + dir);
+      // the changes cannot be recorded incrementally, write all entries
+      parent = 0;
+      removed.clear();
     }
-    do
-    {
-      auto name = std::string(entry->d_name);
-      if (name == "lost+found")
-      {
-        continue;
-      }
-      if (name == "." || name == "..")
-      {
-        continue;
-      }
-      if (is_buffer_path(name))
-      {
-        continue;
-      }
-
-      struct stat st;
-      if (stat((dir + "/" + name).c_str(), &st) != 0)
-      {
-        return logger_->error(
-            "SnapshotController::generate_snapshot: stat failed, " + dir + "/" +
-            name);
-      }
-
-      // write stat struct to tmp file
-      fwrite(&st, sizeof(struct stat), 1, tmp_file);
-      if (S_ISDIR(st.st_mode))
-      {
-        // write dir path to tmp file
-        auto dir_path = dir + "/" + name;
-        size_t dir_path_len = dir_path.size();
-        fwrite(&dir_path_len, sizeof(size_t), 1, tmp_file);
-        fwrite(dir_path.c_str(), sizeof(char), dir_path_len, tmp_file);
-
-        // add to dir queue
-        dir_queue.push(dir + "/" + name);
-      }
-      else
-      {
-        // write regular file path to tmp file
-        auto file_path = dir + "/" + name;
-        size_t file_path_len = file_path.size();
-        fwrite(&file_path_len, sizeof(size_t), 1, tmp_file);
-        fwrite(file_path.c_str(), sizeof(char), file_path_len, tmp_file);
-
-        // write chunk info to tmp file
-        std::vector<Chunk> chunks;
-        if (cloudfs_controller_->get_chunkinfo(file_path, chunks) != 0)
-        {
-          return logger_->error(
-              "SnapshotController::generate_snapshot: get chunk info failed, " +
-              file_path);
-        }
-        size_t num_chunks = chunks.size();
-        fwrite(&num_chunks, sizeof(size_t), 1, tmp_file);
-        for (auto &chunk : chunks)
-        {
-          fwrite(&chunk.start_, sizeof(off_t), 1, tmp_file);
-          fwrite(&chunk.len_, sizeof(size_t), 1, tmp_file);
-          size_t key_len = chunk.key_.size();
-          fwrite(&key_len, sizeof(size_t), 1, tmp_file);
-          fwrite(chunk.key_.c_str(), sizeof(char), key_len, tmp_file);
-        }
+  }
 
-        // write buffer file path to tmp file
-        std::string buffer_path;
-        if (cloudfs_controller_->get_buffer_path(file_path, buffer_path) != 0)
-        {
-          return logger_->error("SnapshotController::generate_snapshot: get "
-                                "buffer path failed, " +
-                                file_path);
-        }
-        size_t buffer_path_len = buffer_path.size();
-        fwrite(&buffer_path_len, sizeof(size_t), 1, tmp_file);
-        fwrite(buffer_path.c_str(), sizeof(char), buffer_path_len, tmp_file);
+  // the snapshot is compressed and uploaded while it is written
+  auto object_key = "snapshot_" + std::to_string(*timestamp);
+  SnapshotStream stream(cloudfs_controller_->get_buffer_file_controller(), object_key, 0, get_compression(), logger_);
+  FILE *tmp_file = stream.file();
+  if (tmp_file == NULL)
+  {
+    errno = EIO;
+    return logger_->error(
+        "SnapshotController::generate_snapshot: open snapshot stream failed");
+  }
 
-        // write file size to tmp file
-        off_t file_size;
-        if (cloudfs_controller_->get_size(buffer_path, file_size) != 0)
-        {
-          return logger_->error(
-              "SnapshotController::generate_snapshot: get file size failed, " +
-              file_path);
-        }
-        fwrite(&file_size, sizeof(size_t), 1, tmp_file);
+  // write the header, the sections are located by the footer
+  uint64_t magic = SNAPSHOT_MAGIC;
+  uint64_t parent64 = parent;
+  fwrite(&magic, sizeof(uint64_t), 1, tmp_file);
+  fwrite(&parent64, sizeof(uint64_t), 1, tmp_file);
 
-        // check if need to copy file content to tmp file
-        if (file_size <= state_->threshold)
-        {
-          // small file, copy content to tmp file
-          FILE *file = fopen(buffer_path.c_str(), "r");
-          if (file == NULL)
-          {
-            return logger_->error("SnapshotController::generate_snapshot: open "
-                                  "buffer file failed, " +
-                                  buffer_path);
-          }
-          size_t read_size = 0;
-          while ((off_t)read_size < file_size)
-          {
-            size_t to_read = std::min(file_size - read_size, sizeof(buf));
-            auto n = fread(buf, sizeof(char), to_read, file);
-            if (n != to_read)
-            {
-              return logger_->error("SnapshotController::generate_snapshot: "
-                                    "read buffer file failed, " +
-                                    buffer_path);
-            }
-            fwrite(buf, sizeof(char), n, tmp_file);
-            read_size += n;
-          }
-          fclose(file);
-        }
-      }
-      entry_count++; // increase entry count
-    } while ((entry = readdir(dirp)) != NULL);
+  // snapshot chunk table
+  long table_pos = ftell(tmp_file);
+  auto chunk_table = cloudfs_controller_->get_chunk_table();
+  auto epoch = chunk_table->snapshot(tmp_file);
+
+  long removed_pos = ftell(tmp_file);
+  write_removed(tmp_file, removed);
+  std::vector<std::pair<std::string, long>> offsets;
+  Blobs blobs;
+  auto ret = parent != 0 ? write_changed_entries(tmp_file, changed, offsets, &blobs)
+                         : write_all_entries(tmp_file, offsets, &blobs);
+  if (ret != 0)
+  {
+    return ret;
   }
 
-  // write entry count to tmp file
-  fseek(tmp_file, 0, SEEK_SET);
-  fwrite(&entry_count, sizeof(size_t), 1, tmp_file);
-  fclose(tmp_file);
-
-  // tar and compress tmp file
-  auto tar_path = tmp_path + ".tar";
-  if (tar_file(tar_path, tmp_path) != 0)
+  // index the entries by path
+  ret = write_index(tmp_file, table_pos, removed_pos, offsets);
+  if (ret != 0)
   {
-    return logger_->error("SnapshotController::generate_snapshot: tar tmp file failed, " + tmp_path);
+    return ret;
   }
-  remove(tmp_path.c_str());
 
-  struct stat st;
-  if (stat(tar_path.c_str(), &st) != 0)
+  // the contents of small files are stored before the snapshot is committed
+  ret = hold_blobs(blobs);
+  if (ret != 0)
   {
-    return logger_->error(
-        "SnapshotController::generate_snapshot: stat tmp file failed, " +
-        tar_path);
+    return ret;
+  }
+  size_t entry_count = offsets.size();
+  std::set<std::string> blob_keys;
+  for (auto &it : blobs.paths_)
+  {
+    blob_keys.insert(it.first);
+  }
+  if (stream.finish() != 0)
+  {
+    ret = logger_->error("SnapshotController::create_snapshot: upload failed");
+    release_blobs(blob_keys);
+    return ret;
   }
 
-  // upload tar file to cloud
-  auto object_key = "snapshot_" + std::to_string(*timestamp);
-  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
-  buffer_controller->upload_file(object_key, tar_path, st.st_size);
-  remove(tar_path.c_str());
+  // the chunks alive now are only pinned once the snapshot is stored, a
+  // snapshot that fails earlier leaves no epoch behind
+  if (!chunk_table->retain_epoch(epoch))
+  {
+    chunk_table->release_epoch(epoch);
+    release_blobs(blob_keys);
+    return logger_->error("SnapshotController::create_snapshot: commit chunk table failed");
+  }
+  logger_->info("SnapshotController::create_snapshot: snapshot ", *timestamp,
+                parent != 0 ? " incremental on " : " full", parent != 0 ? std::to_string(parent) : "",
+                ", ", entry_count, " entries, ", blobs.paths_.size(), " small file chunks");
 
   // update snapshot info
   snapshot_list.push_back(*timestamp);
-  auto ret = set_snapshot_count(snapshot_list.size());
-  if (ret != 0)
-  {
-    return logger_->error(
-        "SnapshotController::create_snapshot: set snapshot count failed");
-  }
   ret = set_snapshot_list(snapshot_list);
   if (ret != 0)
   {
+    chunk_table->release_epoch(epoch);
+    release_blobs(blob_keys);
     return logger_->error(
         "SnapshotController::create_snapshot: set snapshot list failed");
   }
+  set_snapshot_parent(*timestamp, parent);
+
+  // later changes are relative to this snapshot
+  journal_->reset(*timestamp);
   return 0;
 }
 
-int SnapshotController::restore_snapshot(unsigned long *timestamp)
+int SnapshotController::serialize_entry(const std::string &path, const struct stat &st, std::string &record,
+                                        Blobs *blobs)
 {
-  logger_->debug("SnapshotController::restore_snapshot: restore snapshot, " +
-                 std::to_string(*timestamp));
-  std::vector<unsigned long> snapshot_list;
-  if (get_snapshot_list(snapshot_list) != 0)
+  auto append = [&record](const void *data, size_t size)
+  { record.append(static_cast<const char *>(data), size); };
+
+  // write stat struct
+  append(&st, sizeof(struct stat));
+
+  // write path
+  size_t path_len = path.size();
+  append(&path_len, sizeof(size_t));
+  append(path.c_str(), path_len);
+  if (S_ISDIR(st.st_mode))
+  {
+    return 0;
+  }
+
+  // get chunk info
+  std::vector<Chunk> chunks;
+  if (cloudfs_controller_->get_chunkinfo(path, chunks) != 0)
   {
     return logger_->error(
-        "SnapshotController::generate_snapshot: get snapshot list failed");
+        "SnapshotController::generate_snapshot: get chunk info failed, " +
+        path);
   }
-  bool found = false;
-  for (auto &ts : snapshot_list)
+
+  // get buffer file path and file size, read past the metadata cache as this
+  // runs on the snapshot walker threads
+  std::string buffer_path;
+  if (CloudfsController::read_buffer_path(path, buffer_path) != 0)
   {
-    if (ts == *timestamp)
-    {
-      found = true;
-      break;
-    }
+    return logger_->error("SnapshotController::generate_snapshot: get "
+                          "buffer path failed, " +
+                          path);
   }
-  if (!found)
+  off_t file_size;
+  if (CloudfsController::read_size(buffer_path, file_size) != 0)
   {
-    // snapshot not found
-    errno = EINVAL;
     return logger_->error(
-        "SnapshotController::restore_snapshot: snapshot not found");
+        "SnapshotController::generate_snapshot: get file size failed, " +
+        path);
   }
 
-  // clear user contents under ssd path
-  clear_dir(state_->ssd_path);
-
-  // download tar file from cloud
-  auto tmp_path = std::string(state_->ssd_path) + "/.snapshot_tmp";
-  auto tar_path = tmp_path + ".tar";
-  auto object_key = "snapshot_" + std::to_string(*timestamp);
-  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
-  buffer_controller->download_file(object_key, tar_path);
-
-  // untar file
-  if (untar_file(tar_path, "/") != 0)
+  // check if need to copy file content
+  std::string data;
+  if (file_size <= state_->threshold)
+  {
+    // small file, read content
+    FILE *file = fopen(buffer_path.c_str(), "r");
+    if (file == NULL)
+    {
+      return logger_->error("SnapshotController::generate_snapshot: open "
+                            "buffer file failed, " +
+                            buffer_path);
+    }
+    data.resize(file_size);
+    auto n = fread(&data[0], sizeof(char), file_size, file);
+    fclose(file);
+    if ((off_t)n != file_size)
+    {
+      return logger_->error("SnapshotController::generate_snapshot: "
+                            "read buffer file failed, " +
+                            buffer_path);
+    }
+  }
+  if (blobs != NULL && chunks.empty() && !data.empty())
   {
-    return logger_->error("SnapshotController::restore_snapshot: untar file failed, " + tar_path);
+    // the content becomes a chunk of its own, shared by every snapshot
+    // holding the same content
+    auto key = BLOB_PREFIX + hash_contents(data);
+    chunks.emplace_back(0, data.size(), key);
+    data.clear();
+    std::lock_guard<std::mutex> lock(blobs->mutex_);
+    blobs->paths_.emplace(key, buffer_path);
   }
-  remove(tar_path.c_str());
 
-  // read tmp file and restore to ssd path
-  FILE *tmp_file = fopen(tmp_path.c_str(), "r");
-  if (tmp_file == NULL)
+  // write chunk info
+  size_t num_chunks = chunks.size();
+  append(&num_chunks, sizeof(size_t));
+  for (auto &chunk : chunks)
   {
-    return logger_->error(
-        "SnapshotController::restore_snapshot: open tmp file failed, " +
-        tmp_path);
+    append(&chunk.start_, sizeof(off_t));
+    append(&chunk.len_, sizeof(size_t));
+    size_t key_len = chunk.key_.size();
+    append(&key_len, sizeof(size_t));
+    append(chunk.key_.c_str(), key_len);
   }
 
-  // read entry count
-  size_t entry_count;
-  fread(&entry_count, sizeof(size_t), 1, tmp_file);
+  // write buffer file path
+  size_t buffer_path_len = buffer_path.size();
+  append(&buffer_path_len, sizeof(size_t));
+  append(buffer_path.c_str(), buffer_path_len);
 
-  // restore chunk table
-  cloudfs_controller_->get_chunk_table()->restore(tmp_file);
+  // write file size, then the content of a small file kept in the record
+  append(&file_size, sizeof(size_t));
+  record += data;
+  return 0;
+}
 
-  char buf[PATH_MAX + 1];
-  size_t processed = 0;
-  while (processed < entry_count)
-  {
-    // read stat struct
-    struct stat st;
-    fread(&st, sizeof(struct stat), 1, tmp_file);
+int SnapshotController::write_all_entries(FILE *tmp_file, std::vector<std::pair<std::string, long>> &offsets,
+                                          Blobs *blobs)
+{
+  // workers read xattrs directly, so the cached sizes have to be on disk
+  cloudfs_controller_->flush_metadata();
 
-    if (S_ISDIR(st.st_mode))
-    {
-      // read dir path
-      size_t dir_path_len;
-      fread(&dir_path_len, sizeof(size_t), 1, tmp_file);
-      fread(buf, sizeof(char), dir_path_len, tmp_file);
-      std::string dir_path(buf, dir_path_len);
+  // read all files in ssd path and write to tmp file
+  SnapshotWalker walker(
+      state_->snapshot_threads,
+      [](const std::string &name)
+      { return name == "lost+found" || is_buffer_path(name); },
+      [this, blobs](const std::string &path, const struct stat &st, std::string &record)
+      { return serialize_entry(path, st, record, blobs); },
+      logger_);
+  return walker.walk(std::string(state_->ssd_path), tmp_file, offsets);
+}
 
-      // create dir if not exist
-      if (mkdir(dir_path.c_str(), st.st_mode) != 0)
-      {
-        if (errno != EEXIST)
-        {
-          return logger_->error(
-              "SnapshotController::restore_snapshot: mkdir failed, " +
-              dir_path);
-        }
-      }
+SnapshotStream::Compression SnapshotController::get_compression() const
+{
+  SnapshotStream::Compression compression;
+  compression.filter_ = state_->snapshot_compression;
+  compression.level_ = state_->snapshot_level;
+  compression.threads_ = state_->snapshot_threads;
+  return compression;
+}
 
-      processed++;
-      continue;
+int SnapshotController::collect_changes(std::vector<std::pair<std::string, struct stat>> &changed,
+                                        std::vector<std::string> &removed)
+{
+  // sorted, so the parent directory of a path is written before it
+  std::set<std::string> paths;
+  for (auto &path : journal_->paths())
+  {
+    // skip paths the full walk skips as well
+    bool skip = path == "/" || path.compare(0, 12, "/lost+found/") == 0 || path == "/lost+found";
+    size_t start = 1;
+    while (!skip && start < path.size())
+    {
+      auto end = path.find('/', start);
+      skip = is_buffer_path(path.substr(start, end - start));
+      start = end == std::string::npos ? path.size() : end + 1;
     }
+    if (!skip)
+    {
+      paths.insert(path);
+    }
+  }
 
-    // read filepath
-    size_t filepath_len;
-    fread(&filepath_len, sizeof(size_t), 1, tmp_file);
-    fread(buf, sizeof(char), filepath_len, tmp_file);
-    std::string filepath(buf, filepath_len);
-
-    // create file if not exist, first create with full permission
-    auto file_fd = open(filepath.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0777);
-    if (file_fd == -1)
+  // paths that no longer exist are removed, the others are written in full
+  for (auto &path : paths)
+  {
+    auto ssd_path = std::string(state_->ssd_path) + path;
+    struct stat st;
+    if (stat(ssd_path.c_str(), &st) == 0)
     {
-      if (errno != EEXIST)
+      if (!S_ISDIR(st.st_mode) && st.st_nlink > 1)
       {
-        return logger_->error(
-            "SnapshotController::restore_snapshot: create file failed, " +
-            filepath);
+        // the other links of the file are not in the journal
+        return 1;
       }
+      changed.emplace_back(ssd_path, st);
     }
-    close(file_fd);
-
-    // read chunk info
-    size_t num_chunks;
-    fread(&num_chunks, sizeof(size_t), 1, tmp_file);
-    std::vector<Chunk> chunks;
-    chunks.reserve(num_chunks);
-    for (size_t i = 0; i < num_chunks; i++)
-    {
-      off_t start;
-      fread(&start, sizeof(off_t), 1, tmp_file);
-      size_t len;
-      fread(&len, sizeof(size_t), 1, tmp_file);
-      size_t key_len;
-      fread(&key_len, sizeof(size_t), 1, tmp_file);
-      std::vector<char> key(key_len);
-      fread(key.data(), sizeof(char), key_len, tmp_file);
-      std::string key_str(key.begin(), key.end());
-      chunks.emplace_back(start, len, key_str);
-    }
-
-    // write chunks to file
-    auto ret = cloudfs_controller_->set_chunkinfo(filepath, chunks);
-    if (ret != 0)
+    else if (errno == ENOENT)
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: set chunk info failed, " +
-          filepath);
+      removed.push_back(ssd_path);
     }
-
-    // read buffer path
-    size_t buffer_path_len;
-    fread(&buffer_path_len, sizeof(size_t), 1, tmp_file);
-    fread(buf, sizeof(char), buffer_path_len, tmp_file);
-    std::string buffer_path(buf, buffer_path_len);
-    // set buffer path
-    ret = cloudfs_controller_->set_buffer_path(filepath, buffer_path);
-    if (ret != 0)
+    else
     {
       return logger_->error(
-          "SnapshotController::restore_snapshot: set buffer path failed, " +
-          filepath);
+          "SnapshotController::generate_snapshot: stat failed, " + ssd_path);
     }
+  }
+  return 0;
+}
 
-    // create buffer file if not exist
-    auto buffer_fd =
-        open(buffer_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0777);
-    if (buffer_fd == -1)
+int SnapshotController::write_changed_entries(FILE *tmp_file,
+                                              const std::vector<std::pair<std::string, struct stat>> &changed,
+                                              std::vector<std::pair<std::string, long>> &offsets,
+                                              Blobs *blobs)
+{
+  cloudfs_controller_->flush_metadata();
+  std::string record;
+  for (auto &entry : changed)
+  {
+    record.clear();
+    auto ret = serialize_entry(entry.first, entry.second, record, blobs);
+    if (ret != 0)
     {
-      if (errno != EEXIST)
-      {
-        return logger_->error(
-            "SnapshotController::restore_snapshot: open buffer file failed, " +
-            buffer_path);
-      }
+      return ret;
     }
-    close(buffer_fd);
+    offsets.emplace_back(entry.first, ftell(tmp_file));
+    fwrite(record.data(), sizeof(char), record.size(), tmp_file);
+  }
+  return 0;
+}
 
-    // read file size
-    size_t file_size;
-    fread(&file_size, sizeof(size_t), 1, tmp_file);
-    // set file size
-    ret = cloudfs_controller_->set_size(buffer_path, file_size);
-    if (ret != 0)
+int SnapshotController::hold_blobs(Blobs &blobs)
+{
+  auto chunk_table = cloudfs_controller_->get_chunk_table();
+  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
+  std::set<std::string> held;
+  int ret = 0;
+  for (auto &it : blobs.paths_)
+  {
+    held.insert(it.first);
+    if (!chunk_table->snapshot_use(it.first) || buffer_controller->revive_object(it.first))
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: set file size failed, " +
-          buffer_path);
+      // held by another snapshot, or still on cloud
+      continue;
     }
 
-    if ((int)file_size <= state_->threshold)
+    // the content is read again, it must be the one that was hashed
+    std::string data;
+    int fd = open(it.second.c_str(), O_RDONLY);
+    if (fd != -1)
     {
-      // small file, copy contents to buffer file
-      FILE *file = fopen(buffer_path.c_str(), "w");
-      if (file == NULL)
+      char buf[MEM_BUFFER_LEN];
+      ssize_t n;
+      while ((n = pread(fd, buf, sizeof(buf), data.size())) > 0)
       {
-        return logger_->error(
-            "SnapshotController::restore_snapshot: open buffer file failed, " +
-            buffer_path);
+        data.append(buf, n);
       }
-      size_t read_size = 0;
-      while (read_size < file_size)
+    }
+    if (fd == -1 || BLOB_PREFIX + hash_contents(data) != it.first)
+    {
+      if (fd != -1)
       {
-        size_t to_read = std::min(file_size - read_size, sizeof(buf));
-        auto n = fread(buf, sizeof(char), to_read, tmp_file);
-        if (n != to_read)
-        {
-          return logger_->error(
-              "SnapshotController::restore_snapshot: read tmp file failed, " +
-              tmp_path);
-        }
-        fwrite(buf, sizeof(char), n, file);
-        read_size += n;
+        close(fd);
       }
-      fclose(file);
+      errno = EAGAIN;
+      ret = logger_->error("SnapshotController::hold_blobs: file changed during the snapshot, " +
+                           it.second);
+      break;
     }
 
-    // utimensat file
-    struct timespec tv[2];
-    tv[0] = st.st_atim;
-    tv[1] = st.st_mtim;
-    if (utimensat(AT_FDCWD, filepath.c_str(), tv, AT_SYMLINK_NOFOLLOW) != 0)
+    // stored like the chunks of large files, packed into a container if
+    // containers are enabled
+    ret = cloudfs_controller_->store_chunk(it.first, fd, 0, data.size());
+    close(fd);
+    if (ret != 0)
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: utimensat file failed, " +
-          filepath);
+      ret = logger_->error("SnapshotController::hold_blobs: store failed, " + it.first);
+      break;
     }
+  }
+  if (ret == 0 && !chunk_table->commit())
+  {
+    ret = logger_->error("SnapshotController::hold_blobs: commit chunk table failed");
+  }
+  if (ret != 0)
+  {
+    release_blobs(held);
+    return ret;
+  }
+  return 0;
+}
 
-    // chmod file to previous permission
-    if (chmod(filepath.c_str(), st.st_mode) != 0)
+void SnapshotController::release_blobs(const std::set<std::string> &keys)
+{
+  auto chunk_table = cloudfs_controller_->get_chunk_table();
+  for (auto &key : keys)
+  {
+    ChunkLocation location;
+    if (chunk_table->snapshot_release(key, &location))
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: chmod file failed, " +
-          filepath);
+      cloudfs_controller_->retire_chunk(key, location);
     }
-
-    processed++;
   }
-  fclose(tmp_file);
-  remove(tmp_path.c_str());
-
-  // delete snapshot that's newer than the restored snapshot
-  std::vector<unsigned long> new_snapshot_list;
-  std::sort(snapshot_list.begin(), snapshot_list.end()); // sort list from old to new
+  chunk_table->commit();
+}
 
-  // find the index of the restored snapshot
-  auto i = 0;
-  while (i < (int)snapshot_list.size() && snapshot_list[i] <= *timestamp)
+int SnapshotController::collect_blobs(SnapshotFile &snapshot, std::set<std::string> &keys)
+{
+  fseek(snapshot.file_, snapshot.entries_pos_, SEEK_SET);
+  for (size_t i = 0; i < snapshot.entry_count_; i++)
   {
-    new_snapshot_list.push_back(snapshot_list[i]);
-    i++;
+    SnapshotEntry entry;
+    if (read_entry(snapshot.file_, entry) != 0)
+    {
+      return -errno;
+    }
+    if (!entry.blob_.empty())
+    {
+      keys.insert(entry.blob_);
+    }
   }
+  return 0;
+}
 
-  // delete snapshots that are newer than the restored snapshot
-  for (auto j = i + 1; j < (int)snapshot_list.size(); j++)
+void SnapshotController::write_removed(FILE *tmp_file, const std::vector<std::string> &removed)
+{
+  size_t removed_count = removed.size();
+  fwrite(&removed_count, sizeof(size_t), 1, tmp_file);
+  for (auto &path : removed)
   {
-    uninstall_snapshot(&snapshot_list[j]); // uninstall if installed
-    delete_snapshot(&snapshot_list[j]);    // delete after uninstall
+    size_t path_len = path.size();
+    fwrite(&path_len, sizeof(size_t), 1, tmp_file);
+    fwrite(path.c_str(), sizeof(char), path_len, tmp_file);
   }
-
-  // update snapshot info
-  set_snapshot_count(new_snapshot_list.size());
-  set_snapshot_list(new_snapshot_list);
-  return 0;
 }
 
-int SnapshotController::list_snapshots(unsigned long *snapshot_list)
+int SnapshotController::write_index(FILE *tmp_file, long table_pos, long removed_pos,
+                                    std::vector<std::pair<std::string, long>> &offsets)
 {
-  std::vector<unsigned long> snapshot_list_vec;
-  if (get_snapshot_list(snapshot_list_vec) != 0)
+  long index_pos = ftell(tmp_file);
+  if (table_pos < 0 || removed_pos < 0 || index_pos < 0)
   {
-    return logger_->error(
-        "SnapshotController::list_snapshots: get snapshot list failed");
+    errno = EIO;
+    return logger_->error("SnapshotController::write_index: locate sections failed");
   }
-  for (size_t i = 0; i < snapshot_list_vec.size(); i++)
+  std::sort(offsets.begin(), offsets.end());
+  for (auto &it : offsets)
   {
-    snapshot_list[i] = snapshot_list_vec[i];
+    uint64_t offset = it.second;
+    fwrite(&offset, sizeof(uint64_t), 1, tmp_file);
   }
-  snapshot_list[snapshot_list_vec.size()] = 0; // set 0 to indicate end
+
+  // fixed size, read back from the end of the file
+  uint64_t footer[5] = {(uint64_t)table_pos, (uint64_t)removed_pos, (uint64_t)index_pos,
+                        offsets.size(), INDEX_MAGIC};
+  fwrite(footer, sizeof(uint64_t), 5, tmp_file);
   return 0;
 }
 
-int SnapshotController::delete_snapshot(unsigned long *timestamp)
+int SnapshotController::restore_snapshot(unsigned long *timestamp)
 {
-  logger_->debug("SnapshotController::delete_snapshot: delete snapshot, " +
+  logger_->debug("SnapshotController::restore_snapshot: restore snapshot, " +
                  std::to_string(*timestamp));
-
-  // check if snapshot exists
   std::vector<unsigned long> snapshot_list;
   if (get_snapshot_list(snapshot_list) != 0)
   {
     return logger_->error(
-        "SnapshotController::delete_snapshot: get snapshot list failed");
+        "SnapshotController::generate_snapshot: get snapshot list failed");
   }
   bool found = false;
-  for (size_t i = 0; i < snapshot_list.size(); i++)
+  for (auto &ts : snapshot_list)
   {
-    if (snapshot_list[i] == *timestamp)
+    if (ts == *timestamp)
     {
       found = true;
       break;
@@ -626,324 +657,1652 @@ int SnapshotController::delete_snapshot(unsigned long *timestamp)
     // snapshot not found
     errno = EINVAL;
     return logger_->error(
-        "SnapshotController::delete_snapshot: snapshot not found, " +
-        std::to_string(*timestamp));
+        "SnapshotController::restore_snapshot: snapshot not found");
   }
 
-  // check if snapshot is installed
-  std::vector<unsigned long> installed_snapshot_list;
-  if (get_installed_snapshot_list(installed_snapshot_list) != 0)
-  {
-    return logger_->error("SnapshotController::delete_snapshot: get installed "
-                          "snapshot list failed");
-  }
-  bool installed = false;
-  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
-  {
-    if (installed_snapshot_list[i] == *timestamp)
-    {
-      installed = true;
-      break;
-    }
-  }
-  if (installed)
+  // download the snapshot and its ancestors before anything is cleared
+  std::vector<SnapshotFile> chain;
+  if (fetch_chain(*timestamp, chain) != 0)
   {
-    // cannot delete installed snapshot
-    errno = EBUSY;
-    return logger_->error(
-        "SnapshotController::delete_snapshot: snapshot is installed, " +
-        std::to_string(*timestamp));
+    return logger_->error("SnapshotController::restore_snapshot: fetch snapshot failed");
   }
-  // delete snapshot
 
-  // first download snapshot
-  auto tmp_path = std::string(state_->ssd_path) + "/.snapshot_tmp";
-  auto tar_path = tmp_path + ".tar";
-  auto object_key = "snapshot_" + std::to_string(*timestamp);
-  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
-  buffer_controller->download_file(object_key, tar_path);
+  // clear user contents under ssd path, cached metadata of the removed files
+  // must not be written back over the restored ones
+  cloudfs_controller_->invalidate_metadata();
+  clear_dir(state_->ssd_path);
 
-  // untar file
-  if (untar_file(tar_path, "/") != 0)
+  // restore chunk table of the restored snapshot, snapshots that only
+  // record their epoch get the references back from the restored files
+  auto &target = chain.back();
+  fseek(target.file_, target.table_pos_, SEEK_SET);
+  bool restored = cloudfs_controller_->get_chunk_table()->restore(target.file_);
+
+  // restore the composed entries to ssd path
+  std::map<std::string, EntryLocation> entries;
+  std::set<std::string> removed;
+  auto ret = compose_chain(chain, entries, removed);
+  if (ret == 0)
   {
-    return logger_->error("SnapshotController::delete_snapshot: untar file failed, " + tar_path);
+    ret = apply_entries(chain, entries, false, !restored);
+    if (!cloudfs_controller_->get_chunk_table()->commit() && ret == 0)
+    {
+      ret = logger_->error("SnapshotController::restore_snapshot: commit chunk table failed");
+    }
   }
-  remove(tar_path.c_str());
-
-  FILE *tmp_file = fopen(tmp_path.c_str(), "r");
-  if (tmp_file == NULL)
+  close_chain(chain);
+  if (ret != 0)
   {
-    return logger_->error(
-        "SnapshotController::delete_snapshot: open tmp file failed, " +
-        tmp_path);
+    return ret;
   }
 
-  fseek(tmp_file, sizeof(size_t), SEEK_SET); // skip entry count
-
-  cloudfs_controller_->get_chunk_table()->snapshot_deleted(
-      tmp_file); // chunk table will read chunk table info in the tmp file and handle ref count decreasing
-
-  fclose(tmp_file);
-  remove(tmp_path.c_str());
-
-  // delete cloud object
-  buffer_controller->delete_object(object_key);
-
-  // delete from snapshot_list
+  // delete snapshots that are newer than the restored snapshot, newest first
+  // so none of them has to be folded into a child
   std::vector<unsigned long> new_snapshot_list;
-  for (size_t i = 0; i < snapshot_list.size(); i++)
+  std::sort(snapshot_list.begin(), snapshot_list.end()); // sort list from old to new
+  for (auto it = snapshot_list.rbegin(); it != snapshot_list.rend(); it++)
   {
-    if (snapshot_list[i] != *timestamp)
+    if (*it <= *timestamp)
     {
-      new_snapshot_list.push_back(snapshot_list[i]);
+      new_snapshot_list.insert(new_snapshot_list.begin(), *it);
+      continue;
     }
+    uninstall_snapshot(&*it); // uninstall if installed
+    delete_snapshot(&*it);    // delete after uninstall
   }
 
   // update snapshot info
-  set_snapshot_count(new_snapshot_list.size());
   set_snapshot_list(new_snapshot_list);
+
+  // later changes are relative to the restored snapshot
+  journal_->reset(*timestamp);
   return 0;
 }
 
-int SnapshotController::install_snapshot(unsigned long *timestamp)
+int SnapshotController::restore_subtree(unsigned long *timestamp, const std::string &path)
 {
-  logger_->debug("SnapshotController::install_snapshot: install snapshot, " +
+  logger_->debug("SnapshotController::restore_subtree: restore " + path + " from snapshot " +
                  std::to_string(*timestamp));
-
-  // check if snapshot exists
   std::vector<unsigned long> snapshot_list;
   if (get_snapshot_list(snapshot_list) != 0)
   {
     return logger_->error(
-        "SnapshotController::install_snapshot: get snapshot list failed");
-  }
-  bool found = false;
-  for (size_t i = 0; i < snapshot_list.size(); i++)
-  {
-    if (snapshot_list[i] == *timestamp)
-    {
-      found = true;
-      break;
-    }
+        "SnapshotController::restore_subtree: get snapshot list failed");
   }
-  if (!found)
+  if (std::find(snapshot_list.begin(), snapshot_list.end(), *timestamp) == snapshot_list.end())
   {
     // snapshot not found
     errno = EINVAL;
     return logger_->error(
-        "SnapshotController::install_snapshot: snapshot not found, " +
-        std::to_string(*timestamp));
+        "SnapshotController::restore_subtree: snapshot not found");
   }
 
-  // check if snapshot is already installed
-  std::vector<unsigned long> installed_snapshot_list;
-  if (get_installed_snapshot_list(installed_snapshot_list) != 0)
+  // only user contents below the root, the root is restored by
+  // restore_snapshot
+  auto rel_path = path;
+  while (rel_path.size() > 1 && rel_path.back() == '/')
   {
-    return logger_->error("SnapshotController::install_snapshot: get installed "
-                          "snapshot list failed");
+    rel_path.pop_back();
   }
-  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
+  bool valid = rel_path.size() > 1 && rel_path[0] == '/' && !is_view_path(rel_path) &&
+               rel_path != "/lost+found" && rel_path.compare(0, 12, "/lost+found/") != 0;
+  for (size_t start = 1; valid && start < rel_path.size();)
   {
-    if (installed_snapshot_list[i] == *timestamp)
-    {
-      // snapshot is already installed
-      errno = EBUSY;
-      return logger_->error("SnapshotController::install_snapshot: snapshot is "
-                            "already installed, " +
-                            std::to_string(*timestamp));
-    }
+    auto end = std::min(rel_path.find('/', start), rel_path.size());
+    auto name = rel_path.substr(start, end - start);
+    valid = !name.empty() && name != "." && name != ".." && !is_buffer_path(name);
+    start = end + 1;
   }
-  // install snapshot
-
-  // download snapshot
-  auto tmp_path = std::string(state_->ssd_path) + "/.snapshot_tmp";
-  auto tar_path = tmp_path + ".tar";
-  auto object_key = "snapshot_" + std::to_string(*timestamp);
-  cloudfs_controller_->get_buffer_file_controller()->download_file(object_key,
-                                                                   tar_path);
-
-  // untar file
-  if (untar_file(tar_path, "/") != 0)
+  if (!valid)
   {
-    return logger_->error("SnapshotController::install_snapshot: untar file failed, " + tar_path);
+    errno = EINVAL;
+    return logger_->error("SnapshotController::restore_subtree: invalid path, " + path);
   }
-  remove(tar_path.c_str());
 
-  auto root_path = std::string(state_->ssd_path) + "/snapshot_" +
-                   std::to_string(*timestamp);
-  // create root path
-  if (mkdir(root_path.c_str(), 0777) != 0)
+  std::vector<SnapshotFile> chain;
+  if (fetch_chain(*timestamp, chain) != 0)
   {
-    return logger_->error(
-        "SnapshotController::install_snapshot: create root path failed, " +
-        root_path);
+    return logger_->error("SnapshotController::restore_subtree: fetch snapshot failed");
   }
-  root_path += "/";
-
-  // get ssd path length
-  auto ssd_path_len = std::string(state_->ssd_path).size();
-
-  FILE *tmp_file = fopen(tmp_path.c_str(), "r");
-  if (tmp_file == NULL)
+  auto ssd_path = std::string(state_->ssd_path);
+  std::map<std::string, EntryLocation> entries;
+  auto ret = compose_subtree(chain, ssd_path + rel_path, entries);
+  if (ret == 0 && entries.empty())
   {
-    return logger_->error(
-        "SnapshotController::install_snapshot: open tmp file failed, " +
-        tmp_path);
+    errno = ENOENT;
+    ret = logger_->error("SnapshotController::restore_subtree: not in the snapshot, " + rel_path);
   }
 
-  // read entry count
-  size_t entry_count;
-  fread(&entry_count, sizeof(size_t), 1, tmp_file);
-
-  cloudfs_controller_->get_chunk_table()->skip_snapshot(tmp_file); // skip chunk table
-
-  char buf[PATH_MAX + 1];
-  size_t processed = 0;
-  while (processed < entry_count)
+  // directories above the path that are gone are restored as well
+  for (auto end = rel_path.find('/', 1); ret == 0 && end != std::string::npos; end = rel_path.find('/', end + 1))
   {
-
-    // read stat struct
+    auto dir = ssd_path + rel_path.substr(0, end);
     struct stat st;
-    fread(&st, sizeof(struct stat), 1, tmp_file);
-
-    if (S_ISDIR(st.st_mode))
+    if (lstat(dir.c_str(), &st) == 0)
     {
-      // read dir path
-      size_t dir_path_len;
-      fread(&dir_path_len, sizeof(size_t), 1, tmp_file);
-      fread(buf, sizeof(char), dir_path_len, tmp_file);
-      std::string dir_path(buf, dir_path_len);
-      dir_path = root_path + dir_path.substr(ssd_path_len);
-
-      // create dir if not exist
-      if (mkdir(dir_path.c_str(), st.st_mode) != 0)
+      if (!S_ISDIR(st.st_mode))
       {
-        if (errno != EEXIST)
-        {
-          return logger_->error(
-              "SnapshotController::restore_snapshot: mkdir failed, " +
-              dir_path);
-        }
+        errno = ENOTDIR;
+        ret = logger_->error("SnapshotController::restore_subtree: not a directory, " + dir);
       }
-
-      processed++;
       continue;
     }
-
-    // read filepath
-    size_t filepath_len;
-    fread(&filepath_len, sizeof(size_t), 1, tmp_file);
-    fread(buf, sizeof(char), filepath_len, tmp_file);
-    std::string filepath(buf, filepath_len);
-    filepath = root_path + filepath.substr(ssd_path_len);
-
-    // create file if not exist, first create with full permission
-    auto file_fd = open(filepath.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0777);
-    if (file_fd == -1)
+    EntryLocation location;
+    ret = lookup_entry(chain, dir, location);
+    if (ret == 0)
     {
-      if (errno != EEXIST)
-      {
-        return logger_->error(
-            "SnapshotController::restore_snapshot: create file failed, " +
-            filepath);
-      }
-    }
-    close(file_fd);
-
-    // read chunk info
-    size_t num_chunks;
-    fread(&num_chunks, sizeof(size_t), 1, tmp_file);
-    std::vector<Chunk> chunks;
-    chunks.reserve(num_chunks);
-    for (size_t i = 0; i < num_chunks; i++)
-    {
-      off_t start;
-      fread(&start, sizeof(off_t), 1, tmp_file);
-      size_t len;
-      fread(&len, sizeof(size_t), 1, tmp_file);
-      size_t key_len;
-      fread(&key_len, sizeof(size_t), 1, tmp_file);
-      std::vector<char> key(key_len);
-      fread(key.data(), sizeof(char), key_len, tmp_file);
-      std::string key_str(key.begin(), key.end());
-      chunks.emplace_back(start, len, key_str);
+      entries[dir] = location;
     }
-    // write chunks to file
-    auto ret = cloudfs_controller_->set_chunkinfo(filepath, chunks);
-    if (ret != 0)
+    else if (ret == 1)
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: set chunk info failed, " +
-          filepath);
+      errno = ENOENT;
+      ret = logger_->error("SnapshotController::restore_subtree: parent not in the snapshot, " + dir);
     }
+  }
 
-    // read buffer path
-    size_t buffer_path_len;
-    fread(&buffer_path_len, sizeof(size_t), 1, tmp_file);
-    fread(buf, sizeof(char), buffer_path_len, tmp_file);
-    std::string buffer_path(buf, buffer_path_len);
-    buffer_path = root_path + buffer_path.substr(ssd_path_len);
-    // set buffer path
-    ret = cloudfs_controller_->set_buffer_path(filepath, buffer_path);
-    if (ret != 0)
+  // the live subtree releases its chunks, the restored one takes references
+  // on the chunks of the snapshot, the rest of the chunk table is untouched
+  if (ret == 0)
+  {
+    ret = remove_subtree(rel_path);
+  }
+  if (ret == 0)
+  {
+    for (auto &it : entries)
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: set buffer path failed, " +
-          filepath);
+      journal_->record(it.first.substr(ssd_path.size()));
     }
-
-    // create buffer file if not exist
-    auto buffer_fd =
-        open(buffer_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0777);
-    if (buffer_fd == -1)
+    ret = apply_entries(chain, entries, true, true);
+    if (!cloudfs_controller_->get_chunk_table()->commit() && ret == 0)
     {
-      if (errno != EEXIST)
-      {
-        return logger_->error(
-            "SnapshotController::restore_snapshot: open buffer file failed, " +
-            buffer_path);
-      }
+      ret = logger_->error("SnapshotController::restore_subtree: commit chunk table failed");
     }
-    close(buffer_fd);
+  }
+  close_chain(chain);
+  if (ret != 0)
+  {
+    return ret;
+  }
+  logger_->info("SnapshotController::restore_subtree: restored ", rel_path, " from snapshot ",
+                *timestamp, ", ", entries.size(), " entries");
+  return 0;
+}
 
-    // read file size
-    size_t file_size;
-    fread(&file_size, sizeof(size_t), 1, tmp_file);
-    // set file size
-    ret = cloudfs_controller_->set_size(buffer_path, file_size);
+int SnapshotController::list_snapshots(unsigned long *snapshot_list)
+{
+  std::vector<unsigned long> snapshot_list_vec;
+  if (get_snapshot_list(snapshot_list_vec) != 0)
+  {
+    return logger_->error(
+        "SnapshotController::list_snapshots: get snapshot list failed");
+  }
+  for (size_t i = 0; i < snapshot_list_vec.size(); i++)
+  {
+    snapshot_list[i] = snapshot_list_vec[i];
+  }
+  snapshot_list[snapshot_list_vec.size()] = 0; // set 0 to indicate end
+  return 0;
+}
+
+int SnapshotController::diff_snapshots(struct cloudfs_diff *diff)
+{
+  if (diff->cursor == 0)
+  {
+    diff_records_.clear();
+    auto ret = compute_diff(diff->from, diff->to, diff_records_);
     if (ret != 0)
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: set file size failed, " +
-          buffer_path);
+      diff_records_.clear();
+      return ret;
     }
+    diff_from_ = diff->from;
+    diff_to_ = diff->to;
+  }
+  else if (diff_records_.empty() || diff->from != diff_from_ || diff->to != diff_to_ ||
+           diff->cursor >= diff_records_.size())
+  {
+    errno = EINVAL;
+    return logger_->error("SnapshotController::diff_snapshots: no pending diff at cursor ",
+                          diff->cursor);
+  }
 
-    if ((int)file_size <= state_->threshold)
-    {
-      // small file, copy content to buffer file
-      FILE *file = fopen(buffer_path.c_str(), "w");
-      if (file == NULL)
-      {
-        return logger_->error(
-            "SnapshotController::restore_snapshot: open buffer file failed, " +
-            buffer_path);
-      }
-      size_t read_size = 0;
-      while (read_size < file_size)
-      {
-        size_t to_read = std::min(file_size - read_size, sizeof(buf));
-        auto n = fread(buf, sizeof(char), to_read, tmp_file);
-        if (n != to_read)
-        {
-          return logger_->error(
-              "SnapshotController::restore_snapshot: read tmp file failed, " +
-              tmp_path);
-        }
-        fwrite(buf, sizeof(char), n, file);
-        read_size += n;
-      }
-      fclose(file);
-    }
+  // whole records only, the rest goes to the next page
+  size_t used = 0;
+  auto i = diff->cursor;
+  while (i < diff_records_.size() && used + diff_records_[i].size() < sizeof(diff->buf))
+  {
+    memcpy(diff->buf + used, diff_records_[i].data(), diff_records_[i].size());
+    used += diff_records_[i].size();
+    i++;
+  }
+  if (i == diff->cursor && i < diff_records_.size())
+  {
+    errno = EOVERFLOW;
+    return logger_->error("SnapshotController::diff_snapshots: record too long at cursor ", i);
+  }
+  diff->buf[used] = '\0';
+  diff->count = i - diff->cursor;
+  diff->cursor = i;
+  diff->total = diff_records_.size();
+  if (i == diff_records_.size())
+  {
+    // the last page was returned
+    std::vector<std::string>().swap(diff_records_);
+  }
+  return 0;
+}
+
+int SnapshotController::compute_diff(unsigned long from, unsigned long to, std::vector<std::string> &records)
+{
+  std::vector<unsigned long> snapshot_list;
+  if (get_snapshot_list(snapshot_list) != 0)
+  {
+    return logger_->error("SnapshotController::compute_diff: get snapshot list failed");
+  }
+  auto exists = [&snapshot_list](unsigned long ts)
+  { return std::find(snapshot_list.begin(), snapshot_list.end(), ts) != snapshot_list.end(); };
+  if (!exists(from) || (to != 0 && !exists(to)))
+  {
+    errno = EINVAL;
+    return logger_->error("SnapshotController::compute_diff: snapshot not found");
+  }
+
+  // the live tree is written before any snapshot is downloaded, it becomes
+  // the end of the chain of its base
+  std::vector<SnapshotFile> files;
+  std::vector<SnapshotFile> from_chain;
+  std::vector<SnapshotFile> to_chain;
+  int ret = 0;
+  unsigned long to_base = to;
+  if (to == 0)
+  {
+    files.emplace_back();
+    ret = write_live(files.back());
+    to_base = files.back().parent_;
+  }
+  if (ret == 0)
+  {
+    ret = fetch_chains(from, to_base, files, from_chain, to_chain);
+  }
+  if (ret == 0 && to == 0)
+  {
+    to_chain.push_back(files.front());
+  }
+
+  // a snapshot differs from a later one of its chain only in the paths of
+  // the snapshots in between
+  bool in_chain = from_chain.size() <= to_chain.size();
+  for (size_t i = 0; in_chain && i < from_chain.size(); i++)
+  {
+    in_chain = from_chain[i].timestamp_ == to_chain[i].timestamp_;
+  }
+  std::map<std::string, EntryLocation> old_entries;
+  std::map<std::string, EntryLocation> new_entries;
+  if (ret == 0 && in_chain)
+  {
+    std::set<std::string> paths;
+    for (size_t i = from_chain.size(); ret == 0 && i < to_chain.size(); i++)
+    {
+      auto &snapshot = to_chain[i];
+
+      // a removed path or a file that replaced a directory drops the old
+      // entries below it
+      auto dropped = snapshot.removed_;
+      for (size_t j = 0; ret == 0 && j < snapshot.entry_count_; j++)
+      {
+        std::string path;
+        long offset;
+        struct stat st;
+        ret = read_index_path(snapshot, j, path, offset);
+        if (ret == 0 && (fseek(snapshot.file_, offset, SEEK_SET) != 0 ||
+                         fread(&st, sizeof(struct stat), 1, snapshot.file_) != 1))
+        {
+          errno = EIO;
+          ret = logger_->error("SnapshotController::compute_diff: read entry failed, " + path);
+        }
+        if (ret == 0 && !S_ISDIR(st.st_mode))
+        {
+          dropped.push_back(path);
+        }
+        paths.insert(std::move(path));
+      }
+      for (size_t j = 0; ret == 0 && j < dropped.size(); j++)
+      {
+        std::map<std::string, EntryLocation> below;
+        ret = compose_subtree(from_chain, dropped[j], below);
+        for (auto &it : below)
+        {
+          paths.insert(it.first);
+        }
+      }
+    }
+
+    for (auto it = paths.begin(); ret >= 0 && it != paths.end(); it++)
+    {
+      EntryLocation location;
+      ret = lookup_entry(from_chain, *it, location);
+      if (ret == 0)
+      {
+        old_entries[*it] = location;
+      }
+      if (ret >= 0)
+      {
+        ret = lookup_entry(to_chain, *it, location);
+      }
+      if (ret == 0)
+      {
+        new_entries[*it] = location;
+      }
+    }
+    ret = std::min(ret, 0);
+  }
+  else if (ret == 0)
+  {
+    std::set<std::string> removed;
+    ret = compose_chain(from_chain, old_entries, removed);
+    if (ret == 0)
+    {
+      ret = compose_chain(to_chain, new_entries, removed);
+    }
+  }
+
+  // merge in path order, an entry both chains share is unchanged
+  auto old_it = old_entries.begin();
+  auto new_it = new_entries.begin();
+  while (ret == 0 && (old_it != old_entries.end() || new_it != new_entries.end()))
+  {
+    int cmp = old_it == old_entries.end()   ? 1
+              : new_it == new_entries.end() ? -1
+                                            : old_it->first.compare(new_it->first);
+    auto from_location = cmp <= 0 ? &old_it->second : NULL;
+    auto to_location = cmp >= 0 ? &new_it->second : NULL;
+    bool shared = from_location != NULL && to_location != NULL &&
+                  from_chain[from_location->file_].timestamp_ != 0 &&
+                  from_chain[from_location->file_].timestamp_ == to_chain[to_location->file_].timestamp_ &&
+                  from_location->begin_ == to_location->begin_;
+    if (!shared)
+    {
+      ret = diff_entry(cmp <= 0 ? old_it->first : new_it->first, from_chain, from_location,
+                       to_chain, to_location, records);
+    }
+    if (cmp <= 0)
+    {
+      old_it++;
+    }
+    if (cmp >= 0)
+    {
+      new_it++;
+    }
+  }
+  close_chain(files);
+  if (ret != 0)
+  {
+    logger_->error("SnapshotController::compute_diff: diff failed, " + std::to_string(from));
+    return ret;
+  }
+  logger_->info("SnapshotController::compute_diff: ", from, " to ", to, ", ", records.size(),
+                " changes", in_chain ? ", from the indexes" : "");
+  return 0;
+}
+
+int SnapshotController::diff_entry(const std::string &path, std::vector<SnapshotFile> &from_chain,
+                                   const EntryLocation *from, std::vector<SnapshotFile> &to_chain,
+                                   const EntryLocation *to, std::vector<std::string> &records)
+{
+  SnapshotEntry old_entry;
+  SnapshotEntry new_entry;
+  FILE *old_file = from != NULL ? from_chain[from->file_].file_ : NULL;
+  FILE *new_file = to != NULL ? to_chain[to->file_].file_ : NULL;
+  if ((from != NULL && (fseek(old_file, from->begin_, SEEK_SET) != 0 || read_entry(old_file, old_entry) != 0)) ||
+      (to != NULL && (fseek(new_file, to->begin_, SEEK_SET) != 0 || read_entry(new_file, new_entry) != 0)))
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::diff_entry: read entry failed, " + path);
+  }
+  auto rel_path = path.substr(std::string(state_->ssd_path).size());
+  bool old_dir = from != NULL && S_ISDIR(old_entry.st_.st_mode);
+  bool new_dir = to != NULL && S_ISDIR(new_entry.st_.st_mode);
+  std::vector<std::pair<off_t, size_t>> ranges;
+
+  // a path that changed between file and directory is removed and added
+  if (from != NULL && (to == NULL || old_dir != new_dir))
+  {
+    records.push_back(format_diff_record('D', old_dir, old_entry.size_, 0, ranges, rel_path));
+  }
+  if (to != NULL && (from == NULL || old_dir != new_dir))
+  {
+    if (new_entry.size_ > 0)
+    {
+      ranges.emplace_back(0, new_entry.size_);
+    }
+    records.push_back(format_diff_record('A', new_dir, 0, new_entry.size_, ranges, rel_path));
+  }
+  if (from == NULL || to == NULL || old_dir != new_dir)
+  {
+    return 0;
+  }
+
+  bool modified = old_entry.st_.st_mode != new_entry.st_.st_mode ||
+                  old_entry.st_.st_uid != new_entry.st_.st_uid ||
+                  old_entry.st_.st_gid != new_entry.st_.st_gid ||
+                  old_entry.size_ != new_entry.size_;
+  bool old_small = old_entry.data_pos_ >= 0 || !old_entry.blob_.empty();
+  bool new_small = new_entry.data_pos_ >= 0 || !new_entry.blob_.empty();
+  if (new_dir)
+  {
+    // directories only change their attributes
+  }
+  else if (old_small && new_small)
+  {
+    // small files, the range between the common prefix and suffix changed,
+    // contents held by the same chunk are equal
+    std::string old_data;
+    std::string new_data;
+    if ((old_entry.blob_.empty() || old_entry.blob_ != new_entry.blob_) &&
+        (read_contents(old_file, old_entry, old_data) != 0 ||
+         read_contents(new_file, new_entry, new_data) != 0))
+    {
+      return -errno;
+    }
+    size_t begin = 0;
+    while (begin < old_data.size() && begin < new_data.size() && old_data[begin] == new_data[begin])
+    {
+      begin++;
+    }
+    size_t old_end = old_data.size();
+    size_t new_end = new_data.size();
+    while (old_end > begin && new_end > begin && old_data[old_end - 1] == new_data[new_end - 1])
+    {
+      old_end--;
+      new_end--;
+    }
+    modified = modified || old_end > begin || new_end > begin;
+    if (new_end > begin)
+    {
+      ranges.emplace_back(begin, new_end - begin);
+    }
+  }
+  else if (!old_small && !new_small)
+  {
+    // large files, the chunks the old file does not have changed
+    std::unordered_set<std::string> old_keys;
+    bool same = old_entry.chunks_.size() == new_entry.chunks_.size();
+    for (size_t i = 0; i < old_entry.chunks_.size(); i++)
+    {
+      old_keys.insert(old_entry.chunks_[i].key_);
+      same = same && old_entry.chunks_[i].key_ == new_entry.chunks_[i].key_ &&
+             old_entry.chunks_[i].len_ == new_entry.chunks_[i].len_;
+    }
+    modified = modified || !same;
+    for (auto &chunk : new_entry.chunks_)
+    {
+      if (old_keys.count(chunk.key_) > 0)
+      {
+        continue;
+      }
+      if (!ranges.empty() && ranges.back().first + (off_t)ranges.back().second == chunk.start_)
+      {
+        ranges.back().second += chunk.len_;
+      }
+      else
+      {
+        ranges.emplace_back(chunk.start_, chunk.len_);
+      }
+    }
+  }
+  else
+  {
+    // moved across the size threshold, stored differently
+    modified = true;
+    if (new_entry.size_ > 0)
+    {
+      ranges.emplace_back(0, new_entry.size_);
+    }
+  }
+  if (modified)
+  {
+    records.push_back(format_diff_record('M', new_dir, old_entry.size_, new_entry.size_, ranges, rel_path));
+  }
+  return 0;
+}
+
+int SnapshotController::write_live(SnapshotFile &live)
+{
+  // the journal covers the changes since its base if it has one
+  std::vector<unsigned long> snapshot_list;
+  if (get_snapshot_list(snapshot_list) != 0)
+  {
+    return logger_->error("SnapshotController::write_live: get snapshot list failed");
+  }
+  unsigned long parent = journal_->base();
+  if (std::find(snapshot_list.begin(), snapshot_list.end(), parent) == snapshot_list.end())
+  {
+    parent = 0;
+  }
+  std::vector<std::pair<std::string, struct stat>> changed;
+  std::vector<std::string> removed;
+  if (parent != 0)
+  {
+    auto ret = collect_changes(changed, removed);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (ret == 1)
+    {
+      parent = 0;
+      changed.clear();
+      removed.clear();
+    }
+  }
+
+  // the scratch file is gone once it is closed
+  auto scratch_path = std::string(state_->ssd_path) + "/.snapshot_diff_XXXXXX";
+  std::vector<char> name(scratch_path.begin(), scratch_path.end());
+  name.push_back('\0');
+  int scratch_fd = mkstemp(name.data());
+  if (scratch_fd == -1)
+  {
+    return logger_->error("SnapshotController::write_live: create scratch file failed");
+  }
+  unlink(name.data());
+  FILE *file = fdopen(scratch_fd, "w+");
+  if (file == NULL)
+  {
+    close(scratch_fd);
+    return logger_->error("SnapshotController::write_live: open scratch file failed");
+  }
+
+  // laid out like the sections of a snapshot from the removed paths on, the
+  // contents of small files are copied as nothing is uploaded for a diff
+  std::sort(removed.begin(), removed.end());
+  write_removed(file, removed);
+  live.entries_pos_ = ftell(file);
+  std::vector<std::pair<std::string, long>> offsets;
+  auto ret = parent != 0 ? write_changed_entries(file, changed, offsets, NULL)
+                         : write_all_entries(file, offsets, NULL);
+  if (ret == 0 && fflush(file) != 0)
+  {
+    ret = logger_->error("SnapshotController::write_live: write scratch file failed");
+  }
+  if (ret != 0)
+  {
+    fclose(file);
+    return ret;
+  }
+  std::sort(offsets.begin(), offsets.end());
+  live.timestamp_ = 0;
+  live.parent_ = parent;
+  live.file_ = file;
+  live.entry_count_ = offsets.size();
+  live.removed_ = std::move(removed);
+  live.index_pos_ = -1;
+  live.index_.clear();
+  for (auto &it : offsets)
+  {
+    live.index_.push_back(it.second);
+  }
+  return 0;
+}
+
+int SnapshotController::delete_snapshot(unsigned long *timestamp)
+{
+  logger_->debug("SnapshotController::delete_snapshot: delete snapshot, " +
+                 std::to_string(*timestamp));
+
+  // check if snapshot exists
+  std::vector<unsigned long> snapshot_list;
+  if (get_snapshot_list(snapshot_list) != 0)
+  {
+    return logger_->error(
+        "SnapshotController::delete_snapshot: get snapshot list failed");
+  }
+  bool found = false;
+  for (size_t i = 0; i < snapshot_list.size(); i++)
+  {
+    if (snapshot_list[i] == *timestamp)
+    {
+      found = true;
+      break;
+    }
+  }
+  if (!found)
+  {
+    // snapshot not found
+    errno = EINVAL;
+    return logger_->error(
+        "SnapshotController::delete_snapshot: snapshot not found, " +
+        std::to_string(*timestamp));
+  }
+
+  // check if snapshot is installed
+  std::vector<unsigned long> installed_snapshot_list;
+  if (get_installed_snapshot_list(installed_snapshot_list) != 0)
+  {
+    return logger_->error("SnapshotController::delete_snapshot: get installed "
+                          "snapshot list failed");
+  }
+  bool installed = false;
+  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
+  {
+    if (installed_snapshot_list[i] == *timestamp)
+    {
+      installed = true;
+      break;
+    }
+  }
+  if (installed)
+  {
+    // cannot delete installed snapshot
+    errno = EBUSY;
+    return logger_->error(
+        "SnapshotController::delete_snapshot: snapshot is installed, " +
+        std::to_string(*timestamp));
+  }
+  // delete snapshot
+
+  // first download snapshot
+  std::vector<SnapshotFile> chain(1);
+  auto &snapshot = chain[0];
+  if (fetch_snapshot(*timestamp, snapshot) != 0)
+  {
+    close_chain(chain);
+    return logger_->error("SnapshotController::delete_snapshot: fetch snapshot failed, " +
+                          std::to_string(*timestamp));
+  }
+  std::set<std::string> blobs;
+  if (collect_blobs(snapshot, blobs) != 0)
+  {
+    close_chain(chain);
+    return logger_->error("SnapshotController::delete_snapshot: read entries failed, " +
+                          std::to_string(*timestamp));
+  }
+
+  // the children of an incremental chain take over the entries of the
+  // deleted snapshot
+  for (auto &ts : snapshot_list)
+  {
+    if (ts != *timestamp && get_snapshot_parent(ts) == *timestamp &&
+        fold_into_child(snapshot, ts) != 0)
+    {
+      close_chain(chain);
+      return logger_->error("SnapshotController::delete_snapshot: fold into child failed, " +
+                            std::to_string(ts));
+    }
+  }
+
+  // the changes since the deleted snapshot become changes since its parent
+  if (journal_->base() == *timestamp)
+  {
+    if (snapshot.parent_ == 0)
+    {
+      journal_->reset(0);
+    }
+    else
+    {
+      std::vector<std::string> changed(journal_->paths().begin(), journal_->paths().end());
+      auto ssd_path_len = std::string(state_->ssd_path).size();
+      for (auto &path : snapshot.removed_)
+      {
+        changed.push_back(path.substr(ssd_path_len));
+      }
+      bool complete = true;
+      fseek(snapshot.file_, snapshot.entries_pos_, SEEK_SET);
+      for (size_t i = 0; complete && i < snapshot.entry_count_; i++)
+      {
+        SnapshotEntry entry;
+        complete = read_entry(snapshot.file_, entry) == 0;
+        if (complete)
+        {
+          changed.push_back(entry.path_.substr(ssd_path_len));
+        }
+      }
+      journal_->reset(complete ? snapshot.parent_ : 0);
+      for (auto &path : changed)
+      {
+        journal_->record(path);
+      }
+    }
+  }
+
+  fseek(snapshot.file_, snapshot.table_pos_, SEEK_SET); // skip header
+
+  cloudfs_controller_->get_chunk_table()->snapshot_deleted(
+      snapshot.file_); // chunk table will read chunk table info in the tmp file and handle ref count decreasing
+
+  auto parts = snapshot.parts_;
+  close_chain(chain);
+
+  // delete cloud object
+  auto object_key = "snapshot_" + std::to_string(*timestamp);
+  SnapshotStream::remove(cloudfs_controller_->get_buffer_file_controller(), object_key, parts, false);
+
+  // release the small files, the children hold the ones they took over
+  release_blobs(blobs);
+
+  // delete from snapshot_list
+  std::vector<unsigned long> new_snapshot_list;
+  for (size_t i = 0; i < snapshot_list.size(); i++)
+  {
+    if (snapshot_list[i] != *timestamp)
+    {
+      new_snapshot_list.push_back(snapshot_list[i]);
+    }
+  }
+
+  // update snapshot info, the parent of the snapshot is dropped with it
+  return set_snapshot_list(new_snapshot_list);
+}
+
+int SnapshotController::install_snapshot(unsigned long *timestamp)
+{
+  logger_->debug("SnapshotController::install_snapshot: install snapshot, " +
+                 std::to_string(*timestamp));
+
+  // check if snapshot exists
+  std::vector<unsigned long> snapshot_list;
+  if (get_snapshot_list(snapshot_list) != 0)
+  {
+    return logger_->error(
+        "SnapshotController::install_snapshot: get snapshot list failed");
+  }
+  bool found = false;
+  for (size_t i = 0; i < snapshot_list.size(); i++)
+  {
+    if (snapshot_list[i] == *timestamp)
+    {
+      found = true;
+      break;
+    }
+  }
+  if (!found)
+  {
+    // snapshot not found
+    errno = EINVAL;
+    return logger_->error(
+        "SnapshotController::install_snapshot: snapshot not found, " +
+        std::to_string(*timestamp));
+  }
+
+  // check if snapshot is already installed
+  std::vector<unsigned long> installed_snapshot_list;
+  if (get_installed_snapshot_list(installed_snapshot_list) != 0)
+  {
+    return logger_->error("SnapshotController::install_snapshot: get installed "
+                          "snapshot list failed");
+  }
+  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
+  {
+    if (installed_snapshot_list[i] == *timestamp)
+    {
+      // snapshot is already installed
+      errno = EBUSY;
+      return logger_->error("SnapshotController::install_snapshot: snapshot is "
+                            "already installed, " +
+                            std::to_string(*timestamp));
+    }
+  }
+  // install snapshot, its entries are only indexed, nothing is written to
+  // the SSD
+  auto root_path = std::string(state_->ssd_path) + "/snapshot_" +
+                   std::to_string(*timestamp);
+  struct stat st;
+  if (lstat(root_path.c_str(), &st) == 0)
+  {
+    errno = EEXIST;
+    return logger_->error(
+        "SnapshotController::install_snapshot: root path exists, " +
+        root_path);
+  }
+  std::unique_ptr<InstalledView> view(new InstalledView());
+  auto ret = load_view(*timestamp, *view);
+  if (ret != 0)
+  {
+    return ret;
+  }
+  views_[*timestamp] = std::move(view);
+
+  // update installed snapshot list
+  installed_snapshot_list.push_back(*timestamp);
+  set_installed_snapshot_count(installed_snapshot_list.size());
+  set_installed_snapshot_list(installed_snapshot_list);
+  return 0;
+}
+
+int SnapshotController::fetch_snapshot(unsigned long timestamp, SnapshotFile &snapshot)
+{
+  // download and decompress in one pass, entries are read from the local
+  // copy as a chain is composed out of order
+  snapshot.timestamp_ = timestamp;
+  snapshot.path_ = std::string(state_->ssd_path) + "/.snapshot_tmp_" + std::to_string(timestamp);
+  auto object_key = "snapshot_" + std::to_string(timestamp);
+  if (SnapshotStream::download(cloudfs_controller_->get_buffer_file_controller(), object_key,
+                               snapshot.path_, snapshot.parts_, logger_) != 0)
+  {
+    remove(snapshot.path_.c_str());
+    return logger_->error("SnapshotController::fetch_snapshot: download failed, " + object_key);
+  }
+  snapshot.file_ = fopen(snapshot.path_.c_str(), "r");
+  if (snapshot.file_ == NULL)
+  {
+    remove(snapshot.path_.c_str());
+    return logger_->error(
+        "SnapshotController::fetch_snapshot: open tmp file failed, " +
+        snapshot.path_);
+  }
+
+  // read header, files without the magic are full snapshots
+  uint64_t magic = 0;
+  fread(&magic, sizeof(uint64_t), 1, snapshot.file_);
+  bool incremental = magic == SNAPSHOT_MAGIC || magic == SNAPSHOT_MAGIC_V2;
+  snapshot.index_pos_ = -1;
+  snapshot.index_.clear();
+  if (magic == SNAPSHOT_MAGIC)
+  {
+    // the footer locates the sections, the chunk table is not read
+    uint64_t parent;
+    uint64_t footer[5];
+    if (fread(&parent, sizeof(uint64_t), 1, snapshot.file_) != 1 ||
+        fseek(snapshot.file_, -(long)sizeof(footer), SEEK_END) != 0 ||
+        fread(footer, sizeof(uint64_t), 5, snapshot.file_) != 5 || footer[4] != INDEX_MAGIC)
+    {
+      errno = EIO;
+      return logger_->error("SnapshotController::fetch_snapshot: read footer failed, " +
+                            snapshot.path_);
+    }
+    snapshot.parent_ = parent;
+    snapshot.table_pos_ = footer[0];
+    snapshot.table_end_ = footer[1];
+    snapshot.index_pos_ = footer[2];
+    snapshot.entry_count_ = footer[3];
+    fseek(snapshot.file_, snapshot.table_end_, SEEK_SET);
+  }
+  else if (incremental)
+  {
+    uint64_t parent;
+    fread(&parent, sizeof(uint64_t), 1, snapshot.file_);
+    snapshot.parent_ = parent;
+    fread(&snapshot.entry_count_, sizeof(size_t), 1, snapshot.file_);
+    if (snapshot.entry_count_ == ENTRY_COUNT_AT_END)
+    {
+      // streamed snapshots end with the entry count
+      auto pos = ftell(snapshot.file_);
+      fseek(snapshot.file_, -(long)sizeof(size_t), SEEK_END);
+      fread(&snapshot.entry_count_, sizeof(size_t), 1, snapshot.file_);
+      fseek(snapshot.file_, pos, SEEK_SET);
+    }
+  }
+  else
+  {
+    snapshot.parent_ = 0;
+    snapshot.entry_count_ = magic;
+  }
+
+  if (snapshot.index_pos_ < 0)
+  {
+    // locate chunk table
+    snapshot.table_pos_ = ftell(snapshot.file_);
+    cloudfs_controller_->get_chunk_table()->skip_snapshot(snapshot.file_);
+    snapshot.table_end_ = ftell(snapshot.file_);
+  }
+
+  // read removed paths
+  snapshot.removed_.clear();
+  if (incremental)
+  {
+    size_t removed_count = 0;
+    fread(&removed_count, sizeof(size_t), 1, snapshot.file_);
+    char buf[PATH_MAX + 1];
+    for (size_t i = 0; i < removed_count; i++)
+    {
+      size_t path_len = 0;
+      if (fread(&path_len, sizeof(size_t), 1, snapshot.file_) != 1 || path_len > PATH_MAX ||
+          fread(buf, sizeof(char), path_len, snapshot.file_) != path_len)
+      {
+        errno = EIO;
+        return logger_->error("SnapshotController::fetch_snapshot: read removed paths failed, " +
+                              snapshot.path_);
+      }
+      snapshot.removed_.emplace_back(buf, path_len);
+    }
+    std::sort(snapshot.removed_.begin(), snapshot.removed_.end());
+  }
+  snapshot.entries_pos_ = ftell(snapshot.file_);
+  if (snapshot.index_pos_ < 0)
+  {
+    return index_entries(snapshot);
+  }
+  return 0;
+}
+
+int SnapshotController::fetch_chain(unsigned long timestamp, std::vector<SnapshotFile> &chain)
+{
+  // follow the parents back to the full snapshot
+  std::vector<SnapshotFile> reversed;
+  auto ts = timestamp;
+  while (ts != 0)
+  {
+    reversed.emplace_back();
+    if (fetch_snapshot(ts, reversed.back()) != 0)
+    {
+      int err = errno;
+      close_chain(reversed);
+      errno = err;
+      return logger_->error("SnapshotController::fetch_chain: fetch snapshot failed, " +
+                            std::to_string(ts));
+    }
+    ts = reversed.back().parent_;
+  }
+  chain.assign(reversed.rbegin(), reversed.rend());
+  return 0;
+}
+
+int SnapshotController::fetch_chains(unsigned long from, unsigned long to, std::vector<SnapshotFile> &files,
+                                     std::vector<SnapshotFile> &from_chain, std::vector<SnapshotFile> &to_chain)
+{
+  // both chains follow the parents back to their full snapshots
+  for (int side = 0; side < 2; side++)
+  {
+    std::vector<SnapshotFile> reversed;
+    auto ts = side == 0 ? from : to;
+    while (ts != 0)
+    {
+      auto it = std::find_if(files.begin(), files.end(), [ts](const SnapshotFile &file)
+                             { return file.timestamp_ == ts; });
+      if (it == files.end())
+      {
+        files.emplace_back();
+        if (fetch_snapshot(ts, files.back()) != 0)
+        {
+          return logger_->error("SnapshotController::fetch_chains: fetch snapshot failed, " +
+                                std::to_string(ts));
+        }
+        it = files.end() - 1;
+      }
+      reversed.push_back(*it);
+      ts = it->parent_;
+    }
+    (side == 0 ? from_chain : to_chain).assign(reversed.rbegin(), reversed.rend());
+  }
+  return 0;
+}
+
+void SnapshotController::close_chain(std::vector<SnapshotFile> &chain)
+{
+  for (auto &snapshot : chain)
+  {
+    if (snapshot.file_ != NULL)
+    {
+      fclose(snapshot.file_);
+      snapshot.file_ = NULL;
+    }
+    if (!snapshot.path_.empty())
+    {
+      remove(snapshot.path_.c_str());
+    }
+  }
+  chain.clear();
+}
+
+int SnapshotController::index_entries(SnapshotFile &snapshot)
+{
+  std::vector<std::pair<std::string, long>> offsets;
+  offsets.reserve(snapshot.entry_count_);
+  fseek(snapshot.file_, snapshot.entries_pos_, SEEK_SET);
+  for (size_t i = 0; i < snapshot.entry_count_; i++)
+  {
+    long offset = ftell(snapshot.file_);
+    SnapshotEntry entry;
+    if (read_entry(snapshot.file_, entry) != 0)
+    {
+      return logger_->error("SnapshotController::index_entries: read entry failed, " +
+                            std::to_string(snapshot.timestamp_));
+    }
+    offsets.emplace_back(std::move(entry.path_), offset);
+  }
+  std::sort(offsets.begin(), offsets.end());
+  snapshot.index_.clear();
+  snapshot.index_.reserve(offsets.size());
+  for (auto &it : offsets)
+  {
+    snapshot.index_.push_back(it.second);
+  }
+  return 0;
+}
+
+int SnapshotController::read_index_path(SnapshotFile &snapshot, size_t i, std::string &path, long &offset)
+{
+  if (snapshot.index_pos_ < 0)
+  {
+    offset = snapshot.index_[i];
+  }
+  else
+  {
+    uint64_t offset64 = 0;
+    if (fseek(snapshot.file_, snapshot.index_pos_ + i * sizeof(uint64_t), SEEK_SET) != 0 ||
+        fread(&offset64, sizeof(uint64_t), 1, snapshot.file_) != 1)
+    {
+      errno = EIO;
+      return logger_->error("SnapshotController::read_index_path: read index failed, " +
+                            std::to_string(snapshot.timestamp_));
+    }
+    offset = offset64;
+  }
+
+  // the path follows the stat struct
+  char buf[PATH_MAX + 1];
+  size_t path_len = 0;
+  if (fseek(snapshot.file_, offset + sizeof(struct stat), SEEK_SET) != 0 ||
+      fread(&path_len, sizeof(size_t), 1, snapshot.file_) != 1 || path_len > PATH_MAX ||
+      fread(buf, sizeof(char), path_len, snapshot.file_) != path_len)
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::read_index_path: read path failed, " +
+                          std::to_string(snapshot.timestamp_));
+  }
+  path.assign(buf, path_len);
+  return 0;
+}
+
+int SnapshotController::lower_bound_entry(SnapshotFile &snapshot, const std::string &path, size_t &i)
+{
+  size_t low = 0;
+  size_t high = snapshot.entry_count_;
+  std::string mid_path;
+  long offset;
+  while (low < high)
+  {
+    auto mid = low + (high - low) / 2;
+    if (read_index_path(snapshot, mid, mid_path, offset) != 0)
+    {
+      return -errno;
+    }
+    if (mid_path < path)
+    {
+      low = mid + 1;
+    }
+    else
+    {
+      high = mid;
+    }
+  }
+  i = low;
+  return 0;
+}
+
+int SnapshotController::find_entry(SnapshotFile &snapshot, const std::string &path, long &offset)
+{
+  size_t i;
+  if (lower_bound_entry(snapshot, path, i) != 0)
+  {
+    return -errno;
+  }
+  if (i == snapshot.entry_count_)
+  {
+    return 1;
+  }
+  std::string found;
+  if (read_index_path(snapshot, i, found, offset) != 0)
+  {
+    return -errno;
+  }
+  return found == path ? 0 : 1;
+}
+
+int SnapshotController::lookup_entry(std::vector<SnapshotFile> &chain, const std::string &path,
+                                     EntryLocation &location)
+{
+  // newest first, the same rules as compose_chain in reverse
+  for (size_t i = chain.size(); i-- > 0;)
+  {
+    auto &snapshot = chain[i];
+    long offset;
+    auto ret = find_entry(snapshot, path, offset);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (ret == 0)
+    {
+      location.file_ = i;
+      location.begin_ = offset;
+      location.end_ = -1;
+      return 0;
+    }
+
+    ret = drops_path(snapshot, path);
+    if (ret != 0)
+    {
+      return ret;
+    }
+  }
+  return 1;
+}
+
+int SnapshotController::drops_path(SnapshotFile &snapshot, const std::string &path)
+{
+  auto root_len = std::string(state_->ssd_path).size();
+  for (auto end = path.size(); end != std::string::npos && end > root_len; end = path.rfind('/', end - 1))
+  {
+    auto ancestor = path.substr(0, end);
+    if (std::binary_search(snapshot.removed_.begin(), snapshot.removed_.end(), ancestor))
+    {
+      return 1;
+    }
+    if (end == path.size())
+    {
+      continue;
+    }
+    long offset;
+    auto ret = find_entry(snapshot, ancestor, offset);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    struct stat st;
+    if (ret == 0 && fseek(snapshot.file_, offset, SEEK_SET) == 0 &&
+        fread(&st, sizeof(struct stat), 1, snapshot.file_) == 1 && !S_ISDIR(st.st_mode))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int SnapshotController::list_entries(std::vector<SnapshotFile> &chain, const std::string &path,
+                                     std::set<std::string> &names)
+{
+  // oldest first, the same rules as compose_chain
+  auto prefix = path + "/";
+  for (auto &snapshot : chain)
+  {
+    // dropping the directory drops all names, as does a file replacing it
+    auto ret = drops_path(snapshot, path);
+    if (ret == 0)
+    {
+      long offset;
+      struct stat st;
+      ret = find_entry(snapshot, path, offset);
+      if (ret == 1)
+      {
+        ret = 0; // not in this snapshot
+      }
+      else if (ret == 0 && fseek(snapshot.file_, offset, SEEK_SET) == 0 &&
+               fread(&st, sizeof(struct stat), 1, snapshot.file_) == 1 && !S_ISDIR(st.st_mode))
+      {
+        ret = 1;
+      }
+    }
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (ret == 1)
+    {
+      names.clear();
+    }
+
+    // removed names come before the entries of the same snapshot
+    for (auto it = std::lower_bound(snapshot.removed_.begin(), snapshot.removed_.end(), prefix);
+         it != snapshot.removed_.end() && it->compare(0, prefix.size(), prefix) == 0; it++)
+    {
+      if (it->find('/', prefix.size()) == std::string::npos)
+      {
+        names.erase(it->substr(prefix.size()));
+      }
+    }
+
+    size_t i;
+    if (lower_bound_entry(snapshot, prefix, i) != 0)
+    {
+      return -errno;
+    }
+    while (i < snapshot.entry_count_)
+    {
+      std::string entry_path;
+      long offset;
+      if (read_index_path(snapshot, i, entry_path, offset) != 0)
+      {
+        return -errno;
+      }
+      if (entry_path.compare(0, prefix.size(), prefix) != 0)
+      {
+        break;
+      }
+      auto slash = entry_path.find('/', prefix.size());
+      if (slash == std::string::npos)
+      {
+        names.insert(entry_path.substr(prefix.size()));
+        i++;
+        continue;
+      }
+      // skip the contents of a subdirectory, '0' follows '/'
+      if (lower_bound_entry(snapshot, entry_path.substr(0, slash) + "0", i) != 0)
+      {
+        return -errno;
+      }
+    }
+  }
+  return 0;
+}
+
+int SnapshotController::read_entry(FILE *file, SnapshotEntry &entry)
+{
+  char buf[PATH_MAX + 1];
+
+  // read stat struct and path
+  size_t path_len = 0;
+  if (fread(&entry.st_, sizeof(struct stat), 1, file) != 1 ||
+      fread(&path_len, sizeof(size_t), 1, file) != 1 || path_len > PATH_MAX ||
+      fread(buf, sizeof(char), path_len, file) != path_len)
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::read_entry: read path failed");
+  }
+  entry.path_.assign(buf, path_len);
+  entry.chunks_.clear();
+  entry.buffer_path_.clear();
+  entry.size_ = 0;
+  entry.data_pos_ = -1;
+  entry.blob_.clear();
+  if (S_ISDIR(entry.st_.st_mode))
+  {
+    return 0;
+  }
+
+  // read chunk info
+  size_t num_chunks = 0;
+  fread(&num_chunks, sizeof(size_t), 1, file);
+  entry.chunks_.reserve(num_chunks);
+  for (size_t i = 0; i < num_chunks; i++)
+  {
+    off_t start;
+    fread(&start, sizeof(off_t), 1, file);
+    size_t len;
+    fread(&len, sizeof(size_t), 1, file);
+    size_t key_len;
+    fread(&key_len, sizeof(size_t), 1, file);
+    std::vector<char> key(key_len);
+    fread(key.data(), sizeof(char), key_len, file);
+    std::string key_str(key.begin(), key.end());
+    entry.chunks_.emplace_back(start, len, key_str);
+  }
+
+  // read buffer path
+  size_t buffer_path_len = 0;
+  if (fread(&buffer_path_len, sizeof(size_t), 1, file) != 1 || buffer_path_len > PATH_MAX ||
+      fread(buf, sizeof(char), buffer_path_len, file) != buffer_path_len)
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::read_entry: read buffer path failed, " + entry.path_);
+  }
+  entry.buffer_path_.assign(buf, buffer_path_len);
+
+  // read file size, contents of a small file follow
+  if (fread(&entry.size_, sizeof(size_t), 1, file) != 1)
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::read_entry: read file size failed, " + entry.path_);
+  }
+  if (entry.chunks_.size() == 1 && entry.chunks_[0].key_.compare(0, BLOB_PREFIX.size(), BLOB_PREFIX) == 0)
+  {
+    // the contents are held as a chunk of their own
+    entry.blob_ = std::move(entry.chunks_[0].key_);
+    entry.chunks_.clear();
+  }
+  else if ((off_t)entry.size_ <= state_->threshold)
+  {
+    entry.data_pos_ = ftell(file);
+    fseek(file, entry.size_, SEEK_CUR);
+  }
+  return 0;
+}
+
+int SnapshotController::copy_contents(FILE *file, const SnapshotEntry &entry, int fd)
+{
+  if (!entry.blob_.empty())
+  {
+    // fetched like any chunk, through the cache or from its container
+    struct stat st;
+    if (cloudfs_controller_->fetch_chunk(entry.blob_, fd, 0, entry.size_) != 0 ||
+        fstat(fd, &st) != 0 || (size_t)st.st_size != entry.size_)
+    {
+      errno = EIO;
+      return logger_->error("SnapshotController::copy_contents: fetch failed, " + entry.blob_);
+    }
+    return 0;
+  }
+  std::string data;
+  if (read_contents(file, entry, data) != 0)
+  {
+    return -errno;
+  }
+  if (pwrite(fd, data.data(), data.size(), 0) != (ssize_t)data.size())
+  {
+    return logger_->error("SnapshotController::copy_contents: write contents failed, " + entry.path_);
+  }
+  return 0;
+}
+
+int SnapshotController::read_contents(FILE *file, const SnapshotEntry &entry, std::string &data)
+{
+  if (!entry.blob_.empty())
+  {
+    // the chunk is fetched to a scratch file
+    FILE *scratch = tmpfile();
+    if (scratch == NULL)
+    {
+      return logger_->error("SnapshotController::read_contents: create scratch file failed, " + entry.path_);
+    }
+    auto ret = copy_contents(file, entry, fileno(scratch));
+    data.assign(entry.size_, '\0');
+    if (ret == 0 && pread(fileno(scratch), &data[0], data.size(), 0) != (ssize_t)data.size())
+    {
+      errno = EIO;
+      ret = logger_->error("SnapshotController::read_contents: read scratch file failed, " + entry.path_);
+    }
+    fclose(scratch);
+    return ret;
+  }
+  data.assign(entry.size_, '\0');
+  if (fseek(file, entry.data_pos_, SEEK_SET) != 0 ||
+      fread(&data[0], sizeof(char), data.size(), file) != data.size())
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::read_contents: read contents failed, " + entry.path_);
+  }
+  return 0;
+}
+
+int SnapshotController::compose_chain(std::vector<SnapshotFile> &chain,
+                                      std::map<std::string, EntryLocation> &entries,
+                                      std::set<std::string> &removed)
+{
+  for (size_t i = 0; i < chain.size(); i++)
+  {
+    auto &snapshot = chain[i];
+
+    // removals come before the entries of the same snapshot, a path may be
+    // removed and created again
+    for (auto &path : snapshot.removed_)
+    {
+      entries.erase(path);
+      auto prefix = path + "/";
+      auto it = entries.lower_bound(prefix);
+      while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+      {
+        it = entries.erase(it);
+      }
+      removed.insert(path);
+    }
+
+    fseek(snapshot.file_, snapshot.entries_pos_, SEEK_SET);
+    for (size_t processed = 0; processed < snapshot.entry_count_; processed++)
+    {
+      EntryLocation location;
+      location.file_ = i;
+      location.begin_ = ftell(snapshot.file_);
+      SnapshotEntry entry;
+      if (read_entry(snapshot.file_, entry) != 0)
+      {
+        return logger_->error("SnapshotController::compose_chain: read entry failed, " +
+                              std::to_string(snapshot.timestamp_));
+      }
+      location.end_ = ftell(snapshot.file_);
+
+      if (!S_ISDIR(entry.st_.st_mode))
+      {
+        // a file replaced a directory
+        auto prefix = entry.path_ + "/";
+        auto it = entries.lower_bound(prefix);
+        while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+        {
+          it = entries.erase(it);
+        }
+      }
+      entries[entry.path_] = location;
+    }
+  }
+  return 0;
+}
+
+int SnapshotController::compose_subtree(std::vector<SnapshotFile> &chain, const std::string &path,
+                                        std::map<std::string, EntryLocation> &entries)
+{
+  auto erase_tree = [&entries](const std::string &root, bool erase_root)
+  {
+    if (erase_root)
+    {
+      entries.erase(root);
+    }
+    auto prefix = root + "/";
+    auto it = entries.lower_bound(prefix);
+    while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0)
+    {
+      it = entries.erase(it);
+    }
+  };
+
+  // oldest first, the same rules as compose_chain for the entries in index
+  // order from the path on
+  auto prefix = path + "/";
+  for (size_t i = 0; i < chain.size(); i++)
+  {
+    auto &snapshot = chain[i];
+
+    // removals come before the entries of the same snapshot
+    auto ret = drops_path(snapshot, path);
+    if (ret < 0)
+    {
+      return ret;
+    }
+    if (ret == 1)
+    {
+      entries.clear();
+    }
+    for (auto it = std::lower_bound(snapshot.removed_.begin(), snapshot.removed_.end(), prefix);
+         it != snapshot.removed_.end() && it->compare(0, prefix.size(), prefix) == 0; it++)
+    {
+      erase_tree(*it, true);
+    }
+
+    auto add_entry = [&](long offset)
+    {
+      EntryLocation location;
+      location.file_ = i;
+      location.begin_ = offset;
+      SnapshotEntry entry;
+      fseek(snapshot.file_, offset, SEEK_SET);
+      if (read_entry(snapshot.file_, entry) != 0)
+      {
+        return logger_->error("SnapshotController::compose_subtree: read entry failed, " +
+                              std::to_string(snapshot.timestamp_));
+      }
+      location.end_ = ftell(snapshot.file_);
+      if (!S_ISDIR(entry.st_.st_mode))
+      {
+        // a file replaced a directory
+        erase_tree(entry.path_, false);
+      }
+      entries[entry.path_] = location;
+      return 0;
+    };
+
+    // the path itself, then its contents in index order
+    long offset;
+    ret = find_entry(snapshot, path, offset);
+    if (ret < 0 || (ret == 0 && add_entry(offset) != 0))
+    {
+      return -errno;
+    }
+    size_t j;
+    if (lower_bound_entry(snapshot, prefix, j) != 0)
+    {
+      return -errno;
+    }
+    for (; j < snapshot.entry_count_; j++)
+    {
+      std::string entry_path;
+      if (read_index_path(snapshot, j, entry_path, offset) != 0)
+      {
+        return -errno;
+      }
+      if (entry_path.compare(0, prefix.size(), prefix) != 0)
+      {
+        break;
+      }
+      if (add_entry(offset) != 0)
+      {
+        return -errno;
+      }
+    }
+  }
+  return 0;
+}
+
+int SnapshotController::apply_entries(std::vector<SnapshotFile> &chain,
+                                      const std::map<std::string, EntryLocation> &entries,
+                                      bool subtree, bool use_chunks)
+{
+  // entries are sorted by path, so a directory is created before its contents
+  for (auto &it : entries)
+  {
+    FILE *tmp_file = chain[it.second.file_].file_;
+    fseek(tmp_file, it.second.begin_, SEEK_SET);
+    SnapshotEntry entry;
+    if (read_entry(tmp_file, entry) != 0)
+    {
+      return -errno;
+    }
+    auto &st = entry.st_;
+    auto filepath = entry.path_;
+
+    if (S_ISDIR(st.st_mode))
+    {
+      // create dir if not exist
+      if (mkdir(filepath.c_str(), st.st_mode) != 0)
+      {
+        if (errno != EEXIST)
+        {
+          return logger_->error(
+              "SnapshotController::restore_snapshot: mkdir failed, " +
+              filepath);
+        }
+      }
+      continue;
+    }
+
+    // create file if not exist, first create with full permission
+    auto file_fd = open(filepath.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0777);
+    if (file_fd == -1)
+    {
+      if (errno != EEXIST)
+      {
+        return logger_->error(
+            "SnapshotController::restore_snapshot: create file failed, " +
+            filepath);
+      }
+    }
+    close(file_fd);
+
+    // write chunks to file
+    auto ret = cloudfs_controller_->set_chunkinfo(filepath, entry.chunks_);
+    if (ret != 0)
+    {
+      return logger_->error(
+          "SnapshotController::restore_snapshot: set chunk info failed, " +
+          filepath);
+    }
+    if (use_chunks)
+    {
+      // the restored file references the chunks of the snapshot again
+      auto chunk_table = cloudfs_controller_->get_chunk_table();
+      for (auto &chunk : entry.chunks_)
+      {
+        if (chunk_table->use(chunk.key_))
+        {
+          logger_->error("SnapshotController::apply_entries: chunk not in the table, " +
+                         chunk.key_);
+        }
+      }
+    }
+
+    // set buffer path, a restored subtree gets new buffer files as the ones
+    // in the snapshot may belong to live files by now
+    auto buffer_path = entry.buffer_path_;
+    if (subtree)
+    {
+      buffer_path = main_path_to_buffer_path(filepath);
+      auto buffer_fd = open(buffer_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0777);
+      if (buffer_fd == -1 && errno == EEXIST)
+      {
+        // taken by a file renamed away from this path
+        std::string name = buffer_path + ".XXXXXX";
+        buffer_fd = mkstemp(&name[0]);
+        buffer_path = name;
+      }
+      if (buffer_fd == -1)
+      {
+        return logger_->error(
+            "SnapshotController::restore_subtree: create buffer file failed, " +
+            buffer_path);
+      }
+      close(buffer_fd);
+    }
+    ret = cloudfs_controller_->set_buffer_path(filepath, buffer_path);
+    if (ret != 0)
+    {
+      return logger_->error(
+          "SnapshotController::restore_snapshot: set buffer path failed, " +
+          filepath);
+    }
+
+    // create buffer file if not exist
+    auto buffer_fd =
+        open(buffer_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0777);
+    if (buffer_fd == -1)
+    {
+      if (errno != EEXIST)
+      {
+        return logger_->error(
+            "SnapshotController::restore_snapshot: open buffer file failed, " +
+            buffer_path);
+      }
+    }
+    close(buffer_fd);
+
+    // set file size
+    auto file_size = entry.size_;
+    ret = cloudfs_controller_->set_size(buffer_path, file_size);
+    if (ret != 0)
+    {
+      return logger_->error(
+          "SnapshotController::restore_snapshot: set file size failed, " +
+          buffer_path);
+    }
+
+    if (entry.data_pos_ >= 0 || !entry.blob_.empty())
+    {
+      // small file, copy contents to buffer file
+      int fd = open(buffer_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd == -1)
+      {
+        return logger_->error(
+            "SnapshotController::restore_snapshot: open buffer file failed, " +
+            buffer_path);
+      }
+      ret = copy_contents(tmp_file, entry, fd);
+      if (close(fd) != 0 && ret == 0)
+      {
+        ret = logger_->error(
+            "SnapshotController::restore_snapshot: write buffer file failed, " +
+            buffer_path);
+      }
+      if (ret != 0)
+      {
+        return ret;
+      }
+    }
 
     // utimensat file
     struct timespec tv[2];
@@ -951,76 +2310,477 @@ int SnapshotController::install_snapshot(unsigned long *timestamp)
     tv[1] = st.st_mtim;
     if (utimensat(AT_FDCWD, filepath.c_str(), tv, AT_SYMLINK_NOFOLLOW) != 0)
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: utimensat file failed, " +
-          filepath);
+      return logger_->error(
+          "SnapshotController::restore_snapshot: utimensat file failed, " +
+          filepath);
+    }
+
+    // chmod file to previous permission
+    if (chmod(filepath.c_str(), st.st_mode) != 0)
+    {
+      return logger_->error(
+          "SnapshotController::restore_snapshot: chmod file failed, " +
+          filepath);
+    }
+  }
+  return 0;
+}
+
+int SnapshotController::fold_into_child(SnapshotFile &snapshot, unsigned long child)
+{
+  std::vector<SnapshotFile> chain(1);
+  if (fetch_snapshot(child, chain[0]) != 0)
+  {
+    close_chain(chain);
+    return logger_->error("SnapshotController::fold_into_child: fetch child failed, " +
+                          std::to_string(child));
+  }
+
+  // the child's entries win over the ones it inherits
+  std::vector<SnapshotFile> pair;
+  pair.push_back(snapshot);
+  pair.push_back(chain[0]);
+  std::map<std::string, EntryLocation> entries;
+  std::set<std::string> removed;
+  if (compose_chain(pair, entries, removed) != 0)
+  {
+    close_chain(chain);
+    return -errno;
+  }
+
+  // the child holds the small files it inherits once it is complete
+  std::set<std::string> own;
+  std::set<std::string> inherited;
+  if (collect_blobs(chain[0], own) != 0)
+  {
+    close_chain(chain);
+    return -errno;
+  }
+  for (auto &it : entries)
+  {
+    if (it.second.file_ != 0)
+    {
+      continue;
+    }
+    SnapshotEntry entry;
+    if (fseek(snapshot.file_, it.second.begin_, SEEK_SET) != 0 || read_entry(snapshot.file_, entry) != 0)
+    {
+      close_chain(chain);
+      return -errno;
+    }
+    if (!entry.blob_.empty() && own.count(entry.blob_) == 0)
+    {
+      inherited.insert(entry.blob_);
+    }
+  }
+
+  // the new generation replaces the child once it is complete
+  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
+  auto object_key = "snapshot_" + std::to_string(child);
+  auto old_parts = chain[0].parts_;
+  SnapshotStream stream(buffer_controller, object_key, old_parts.generation_ + 1, get_compression(), logger_);
+  FILE *tmp_file = stream.file();
+  if (tmp_file == NULL)
+  {
+    close_chain(chain);
+    errno = EIO;
+    return logger_->error(
+        "SnapshotController::fold_into_child: open snapshot stream failed");
+  }
+
+  // header, the child takes over the parent of the deleted snapshot
+  uint64_t magic = SNAPSHOT_MAGIC;
+  uint64_t parent = snapshot.parent_;
+  size_t entry_count = entries.size();
+  fwrite(&magic, sizeof(uint64_t), 1, tmp_file);
+  fwrite(&parent, sizeof(uint64_t), 1, tmp_file);
+
+  // copy raw byte ranges, the chunk table stays the child's
+  char buf[MEM_BUFFER_LEN];
+  auto copy_range = [&](FILE *from, long begin, long end) {
+    fseek(from, begin, SEEK_SET);
+    while (begin < end)
+    {
+      auto n = fread(buf, sizeof(char), std::min((long)sizeof(buf), end - begin), from);
+      if (n == 0)
+      {
+        return false;
+      }
+      fwrite(buf, sizeof(char), n, tmp_file);
+      begin += n;
+    }
+    return true;
+  };
+  long table_pos = ftell(tmp_file);
+  bool ok = copy_range(chain[0].file_, chain[0].table_pos_, chain[0].table_end_);
+
+  // a full snapshot removes nothing
+  long removed_pos = ftell(tmp_file);
+  write_removed(tmp_file, parent != 0 ? std::vector<std::string>(removed.begin(), removed.end())
+                                      : std::vector<std::string>());
+  std::vector<std::pair<std::string, long>> offsets;
+  offsets.reserve(entries.size());
+  for (auto &it : entries)
+  {
+    offsets.emplace_back(it.first, ftell(tmp_file));
+    ok = ok && copy_range(pair[it.second.file_].file_, it.second.begin_, it.second.end_);
+  }
+  close_chain(chain);
+  if (!ok)
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::fold_into_child: copy entries failed, " +
+                          std::to_string(child));
+  }
+  if (write_index(tmp_file, table_pos, removed_pos, offsets) != 0)
+  {
+    return -errno;
+  }
+
+  if (stream.finish() != 0)
+  {
+    return logger_->error("SnapshotController::fold_into_child: upload failed, " +
+                          std::to_string(child));
+  }
+  SnapshotStream::remove(buffer_controller, object_key, old_parts, true);
+  auto chunk_table = cloudfs_controller_->get_chunk_table();
+  for (auto &key : inherited)
+  {
+    chunk_table->snapshot_use(key);
+  }
+  if (!chunk_table->commit())
+  {
+    return logger_->error("SnapshotController::fold_into_child: commit chunk table failed, " +
+                          std::to_string(child));
+  }
+  logger_->info("SnapshotController::fold_into_child: folded ", snapshot.timestamp_,
+                " into ", child, ", ", entry_count, " entries");
+  return set_snapshot_parent(child, snapshot.parent_);
+}
+
+int SnapshotController::uninstall_snapshot(unsigned long *timestamp)
+{
+  // check if snapshot is installed
+  std::vector<unsigned long> installed_snapshot_list;
+  if (get_installed_snapshot_list(installed_snapshot_list) != 0)
+  {
+    return logger_->error("SnapshotController::uninstall_snapshot: get installed snapshot list failed");
+  }
+  bool found = false;
+  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
+  {
+    if (installed_snapshot_list[i] == *timestamp)
+    {
+      found = true;
+      break;
+    }
+  }
+  if (!found)
+  {
+    // snapshot is not installed
+    errno = EINVAL;
+    return logger_->error("SnapshotController::uninstall_snapshot: snapshot is not installed, " +
+                          std::to_string(*timestamp));
+  }
+  // uninstall snapshot, open files keep their scratch files until released
+  auto it = views_.find(*timestamp);
+  if (it != views_.end())
+  {
+    if (it->second != nullptr)
+    {
+      close_chain(it->second->chain_);
+    }
+    views_.erase(it);
+  }
+
+  // update installed snapshot list
+  std::vector<unsigned long> new_installed_snapshot_list;
+  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
+  {
+    if (installed_snapshot_list[i] != *timestamp)
+    {
+      new_installed_snapshot_list.push_back(installed_snapshot_list[i]);
+    }
+  }
+
+  // update installed snapshot info
+  set_installed_snapshot_count(new_installed_snapshot_list.size());
+  set_installed_snapshot_list(new_installed_snapshot_list);
+  return 0;
+}
+
+void SnapshotController::record_change(const std::string &path)
+{
+  journal_->record(path);
+}
+
+bool SnapshotController::is_view_path(const std::string &path)
+{
+  if (path.compare(0, 10, "/snapshot_") != 0)
+  {
+    return false;
+  }
+  auto end = path.find('/', 1);
+  auto name = path.substr(1, end == std::string::npos ? std::string::npos : end - 1);
+  for (auto &it : views_)
+  {
+    if (name == "snapshot_" + std::to_string(it.first))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+void SnapshotController::get_view_names(std::vector<std::string> &names)
+{
+  for (auto &it : views_)
+  {
+    names.push_back("snapshot_" + std::to_string(it.first));
+  }
+}
+
+SnapshotController::InstalledView *SnapshotController::find_view(const std::string &path,
+                                                                 std::string &view_path)
+{
+  auto end = path.find('/', 1);
+  auto name = path.substr(1, end == std::string::npos ? std::string::npos : end - 1);
+  view_path = end == std::string::npos ? "/" : path.substr(end);
+  for (auto &it : views_)
+  {
+    if (name != "snapshot_" + std::to_string(it.first))
+    {
+      continue;
     }
-
-    // chmod file, change as readonly
-    if (chmod(filepath.c_str(), 0444) != 0)
+    if (it.second == nullptr)
     {
-      return logger_->error(
-          "SnapshotController::restore_snapshot: chmod file failed, " +
-          filepath);
+      // installed before the last mount
+      std::unique_ptr<InstalledView> view(new InstalledView());
+      if (load_view(it.first, *view) != 0)
+      {
+        return NULL;
+      }
+      it.second = std::move(view);
     }
+    return it.second.get();
+  }
+  errno = ENOENT;
+  return NULL;
+}
 
-    processed++;
+int SnapshotController::load_view(unsigned long timestamp, InstalledView &view)
+{
+  if (fetch_chain(timestamp, view.chain_) != 0)
+  {
+    return logger_->error("SnapshotController::load_view: fetch snapshot failed, " +
+                          std::to_string(timestamp));
+  }
+  // the downloaded files stay open, unlinked so that restore and delete can
+  // download the same snapshots again, paths are looked up in their indexes
+  // as they are accessed
+  for (auto &snapshot : view.chain_)
+  {
+    remove(snapshot.path_.c_str());
+    snapshot.path_.clear();
   }
-  fclose(tmp_file);
-  remove(tmp_path.c_str());
+  logger_->info("SnapshotController::load_view: snapshot ", timestamp, ", chain of ",
+                view.chain_.size());
+  return 0;
+}
 
-  // update installed snapshot list
-  installed_snapshot_list.push_back(*timestamp);
-  set_installed_snapshot_count(installed_snapshot_list.size());
-  set_installed_snapshot_list(installed_snapshot_list);
+int SnapshotController::read_view_entry(const std::string &path, SnapshotEntry &entry, FILE **file)
+{
+  std::string view_path;
+  auto view = find_view(path, view_path);
+  if (view == NULL)
+  {
+    return -errno;
+  }
+  if (view_path == "/")
+  {
+    return 1;
+  }
+  EntryLocation location;
+  auto ret = lookup_entry(view->chain_, std::string(state_->ssd_path) + view_path, location);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if (ret == 1)
+  {
+    errno = ENOENT;
+    return -errno;
+  }
+  auto &snapshot = view->chain_[location.file_];
+  fseek(snapshot.file_, location.begin_, SEEK_SET);
+  if (read_entry(snapshot.file_, entry) != 0)
+  {
+    return -errno;
+  }
+  entry.path_ = view_path;
+  if (file != NULL)
+  {
+    *file = snapshot.file_;
+  }
   return 0;
 }
 
-int SnapshotController::uninstall_snapshot(unsigned long *timestamp)
+int SnapshotController::view_getattr(const std::string &path, struct stat *statbuf)
 {
-  // check if snapshot is installed
-  std::vector<unsigned long> installed_snapshot_list;
-  if (get_installed_snapshot_list(installed_snapshot_list) != 0)
+  SnapshotEntry entry;
+  auto ret = read_view_entry(path, entry, NULL);
+  if (ret < 0)
   {
-    return logger_->error("SnapshotController::uninstall_snapshot: get installed snapshot list failed");
+    return ret;
   }
-  bool found = false;
-  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
+  if (ret == 1)
   {
-    if (installed_snapshot_list[i] == *timestamp)
+    // the view root looks like the SSD root
+    if (lstat(state_->ssd_path, statbuf) != 0)
     {
-      found = true;
-      break;
+      return -errno;
     }
+    statbuf->st_mode = S_IFDIR | 0555;
+    return 0;
   }
-  if (!found)
+
+  // installed files are read-only
+  *statbuf = entry.st_;
+  statbuf->st_mode &= ~0222;
+  if (!S_ISDIR(statbuf->st_mode))
   {
-    // snapshot is not installed
-    errno = EINVAL;
-    return logger_->error("SnapshotController::uninstall_snapshot: snapshot is not installed, " +
-                          std::to_string(*timestamp));
+    statbuf->st_size = entry.size_;
   }
-  // uninstall snapshot
+  return 0;
+}
 
-  auto root_path = std::string(state_->ssd_path) + "/snapshot_" +
-                   std::to_string(*timestamp);
-  clear_dir(root_path);
-  // delete root path
-  remove(root_path.c_str());
+int SnapshotController::view_readdir(const std::string &path, std::vector<std::string> &names)
+{
+  SnapshotEntry entry;
+  auto ret = read_view_entry(path, entry, NULL);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if (ret == 0 && !S_ISDIR(entry.st_.st_mode))
+  {
+    errno = ENOTDIR;
+    return -errno;
+  }
 
-  // update installed snapshot list
-  std::vector<unsigned long> new_installed_snapshot_list;
-  for (size_t i = 0; i < installed_snapshot_list.size(); i++)
+  std::string view_path;
+  auto view = find_view(path, view_path);
+  auto dir = std::string(state_->ssd_path);
+  if (view_path != "/")
   {
-    if (installed_snapshot_list[i] != *timestamp)
+    dir += view_path;
+  }
+  std::set<std::string> listed;
+  ret = list_entries(view->chain_, dir, listed);
+  if (ret != 0)
+  {
+    return ret;
+  }
+  names.assign(listed.begin(), listed.end());
+  return 0;
+}
+
+int SnapshotController::view_open(const std::string &path, int flags, uint64_t *fd)
+{
+  if ((flags & O_ACCMODE) != O_RDONLY)
+  {
+    errno = EACCES;
+    return logger_->error("SnapshotController::view_open: installed snapshots are read-only, " + path);
+  }
+  SnapshotEntry entry;
+  FILE *tmp_file = NULL;
+  auto ret = read_view_entry(path, entry, &tmp_file);
+  if (ret < 0)
+  {
+    return ret;
+  }
+  if (ret == 1 || S_ISDIR(entry.st_.st_mode))
+  {
+    errno = EISDIR;
+    return -errno;
+  }
+
+  // the scratch file is gone once it is closed
+  auto scratch_path = std::string(state_->ssd_path) + "/.snapshot_view_XXXXXX";
+  std::vector<char> name(scratch_path.begin(), scratch_path.end());
+  name.push_back('\0');
+  int scratch_fd = mkstemp(name.data());
+  if (scratch_fd == -1)
+  {
+    return logger_->error("SnapshotController::view_open: create scratch file failed, " + path);
+  }
+  unlink(name.data());
+
+  ViewFile file;
+  if (entry.data_pos_ >= 0 || !entry.blob_.empty())
+  {
+    // small file, copy its contents from the snapshot file or its chunk
+    if (copy_contents(tmp_file, entry, scratch_fd) != 0)
     {
-      new_installed_snapshot_list.push_back(installed_snapshot_list[i]);
+      close(scratch_fd);
+      errno = EIO;
+      return logger_->error("SnapshotController::view_open: copy contents failed, " + path);
+    }
+  }
+  else
+  {
+    // large file, chunks are fetched as they are read
+    if (ftruncate(scratch_fd, entry.size_) != 0)
+    {
+      close(scratch_fd);
+      return logger_->error("SnapshotController::view_open: size scratch file failed, " + path);
     }
+    file.chunks_ = std::move(entry.chunks_);
+    file.fetched_.assign(file.chunks_.size(), false);
   }
+  *fd = scratch_fd;
+  view_files_[*fd] = std::move(file);
+  return 0;
+}
 
-  // update installed snapshot info
-  set_installed_snapshot_count(new_installed_snapshot_list.size());
-  set_installed_snapshot_list(new_installed_snapshot_list);
+int SnapshotController::view_locate_read(uint64_t fd, size_t size, off_t offset)
+{
+  auto it = view_files_.find(fd);
+  if (it == view_files_.end())
+  {
+    errno = EBADF;
+    return -errno;
+  }
+  // chunks are sorted by offset, start at the one holding the offset
+  auto &file = it->second;
+  auto first = std::upper_bound(file.chunks_.begin(), file.chunks_.end(), offset,
+                                [](off_t offset, const Chunk &chunk)
+                                { return offset < chunk.start_; });
+  size_t i = first == file.chunks_.begin() ? 0 : first - file.chunks_.begin() - 1;
+  for (; i < file.chunks_.size() && file.chunks_[i].start_ < offset + (off_t)size; i++)
+  {
+    auto &chunk = file.chunks_[i];
+    if (file.fetched_[i])
+    {
+      continue;
+    }
+    if (cloudfs_controller_->fetch_chunk(chunk.key_, fd, chunk.start_, chunk.len_) != 0)
+    {
+      return logger_->error("SnapshotController::view_locate_read: fetch chunk failed, " +
+                            chunk.key_);
+    }
+    file.fetched_[i] = true;
+  }
+  return 0;
+}
+
+int SnapshotController::view_release(uint64_t fd)
+{
+  view_files_.erase(fd);
+  if (close(fd) != 0)
+  {
+    return -errno;
+  }
   return 0;
 }
 
@@ -1028,121 +2788,167 @@ void SnapshotController::persist()
 {
   logger_->debug("SnapshotController::persist: persist snapshot info");
 
-  std::vector<unsigned long> snapshot_list;
-  if (get_snapshot_list(snapshot_list) != 0)
+  if (snapshot_list_.size() == 0)
   {
-    logger_->error("SnapshotController::persist: get snapshot list failed");
+    // no snapshot state to persist
+    logger_->info("SnapshotController::persist: no snapshot state to persist");
+    return;
   }
 
-  if (snapshot_list.size() == 0)
+  // the snapshot info file is up to date, upload it as it is
+  struct stat st;
+  if (write_snapshot_info() != 0 || stat(info_path_.c_str(), &st) != 0)
   {
-    // no snapshot state to persist
-    logger_->info("SnapshotController::persist: no snapshot state to persist");
+    logger_->error("SnapshotController::persist: write snapshot info failed, " +
+                   info_path_);
     return;
   }
+  auto object_key = generate_object_key(snapshot_stub_path_);
+  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
+  buffer_controller->upload_file(object_key, info_path_, st.st_size);
+}
 
-  // use .snapshot file as buffer file
-  FILE *file = fopen(snapshot_stub_path_.c_str(), "w");
+int SnapshotController::read_snapshot_info(const std::string &path)
+{
+  FILE *file = fopen(path.c_str(), "r");
   if (file == NULL)
   {
-    logger_->error(
-        "SnapshotController::persist: open snapshot stub file failed, " +
-        snapshot_stub_path_);
+    return 1;
   }
-
-  // write snapshot infos to .snapshot file
-  size_t snapshot_count = snapshot_list.size();
-  fwrite(&snapshot_count, sizeof(size_t), 1, file);
-  for (auto &ts : snapshot_list)
+  size_t entry_count;
+  if (fread(&entry_count, sizeof(size_t), 1, file) != 1)
   {
-    fwrite(&ts, sizeof(unsigned long), 1, file);
-    logger_->debug("SnapshotController::persist: snapshot " +
-                   std::to_string(ts));
+    // empty, nothing persisted
+    fclose(file);
+    return 1;
   }
-  fclose(file);
 
-  struct stat st;
-  if (stat(snapshot_stub_path_.c_str(), &st) != 0)
+  std::vector<unsigned long> snapshot_list;
+  for (size_t i = 0; i < entry_count; i++)
   {
-    logger_->error(
-        "SnapshotController::persist: stat snapshot stub file failed, " +
-        snapshot_stub_path_);
+    unsigned long ts;
+    if (fread(&ts, sizeof(unsigned long), 1, file) != 1)
+    {
+      fclose(file);
+      errno = EIO;
+      return logger_->error("SnapshotController::read_snapshot_info: snapshot info truncated, " +
+                            path);
+    }
+    snapshot_list.push_back(ts);
+    logger_->debug("SnapshotController::read_snapshot_info: recovered snapshot " + std::to_string(ts));
   }
 
-  // upload file contents to cloud
-  auto object_key = generate_object_key(snapshot_stub_path_);
-  auto buffer_controller = cloudfs_controller_->get_buffer_file_controller();
-  buffer_controller->upload_file(object_key, snapshot_stub_path_, st.st_size);
-
-  // truncate snapshot stub file to size 0
-  truncate(snapshot_stub_path_.c_str(), 0);
-}
-
-int SnapshotController::get_snapshot_count(int &count)
-{
-  // get snapshot count from xattr "user.cloudfs.snapshot_count"
-  char buf[sizeof(int)];
-  auto ret = lgetxattr(snapshot_stub_path_.c_str(),
-                       "user.cloudfs.snapshot_count", buf, sizeof(buf));
-  if (ret == -1)
+  // parents follow the list, snapshot info of older versions has none
+  uint64_t magic;
+  std::map<unsigned long, unsigned long> parents;
+  if (fread(&magic, sizeof(uint64_t), 1, file) == 1 && magic == PARENTS_MAGIC)
   {
-    if (errno == ENODATA)
+    for (size_t i = 0; i < entry_count; i++)
     {
-      count = 0;
-      return 0;
+      unsigned long parent = 0;
+      fread(&parent, sizeof(unsigned long), 1, file);
+      parents[snapshot_list[i]] = parent;
     }
-    return logger_->error(
-        "SnapshotController::get_snapshot_count: get snapshot count failed");
   }
-  count = *(int *)buf;
+  fclose(file);
+
+  snapshot_list_.swap(snapshot_list);
+  snapshot_parents_.swap(parents);
   return 0;
 }
 
-int SnapshotController::set_snapshot_count(int count)
+int SnapshotController::write_snapshot_info()
 {
-  // set snapshot count to xattr "user.cloudfs.snapshot_count"
-  return lsetxattr(snapshot_stub_path_.c_str(), "user.cloudfs.snapshot_count",
-                   &count, sizeof(count), 0);
+  // same layout as the snapshot info persisted on cloud, replaced atomically
+  auto tmp_path = info_path_ + ".tmp";
+  FILE *file = fopen(tmp_path.c_str(), "w");
+  if (file == NULL)
+  {
+    return logger_->error("SnapshotController::write_snapshot_info: open failed, " + tmp_path);
+  }
+  size_t snapshot_count = snapshot_list_.size();
+  fwrite(&snapshot_count, sizeof(size_t), 1, file);
+  fwrite(snapshot_list_.data(), sizeof(unsigned long), snapshot_count, file);
+  uint64_t magic = PARENTS_MAGIC;
+  fwrite(&magic, sizeof(uint64_t), 1, file);
+  for (auto &ts : snapshot_list_)
+  {
+    unsigned long parent = get_snapshot_parent(ts);
+    fwrite(&parent, sizeof(unsigned long), 1, file);
+  }
+  auto failed = fflush(file) != 0 || ferror(file) || fsync(fileno(file)) != 0;
+  fclose(file);
+  if (failed || rename(tmp_path.c_str(), info_path_.c_str()) != 0)
+  {
+    errno = EIO;
+    return logger_->error("SnapshotController::write_snapshot_info: write failed, " + info_path_);
+  }
+  return 0;
 }
 
-int SnapshotController::get_snapshot_list(std::vector<unsigned long> &list)
+void SnapshotController::load_legacy_snapshot_info()
 {
-  // get snapshot list from xattr "user.cloudfs.snapshot_i", i is the index of
-  // snapshot, from 0 to count-1
-  auto xattr_name_header = "user.cloudfs.snapshot_";
-  int count;
-  if (get_snapshot_count(count) != 0)
+  // "user.cloudfs.snapshot_count", "user.cloudfs.snapshot_i" for i from 0 to
+  // count-1 and "user.cloudfs.snapshot_parent_<timestamp>"
+  int count = 0;
+  if (lgetxattr(snapshot_stub_path_.c_str(), "user.cloudfs.snapshot_count", &count,
+                sizeof(count)) != sizeof(count))
   {
-    return logger_->error(
-        "SnapshotController::get_snapshot_list: get snapshot count failed");
+    return;
   }
+  lremovexattr(snapshot_stub_path_.c_str(), "user.cloudfs.snapshot_count");
   for (int i = 0; i < count; i++)
   {
-    char buf[sizeof(unsigned long)];
-    auto xattr_name = xattr_name_header + std::to_string(i);
-    auto ret = lgetxattr(snapshot_stub_path_.c_str(), xattr_name.c_str(), buf,
-                         sizeof(buf));
-    if (ret == -1)
+    auto xattr_name = "user.cloudfs.snapshot_" + std::to_string(i);
+    unsigned long ts;
+    if (lgetxattr(snapshot_stub_path_.c_str(), xattr_name.c_str(), &ts, sizeof(ts)) == sizeof(ts))
     {
-      return logger_->error(
-          "SnapshotController::get_snapshot_list: get snapshot list failed");
+      snapshot_list_.push_back(ts);
     }
-    list.push_back(*(unsigned long *)buf);
+    lremovexattr(snapshot_stub_path_.c_str(), xattr_name.c_str());
+  }
+  for (auto ts : snapshot_list_)
+  {
+    auto xattr_name = "user.cloudfs.snapshot_parent_" + std::to_string(ts);
+    unsigned long parent;
+    if (lgetxattr(snapshot_stub_path_.c_str(), xattr_name.c_str(), &parent, sizeof(parent)) ==
+        sizeof(parent))
+    {
+      snapshot_parents_[ts] = parent;
+    }
+    lremovexattr(snapshot_stub_path_.c_str(), xattr_name.c_str());
   }
+  logger_->info("SnapshotController::load_legacy_snapshot_info: migrated ", snapshot_list_.size(),
+                " snapshots");
+}
+
+int SnapshotController::get_snapshot_count(int &count)
+{
+  count = snapshot_list_.size();
+  return 0;
+}
+
+int SnapshotController::get_snapshot_list(std::vector<unsigned long> &list)
+{
+  list.insert(list.end(), snapshot_list_.begin(), snapshot_list_.end());
   return 0;
 }
 
 int SnapshotController::set_snapshot_list(std::vector<unsigned long> &list)
 {
-  // set snapshot list to xattr "user.cloudfs.snapshot_i", i is the index of
-  // snapshot, from 0 to count-1
-  for (size_t i = 0; i < list.size(); i++)
+  // parents of snapshots no longer in the list are dropped
+  std::map<unsigned long, unsigned long> parents;
+  for (auto ts : list)
   {
-    auto xattr_name = "user.cloudfs.snapshot_" + std::to_string(i);
-    lsetxattr(snapshot_stub_path_.c_str(), xattr_name.c_str(), &list[i],
-              sizeof(unsigned long), 0);
+    auto it = snapshot_parents_.find(ts);
+    if (it != snapshot_parents_.end())
+    {
+      parents.insert(*it);
+    }
   }
-  return 0;
+  snapshot_list_ = list;
+  snapshot_parents_.swap(parents);
+  return write_snapshot_info();
 }
 
 int SnapshotController::get_installed_snapshot_count(int &count)
@@ -1216,6 +3022,86 @@ int SnapshotController::set_installed_snapshot_list(
   return 0;
 }
 
+unsigned long SnapshotController::get_snapshot_parent(unsigned long timestamp)
+{
+  auto it = snapshot_parents_.find(timestamp);
+  if (it == snapshot_parents_.end())
+  {
+    // snapshots of older versions are full snapshots
+    return 0;
+  }
+  return it->second;
+}
+
+int SnapshotController::set_snapshot_parent(unsigned long timestamp, unsigned long parent)
+{
+  snapshot_parents_[timestamp] = parent;
+  return write_snapshot_info();
+}
+
+int SnapshotController::get_chain_length(unsigned long timestamp)
+{
+  int length = 0;
+  for (auto ts = timestamp; ts != 0; ts = get_snapshot_parent(ts))
+  {
+    length++;
+  }
+  return length;
+}
+
+int SnapshotController::remove_subtree(const std::string &path)
+{
+  auto full_path = std::string(state_->ssd_path) + path;
+  struct stat st;
+  if (lstat(full_path.c_str(), &st) != 0)
+  {
+    if (errno == ENOENT)
+    {
+      return 0;
+    }
+    return logger_->error("SnapshotController::remove_subtree: stat failed, " + full_path);
+  }
+  journal_->record(path);
+  if (!S_ISDIR(st.st_mode))
+  {
+    // releases the chunks of the file
+    return cloudfs_controller_->unlink_file(path);
+  }
+
+  // buffer files go with their files
+  std::vector<std::string> names;
+  DIR *dirp = opendir(full_path.c_str());
+  if (dirp == NULL)
+  {
+    return logger_->error("SnapshotController::remove_subtree: open dir failed, " + full_path);
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dirp)) != NULL)
+  {
+    std::string name(entry->d_name);
+    if (name != "." && name != ".." && !is_buffer_path(name))
+    {
+      names.push_back(name);
+    }
+  }
+  closedir(dirp);
+  for (auto &name : names)
+  {
+    auto ret = remove_subtree(path + "/" + name);
+    if (ret != 0)
+    {
+      return ret;
+    }
+  }
+
+  // the buffer file of a file renamed out of the directory keeps it
+  if (rmdir(full_path.c_str()) != 0 && errno != ENOTEMPTY)
+  {
+    return logger_->error("SnapshotController::remove_subtree: rmdir failed, " + full_path);
+  }
+  return 0;
+}
+
 int SnapshotController::clear_dir(const std::string &path)
 {
   std::queue<std::string> dir_queue;
@@ -1255,6 +3141,31 @@ int SnapshotController::clear_dir(const std::string &path)
       {
         continue;
       }
+      if (ChunkTable::is_table_file(name))
+      {
+        continue;
+      }
+      if (name == ChunkCollector::QUEUE_FILE_NAME ||
+          name == ChunkCollector::QUEUE_FILE_NAME + ".tmp")
+      {
+        continue;
+      }
+      if (name == ContainerStore::DIR_NAME)
+      {
+        continue;
+      }
+      if (name == ChangeJournal::FILE_NAME)
+      {
+        continue;
+      }
+      if (name.compare(0, INFO_FILE_NAME.size(), INFO_FILE_NAME) == 0)
+      {
+        continue; // snapshot info file and its temporary copy
+      }
+      if (name.compare(0, 13, ".snapshot_tmp") == 0)
+      {
+        continue; // downloaded snapshot files of the chain being restored
+      }
 
       auto full_path = dir + "/" + name;
       struct stat st;
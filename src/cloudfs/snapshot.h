@@ -5,22 +5,162 @@
  */
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
 #include <vector>
 
 #include "util.h"
+#include "change_journal.h"
 #include "cloudfs.h"
 #include "cloudfs_controller.h"
+#include "snapshot_stream.h"
+
+struct cloudfs_diff;
 
 /**
  * Snapshot controller
+ *
+ * A full snapshot records every file and directory of the SSD. An incremental
+ * snapshot only records the paths in the change journal plus the paths removed
+ * since its parent, the latest snapshot, so its cost scales with the churn.
+ * Restore and install compose the chain from the full snapshot at its root.
+ * Deleting a snapshot folds it into its children.
+ *
+ * An installed snapshot is not written to the SSD. It is served read-only
+ * under "/snapshot_<timestamp>" by looking paths up in the indexes of its
+ * chain, the data of a large file is fetched chunk by chunk as it is read.
+ *
+ * Snapshot file layout: [u64 magic][u64 parent][chunk table][removed count]
+ * [removed paths][entries][index][footer]. The index holds the u64 offsets of
+ * the entries sorted by path, so an entry is found by binary search. A
+ * snapshot is streamed to the cloud while it is written, so the sections are
+ * located by the footer at its end: [u64 chunk table offset][u64 removed
+ * paths offset][u64 index offset][u64 entry count][u64 index magic].
+ *
+ * A diff compares the entries of two snapshots by their chunk lists. If the
+ * older snapshot is in the chain of the newer one, only the paths recorded by
+ * the snapshots in between are looked up in the indexes. The live tree is
+ * compared as an incremental snapshot on the base of the change journal.
+ *
+ * The contents of a small file are not copied into the snapshot file. They
+ * are stored once as a chunk keyed by their hash, which is the only chunk of
+ * the entry, and every snapshot holding the file counts as a snapshot
+ * reference of that chunk in the chunk table. Unchanged small files therefore
+ * cost one entry per snapshot, and deleting a snapshot releases its chunks.
+ * Entries of older versions keep the contents after the file size.
+ *
+ * Files of the previous version have the entry count after the parent and no
+ * index and footer, they are indexed in memory once downloaded. Files of
+ * older versions also have no magic, parent and removed paths and are full
+ * snapshots.
  */
 class SnapshotController
 {
+    /**
+     * Downloaded snapshot file
+     */
+    struct SnapshotFile
+    {
+        unsigned long timestamp_;          // timestamp of the snapshot
+        unsigned long parent_;             // parent snapshot, 0 if full
+        std::string path_;                 // local path of the file
+        FILE *file_;                       // open file
+        size_t entry_count_;               // number of entries
+        long table_pos_;                   // offset of the chunk table
+        long table_end_;                   // end offset of the chunk table
+        std::vector<std::string> removed_; // paths removed since the parent, sorted
+        long entries_pos_;                 // offset of the first entry
+        long index_pos_;                   // offset of the index, -1 if indexed in memory
+        std::vector<long> index_;          // entry offsets sorted by path, for files without an index
+        SnapshotStream::Parts parts_;      // layout of the cloud object
+
+        SnapshotFile() : timestamp_(0), parent_(0), file_(NULL), entry_count_(0), table_pos_(0), table_end_(0), entries_pos_(0), index_pos_(-1) {}
+    };
+
+    /**
+     * Entry of a snapshot file
+     */
+    struct SnapshotEntry
+    {
+        struct stat st_;            // stat of the file or directory
+        std::string path_;          // absolute path on the SSD
+        std::vector<Chunk> chunks_; // chunks of a file
+        std::string buffer_path_;   // buffer path of a file
+        size_t size_;               // size of a file
+        long data_pos_;             // offset of the contents of a small file,
+                                    // -1 if not stored
+        std::string blob_;          // key of the chunk holding the contents of
+                                    // a small file, empty if not stored
+    };
+
+    /**
+     * Location of an entry in a chain of snapshot files
+     */
+    struct EntryLocation
+    {
+        size_t file_; // index of the snapshot file in the chain
+        long begin_;  // offset of the entry
+        long end_;    // end offset of the entry, -1 if not known
+    };
+
+    /**
+     * Installed snapshot, served from the indexes of its chain
+     */
+    struct InstalledView
+    {
+        std::vector<SnapshotFile> chain_; // downloaded chain, kept open
+    };
+
+    /**
+     * Open file of an installed snapshot, backed by an unlinked scratch file
+     */
+    struct ViewFile
+    {
+        std::vector<Chunk> chunks_; // chunks of a large file
+        std::vector<bool> fetched_; // true once a chunk is in the scratch file
+    };
+
+    /**
+     * Contents of small files referenced by a snapshot being written
+     */
+    struct Blobs
+    {
+        std::mutex mutex_;                         // guards paths_, filled by the walker threads
+        std::map<std::string, std::string> paths_; // buffer path of the contents by chunk key
+    };
+
+    static const uint64_t SNAPSHOT_MAGIC;  // magic of the snapshot file
+    static const uint64_t SNAPSHOT_MAGIC_V2; // magic of the previous version
+    static const uint64_t INDEX_MAGIC;     // magic ending the footer
+    static const uint64_t PARENTS_MAGIC;   // magic of the parents in the
+                                           // persisted snapshot info
+    static const std::string INFO_FILE_NAME; // name of the snapshot info file
+                                             // on the SSD
+    static const int MAX_CHAIN_LENGTH;     // snapshots in a chain before the
+                                           // next one is a full snapshot
+    static const size_t ENTRY_COUNT_AT_END; // entry count in the header if
+                                            // the count follows the entries
+    static const std::string BLOB_PREFIX;   // key prefix of the chunks holding
+                                            // the contents of small files
+
     struct cloudfs_state *state_;                           // cloudfs state
     std::shared_ptr<DebugLogger> logger_;                   // logger
     std::shared_ptr<CloudfsController> cloudfs_controller_; // cloudfs controller
     std::string snapshot_stub_path_;                        // absolute path to the ".snapshot" file
+    std::string info_path_;                                 // absolute path to the snapshot info file
+    std::vector<unsigned long> snapshot_list_;              // timestamps of the snapshots
+    std::map<unsigned long, unsigned long> snapshot_parents_; // parent of each snapshot, 0 for a full snapshot
+    std::unique_ptr<ChangeJournal> journal_;                // paths changed since the latest snapshot
+    std::map<unsigned long, std::unique_ptr<InstalledView>> views_; // installed snapshots, NULL until first access
+    std::unordered_map<uint64_t, ViewFile> view_files_;              // open files of installed snapshots by fd
+    unsigned long diff_from_;                // snapshot compared from by the pending diff
+    unsigned long diff_to_;                  // snapshot compared to by the pending diff
+    std::vector<std::string> diff_records_;  // records of the pending diff, empty once all were returned
 
 public:
     SnapshotController(struct cloudfs_state *state, std::shared_ptr<DebugLogger> logger, std::shared_ptr<CloudfsController> cloudfs_controller);
@@ -40,6 +180,15 @@ public:
      */
     int restore_snapshot(unsigned long *timestamp);
 
+    /**
+     * Restore a file or directory subtree from a snapshot, the rest of the
+     * tree, the chunk table and newer snapshots are kept
+     * @param timestamp The timestamp of the snapshot
+     * @param path The path relative to the mount point
+     * @return 0 on success, negative errno on failure
+     */
+    int restore_subtree(unsigned long *timestamp, const std::string &path);
+
     /**
      * List snapshots
      * @param snapshot_list The list of snapshots, used as output
@@ -47,6 +196,15 @@ public:
      */
     int list_snapshots(unsigned long *snapshot_list);
 
+    /**
+     * List the paths changed from a snapshot to another snapshot or to the
+     * live tree, a page of records at a time
+     * @param diff The snapshots and the cursor, the page of records is
+     * returned in it
+     * @return 0 on success, negative errno on failure
+     */
+    int diff_snapshots(struct cloudfs_diff *diff);
+
     /**
      * Delete a snapshot
      * @param timestamp The timestamp of the snapshot
@@ -73,20 +231,75 @@ public:
      */
     void persist();
 
-private:
     /**
-     * Get the snapshot count
-     * @param count The snapshot count, used as output
+     * Record a path that is about to change, for the next incremental snapshot
+     * @param path path relative to the mount point
+     */
+    void record_change(const std::string &path);
+
+    /**
+     * Check whether a path is inside an installed snapshot
+     * @param path path relative to the mount point
+     * @return true if the path is "/snapshot_<timestamp>" of an installed
+     * snapshot or below it
+     */
+    bool is_view_path(const std::string &path);
+
+    /**
+     * Get the names of the installed snapshot roots
+     * @param names The names, used as output
+     */
+    void get_view_names(std::vector<std::string> &names);
+
+    /**
+     * Get the attributes of a path inside an installed snapshot
+     * @param path path relative to the mount point
+     * @param statbuf The attributes, used as output
      * @return 0 on success, negative errno on failure
      */
-    int get_snapshot_count(int &count);
+    int view_getattr(const std::string &path, struct stat *statbuf);
 
     /**
-     * Set the snapshot count
-     * @param count The snapshot count
+     * List a directory inside an installed snapshot
+     * @param path path relative to the mount point
+     * @param names The names in the directory, used as output
      * @return 0 on success, negative errno on failure
      */
-    int set_snapshot_count(int count);
+    int view_readdir(const std::string &path, std::vector<std::string> &names);
+
+    /**
+     * Open a file inside an installed snapshot, read-only
+     * @param path path relative to the mount point
+     * @param flags The open flags
+     * @param fd The file descriptor of the scratch file, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int view_open(const std::string &path, int flags, uint64_t *fd);
+
+    /**
+     * Make a range of an open file of an installed snapshot available in its
+     * scratch file, at the same offset
+     * @param fd The file descriptor of the scratch file
+     * @param size The size of the range
+     * @param offset The offset of the range
+     * @return 0 on success, negative errno on failure
+     */
+    int view_locate_read(uint64_t fd, size_t size, off_t offset);
+
+    /**
+     * Close an open file of an installed snapshot
+     * @param fd The file descriptor of the scratch file
+     * @return 0 on success, negative errno on failure
+     */
+    int view_release(uint64_t fd);
+
+private:
+    /**
+     * Get the snapshot count
+     * @param count The snapshot count, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int get_snapshot_count(int &count);
 
     /**
      * Get the snapshot list
@@ -96,7 +309,7 @@ private:
     int get_snapshot_list(std::vector<unsigned long> &list);
 
     /**
-     * Set the snapshot list
+     * Set the snapshot list, drops the parents of removed snapshots
      * @param list The snapshot list
      * @return 0 on success, negative errno on failure
      */
@@ -130,6 +343,395 @@ private:
      */
     int set_installed_snapshot_list(std::vector<unsigned long> &list);
 
+    /**
+     * Get the parent of a snapshot
+     * @param timestamp The timestamp of the snapshot
+     * @return The timestamp of the parent, 0 for a full snapshot
+     */
+    unsigned long get_snapshot_parent(unsigned long timestamp);
+
+    /**
+     * Set the parent of a snapshot
+     * @param timestamp The timestamp of the snapshot
+     * @param parent The timestamp of the parent, 0 for a full snapshot
+     * @return 0 on success, negative errno on failure
+     */
+    int set_snapshot_parent(unsigned long timestamp, unsigned long parent);
+
+    /**
+     * Get the number of snapshots from a snapshot up to its full snapshot
+     * @param timestamp The timestamp of the snapshot
+     * @return The chain length, 1 for a full snapshot
+     */
+    int get_chain_length(unsigned long timestamp);
+
+    /**
+     * Read snapshot info, in the layout persisted on cloud
+     * @param path The path of the snapshot info file
+     * @return 0 on success, 1 if the file holds no snapshot info, negative
+     * errno on failure
+     */
+    int read_snapshot_info(const std::string &path);
+
+    /**
+     * Write the snapshot info file on the SSD
+     * @return 0 on success, negative errno on failure
+     */
+    int write_snapshot_info();
+
+    /**
+     * Move snapshot info kept in xattrs by older versions into memory
+     */
+    void load_legacy_snapshot_info();
+
+    /**
+     * Find the installed snapshot of a path, its chain is downloaded on first
+     * access
+     * @param path path relative to the mount point
+     * @param view_path The path below the view root, "/" for the root, used
+     * as output
+     * @return The installed snapshot, NULL if the path is not inside one or
+     * loading it failed
+     */
+    InstalledView *find_view(const std::string &path, std::string &view_path);
+
+    /**
+     * Download the chain of an installed snapshot
+     * @param timestamp The timestamp of the snapshot
+     * @param view The installed snapshot, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int load_view(unsigned long timestamp, InstalledView &view);
+
+    /**
+     * Read the entry of a path inside an installed snapshot
+     * @param path path relative to the mount point
+     * @param entry The entry, used as output
+     * @param file The snapshot file holding the entry, used as output if not
+     * NULL
+     * @return 0 on success, 1 for the view root, negative errno on failure
+     */
+    int read_view_entry(const std::string &path, SnapshotEntry &entry, FILE **file);
+
+    /**
+     * Serialize a snapshot entry for a file or directory, safe to call from
+     * the snapshot walker threads once the cached metadata is written back
+     * @param path The absolute path on the SSD
+     * @param st The stat of the path
+     * @param record The record to append the entry to
+     * @param blobs The contents of small files to store as chunks, NULL to
+     * copy them into the record
+     * @return 0 on success, negative errno on failure
+     */
+    int serialize_entry(const std::string &path, const struct stat &st, std::string &record, Blobs *blobs);
+
+    /**
+     * Write the entries of all files and directories on the SSD, the tree is
+     * walked by state_->snapshot_threads threads
+     * @param tmp_file The snapshot file
+     * @param offsets The path and offset of every entry written, used as
+     * output
+     * @param blobs The contents of small files to store as chunks, NULL to
+     * copy them into the snapshot file
+     * @return 0 on success, negative errno on failure
+     */
+    int write_all_entries(FILE *tmp_file, std::vector<std::pair<std::string, long>> &offsets,
+                          Blobs *blobs);
+
+    /**
+     * Get the compression of new snapshot objects from the cloudfs state
+     * @return The compression
+     */
+    SnapshotStream::Compression get_compression() const;
+
+    /**
+     * Collect the paths in the change journal
+     * @param changed The existing paths and their stat, used as output
+     * @param removed The removed paths, used as output
+     * @return 0 on success, 1 if a full snapshot is needed, negative errno on
+     * failure
+     */
+    int collect_changes(std::vector<std::pair<std::string, struct stat>> &changed,
+                        std::vector<std::string> &removed);
+
+    /**
+     * Write the entries of the changed paths
+     * @param tmp_file The snapshot file
+     * @param changed The existing paths and their stat
+     * @param offsets The path and offset of every entry written, used as
+     * output
+     * @param blobs The contents of small files to store as chunks, NULL to
+     * copy them into the snapshot file
+     * @return 0 on success, negative errno on failure
+     */
+    int write_changed_entries(FILE *tmp_file,
+                              const std::vector<std::pair<std::string, struct stat>> &changed,
+                              std::vector<std::pair<std::string, long>> &offsets,
+                              Blobs *blobs);
+
+    /**
+     * Hold the chunks of the small files of a new snapshot, the ones not held
+     * by another snapshot yet are uploaded
+     * @param blobs The contents referenced by the snapshot
+     * @return 0 on success, negative errno on failure, nothing is held then
+     */
+    int hold_blobs(Blobs &blobs);
+
+    /**
+     * Release the chunks of small files held by a snapshot, retire the ones
+     * no other snapshot holds
+     * @param keys The keys of the chunks
+     */
+    void release_blobs(const std::set<std::string> &keys);
+
+    /**
+     * Collect the chunks of small files held by a snapshot
+     * @param snapshot The snapshot file
+     * @param keys The keys of the chunks, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int collect_blobs(SnapshotFile &snapshot, std::set<std::string> &keys);
+
+    /**
+     * Write the removed paths section
+     * @param tmp_file The snapshot file
+     * @param removed The removed paths
+     */
+    void write_removed(FILE *tmp_file, const std::vector<std::string> &removed);
+
+    /**
+     * Write the index and the footer after the entries
+     * @param tmp_file The snapshot file
+     * @param table_pos The offset of the chunk table
+     * @param removed_pos The offset of the removed paths
+     * @param offsets The path and offset of every entry, sorted in place
+     * @return 0 on success, negative errno on failure
+     */
+    int write_index(FILE *tmp_file, long table_pos, long removed_pos,
+                    std::vector<std::pair<std::string, long>> &offsets);
+
+    /**
+     * Download a snapshot and read its header
+     * @param timestamp The timestamp of the snapshot
+     * @param snapshot The snapshot file, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int fetch_snapshot(unsigned long timestamp, SnapshotFile &snapshot);
+
+    /**
+     * Download a snapshot and its ancestors up to the full snapshot
+     * @param timestamp The timestamp of the snapshot
+     * @param chain The snapshot files from the full snapshot to the snapshot,
+     * used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int fetch_chain(unsigned long timestamp, std::vector<SnapshotFile> &chain);
+
+    /**
+     * Index the entries of a snapshot file without an index in memory
+     * @param snapshot The snapshot file
+     * @return 0 on success, negative errno on failure
+     */
+    int index_entries(SnapshotFile &snapshot);
+
+    /**
+     * Read the path of an entry in index order
+     * @param snapshot The snapshot file
+     * @param i The position in the index
+     * @param path The absolute path of the entry, used as output
+     * @param offset The offset of the entry, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int read_index_path(SnapshotFile &snapshot, size_t i, std::string &path, long &offset);
+
+    /**
+     * Find the first entry in index order whose path is not less than a path
+     * @param snapshot The snapshot file
+     * @param path The absolute path
+     * @param i The position in the index, the entry count if there is none,
+     * used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int lower_bound_entry(SnapshotFile &snapshot, const std::string &path, size_t &i);
+
+    /**
+     * Find the entry of a path in a snapshot file
+     * @param snapshot The snapshot file
+     * @param path The absolute path
+     * @param offset The offset of the entry, used as output
+     * @return 0 on success, 1 if the snapshot has no entry for the path,
+     * negative errno on failure
+     */
+    int find_entry(SnapshotFile &snapshot, const std::string &path, long &offset);
+
+    /**
+     * Check whether a snapshot drops the entries older snapshots hold for a
+     * path, as it removed the path or a directory above it, or a file
+     * replaced a directory above it
+     * @param snapshot The snapshot file
+     * @param path The absolute path
+     * @return 1 if the path is dropped, 0 if not, negative errno on failure
+     */
+    int drops_path(SnapshotFile &snapshot, const std::string &path);
+
+    /**
+     * Find the latest entry of a path in a chain of snapshots, without
+     * composing the chain
+     * @param chain The snapshot files, oldest first
+     * @param path The absolute path
+     * @param location The location of the entry, used as output
+     * @return 0 on success, 1 if the path is not in the composed chain,
+     * negative errno on failure
+     */
+    int lookup_entry(std::vector<SnapshotFile> &chain, const std::string &path, EntryLocation &location);
+
+    /**
+     * List the names in a directory of a chain of snapshots, without
+     * composing the chain
+     * @param chain The snapshot files, oldest first
+     * @param path The absolute path of the directory
+     * @param names The names, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int list_entries(std::vector<SnapshotFile> &chain, const std::string &path, std::set<std::string> &names);
+
+    /**
+     * Download the chains of two snapshots, a snapshot in both chains is
+     * downloaded once
+     * @param from The timestamp of the first snapshot, 0 for none
+     * @param to The timestamp of the second snapshot, 0 for none
+     * @param files The downloaded snapshot files, to be closed by the caller
+     * even on failure, used as output
+     * @param from_chain The chain of the first snapshot, oldest first, shares
+     * the open files, used as output
+     * @param to_chain The chain of the second snapshot, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int fetch_chains(unsigned long from, unsigned long to, std::vector<SnapshotFile> &files,
+                     std::vector<SnapshotFile> &from_chain, std::vector<SnapshotFile> &to_chain);
+
+    /**
+     * Write the entries of the live tree to an unlinked scratch file, as an
+     * incremental snapshot on the base of the change journal if the journal
+     * covers all changes
+     * @param live The scratch file, indexed in memory, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int write_live(SnapshotFile &live);
+
+    /**
+     * Compute the changes from a snapshot to another snapshot or to the live
+     * tree
+     * @param from The timestamp of the snapshot compared from
+     * @param to The timestamp of the snapshot compared to, 0 for the live tree
+     * @param records One record per changed path in path order, see struct
+     * cloudfs_diff, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int compute_diff(unsigned long from, unsigned long to, std::vector<std::string> &records);
+
+    /**
+     * Compare the entries of a path and add its records
+     * @param path The absolute path
+     * @param from_chain The chain compared from
+     * @param from The location of the old entry, NULL if there is none
+     * @param to_chain The chain compared to
+     * @param to The location of the new entry, NULL if there is none
+     * @param records The records, appended to
+     * @return 0 on success, negative errno on failure
+     */
+    int diff_entry(const std::string &path, std::vector<SnapshotFile> &from_chain, const EntryLocation *from,
+                   std::vector<SnapshotFile> &to_chain, const EntryLocation *to,
+                   std::vector<std::string> &records);
+
+    /**
+     * Close and remove downloaded snapshot files
+     * @param chain The snapshot files
+     */
+    void close_chain(std::vector<SnapshotFile> &chain);
+
+    /**
+     * Read a snapshot entry, the contents of a small file are skipped
+     * @param file The snapshot file
+     * @param entry The entry, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int read_entry(FILE *file, SnapshotEntry &entry);
+
+    /**
+     * Read the contents of a small file, from the snapshot file or from the
+     * chunk holding them
+     * @param file The snapshot file of the entry
+     * @param entry The entry
+     * @param data The contents, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int read_contents(FILE *file, const SnapshotEntry &entry, std::string &data);
+
+    /**
+     * Copy the contents of a small file to the start of a file, from the
+     * snapshot file or from the chunk holding them
+     * @param file The snapshot file of the entry
+     * @param entry The entry
+     * @param fd The file to copy to, empty
+     * @return 0 on success, negative errno on failure
+     */
+    int copy_contents(FILE *file, const SnapshotEntry &entry, int fd);
+
+    /**
+     * Compose the entries of a chain of snapshots
+     * @param chain The snapshot files, oldest first
+     * @param entries The latest entry of every path, used as output
+     * @param removed The paths removed since the parent of the oldest
+     * snapshot, used as output
+     * @return 0 on success, negative errno on failure
+     */
+    int compose_chain(std::vector<SnapshotFile> &chain,
+                      std::map<std::string, EntryLocation> &entries,
+                      std::set<std::string> &removed);
+
+    /**
+     * Compose the entries of a path and everything below it in a chain of
+     * snapshots, from their indexes
+     * @param chain The snapshot files, oldest first
+     * @param path The absolute path
+     * @param entries The latest entry of every path in the subtree, used as
+     * output
+     * @return 0 on success, negative errno on failure
+     */
+    int compose_subtree(std::vector<SnapshotFile> &chain, const std::string &path,
+                        std::map<std::string, EntryLocation> &entries);
+
+    /**
+     * Recreate composed entries on the SSD
+     * @param chain The snapshot files the entries are located in
+     * @param entries The entries
+     * @param subtree true if the entries are restored next to the live tree,
+     * files then get new buffer files
+     * @param use_chunks true if the restored files take references on their
+     * chunks
+     * @return 0 on success, negative errno on failure
+     */
+    int apply_entries(std::vector<SnapshotFile> &chain,
+                      const std::map<std::string, EntryLocation> &entries,
+                      bool subtree, bool use_chunks);
+
+    /**
+     * Fold a snapshot into its child, the child takes over its parent
+     * @param snapshot The snapshot file being deleted
+     * @param child The timestamp of the child
+     * @return 0 on success, negative errno on failure
+     */
+    int fold_into_child(SnapshotFile &snapshot, unsigned long child);
+
+    /**
+     * Remove a file or directory subtree of the live tree, its files release
+     * their chunks
+     * @param path The path relative to the mount point
+     * @return 0 on success, negative errno on failure
+     */
+    int remove_subtree(const std::string &path);
+
     /**
      * Clear user contents under a directory
      * @param path The path to the directory
@@ -0,0 +1,378 @@
+#include "snapshot_stream.h"
+
+#include <algorithm>
+#include <archive.h>
+#include <archive_entry.h>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+const uint64_t SnapshotStream::MAGIC = 0x314d525453534643; // "CFSSTRM1"
+const size_t SnapshotStream::PART_SIZE = 8 * 1024 * 1024;
+const size_t SnapshotStream::BLOCK_SIZE = 64 * 1024;
+
+/**
+ * State of a download
+ *
+ * Only the prefetch thread uses the controller while it runs, the buffers of
+ * BufferFileController are shared by all its downloads.
+ */
+struct SnapshotStream::Download {
+  std::shared_ptr<BufferFileController> controller_; // buffer file controller
+  std::string key_;                                  // object key
+  Parts parts_;                                      // layout of the object
+  uint64_t next_;                                    // next part to download
+  std::string data_;                                 // current part
+  size_t offset_; // offset of the unread data in the current part
+  bool failed_;   // true if downloading a part failed
+  std::thread prefetch_;  // downloads part next_, if joinable
+  std::string next_data_; // part next_, once prefetch_ is joined
+  int next_ret_;          // result of downloading part next_
+
+  ~Download() {
+    if (prefetch_.joinable()) {
+      prefetch_.join();
+    }
+  }
+};
+
+SnapshotStream::SnapshotStream(std::shared_ptr<BufferFileController> controller,
+                               std::string key, uint64_t generation,
+                               const Compression &compression,
+                               std::shared_ptr<DebugLogger> logger)
+    : controller_(std::move(controller)), key_(std::move(key)),
+      logger_(std::move(logger)), generation_(generation), archive_(NULL),
+      file_(NULL), position_(0), compressed_(0), parts_(0), failed_(false),
+      finished_(false) {
+  // a single raw entry, its size is not known up front
+  archive_ = archive_write_new();
+  if (add_filter(compression) != 0) {
+    return;
+  }
+  archive_write_set_format_raw(archive_);
+  archive_write_set_bytes_per_block(archive_, BLOCK_SIZE);
+  archive_write_set_bytes_in_last_block(archive_, 1); // no padding
+  if (archive_write_open(archive_, this, NULL, write_archive, NULL) !=
+      ARCHIVE_OK) {
+    logger_->error("SnapshotStream: open compressor failed, key: ", key_, ", ",
+                   archive_error_string(archive_));
+    return;
+  }
+  struct archive_entry *entry = archive_entry_new();
+  archive_entry_set_pathname(entry, "snapshot");
+  archive_entry_set_filetype(entry, AE_IFREG);
+  archive_entry_set_perm(entry, 0644);
+  auto ret = archive_write_header(archive_, entry);
+  archive_entry_free(entry);
+  if (ret != ARCHIVE_OK) {
+    logger_->error("SnapshotStream: write header failed, key: ", key_, ", ",
+                   archive_error_string(archive_));
+    return;
+  }
+
+  cookie_io_functions_t functions;
+  memset(&functions, 0, sizeof(functions));
+  functions.write = write_cookie;
+  functions.seek = seek_cookie;
+  functions.close = close_cookie;
+  file_ = fopencookie(this, "w", functions);
+  if (file_ == NULL) {
+    logger_->error("SnapshotStream: open stream failed, key: ", key_);
+    return;
+  }
+  setvbuf(file_, NULL, _IOFBF, BLOCK_SIZE);
+}
+
+SnapshotStream::~SnapshotStream() {
+  failed_ = true; // nothing left to upload
+  if (file_ != NULL) {
+    fclose(file_);
+  }
+  if (archive_ != NULL) {
+    archive_write_free(archive_);
+  }
+  if (!finished_) {
+    // the first part was never uploaded, only the others exist
+    Parts parts;
+    parts.generation_ = generation_;
+    parts.count_ = parts_;
+    remove(controller_, key_, parts, true);
+  }
+}
+
+int SnapshotStream::finish() {
+  if (file_ == NULL) {
+    errno = EIO;
+    return logger_->error("SnapshotStream::finish: stream not open, key: ",
+                          key_);
+  }
+
+  // flush the stream, then the compressor
+  auto ret = fclose(file_);
+  file_ = NULL;
+  if (ret != 0 || archive_write_close(archive_) != ARCHIVE_OK) {
+    failed_ = true;
+  }
+  archive_write_free(archive_);
+  archive_ = NULL;
+  if (!failed_ && (parts_ == 0 || !current_.empty())) {
+    flush_part();
+  }
+  if (failed_) {
+    errno = EIO;
+    return logger_->error("SnapshotStream::finish: upload failed, key: ",
+                          key_);
+  }
+
+  // the first part commits the object
+  std::string first(3 * sizeof(uint64_t), '\0');
+  memcpy(&first[0], &MAGIC, sizeof(uint64_t));
+  memcpy(&first[sizeof(uint64_t)], &generation_, sizeof(uint64_t));
+  memcpy(&first[2 * sizeof(uint64_t)], &parts_, sizeof(uint64_t));
+  first += first_;
+  if (controller_->upload_buffer(key_, first.data(), first.size()) != 0) {
+    return logger_->error("SnapshotStream::finish: upload first part failed, "
+                          "key: ",
+                          key_);
+  }
+  finished_ = true;
+  logger_->info("SnapshotStream::finish: uploaded ", key_, ", ", parts_,
+                " parts");
+  return 0;
+}
+
+int SnapshotStream::download(std::shared_ptr<BufferFileController> controller,
+                             const std::string &key, const std::string &path,
+                             Parts &parts,
+                             std::shared_ptr<DebugLogger> logger) {
+  Download download;
+  download.controller_ = controller;
+  download.key_ = key;
+  download.next_ = 1;
+  download.offset_ = 0;
+  download.failed_ = false;
+  download.next_ret_ = 0;
+  if (controller->download_buffer(key, download.data_) != 0) {
+    return logger->error("SnapshotStream::download: get first part failed, "
+                         "key: ",
+                         key);
+  }
+  uint64_t magic = 0;
+  if (download.data_.size() >= 3 * sizeof(uint64_t)) {
+    memcpy(&magic, download.data_.data(), sizeof(uint64_t));
+  }
+  if (magic == MAGIC) {
+    memcpy(&download.parts_.generation_,
+           download.data_.data() + sizeof(uint64_t), sizeof(uint64_t));
+    memcpy(&download.parts_.count_,
+           download.data_.data() + 2 * sizeof(uint64_t), sizeof(uint64_t));
+    download.offset_ = 3 * sizeof(uint64_t);
+  } else {
+    // a tar archive of an older version
+    download.parts_.count_ = 1;
+  }
+  parts = download.parts_;
+  if (download.next_ < download.parts_.count_) {
+    prefetch(&download);
+  }
+
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == NULL) {
+    return logger->error("SnapshotStream::download: open file failed, path: ",
+                         path);
+  }
+
+  // decompress the parts as they are downloaded
+  struct archive *a = archive_read_new();
+  archive_read_support_filter_gzip(a);
+  archive_read_support_filter_zstd(a);
+  archive_read_support_format_raw(a);
+  archive_read_support_format_tar(a);
+  struct archive_entry *entry;
+  int ret = -1;
+  if (archive_read_open(a, &download, NULL, read_archive, NULL) ==
+          ARCHIVE_OK &&
+      archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+    char buf[BLOCK_SIZE];
+    la_ssize_t n;
+    while ((n = archive_read_data(a, buf, sizeof(buf))) > 0) {
+      if (fwrite(buf, 1, n, file) != (size_t)n) {
+        break;
+      }
+    }
+    ret = n == 0 && !download.failed_ ? 0 : -1;
+  }
+  if (ret != 0) {
+    logger->error("SnapshotStream::download: decompress failed, key: ", key,
+                  ", ", archive_error_string(a));
+  }
+  archive_read_free(a);
+  if (fclose(file) != 0) {
+    ret = -1;
+  }
+  if (ret != 0) {
+    errno = EIO;
+    return -errno;
+  }
+  return 0;
+}
+
+void SnapshotStream::remove(std::shared_ptr<BufferFileController> controller,
+                            const std::string &key, const Parts &parts,
+                            bool keep_first) {
+  for (uint64_t i = 1; i < parts.count_; i++) {
+    controller->delete_object(part_key(key, parts.generation_, i));
+  }
+  if (!keep_first) {
+    controller->delete_object(key);
+  }
+}
+
+std::string SnapshotStream::part_key(const std::string &key,
+                                     uint64_t generation, uint64_t part) {
+  return key + "." + std::to_string(generation) + "." + std::to_string(part);
+}
+
+bool SnapshotStream::zstd_supported() {
+  auto archive = archive_write_new();
+  auto ret = archive_write_add_filter_zstd(archive);
+  archive_write_free(archive);
+  return ret == ARCHIVE_OK;
+}
+
+int SnapshotStream::add_filter(const Compression &compression) {
+  bool zstd = compression.filter_ == "zstd";
+  if (zstd && archive_write_add_filter_zstd(archive_) != ARCHIVE_OK) {
+    // a libarchive built without zstd
+    logger_->error("SnapshotStream::add_filter: zstd not supported, using "
+                   "gzip, key: ",
+                   key_, ", ", archive_error_string(archive_));
+    zstd = false;
+  }
+  if (!zstd && archive_write_add_filter_gzip(archive_) != ARCHIVE_OK) {
+    errno = EINVAL;
+    return logger_->error("SnapshotStream::add_filter: add gzip failed, key: ",
+                          key_, ", ", archive_error_string(archive_));
+  }
+
+  // a bad option leaves the default of the filter in place
+  const char *module = zstd ? "zstd" : "gzip";
+  if (compression.level_ != 0) {
+    auto level = std::to_string(compression.level_);
+    if (archive_write_set_filter_option(archive_, module, "compression-level",
+                                        level.c_str()) != ARCHIVE_OK) {
+      logger_->error("SnapshotStream::add_filter: set ", module, " level ",
+                     level, " failed, ", archive_error_string(archive_));
+    }
+  }
+  if (zstd) {
+    int threads = compression.threads_;
+    if (threads <= 0) {
+      threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // the threads option needs libarchive 3.6, older ones compress on the
+    // calling thread
+    if (threads > 1 && archive_version_number() < 3006000) {
+      threads = 1;
+    }
+    if (threads > 1 &&
+        archive_write_set_filter_option(archive_, module, "threads",
+                                        std::to_string(threads).c_str()) !=
+            ARCHIVE_OK) {
+      logger_->error("SnapshotStream::add_filter: set zstd threads ", threads,
+                     " failed, compressing on one thread, ",
+                     archive_error_string(archive_));
+    }
+  }
+  return 0;
+}
+
+int SnapshotStream::flush_part() {
+  if (parts_ == 0) {
+    // held back until the part count is known
+    first_.swap(current_);
+  } else if (controller_->upload_buffer(part_key(key_, generation_, parts_),
+                                        current_.data(),
+                                        current_.size()) != 0) {
+    failed_ = true;
+    return -errno;
+  }
+  current_.clear();
+  parts_++;
+  return 0;
+}
+
+ssize_t SnapshotStream::write_cookie(void *cookie, const char *buf,
+                                     size_t size) {
+  auto stream = static_cast<SnapshotStream *>(cookie);
+  if (stream->failed_ || archive_write_data(stream->archive_, buf, size) < 0) {
+    stream->failed_ = true;
+    return -1;
+  }
+  stream->position_ += size;
+  return size;
+}
+
+int SnapshotStream::seek_cookie(void *cookie, off64_t *offset, int whence) {
+  // only reports the position, for ftell
+  auto stream = static_cast<SnapshotStream *>(cookie);
+  if (whence != SEEK_CUR || *offset != 0) {
+    errno = ESPIPE;
+    return -1;
+  }
+  *offset = stream->position_;
+  return 0;
+}
+
+int SnapshotStream::close_cookie(void *cookie) {
+  // the compressor is closed by finish, it still has to flush
+  return 0;
+}
+
+ssize_t SnapshotStream::write_archive(struct archive *a, void *client_data,
+                                      const void *buf, size_t size) {
+  auto stream = static_cast<SnapshotStream *>(client_data);
+  if (stream->failed_) {
+    return -1;
+  }
+  stream->current_.append(static_cast<const char *>(buf), size);
+  stream->compressed_ += size;
+  if (stream->current_.size() >= PART_SIZE && stream->flush_part() != 0) {
+    return -1;
+  }
+  return size;
+}
+
+ssize_t SnapshotStream::read_archive(struct archive *a, void *client_data,
+                                     const void **buf) {
+  auto download = static_cast<Download *>(client_data);
+  while (download->offset_ >= download->data_.size()) {
+    if (download->next_ >= download->parts_.count_) {
+      return 0; // end of the object
+    }
+    download->prefetch_.join();
+    if (download->next_ret_ != 0) {
+      download->failed_ = true;
+      return -1;
+    }
+    download->data_.swap(download->next_data_);
+    download->next_++;
+    download->offset_ = 0;
+    if (download->next_ < download->parts_.count_) {
+      prefetch(download);
+    }
+  }
+  *buf = download->data_.data() + download->offset_;
+  auto n = download->data_.size() - download->offset_;
+  download->offset_ = download->data_.size();
+  return n;
+}
+
+void SnapshotStream::prefetch(Download *download) {
+  auto key = part_key(download->key_, download->parts_.generation_,
+                      download->next_);
+  download->prefetch_ = std::thread([download, key]() {
+    download->next_ret_ =
+        download->controller_->download_buffer(key, download->next_data_);
+  });
+}
@@ -0,0 +1,192 @@
+/**
+ * @file snapshot_stream.h
+ * @brief Compressed snapshot objects streamed to and from the cloud in parts
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+
+#include "buffer_file.h"
+#include "util.h"
+
+struct archive;
+
+/**
+ * Compressed snapshot object streamed to the cloud in parts
+ *
+ * Everything written to file() is compressed on the fly and uploaded in parts
+ * of PART_SIZE compressed bytes, so a snapshot needs neither a scratch file on
+ * the SSD nor a known size up front. zstd compresses on several threads while
+ * the caller keeps writing (libarchive 3.6 and later), gzip uses the calling
+ * thread only. A stream falls back to gzip if zstd is not supported. The filter is
+ * detected when an object is read, so objects of either filter can be
+ * restored whatever the current setting is. The first part keeps the object
+ * key and starts with [u64 magic][u64 generation][u64 part count], part i > 0
+ * is stored as "<key>.<generation>.<i>". The first part is uploaded last and
+ * commits the object, an object that is rewritten gets a new generation so
+ * its old parts stay valid until then.
+ *
+ * Objects of older versions are a single gzip compressed tar archive and are
+ * read as one part.
+ *
+ * A download fetches the next part on a background thread while the current
+ * one is decompressed, so the transfer of a part overlaps the decompression
+ * of the previous one.
+ */
+class SnapshotStream {
+
+  static const uint64_t MAGIC;    // magic of the first part
+  static const size_t PART_SIZE;  // compressed bytes per part
+  static const size_t BLOCK_SIZE; // bytes handed to the compressor at once
+
+  std::shared_ptr<BufferFileController> controller_; // buffer file controller
+  std::string key_;                                  // object key
+  std::shared_ptr<DebugLogger> logger_;              // logger
+  uint64_t generation_;                              // generation of the parts
+  struct archive *archive_;                          // compressor
+  FILE *file_;          // stream written by the caller
+  uint64_t position_;   // bytes written to the stream so far
+  uint64_t compressed_; // compressed bytes so far
+  std::string first_;   // first part, uploaded last
+  std::string current_; // part being filled
+  uint64_t parts_;      // parts uploaded or held so far
+  bool failed_;         // true if compressing or uploading failed
+  bool finished_;       // true if the object was committed
+
+public:
+  /**
+   * Object layout
+   */
+  struct Parts {
+    uint64_t generation_; // generation of the parts
+    uint64_t count_;      // number of parts
+
+    Parts() : generation_(0), count_(0) {}
+  };
+
+  /**
+   * Compression of an object
+   */
+  struct Compression {
+    std::string filter_; // "zstd" or "gzip"
+    int level_;          // compression level, 0 for the default of the filter
+    int threads_;        // compression threads of zstd, 0 for one per core
+
+    Compression() : filter_("gzip"), level_(0), threads_(1) {}
+  };
+
+  /**
+   * Check whether the linked libarchive can compress with zstd
+   * @return true if zstd is supported
+   */
+  static bool zstd_supported();
+
+  /**
+   * Constructor, opens a stream that uploads an object
+   * @param controller buffer file controller
+   * @param key object key
+   * @param generation generation of the parts, higher than the one of an
+   * existing object with the same key
+   * @param compression compression of the object
+   * @param logger logger
+   */
+  SnapshotStream(std::shared_ptr<BufferFileController> controller,
+                 std::string key, uint64_t generation,
+                 const Compression &compression,
+                 std::shared_ptr<DebugLogger> logger);
+
+  /**
+   * Destructor, an unfinished object is abandoned and its parts are deleted
+   */
+  ~SnapshotStream();
+
+  /**
+   * Get the stream to write the object contents to, it cannot seek but
+   * ftell reports the offset in the object contents
+   * @return the stream, NULL if it could not be opened
+   */
+  FILE *file() const { return file_; }
+
+  /**
+   * Get the compressed size of the object contents, complete after finish()
+   * @return compressed bytes so far, without the header of the first part
+   */
+  uint64_t compressed_size() const { return compressed_; }
+
+  /**
+   * Flush the stream and commit the object
+   * @return 0 on success, negative errno on failure
+   */
+  int finish();
+
+  /**
+   * Download and decompress an object to a local file
+   * @param controller buffer file controller
+   * @param key object key
+   * @param path path of the local file
+   * @param parts layout of the object, used as output
+   * @param logger logger
+   * @return 0 on success, negative errno on failure
+   */
+  static int download(std::shared_ptr<BufferFileController> controller,
+                      const std::string &key, const std::string &path,
+                      Parts &parts, std::shared_ptr<DebugLogger> logger);
+
+  /**
+   * Delete the parts of an object, the first part is deleted last
+   * @param controller buffer file controller
+   * @param key object key
+   * @param parts layout of the object
+   * @param keep_first true to keep the first part, e.g. after it was
+   * overwritten by a new generation
+   */
+  static void remove(std::shared_ptr<BufferFileController> controller,
+                     const std::string &key, const Parts &parts,
+                     bool keep_first);
+
+private:
+  /**
+   * Get the key of a part
+   * @param key object key
+   * @param generation generation of the parts
+   * @param part index of the part
+   * @return key of the part
+   */
+  static std::string part_key(const std::string &key, uint64_t generation,
+                              uint64_t part);
+
+  /**
+   * Add the compression filter to the compressor, falls back to gzip if zstd
+   * is not supported
+   * @param compression compression of the object
+   * @return 0 on success, negative errno on failure
+   */
+  int add_filter(const Compression &compression);
+
+  /**
+   * Upload the part being filled, the first part is held back
+   * @return 0 on success, negative errno on failure
+   */
+  int flush_part();
+
+  struct Download; // state of a download
+
+  /**
+   * Start downloading the next part of a download in the background
+   * @param download state of the download
+   */
+  static void prefetch(Download *download);
+
+  static ssize_t write_cookie(void *cookie, const char *buf, size_t size);
+  static int seek_cookie(void *cookie, off64_t *offset, int whence);
+  static int close_cookie(void *cookie);
+  static ssize_t write_archive(struct archive *a, void *client_data,
+                               const void *buf, size_t size);
+  static ssize_t read_archive(struct archive *a, void *client_data,
+                              const void **buf);
+};
@@ -0,0 +1,183 @@
+#include "snapshot_walker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <dirent.h>
+#include <thread>
+
+const size_t SnapshotWalker::BATCH_SIZE = 256;
+const size_t SnapshotWalker::WINDOW = 4;
+
+SnapshotWalker::SnapshotWalker(int threads, Filter filter,
+                               Serializer serializer,
+                               std::shared_ptr<DebugLogger> logger)
+    : threads_(threads > 0 ? threads : 0), filter_(std::move(filter)),
+      serializer_(std::move(serializer)), logger_(std::move(logger)),
+      queued_(0), written_(0), active_(0), stop_(false) {
+  if (threads_ == 0) {
+    threads_ = std::max(1u, std::thread::hardware_concurrency());
+  }
+}
+
+int SnapshotWalker::walk(const std::string &root, FILE *file,
+                         std::vector<std::pair<std::string, long>> &offsets) {
+  long position = ftell(file);
+  if (position < 0) {
+    return logger_->error("SnapshotWalker::walk: ftell failed, ", root);
+  }
+
+  queue_.clear();
+  results_.clear();
+  queued_ = 0;
+  written_ = 0;
+  active_ = 0;
+  stop_ = false;
+
+  Task task;
+  task.seq_ = queued_++;
+  task.dir_ = root;
+  queue_.push_back(std::move(task));
+  results_.emplace_back();
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < threads_; i++) {
+    workers.emplace_back(&SnapshotWalker::run, this);
+  }
+
+  // a task queues its children before it finishes, so there is nothing left
+  // once the results of all queued tasks are written
+  int ret = 0;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!results_.empty()) {
+    write_cv_.wait(lock, [this] { return results_.front().done_; });
+    Result result = std::move(results_.front());
+    results_.pop_front();
+    written_++;
+    work_cv_.notify_all();
+    if (result.error_ != 0) {
+      ret = result.error_;
+      break;
+    }
+
+    lock.unlock();
+    if (fwrite(result.records_.data(), 1, result.records_.size(), file) !=
+        result.records_.size()) {
+      ret = -EIO;
+      lock.lock();
+      break;
+    }
+    for (auto &start : result.starts_) {
+      offsets.emplace_back(std::move(start.first), position + start.second);
+    }
+    position += result.records_.size();
+    lock.lock();
+  }
+  stop_ = true;
+  work_cv_.notify_all();
+  lock.unlock();
+
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  logger_->debug("SnapshotWalker::walk: ", root, ", ", written_, " tasks on ",
+                 threads_, " threads");
+  return ret;
+}
+
+void SnapshotWalker::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_cv_.wait(lock, [this] {
+      return stop_ ||
+             (!queue_.empty() &&
+              queue_.front().seq_ < written_ + WINDOW * threads_) ||
+             (queue_.empty() && active_ == 0);
+    });
+    if (stop_ || queue_.empty()) {
+      return;
+    }
+    Task task = std::move(queue_.front());
+    queue_.pop_front();
+    active_++;
+    lock.unlock();
+
+    Result result;
+    std::vector<Task> children;
+    run_task(task, result, children);
+    result.done_ = true;
+
+    lock.lock();
+    for (auto &child : children) {
+      child.seq_ = queued_++;
+      queue_.push_back(std::move(child));
+      results_.emplace_back();
+    }
+    active_--;
+    if (!stop_) {
+      // the task is not written yet, so its result is still queued
+      results_[task.seq_ - written_] = std::move(result);
+      if (task.seq_ == written_) {
+        write_cv_.notify_one();
+      }
+    }
+    work_cv_.notify_all();
+  }
+}
+
+void SnapshotWalker::run_task(const Task &task, Result &result,
+                              std::vector<Task> &children) {
+  const std::vector<std::string> *names = &task.names_;
+  std::vector<std::string> listed;
+  if (names->empty()) {
+    // list the directory, serialize the first batch and queue the others
+    DIR *dirp = opendir(task.dir_.c_str());
+    if (dirp == NULL) {
+      result.error_ = logger_->error("SnapshotWalker::run_task: opendir "
+                                     "failed, ",
+                                     task.dir_);
+      return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dirp)) != NULL) {
+      std::string name(entry->d_name);
+      if (name == "." || name == ".." || filter_(name)) {
+        continue;
+      }
+      listed.push_back(std::move(name));
+    }
+    closedir(dirp);
+
+    for (size_t i = BATCH_SIZE; i < listed.size(); i += BATCH_SIZE) {
+      Task batch;
+      batch.dir_ = task.dir_;
+      batch.names_.assign(listed.begin() + i,
+                          listed.begin() + std::min(i + BATCH_SIZE,
+                                                    listed.size()));
+      children.push_back(std::move(batch));
+    }
+    listed.resize(std::min(listed.size(), BATCH_SIZE));
+    names = &listed;
+  }
+
+  for (auto &name : *names) {
+    auto path = task.dir_ + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      result.error_ =
+          logger_->error("SnapshotWalker::run_task: stat failed, ", path);
+      return;
+    }
+    auto start = result.records_.size();
+    auto ret = serializer_(path, st, result.records_);
+    if (ret != 0) {
+      result.error_ = ret;
+      return;
+    }
+    if (S_ISDIR(st.st_mode)) {
+      Task dir;
+      dir.dir_ = path;
+      children.push_back(std::move(dir));
+    }
+    result.starts_.emplace_back(path, start);
+  }
+}
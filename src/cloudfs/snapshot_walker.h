@@ -0,0 +1,135 @@
+/**
+ * @file snapshot_walker.h
+ * @brief Parallel directory walk for snapshot creation
+ * @author Cundao Yu <cundaoy@andrew.cmu.edu>
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+#include "util.h"
+
+/**
+ * Parallel directory walk for snapshot creation
+ *
+ * Worker threads list directories and serialize their entries while the
+ * calling thread writes the records to the snapshot file. Work is handed out
+ * from a shared FIFO queue in breadth-first order and the records of the tasks
+ * are written in the order the tasks were queued. A task queues the listing of
+ * a directory after serializing its entry, so a directory is always written
+ * before its contents. A directory is split into batches of BATCH_SIZE
+ * entries, so the entries of one huge directory are serialized by all workers
+ * as well.
+ *
+ * A worker only starts a task within WINDOW tasks of the next one to be
+ * written, which bounds the memory held by finished records. Since tasks are
+ * started in queue order the next task to be written is always running or
+ * finished, so the window cannot deadlock.
+ */
+class SnapshotWalker {
+public:
+  /**
+   * Filter of directory entries
+   * @param name name of the entry
+   * @return true to skip the entry
+   */
+  typedef std::function<bool(const std::string &name)> Filter;
+
+  /**
+   * Serializer of an entry, called on worker threads
+   * @param path absolute path of the entry
+   * @param st stat of the entry
+   * @param record record to append the entry to
+   * @return 0 on success, negative errno on failure
+   */
+  typedef std::function<int(const std::string &path, const struct stat &st,
+                            std::string &record)>
+      Serializer;
+
+  /**
+   * Constructor
+   * @param threads number of worker threads, 0 for one per core
+   * @param filter filter of directory entries
+   * @param serializer serializer of an entry
+   * @param logger logger
+   */
+  SnapshotWalker(int threads, Filter filter, Serializer serializer,
+                 std::shared_ptr<DebugLogger> logger);
+
+  /**
+   * Walk a directory tree and write the records of all entries below it
+   * @param root path of the root directory, not written itself
+   * @param file file to write the records to, has to support ftell
+   * @param offsets path and offset in the file of every record written, in
+   * the order written, used as output
+   * @return 0 on success, negative errno on failure
+   */
+  int walk(const std::string &root, FILE *file,
+           std::vector<std::pair<std::string, long>> &offsets);
+
+private:
+  static const size_t BATCH_SIZE; // entries serialized by one task
+  static const size_t WINDOW;     // tasks per thread ahead of the writer
+
+  /**
+   * Task of a worker, lists a directory if names_ is empty, otherwise
+   * serializes the named entries of the directory
+   */
+  struct Task {
+    uint64_t seq_;                   // position in the output
+    std::string dir_;                // directory
+    std::vector<std::string> names_; // entries to serialize
+  };
+
+  /**
+   * Records of a task
+   */
+  struct Result {
+    bool done_;           // true once the task finished
+    int error_;           // 0 on success, negative errno on failure
+    std::string records_; // serialized entries
+    std::vector<std::pair<std::string, size_t>>
+        starts_; // path and offset in records_ of each entry
+
+    Result() : done_(false), error_(0) {}
+  };
+
+  size_t threads_;                      // number of worker threads
+  Filter filter_;                       // filter of directory entries
+  Serializer serializer_;               // serializer of an entry
+  std::shared_ptr<DebugLogger> logger_; // logger
+
+  std::mutex mutex_;                 // protects the fields below
+  std::condition_variable work_cv_;  // signals workers
+  std::condition_variable write_cv_; // signals the writer
+  std::deque<Task> queue_;           // tasks not started yet
+  std::deque<Result> results_;       // results from the next one to write on
+  uint64_t queued_;                  // tasks queued
+  uint64_t written_;                 // tasks written
+  size_t active_;                    // tasks running
+  bool stop_;                        // workers should exit
+
+  /**
+   * Worker thread
+   */
+  void run();
+
+  /**
+   * Run a task
+   * @param task task
+   * @param result result, used as output
+   * @param children tasks queued by the task, used as output
+   */
+  void run_task(const Task &task, Result &result, std::vector<Task> &children);
+};
@@ -283,12 +283,28 @@ class ObjectHandler(BaseRequestHandler):
         self.set_header(
             "Last-Modified", datetime.datetime.utcfromtimestamp(info.st_mtime)
         )
-        tmon.num_read_bytes += os.path.getsize(path)
+        size = os.path.getsize(path)
+        start, end = 0, size - 1
+        byte_range = self.request.headers.get("Range")
+        if byte_range and byte_range.startswith("bytes="):
+            first, _, last = byte_range[len("bytes="):].partition("-")
+            if first:
+                start = int(first)
+            if last:
+                end = min(int(last), size - 1)
+            if start > end:
+                raise web.HTTPError(416)
+            self.set_status(206)
+            self.set_header(
+                "Content-Range", "bytes %d-%d/%d" % (start, end, size)
+            )
+        tmon.num_read_bytes += end - start + 1
         self.application.logger.debug(tmon.debug_out("GET"))
         object_file = open(path, "rb")
 
         try:
-            self.finish(object_file.read())
+            object_file.seek(start)
+            self.finish(object_file.read(end - start + 1))
         finally:
             object_file.close()
 
@@ -81,7 +81,7 @@ function untar()
 
 function process_args()
 {
-	OPTIONS=`getopt -o s:f:a:t:m:S:M:w:c:do --long ssd-path:,fuse-path:,ssd-size:,threshold:,min-seg-size:,avg-seg-size:,max-seg-size:,rabin-window-size:,cache-size:,no-dedup,no-cache -n '$0' -- "$@"`
+	OPTIONS=`getopt -o s:f:a:t:m:S:M:w:c:do --long ssd-path:,fuse-path:,ssd-size:,threshold:,min-seg-size:,avg-seg-size:,max-seg-size:,rabin-window-size:,cache-size:,gc-grace:,gc-rate:,container-size:,attr-timeout:,entry-timeout:,max-io-size:,direct-io,log-level:,snapshot-threads:,snapshot-compression:,snapshot-level:,no-dedup,no-cache -n '$0' -- "$@"`
 
 	if [ $? != 0 ]; then
 		echo "parsing options failed. Exiting."
@@ -102,6 +102,17 @@ function process_args()
 		-M|--max-seg-size) CLOUDFSOPTS+=" $1 $2"; MAXSEGSIZE=$2; shift 2;;
 		-w|--rabin-window-size) CLOUDFSOPTS+=" $1 $2"; RABINWINDOWSIZE=$2; shift 2;;
 		-c|--cache-size) CLOUDFSOPTS+=" $1 $2"; CACHESIZE=$2; shift 2;;
+		--gc-grace) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--gc-rate) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--container-size) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--attr-timeout) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--entry-timeout) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--max-io-size) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--direct-io) CLOUDFSOPTS+=" $1"; shift 1;;
+		--log-level) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--snapshot-threads) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--snapshot-compression) CLOUDFSOPTS+=" $1 $2"; shift 2;;
+		--snapshot-level) CLOUDFSOPTS+=" $1 $2"; shift 2;;
     -d|--no-dedup) CLOUDFSOPTS+=" $1"; NODEDUP=1; shift 1;;
     -o|--no-cache) CLOUDFSOPTS+=" $1"; NOCACHE=1; shift 1;;
 		-h|-\?) usage; exit 1;;
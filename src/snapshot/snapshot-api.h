@@ -12,8 +12,56 @@
 
 /**
  * defines the maximum number of snapshots cloudfs supports.
+ * CLOUDFS_SNAPSHOT_LIST fills one more slot with 0 to end the list.
  */
-#define CLOUDFS_MAX_NUM_SNAPSHOTS 8
+#define CLOUDFS_MAX_NUM_SNAPSHOTS 512
+
+/**
+ * defines the maximum length of a path restored by CLOUDFS_RESTORE_PATH,
+ * including the terminating null byte.
+ */
+#define CLOUDFS_MAX_RESTORE_PATH 4096
+
+/**
+ * Argument of CLOUDFS_RESTORE_PATH, restores a single file or directory
+ * subtree from a snapshot and keeps the rest of the file system.
+ */
+struct cloudfs_restore_path {
+    unsigned long timestamp;              /* snapshot to restore from */
+    char path[CLOUDFS_MAX_RESTORE_PATH];  /* path relative to the mount point, e.g. "/dir/file" */
+};
+
+/**
+ * defines the size of the record buffer of CLOUDFS_DIFF.
+ */
+#define CLOUDFS_DIFF_BUF_SIZE 8192
+
+/**
+ * defines the number of changed ranges listed in a record of CLOUDFS_DIFF.
+ */
+#define CLOUDFS_DIFF_MAX_RANGES 16
+
+/**
+ * Argument of CLOUDFS_DIFF, lists the paths added, removed or modified from
+ * one snapshot to another snapshot or to the live file system. The diff is
+ * computed when cursor is 0 and returned a page at a time, call again with
+ * the returned cursor until it reaches total.
+ *
+ * buf holds count records, one line each:
+ *   <A|D|M> <f|d> <old size> <new size> <changed bytes> <ranges> <path>
+ * ranges are the byte ranges of the new file whose chunks the old file does
+ * not have, as <offset>+<length> separated by commas, "-" if there are none.
+ * At most CLOUDFS_DIFF_MAX_RANGES are listed, followed by ",..." if there are
+ * more, changed bytes counts all of them.
+ */
+struct cloudfs_diff {
+    unsigned long from;   /* snapshot to compare from */
+    unsigned long to;     /* snapshot to compare to, 0 for the live file system */
+    unsigned long cursor; /* in: first record to return, out: next record */
+    unsigned long total;  /* out: number of records in the diff */
+    unsigned long count;  /* out: number of records in buf */
+    char buf[CLOUDFS_DIFF_BUF_SIZE]; /* out: the records, null terminated */
+};
 
 /**
  * Identifies the ioctl calls to cloudfs.
@@ -23,7 +71,9 @@
 #define CLOUDFS_SNAPSHOT  (int)_IOR(CLOUDFS_IOCTL_MAGIC, 0, unsigned long *)
 #define CLOUDFS_RESTORE (int)_IOW(CLOUDFS_IOCTL_MAGIC, 1, unsigned long *)
 #define CLOUDFS_DELETE (int)_IOW(CLOUDFS_IOCTL_MAGIC, 2, unsigned long *)
-#define CLOUDFS_SNAPSHOT_LIST  (int)_IOR(CLOUDFS_IOCTL_MAGIC, 3, unsigned long[CLOUDFS_MAX_NUM_SNAPSHOTS])
+#define CLOUDFS_SNAPSHOT_LIST  (int)_IOR(CLOUDFS_IOCTL_MAGIC, 3, unsigned long[CLOUDFS_MAX_NUM_SNAPSHOTS + 1])
 #define CLOUDFS_INSTALL_SNAPSHOT (int)_IOW(CLOUDFS_IOCTL_MAGIC, 4, unsigned long *)
 #define CLOUDFS_UNINSTALL_SNAPSHOT (int)_IOW(CLOUDFS_IOCTL_MAGIC, 5, unsigned long *)
+#define CLOUDFS_RESTORE_PATH (int)_IOW(CLOUDFS_IOCTL_MAGIC, 6, struct cloudfs_restore_path)
+#define CLOUDFS_DIFF (int)_IOWR(CLOUDFS_IOCTL_MAGIC, 7, struct cloudfs_diff)
 #endif
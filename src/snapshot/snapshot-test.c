@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
 #include "../snapshot/snapshot-api.h"
 
 int main(int argc, char **argv)
@@ -48,6 +49,20 @@ int main(int argc, char **argv)
             return 0;
         case 'r':
             timestamp = strtoul(arg_ts, NULL, 10);
+            if (argc > 4)
+            {
+                struct cloudfs_restore_path restore;
+                restore.timestamp = timestamp;
+                strncpy(restore.path, argv[4], sizeof(restore.path) - 1);
+                restore.path[sizeof(restore.path) - 1] = '\0';
+                printf("Restoring %s from %s %lu ", restore.path, arg_ts, timestamp);
+                if (ioctl(fd, CLOUDFS_RESTORE_PATH, &restore))
+                {
+                    perror("ioctl");
+                    return 1;
+                }
+                return 0;
+            }
             printf("Restoring %s %lu ", arg_ts, timestamp);
             if (ioctl(fd, CLOUDFS_RESTORE, &timestamp)) 
             {
@@ -79,6 +94,25 @@ int main(int argc, char **argv)
                 return 1;
             }
             return 0;
+        case 'c':
+        {
+            if (argc < 4)
+                goto usage;
+            struct cloudfs_diff diff;
+            memset(&diff, 0, sizeof(diff));
+            diff.from = strtoul(arg_ts, NULL, 10);
+            diff.to = argc > 4 ? strtoul(argv[4], NULL, 10) : 0;
+            do
+            {
+                if (ioctl(fd, CLOUDFS_DIFF, &diff))
+                {
+                    perror("ioctl");
+                    return 1;
+                }
+                fputs(diff.buf, stdout);
+            } while (diff.cursor < diff.total);
+            return 0;
+        }
         case 'i':
             timestamp = strtoul(arg_ts, NULL, 10);
             printf("Installing %s %lu ", arg_ts, timestamp);
@@ -101,5 +135,7 @@ int main(int argc, char **argv)
 
 usage:
     fprintf(stderr, "./snapshot <path_to_fuse>/.snapshot s|r|l|i|u\n");
+    fprintf(stderr, "./snapshot <path_to_fuse>/.snapshot r <timestamp> <path>\n");
+    fprintf(stderr, "./snapshot <path_to_fuse>/.snapshot c <from> [<to>]\n");
     return 1;
 }
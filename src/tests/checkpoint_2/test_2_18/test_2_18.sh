@@ -0,0 +1,111 @@
+#!/bin/bash
+#
+# A script to test that the chunk table survives a crash of CloudFS.
+# Writes deduplicated files, kills cloudfs with SIGKILL so that no
+# checkpoint is taken, remounts and checks that the reference counts
+# replayed from the delta log are still correct. Has to be run from
+# the src directory.
+#
+
+TEST_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+source $TEST_DIR/../../../scripts/paths.sh
+source $SCRIPTS_DIR/functions.sh
+
+REFERENCE_DIR="/tmp/cloudfstest"
+LOG_DIR="/tmp/testrun-`date +"%Y-%m-%d-%H%M%S"`"
+STAT_FILE="$LOG_DIR/stats"
+THRESHOLD="4"
+AVGSEGSIZE="4"
+MINSEGSIZE="1"
+MAXSEGSIZE="8"
+CACHE_SIZE="0"
+NODEDUP=0
+
+function check_md5()
+{
+   (cd $REFERENCE_DIR && find $1 \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out.master)
+   (cd $FUSE_MNT_ && find $1 \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out)
+   diff $LOG_DIR/md5sum.out.master $LOG_DIR/md5sum.out
+   print_result $?
+}
+
+process_args cloudfs --ssd-path $SSD_MNT_ --fuse-path $FUSE_MNT_ --threshold $THRESHOLD --avg-seg-size $AVGSEGSIZE --min-seg-size $MINSEGSIZE --max-seg-size $MAXSEGSIZE --cache-size $CACHE_SIZE
+
+# test setup
+rm -rf $REFERENCE_DIR
+mkdir -p $REFERENCE_DIR
+mkdir -p $LOG_DIR
+
+reinit_env
+
+echo ""
+echo "Executing test_2_18"
+echo -e "Running cloudfs in dedup mode\n"
+
+# file_b shares every chunk of file_a, so its chunks have a reference
+# count of two that only the delta log knows about after the crash
+dd if=/dev/urandom of=$REFERENCE_DIR/file_a bs=1024 count=256 2> /dev/null
+dd if=/dev/urandom of=$REFERENCE_DIR/file_c bs=1024 count=64 2> /dev/null
+cp $REFERENCE_DIR/file_a $REFERENCE_DIR/file_b
+
+echo -e "Copying test files into the fuse folder..."
+cp $REFERENCE_DIR/file_a $FUSE_MNT/file_a
+cp $REFERENCE_DIR/file_b $FUSE_MNT/file_b
+cp $REFERENCE_DIR/file_c $FUSE_MNT/file_c
+sync
+sleep 1
+
+collect_stats > $STAT_FILE
+echo -e "\nCloud statistics -->"
+echo "Current usage in cloud : $(get_cloud_current_usage $STAT_FILE)"
+
+echo -ne "Killing cloudfs without a checkpoint               "
+pkill -9 cloudfs
+sleep 1
+if pgrep cloudfs > /dev/null; then
+   print_result 1
+else
+   print_result 0
+fi
+
+echo -ne "Remounting cloudfs after the crash                 "
+$SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS
+print_result $?
+sleep 1
+
+echo -ne "Checking for data integrity(file_a)                "
+check_md5 file_a
+echo -ne "Checking for data integrity(file_b)                "
+check_md5 file_b
+echo -ne "Checking for data integrity(file_c)                "
+check_md5 file_c
+
+# a lost reference count would delete the chunks file_b still uses
+echo -ne "Checking shared chunks after removing file_a       "
+rm $FUSE_MNT/file_a
+rm $REFERENCE_DIR/file_a
+$SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+sleep 1
+check_md5 file_b
+
+collect_stats > $STAT_FILE
+echo -e "\nCloud statistics -->"
+echo "Current usage in cloud : $(get_cloud_current_usage $STAT_FILE)"
+
+#----
+#destructive test : always do this test at the end!!
+echo -ne "\nFile removal test (rm -rf)                        "
+rm -rf $FUSE_MNT/*
+LF="$LOG_DIR/files-remaining-after-rm-rf.out"
+
+ls $FUSE_MNT_ > $LF
+find $SSD_MNT_ \( ! -regex '.*/\..*' \) -type f >> $LF
+find $S3_DIR \( ! -regex '.*/\..*' \) -type f >> $LF
+nfiles=`wc -l $LF|cut -d" " -f1`
+print_result $nfiles
+
+# test cleanup
+rm -rf $REFERENCE_DIR
+rm -rf $LOG_DIR
+exit 0
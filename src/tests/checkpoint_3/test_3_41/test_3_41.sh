@@ -0,0 +1,218 @@
+#!/bin/bash
+#
+# A script to test a chain of incremental snapshots. Takes a full
+# snapshot and three incremental ones with files changed, added and
+# deleted in between and checks each of them through an installed view,
+# which keeps the chain. Then deletes a middle snapshot, checks that the
+# snapshots around it, the one after it is folded into, still hold their
+# files, and restores them from the newest to the oldest, as a restore
+# deletes the newer snapshots. Has to be run from the ./src/scripts/
+# directory.
+#
+
+TEST_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+source $TEST_DIR/../../../scripts/paths.sh
+source $SCRIPTS_DIR/functions.sh
+
+THRESHOLD="64"
+AVGSEGSIZE="4"
+LOG_DIR="/tmp/testrun-`date +"%Y-%m-%d-%H%M%S"`"
+TESTDIR=$FUSE_MNT_
+TEMPDIR="/tmp/cloudfstest"
+CACHE_SIZE="0"
+STAT_FILE="$LOG_DIR/stats"
+NUM_SNAPSHOTS="4"
+
+#
+# Take a snapshot and keep a reference copy of the tree in
+# $TEMPDIR/snapshot_$1
+#
+function take_snapshot()
+{
+   echo -ne "Checking for snapshot $1 creation                 "
+   snapshots[$1]=$($SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot s)
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   mkdir -p $TEMPDIR/snapshot_$1
+   cp -r $TESTDIR/* $TEMPDIR/snapshot_$1
+   sleep 1
+}
+
+#
+# Compare the tree under $1 with the reference copy of snapshot $2
+#
+function check_tree()
+{
+   (cd $1 && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out)
+   (cd $1 && find . \( ! -regex '.*/\..*' \) -type d ! -name lost+found | sort >> $LOG_DIR/md5sum.out)
+   (cd $TEMPDIR/snapshot_$2 && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out.master)
+   (cd $TEMPDIR/snapshot_$2 && find . \( ! -regex '.*/\..*' \) -type d ! -name lost+found | sort >> $LOG_DIR/md5sum.out.master)
+   diff $LOG_DIR/md5sum.out.master $LOG_DIR/md5sum.out
+   print_result $?
+}
+
+#
+# Install snapshot $1, compare its view with its reference copy and
+# uninstall it again
+#
+function check_install()
+{
+   echo -ne "Checking for snapshot $1 install                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot i ${snapshots[$1]} > /dev/null
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+
+   echo -ne "Checking for data integrity(snapshot $1 view)     "
+   check_tree $TESTDIR/snapshot_${snapshots[$1]} $1
+
+   echo -ne "Checking for snapshot $1 uninstall                "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot u ${snapshots[$1]} > /dev/null
+   print_result $?
+}
+
+#
+# Restore snapshot $1 and compare the tree with its reference copy, the
+# snapshots newer than $1 are deleted by the restore
+#
+function check_restore()
+{
+   echo -ne "Checking for snapshot $1 restore                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot r ${snapshots[$1]} > /dev/null
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   sleep 1
+
+   echo -ne "Checking for data integrity(snapshot $1)          "
+   check_tree $TESTDIR $1
+}
+
+#
+# Execute battery of test cases.
+# expects that the test files are in $TESTDIR
+# and the reference files are in $TEMPDIR
+# Creates the intermediate results in $LOGDIR
+#
+function execute_part3_tests()
+{
+
+   echo "Executing test_3_41"
+   reinit_env
+
+   # snapshot 1 is full
+   echo "Creating files"
+   mkdir -p $TESTDIR/dir_a $TESTDIR/dir_b
+   dd if=/dev/urandom of=$TESTDIR/largefile bs=1024 count=1024 2> /dev/null
+   dd if=/dev/urandom of=$TESTDIR/dir_a/largefile bs=1024 count=512 2> /dev/null
+   for ((f=0; f<20; f++)); do
+      head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_a/file_$f
+      head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_b/file_$f
+   done
+   sleep 1
+   take_snapshot 1
+
+   # snapshot 2 modifies, adds and deletes files
+   echo "Changing files for snapshot 2"
+   dd if=/dev/urandom of=$TESTDIR/largefile bs=1024 count=64 seek=256 conv=notrunc 2> /dev/null
+   head -c 100 /dev/urandom > $TESTDIR/dir_a/file_0
+   rm $TESTDIR/dir_a/file_1 $TESTDIR/dir_b/file_1
+   dd if=/dev/urandom of=$TESTDIR/dir_b/largefile bs=1024 count=768 2> /dev/null
+   sleep 1
+   take_snapshot 2
+
+   # snapshot 3 deletes a directory and files of snapshot 1 and 2
+   echo "Changing files for snapshot 3"
+   rm -rf $TESTDIR/dir_a
+   rm $TESTDIR/dir_b/largefile
+   truncate -s 4096 $TESTDIR/largefile
+   echo "new" > $TESTDIR/dir_b/file_1
+   sleep 1
+   take_snapshot 3
+
+   # snapshot 4 brings back a path deleted by snapshot 3
+   echo "Changing files for snapshot 4"
+   mkdir -p $TESTDIR/dir_a
+   dd if=/dev/urandom of=$TESTDIR/dir_a/largefile bs=1024 count=256 2> /dev/null
+   rm $TESTDIR/dir_b/file_2
+   dd if=/dev/urandom of=$TESTDIR/largefile bs=1024 count=1024 2> /dev/null
+   sleep 1
+   take_snapshot 4
+
+   collect_stats > $STAT_FILE
+   echo -e "\nCloud statistics -->"
+   echo "Capacity usage in cloud : $(get_cloud_max_usage $STAT_FILE)"
+
+   # the chains are downloaded from the cloud after a remount
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   for ((s=1; s<=NUM_SNAPSHOTS; s++)); do
+      check_install $s
+   done
+
+   # snapshot 3 removes dir_a and dir_b/largefile and holds the only
+   # entry of the truncated largefile, it is folded into snapshot 4
+   echo -ne "Checking for snapshot 3 deletion                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot d ${snapshots[3]} > /dev/null
+   print_result $?
+
+   echo -ne "Checking for snapshot list                        "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot l > $LOG_DIR/snapshots.out
+   nsnapshots=`wc -l $LOG_DIR/snapshots.out|cut -d" " -f1`
+   if [ $nsnapshots -eq 3 ] && ! grep -q ${snapshots[3]} $LOG_DIR/snapshots.out; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   check_install 4
+   check_install 2
+   check_install 1
+
+   # newest first, restoring a snapshot deletes the ones after it
+   rm -rf $TESTDIR/*
+   check_restore 4
+   check_restore 2
+   check_restore 1
+
+   echo -ne "Checking only snapshot 1 is left                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot l > $LOG_DIR/snapshots.out
+   if [ `wc -l < $LOG_DIR/snapshots.out` -eq 1 ] && grep -q ${snapshots[1]} $LOG_DIR/snapshots.out; then
+      print_result 0
+   else
+      print_result 1
+   fi
+}
+
+#
+# Main
+#
+process_args cloudfs --ssd-path $SSD_MNT_ --fuse-path $FUSE_MNT_ --threshold $THRESHOLD --avg-seg-size $AVGSEGSIZE --cache-size $CACHE_SIZE
+
+#----
+# test setup
+rm -rf $TEMPDIR
+mkdir -p $TEMPDIR
+mkdir -p $LOG_DIR
+
+#----
+# tests
+#run the actual tests
+execute_part3_tests
+#----
+
+rm -rf $TEMPDIR
+rm -rf $LOG_DIR
+
+exit 0
@@ -0,0 +1,202 @@
+#!/bin/bash
+#
+# A script to test restoring a single file or directory subtree from a
+# snapshot. The rest of the tree has to be kept as it is, a path the
+# snapshot does not hold has to fail, and a directory that a later
+# snapshot replaced by a file has to be restored as the snapshot holds
+# it. Has to be run from the ./src/scripts/ directory.
+#
+
+TEST_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+source $TEST_DIR/../../../scripts/paths.sh
+source $SCRIPTS_DIR/functions.sh
+
+THRESHOLD="64"
+AVGSEGSIZE="4"
+LOG_DIR="/tmp/testrun-`date +"%Y-%m-%d-%H%M%S"`"
+TESTDIR=$FUSE_MNT_
+TEMPDIR="/tmp/cloudfstest"
+CACHE_SIZE="0"
+STAT_FILE="$LOG_DIR/stats"
+
+#
+# Compare the tree under $TESTDIR with the reference tree $TEMPDIR/$1
+#
+function check_tree()
+{
+   (cd $TESTDIR && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out)
+   (cd $TESTDIR && find . \( ! -regex '.*/\..*' \) -type d ! -name lost+found | sort >> $LOG_DIR/md5sum.out)
+   (cd $TEMPDIR/$1 && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out.master)
+   (cd $TEMPDIR/$1 && find . \( ! -regex '.*/\..*' \) -type d ! -name lost+found | sort >> $LOG_DIR/md5sum.out.master)
+   diff $LOG_DIR/md5sum.out.master $LOG_DIR/md5sum.out
+   print_result $?
+}
+
+#
+# Restore path $2 from snapshot $1
+#
+function restore_path()
+{
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot r $1 $2 > /dev/null
+   print_result $?
+   sleep 1
+}
+
+#
+# Execute battery of test cases.
+# expects that the test files are in $TESTDIR
+# and the reference files are in $TEMPDIR
+# Creates the intermediate results in $LOGDIR
+#
+function execute_part3_tests()
+{
+
+   echo "Executing test_3_46"
+   reinit_env
+
+   echo "Creating files"
+   mkdir -p $TESTDIR/dir_a/sub $TESTDIR/dir_b
+   dd if=/dev/urandom of=$TESTDIR/dir_a/largefile bs=1024 count=512 2> /dev/null
+   dd if=/dev/urandom of=$TESTDIR/dir_a/sub/largefile bs=1024 count=256 2> /dev/null
+   dd if=/dev/urandom of=$TESTDIR/largefile bs=1024 count=256 2> /dev/null
+   for ((f=0; f<10; f++)); do
+      head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_a/file_$f
+      head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_a/sub/file_$f
+      head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_b/file_$f
+   done
+   sleep 1
+
+   echo -ne "Checking for snapshot 1 creation                  "
+   snapshot_1=$($SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot s)
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   mkdir -p $TEMPDIR/snapshot_1
+   cp -r $TESTDIR/* $TEMPDIR/snapshot_1
+   sleep 1
+
+   # dir_b is replaced by a file in snapshot 2
+   echo "Replacing dir_b by a file"
+   rm -rf $TESTDIR/dir_b
+   head -c 5000 /dev/urandom > $TESTDIR/dir_b
+   sleep 1
+
+   echo -ne "Checking for snapshot 2 creation                  "
+   snapshot_2=$($SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot s)
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   mkdir -p $TEMPDIR/snapshot_2
+   cp -r $TESTDIR/* $TEMPDIR/snapshot_2
+   sleep 1
+
+   # the live tree is kept in $TEMPDIR/live, restored paths are copied
+   # into it from the snapshot copies
+   echo "Changing files"
+   dd if=/dev/urandom of=$TESTDIR/dir_a/largefile bs=1024 count=64 seek=128 conv=notrunc 2> /dev/null
+   head -c 100 /dev/urandom > $TESTDIR/dir_a/file_0
+   rm $TESTDIR/dir_a/file_1
+   rm -rf $TESTDIR/dir_a/sub
+   echo "new" > $TESTDIR/dir_a/new_file
+   dd if=/dev/urandom of=$TESTDIR/largefile bs=1024 count=64 seek=64 conv=notrunc 2> /dev/null
+   head -c 3000 /dev/urandom > $TESTDIR/dir_b
+   sleep 1
+   mkdir -p $TEMPDIR/live
+   cp -r $TESTDIR/* $TEMPDIR/live
+
+   collect_stats > $STAT_FILE
+   echo -e "\nCloud statistics -->"
+   echo "Capacity usage in cloud : $(get_cloud_max_usage $STAT_FILE)"
+
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+
+   # a path the snapshot does not hold fails and changes nothing
+   echo -ne "Checking restore of a missing path fails          "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot r $snapshot_1 /dir_a/new_file > /dev/null 2>&1
+   if [ $? -ne 0 ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+   echo -ne "Checking restore of a missing directory fails     "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot r $snapshot_1 /no_such_dir/file > /dev/null 2>&1
+   if [ $? -ne 0 ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+   echo -ne "Checking the tree is unchanged                    "
+   check_tree live
+
+   # a single file
+   echo -ne "Checking for restore of a file                    "
+   restore_path $snapshot_1 /dir_a/file_0
+   cp $TEMPDIR/snapshot_1/dir_a/file_0 $TEMPDIR/live/dir_a/file_0
+   echo -ne "Checking for data integrity(file)                 "
+   check_tree live
+
+   # a deleted file of a directory that still exists
+   echo -ne "Checking for restore of a deleted file            "
+   restore_path $snapshot_1 /dir_a/file_1
+   cp $TEMPDIR/snapshot_1/dir_a/file_1 $TEMPDIR/live/dir_a/file_1
+   echo -ne "Checking for data integrity(deleted file)         "
+   check_tree live
+
+   # a subtree, the files added since the snapshot are removed
+   echo -ne "Checking for restore of a directory               "
+   restore_path $snapshot_1 /dir_a
+   rm -rf $TEMPDIR/live/dir_a
+   cp -r $TEMPDIR/snapshot_1/dir_a $TEMPDIR/live/dir_a
+   echo -ne "Checking for data integrity(directory)            "
+   check_tree live
+
+   # snapshot 2 holds dir_b as a file, the entries below the directory
+   # of snapshot 1 must not show up
+   echo -ne "Checking for restore of a file that was a dir     "
+   restore_path $snapshot_2 /dir_b
+   cp $TEMPDIR/snapshot_2/dir_b $TEMPDIR/live/dir_b
+   echo -ne "Checking for data integrity(file that was a dir)  "
+   check_tree live
+
+   # snapshot 1 holds dir_b as a directory, the live file is replaced
+   echo -ne "Checking for restore of a dir replaced by a file  "
+   restore_path $snapshot_1 /dir_b
+   rm -f $TEMPDIR/live/dir_b
+   cp -r $TEMPDIR/snapshot_1/dir_b $TEMPDIR/live/dir_b
+   echo -ne "Checking for data integrity(dir replaced by file) "
+   check_tree live
+
+   # the paths restored are kept across a remount
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   echo -ne "Checking for data integrity after remount         "
+   check_tree live
+}
+
+#
+# Main
+#
+process_args cloudfs --ssd-path $SSD_MNT_ --fuse-path $FUSE_MNT_ --threshold $THRESHOLD --avg-seg-size $AVGSEGSIZE --cache-size $CACHE_SIZE
+
+#----
+# test setup
+rm -rf $TEMPDIR
+mkdir -p $TEMPDIR
+mkdir -p $LOG_DIR
+
+#----
+# tests
+#run the actual tests
+execute_part3_tests
+#----
+
+rm -rf $TEMPDIR
+rm -rf $LOG_DIR
+
+exit 0
@@ -0,0 +1,210 @@
+#!/bin/bash
+#
+# A script to test that deleting a snapshot frees only the chunks no
+# other snapshot or live file holds. Takes three snapshots, the middle
+# one holds a file nothing else does, deletes it and checks that the
+# cloud usage drops by that file once the sweeper released it while the
+# other snapshots still hold their files. Has to be run from the
+# ./src/scripts/ directory.
+#
+
+TEST_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+source $TEST_DIR/../../../scripts/paths.sh
+source $SCRIPTS_DIR/functions.sh
+
+THRESHOLD="64"
+AVGSEGSIZE="4"
+LOG_DIR="/tmp/testrun-`date +"%Y-%m-%d-%H%M%S"`"
+TESTDIR=$FUSE_MNT_
+TEMPDIR="/tmp/cloudfstest"
+CACHE_SIZE="0"
+STAT_FILE="$LOG_DIR/stats"
+SHARED_SIZE="1024"
+UNSHARED_SIZE="2048"
+LIVE_SIZE="256"
+
+#
+# Take a snapshot and keep a reference copy of the tree in
+# $TEMPDIR/snapshot_$1
+#
+function take_snapshot()
+{
+   echo -ne "Checking for snapshot $1 creation                 "
+   snapshots[$1]=$($SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot s)
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   mkdir -p $TEMPDIR/snapshot_$1
+   cp -r $TESTDIR/* $TEMPDIR/snapshot_$1
+   sleep 1
+}
+
+#
+# Compare the files under $1 with the reference copy of snapshot $2
+#
+function check_tree()
+{
+   (cd $1 && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out)
+   (cd $TEMPDIR/snapshot_$2 && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out.master)
+   diff $LOG_DIR/md5sum.out.master $LOG_DIR/md5sum.out
+   print_result $?
+}
+
+#
+# Install snapshot $1, compare its view with its reference copy and
+# uninstall it again
+#
+function check_install()
+{
+   echo -ne "Checking for snapshot $1 install                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot i ${snapshots[$1]} > /dev/null
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+
+   echo -ne "Checking for data integrity(snapshot $1 view)     "
+   check_tree $TESTDIR/snapshot_${snapshots[$1]} $1
+
+   echo -ne "Checking for snapshot $1 uninstall                "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot u ${snapshots[$1]} > /dev/null
+   print_result $?
+}
+
+#
+# Restore snapshot $1 and compare the tree with its reference copy, the
+# snapshots newer than $1 are deleted by the restore
+#
+function check_restore()
+{
+   echo -ne "Checking for snapshot $1 restore                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot r ${snapshots[$1]} > /dev/null
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   sleep 1
+
+   echo -ne "Checking for data integrity(snapshot $1)          "
+   check_tree $TESTDIR $1
+}
+
+#
+# Execute battery of test cases.
+# expects that the test files are in $TESTDIR
+# and the reference files are in $TEMPDIR
+# Creates the intermediate results in $LOGDIR
+#
+function execute_part3_tests()
+{
+
+   echo "Executing test_3_47"
+   reinit_env
+
+   # shared_file is held by every snapshot and the live tree
+   echo "Creating files"
+   dd if=/dev/urandom of=$TESTDIR/shared_file bs=1024 count=$SHARED_SIZE 2> /dev/null
+   head -c 4000 /dev/urandom > $TESTDIR/small_file
+   sleep 1
+   take_snapshot 1
+
+   # unshared_file is only held by snapshot 2
+   dd if=/dev/urandom of=$TESTDIR/unshared_file bs=1024 count=$UNSHARED_SIZE 2> /dev/null
+   sleep 1
+   take_snapshot 2
+
+   rm $TESTDIR/unshared_file
+   dd if=/dev/urandom of=$TESTDIR/live_file bs=1024 count=$LIVE_SIZE 2> /dev/null
+   sleep 1
+   take_snapshot 3
+
+   # the chunks of the removed file are kept for snapshot 2
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   collect_stats > $STAT_FILE
+   usage_before=$(get_cloud_current_usage $STAT_FILE)
+   echo -e "\nCloud statistics -->"
+   echo "Current usage in cloud : $usage_before"
+
+   echo -ne "Checking the unshared file is kept on cloud       "
+   if [ $usage_before -ge $(((SHARED_SIZE + UNSHARED_SIZE + LIVE_SIZE) * 1024)) ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   echo -ne "Checking for snapshot 2 deletion                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot d ${snapshots[2]} > /dev/null
+   print_result $?
+
+   # the sweeper finds the chunks of a deleted snapshot in the background
+   # and the following commits retire them in batches, rewriting a copy
+   # of the shared file commits without adding chunks
+   for ((i=0; i<16; i++)); do
+      dd if=$TESTDIR/shared_file of=$TESTDIR/churn_file bs=1024 count=128 2> /dev/null
+      sleep 1
+   done
+   rm $TESTDIR/churn_file
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   collect_stats > $STAT_FILE
+   usage_after=$(get_cloud_current_usage $STAT_FILE)
+   echo -e "\nCloud statistics -->"
+   echo "Current usage in cloud : $usage_after"
+
+   echo -ne "Checking the unshared chunks are freed            "
+   if [ $((usage_before - usage_after)) -ge $((UNSHARED_SIZE * 1024)) ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   echo -ne "Checking the shared chunks are kept               "
+   if [ $usage_after -ge $(((SHARED_SIZE + LIVE_SIZE) * 1024)) ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   # restoring snapshot 1 would delete snapshot 3, it is checked through
+   # its view instead
+   check_install 1
+   check_restore 3
+
+   # the live tree holds the chunks of snapshot 3, deleting it frees
+   # nothing but the snapshot itself
+   echo -ne "Checking for snapshot 3 deletion                  "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot d ${snapshots[3]} > /dev/null
+   print_result $?
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   echo -ne "Checking for data integrity(live tree)            "
+   check_tree $TESTDIR 3
+}
+
+#
+# Main
+#
+process_args cloudfs --ssd-path $SSD_MNT_ --fuse-path $FUSE_MNT_ --threshold $THRESHOLD --avg-seg-size $AVGSEGSIZE --cache-size $CACHE_SIZE
+
+#----
+# test setup
+rm -rf $TEMPDIR
+mkdir -p $TEMPDIR
+mkdir -p $LOG_DIR
+
+#----
+# tests
+#run the actual tests
+execute_part3_tests
+#----
+
+rm -rf $TEMPDIR
+rm -rf $LOG_DIR
+
+exit 0
@@ -0,0 +1,177 @@
+#!/bin/bash
+#
+# A script to test the diff of snapshots. Changes more files than fit in
+# one page of the diff ioctl and checks that "snapshot c" lists every
+# added, modified and deleted file exactly once, both against the live
+# file system and against a later snapshot. Has to be run from the
+# ./src/scripts/ directory.
+#
+
+TEST_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+source $TEST_DIR/../../../scripts/paths.sh
+source $SCRIPTS_DIR/functions.sh
+
+THRESHOLD="64"
+AVGSEGSIZE="4"
+LOG_DIR="/tmp/testrun-`date +"%Y-%m-%d-%H%M%S"`"
+TESTDIR=$FUSE_MNT_
+TEMPDIR="/tmp/cloudfstest"
+CACHE_SIZE="0"
+STAT_FILE="$LOG_DIR/stats"
+NUM_DIRS="6"
+NUM_FILES="100"
+
+#
+# Check the file records of the diff in $1 against the expected records
+# in $LOG_DIR/expected.out, the records are "<A|D|M> <path>"
+#
+function check_diff()
+{
+   grep "^[ADM] f " $1 | awk '{print $1, $NF}' | sort -k2 > $LOG_DIR/records.out
+   diff $LOG_DIR/expected.out $LOG_DIR/records.out
+   print_result $?
+}
+
+#
+# Execute battery of test cases.
+# expects that the test files are in $TESTDIR
+# Creates the intermediate results in $LOGDIR
+#
+function execute_part3_tests()
+{
+
+   echo "Executing test_3_49"
+   reinit_env
+
+   echo "Creating $((NUM_DIRS * NUM_FILES)) files"
+   for ((d=0; d<NUM_DIRS; d++)); do
+      mkdir -p $TESTDIR/dir_$d
+      for ((f=0; f<NUM_FILES; f++)); do
+         head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_$d/file_$f
+      done
+   done
+   dd if=/dev/urandom of=$TESTDIR/largefile bs=1024 count=512 2> /dev/null
+   sleep 1
+
+   echo -ne "Checking for snapshot 1 creation                  "
+   snapshot_1=$($SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot s)
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   sleep 1
+
+   # in every directory a third of the files is modified, a quarter is
+   # deleted and as many are added as modified, far more records than
+   # one page holds
+   echo "Changing files"
+   rm -f $LOG_DIR/expected.out.unsorted
+   for ((d=0; d<NUM_DIRS; d++)); do
+      for ((f=0; f<NUM_FILES; f++)); do
+         if [ $((f % 3)) -eq 0 ]; then
+            head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_$d/file_$f
+            echo "M /dir_$d/file_$f" >> $LOG_DIR/expected.out.unsorted
+         elif [ $((f % 4)) -eq 1 ]; then
+            rm $TESTDIR/dir_$d/file_$f
+            echo "D /dir_$d/file_$f" >> $LOG_DIR/expected.out.unsorted
+         fi
+      done
+      for ((f=NUM_FILES; f<NUM_FILES + NUM_FILES / 3; f++)); do
+         head -c $((RANDOM % 8192 + 1)) /dev/urandom > $TESTDIR/dir_$d/file_$f
+         echo "A /dir_$d/file_$f" >> $LOG_DIR/expected.out.unsorted
+      done
+   done
+   dd if=/dev/urandom of=$TESTDIR/largefile bs=1024 count=64 seek=128 conv=notrunc 2> /dev/null
+   echo "M /largefile" >> $LOG_DIR/expected.out.unsorted
+   sort -k2 $LOG_DIR/expected.out.unsorted > $LOG_DIR/expected.out
+   sleep 1
+
+   # the live file system is compared with snapshot 1
+   echo -ne "Checking for diff with the live file system       "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot c $snapshot_1 > $LOG_DIR/diff_live.out
+   print_result $?
+
+   echo -ne "Checking the diff spans more than one page        "
+   nbytes=`wc -c $LOG_DIR/diff_live.out|cut -d" " -f1`
+   if [ $nbytes -gt 8192 ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   echo -ne "Checking the diff lists every change once         "
+   check_diff $LOG_DIR/diff_live.out
+
+   # the modified large file lists the changed range only
+   echo -ne "Checking the changed bytes of largefile           "
+   changed=`grep " /largefile$" $LOG_DIR/diff_live.out | awk '{print $5}'`
+   if [ -n "$changed" ] && [ $changed -gt 0 ] && [ $changed -lt 524288 ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   echo -ne "Checking for snapshot 2 creation                  "
+   snapshot_2=$($SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot s)
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   sleep 1
+
+   # the same changes are found between the snapshots after a remount
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   echo -ne "Checking for diff between snapshots               "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot c $snapshot_1 $snapshot_2 > $LOG_DIR/diff_snapshots.out
+   print_result $?
+   echo -ne "Checking the diff lists every change once         "
+   check_diff $LOG_DIR/diff_snapshots.out
+
+   echo -ne "Checking the diff is the same as the live one     "
+   diff $LOG_DIR/diff_live.out $LOG_DIR/diff_snapshots.out
+   print_result $?
+
+   # nothing changed since snapshot 2
+   echo -ne "Checking for an empty diff                        "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot c $snapshot_2 > $LOG_DIR/diff_empty.out
+   if [ $? -eq 0 ] && [ `grep -c "^[ADM] f " $LOG_DIR/diff_empty.out` -eq 0 ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   echo -ne "Checking diff with a missing snapshot fails       "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot c 1 > /dev/null 2>&1
+   if [ $? -ne 0 ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+}
+
+#
+# Main
+#
+process_args cloudfs --ssd-path $SSD_MNT_ --fuse-path $FUSE_MNT_ --threshold $THRESHOLD --avg-seg-size $AVGSEGSIZE --cache-size $CACHE_SIZE
+
+#----
+# test setup
+rm -rf $TEMPDIR
+mkdir -p $TEMPDIR
+mkdir -p $LOG_DIR
+
+#----
+# tests
+#run the actual tests
+execute_part3_tests
+#----
+
+rm -rf $TEMPDIR
+rm -rf $LOG_DIR
+
+exit 0
@@ -0,0 +1,174 @@
+#!/bin/bash
+#
+# A script to test that snapshots restore many small files byte for
+# byte. The contents of small files are stored as chunks packed into
+# containers, files with equal contents share one chunk. Has to be run
+# from the ./src/scripts/ directory.
+#
+
+TEST_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" && pwd )"
+
+source $TEST_DIR/../../../scripts/paths.sh
+source $SCRIPTS_DIR/functions.sh
+
+THRESHOLD="64"
+AVGSEGSIZE="4"
+LOG_DIR="/tmp/testrun-`date +"%Y-%m-%d-%H%M%S"`"
+TESTDIR=$FUSE_MNT_
+TEMPDIR="/tmp/cloudfstest"
+CACHE_SIZE="0"
+CONTAINER_SIZE="256"
+STAT_FILE="$LOG_DIR/stats"
+NUM_DIRS="8"
+NUM_FILES="50"
+
+#
+# Create small files of random sizes under $1, every tenth file has the
+# contents of the first file in its directory
+#
+function create_small_files()
+{
+   for ((d=0; d<NUM_DIRS; d++)); do
+      mkdir -p $1/dir_$d
+      for ((f=0; f<NUM_FILES; f++)); do
+         if [ $f -gt 0 ] && [ $((f % 10)) -eq 0 ]; then
+            cp $1/dir_$d/file_0 $1/dir_$d/file_$f
+         else
+            head -c $((RANDOM % 16384 + 1)) /dev/urandom > $1/dir_$d/file_$f
+         fi
+      done
+   done
+   # an empty file has no chunk
+   touch $1/dir_0/empty
+}
+
+#
+# Compare the tree under $TESTDIR with the reference tree
+#
+function check_tree()
+{
+   (cd $TESTDIR && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out)
+   (cd $TEMPDIR && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out.master)
+   diff $LOG_DIR/md5sum.out.master $LOG_DIR/md5sum.out
+   print_result $?
+}
+
+#
+# Execute battery of test cases.
+# expects that the test files are in $TESTDIR
+# and the reference files are in $TEMPDIR
+# Creates the intermediate results in $LOGDIR
+#
+function execute_part3_tests()
+{
+
+   echo "Executing test_3_50"
+   reinit_env
+
+   echo "Creating $((NUM_DIRS * NUM_FILES)) small files"
+   create_small_files $TEMPDIR
+   cp -r $TEMPDIR/. $TESTDIR
+   sleep 1
+
+   # create snapshot
+   echo -ne "Checking for snapshot creation                   "
+   snapshot_num=$($SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot s)
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+
+   collect_stats > $STAT_FILE
+   echo -e "\nCloud statistics -->"
+   echo "Capacity usage in cloud : $(get_cloud_max_usage $STAT_FILE)"
+
+   # the contents are packed, far fewer objects than files
+   echo -ne "Checking that small files are packed              "
+   nobjects=$(find $S3_DIR \( ! -regex '.*/\..*' \) -type f | wc -l)
+   echo -n "($nobjects objects) "
+   if [ $nobjects -lt $NUM_FILES ]; then
+      print_result 0
+   else
+      print_result 1
+   fi
+
+   # overwrite, truncate and delete files
+   echo "Changing files"
+   for ((d=0; d<NUM_DIRS; d++)); do
+      head -c 100 /dev/urandom > $TESTDIR/dir_$d/file_1
+      truncate -s 10 $TESTDIR/dir_$d/file_2
+      rm $TESTDIR/dir_$d/file_3
+   done
+   rm -rf $TESTDIR/dir_7
+   echo "new" > $TESTDIR/dir_0/new_file
+   sleep 1
+
+   # restore the snapshot after a remount, no chunk is cached
+   $SCRIPTS_DIR/cloudfs_controller.sh x $CLOUDFSOPTS > /dev/null
+   echo -ne "Checking for snapshot restore                     "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot r $snapshot_num
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   sleep 1
+
+   echo -ne "Checking restored files are byte-identical        "
+   check_tree
+
+   # view the snapshot without restoring it
+   echo -ne "Checking for snapshot install                     "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot i $snapshot_num
+   if [ $? -ne 0 ]; then
+      print_result 1
+      exit
+   else
+      print_result 0
+   fi
+   SNAPDIR="$TESTDIR/snapshot_$snapshot_num"
+   echo -ne "Checking installed files are byte-identical       "
+   (cd $SNAPDIR && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out)
+   (cd $TEMPDIR && find . \( ! -regex '.*/\..*' \) -type f -exec md5sum \{\} \; | sort -k2 > $LOG_DIR/md5sum.out.master)
+   diff $LOG_DIR/md5sum.out.master $LOG_DIR/md5sum.out
+   print_result $?
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot u $snapshot_num > /dev/null
+
+   # the chunks of the small files are released with the snapshot
+   echo -ne "Checking for snapshot deletion                    "
+   $SCRIPTS_DIR/snapshot $FUSE_MNT/.snapshot d $snapshot_num > /dev/null
+   print_result $?
+   rm -rf $TESTDIR/*
+   $SCRIPTS_DIR/cloudfs_controller.sh u > /dev/null
+
+   # only the object holding the snapshot list stays
+   echo -ne "Checking that no object is left on cloud          "
+   find $S3_DIR \( ! -regex '.*/\..*' \) -type f ! -name '*.snapshot' > $LOG_DIR/objects.out
+   nfiles=`wc -l $LOG_DIR/objects.out|cut -d" " -f1`
+   print_result $nfiles
+}
+
+#
+# Main
+#
+process_args cloudfs --ssd-path $SSD_MNT_ --fuse-path $FUSE_MNT_ --threshold $THRESHOLD --avg-seg-size $AVGSEGSIZE --cache-size $CACHE_SIZE --container-size $CONTAINER_SIZE
+
+#----
+# test setup
+rm -rf $TEMPDIR
+mkdir -p $TEMPDIR
+mkdir -p $LOG_DIR
+
+#----
+# tests
+#run the actual tests
+execute_part3_tests
+#----
+
+rm -rf $TEMPDIR
+rm -rf $LOG_DIR
+
+exit 0